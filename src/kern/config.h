@@ -25,10 +25,18 @@
 // The memory manager assumes that the user memory region starts on a gigapage
 // boundary after the kernel's identity-mapped MMIO and RAM in the first three
 // gigabytes of the address space, i.e., [0,0xC0000000).
-
-#define USER_START_VMA  0xC0000000UL // User programs loaded here
-#define USER_END_VMA    0xD0000000UL // End of user program space
-#define USER_STACK_VMA  USER_END_VMA // starting user stack pointer
+//
+// Under Sv39 the user region extends to the top of the lower half of the
+// address space (256 GB). When the hart supports Sv48 and the memory manager
+// selects it at boot, the region extends to USER_END_VMA_SV48 instead; the
+// runtime bound is memory_user_end (memory.h). The initial user stack stays at
+// the Sv39 bound so that programs see the same layout in either mode.
+
+#define USER_START_VMA      0xC0000000UL     // User programs loaded here
+#define USER_END_VMA        0x4000000000UL   // End of user space (Sv39)
+#define USER_END_VMA_SV48   0x800000000000UL // End of user space (Sv48)
+#define USER_STACK_VMA      USER_END_VMA     // starting user stack pointer
+#define USER_MMAP_VMA       0x1000000000UL   // lowest address chosen by mmap
 
 #define UART0_IOBASE 0x10000000 // PMA
 #define UART1_IOBASE 0x10000100 // PMA
@@ -13,6 +13,11 @@ extern int console_initialized;
 extern void console_putchar(char c);
 extern char console_getchar(void);
 extern void console_puts(const char * str);
+
+//           Reads a line of at most n-1 characters into buf, without the newline.
+//           Sleeps while waiting for input once UART0 has its ISR (uart.c).
+
+extern char * console_getsn(char * buf, size_t n);
 extern size_t console_printf(const char * fmt, ...);
 extern size_t console_vprintf(const char * fmt, va_list ap);
 
@@ -43,5 +48,10 @@ extern void com0_init(void);
 extern void com0_putc(char c);
 extern char com0_getc(void);
 
+//           Switches console input back to polling, for use where the caller
+//           cannot sleep (panic).
+
+extern void com0_poll(void);
+
 //           _CONSOLE_H_
 #endif
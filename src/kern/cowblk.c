@@ -0,0 +1,601 @@
+// cowblk.c - Copy-on-write overlay block device
+//
+
+#include "cowblk.h"
+
+#include "io.h"
+#include "device.h"
+#include "heap.h"
+#include "lock.h"
+#include "string.h"
+#include "error.h"
+#include "console.h"
+#include "process.h"
+
+#ifdef COWBLK_TRACE
+#define TRACE
+#endif
+
+#ifdef COWBLK_DEBUG
+#define DEBUG
+#endif
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Chunk numbers on the delta count from its header chunk, so table entries
+// are never below 1 + tabchunks and 0 can mean "not copied".
+
+struct cowblk {
+    struct io_intf * base;
+    struct io_intf * delta;
+    struct lock lock;               // held across each request
+
+    uint64_t size;                  // size of the base in bytes
+    uint32_t blksz;                 // sector size of the base
+
+    uint32_t nchunks;               // chunks in the base
+    uint32_t tabchunks;             // chunks of remap table on the delta
+    uint32_t dchunks;               // chunks the delta can hold
+    uint32_t next;                  // next free chunk of the delta
+    uint32_t ncopied;               // nonzero table entries
+
+    uint32_t * tab;                 // remap table, tabchunks chunks long
+    char * chunkbuf;                // one chunk, for copies and the header
+};
+
+// Each open has its own position, so a process can open the overlay while the
+// file system has it mounted without moving the file system's position.
+
+struct cowblk_file {
+    struct io_intf io_intf;
+    struct cowblk * cow;
+    uint64_t pos;                   // changed with the overlay locked
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int cowblk_open(struct io_intf ** ioptr, void * aux);
+static void cowblk_close(struct io_intf * io);
+static long cowblk_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static long cowblk_write(struct io_intf * io, const void * buf, unsigned long n);
+static int cowblk_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static int copy_chunk(struct cowblk * cow, uint32_t c,
+    uint32_t off, const void * buf, uint32_t n);
+static int store_entry(struct cowblk * cow, uint32_t c);
+static int commit(struct cowblk * cow, uint64_t * nmerged);
+
+static int dev_read(struct io_intf * io, uint64_t pos, void * buf, size_t len);
+static int dev_write(struct io_intf * io, uint64_t pos, const void * buf, size_t len);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct io_ops cowblk_ops = {
+    .close = cowblk_close,
+    .read = cowblk_read,
+    .write = cowblk_write,
+    .ctl = cowblk_ioctl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * int cowblk_attach(void);
+ *
+ * Opens blk1 and, if it holds a delta for blk0, opens blk0 and registers the
+ * overlay of the two as "cow".
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          0 on success, -ENODEV without a second disk, -EBADFMT if it holds
+ *          no usable delta for blk0, -ENOMEM, or an error from the disks
+ * Side Effects:
+ *          Leaves blk0 and blk1 open on success, so they can no longer be
+ *          opened on their own.
+ */
+int cowblk_attach(void) {
+    const struct cow_header * hdr;
+    struct cowblk * cow;
+    uint64_t len;
+    uint32_t i, e;
+    int result;
+
+    cow = kmalloc(sizeof(struct cowblk));
+    if (cow == NULL)
+        return -ENOMEM;
+
+    memset(cow, 0, sizeof(struct cowblk));
+
+    cow->chunkbuf = kmalloc(COWBLK_CHUNKSZ);
+    if (cow->chunkbuf == NULL) {
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    result = device_open(&cow->delta, "blk", 1);
+    if (result < 0) {
+        cow->delta = NULL;
+        goto fail;
+    }
+
+    result = ioctl(cow->delta, IOCTL_GETLEN, &len);
+    if (result < 0)
+        goto fail;
+
+    cow->dchunks = len / COWBLK_CHUNKSZ;
+
+    result = (cow->dchunks != 0) ?
+        dev_read(cow->delta, 0, cow->chunkbuf, COWBLK_CHUNKSZ) : -EBADFMT;
+    if (result < 0)
+        goto fail;
+
+    hdr = (const struct cow_header *)cow->chunkbuf;
+    if (hdr->magic != COWBLK_MAGIC || hdr->chunksz != COWBLK_CHUNKSZ) {
+        result = -EBADFMT;
+        goto fail;
+    }
+
+    cow->size = hdr->base_size;
+    cow->tabchunks = hdr->tabchunks;
+    cow->nchunks = (cow->size + COWBLK_CHUNKSZ-1) / COWBLK_CHUNKSZ;
+
+    if ((uint64_t)cow->tabchunks * COWBLK_CHUNKSZ < cow->nchunks * 4UL ||
+        cow->dchunks <= cow->tabchunks)
+    {
+        result = -EBADFMT;
+        goto fail;
+    }
+
+    result = device_open(&cow->base, "blk", 0);
+    if (result < 0) {
+        cow->base = NULL;
+        goto fail;
+    }
+
+    // A delta made for another image would hand out the wrong chunks
+
+    result = ioctl(cow->base, IOCTL_GETLEN, &len);
+    if (result >= 0 && len != cow->size)
+        result = -EBADFMT;
+    if (result >= 0)
+        result = ioctl(cow->base, IOCTL_GETBLKSZ, &cow->blksz);
+    if (result < 0)
+        goto fail;
+
+    cow->tab = kmalloc((size_t)cow->tabchunks * COWBLK_CHUNKSZ);
+    if (cow->tab == NULL) {
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    result = dev_read(cow->delta, COWBLK_CHUNKSZ, cow->tab,
+        (size_t)cow->tabchunks * COWBLK_CHUNKSZ);
+    if (result < 0)
+        goto fail;
+
+    // Copied chunks are allocated in order, so the next free one follows the
+    // highest in the table. A chunk leaked by a crash is skipped for good.
+
+    cow->next = 1 + cow->tabchunks;
+
+    for (i = 0; i < cow->nchunks; i++) {
+        e = cow->tab[i];
+        if (e == 0)
+            continue;
+
+        if (e < 1 + cow->tabchunks || cow->dchunks <= e) {
+            result = -EBADFMT;
+            goto fail;
+        }
+
+        cow->ncopied += 1;
+        if (cow->next <= e)
+            cow->next = e + 1;
+    }
+
+    lock_init(&cow->lock, "cowblk");
+    device_register("cow", &cowblk_open, cow);
+
+    kprintf("cow: %u chunks of blk0, %u copied to blk1, room for %u more\n",
+        cow->nchunks, cow->ncopied, cow->dchunks - cow->next);
+    return 0;
+
+fail:
+    if (cow->base != NULL)
+        ioclose(cow->base);
+    if (cow->delta != NULL)
+        ioclose(cow->delta);
+    kfree(cow->tab);
+    kfree(cow->chunkbuf);
+    kfree(cow);
+    return result;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * int cowblk_open(struct io_intf ** ioptr, void * aux);
+ *
+ * Opens the overlay. It may be open any number of times; each open has its
+ * own position, starting at 0.
+ *
+ * Inputs:
+ *          ioptr - receives the I/O interface
+ *          aux - the overlay
+ * Outputs:
+ *          0, or -ENOMEM
+ * Side Effects:
+ *          Allocates the open's state, freed by cowblk_close.
+ */
+int cowblk_open(struct io_intf ** ioptr, void * aux) {
+    struct cowblk_file * file;
+
+    file = kmalloc(sizeof(struct cowblk_file));
+    if (file == NULL)
+        return -ENOMEM;
+
+    file->io_intf.ops = &cowblk_ops;
+    file->io_intf.refcnt = 1;
+    file->cow = aux;
+    file->pos = 0;
+
+    *ioptr = &file->io_intf;
+    return 0;
+}
+
+/**
+ * void cowblk_close(struct io_intf * io);
+ *
+ * Closes an open of the overlay. The overlay itself stays registered.
+ *
+ * Inputs:
+ *          io - the open
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Frees the open's state.
+ */
+void cowblk_close(struct io_intf * io) {
+    kfree((void*)io - offsetof(struct cowblk_file, io_intf));
+}
+
+/**
+ * long cowblk_read(struct io_intf * io, void * buf, unsigned long bufsz);
+ *
+ * Reads from the current position, taking each chunk from the delta if it
+ * was copied there and from the base otherwise.
+ *
+ * Inputs:
+ *          io - the overlay
+ *          buf - receives the data
+ *          bufsz - bytes to read, a multiple of the sector size
+ * Outputs:
+ *          Bytes read, 0 at the end of the device, -ENOTSUP for a partial
+ *          sector, or -EIO
+ * Side Effects:
+ *          Advances the position.
+ */
+long cowblk_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct cowblk_file * const file =
+        (void*)io - offsetof(struct cowblk_file, io_intf);
+    struct cowblk * const cow = file->cow;
+    uint64_t pos, end;
+    uint32_t c, off, n;
+    long nread;
+    int result;
+
+    if (bufsz % cow->blksz != 0)
+        return -ENOTSUP;
+
+    lock_acquire(&cow->lock);
+
+    pos = file->pos;
+    if (pos % cow->blksz != 0) {
+        lock_release(&cow->lock);
+        return -ENOTSUP;
+    }
+
+    end = MIN(pos + bufsz, cow->size);
+    nread = 0;
+
+    while (pos < end) {
+        c = pos / COWBLK_CHUNKSZ;
+        off = pos % COWBLK_CHUNKSZ;
+        n = MIN(COWBLK_CHUNKSZ - off, end - pos);
+
+        if (cow->tab[c] != 0) {
+            result = dev_read(cow->delta,
+                (uint64_t)cow->tab[c] * COWBLK_CHUNKSZ + off, buf, n);
+        } else
+            result = dev_read(cow->base, pos, buf, n);
+
+        if (result < 0)
+            break;
+
+        buf += n;
+        pos += n;
+        nread += n;
+    }
+
+    file->pos = pos;
+    lock_release(&cow->lock);
+
+    return (nread != 0 || pos == end) ? nread : -EIO;
+}
+
+/**
+ * long cowblk_write(struct io_intf * io, const void * buf, unsigned long n);
+ *
+ * Writes at the current position. Chunks not yet copied are copied to the
+ * delta first, with the written bytes in place; the base is never written.
+ *
+ * Inputs:
+ *          io - the overlay
+ *          buf - data to write
+ *          n - bytes to write, a multiple of the sector size
+ * Outputs:
+ *          Bytes written, -ENOTSUP for a partial sector, -ENOSPC if the delta
+ *          is full, or -EIO
+ * Side Effects:
+ *          Advances the position. May write the remap table.
+ */
+long cowblk_write(struct io_intf * io, const void * buf, unsigned long n) {
+    struct cowblk_file * const file =
+        (void*)io - offsetof(struct cowblk_file, io_intf);
+    struct cowblk * const cow = file->cow;
+    uint64_t pos, end;
+    uint32_t c, off, cnt;
+    long nwritten;
+    int result;
+
+    if (n % cow->blksz != 0)
+        return -ENOTSUP;
+
+    lock_acquire(&cow->lock);
+
+    pos = file->pos;
+    if (pos % cow->blksz != 0) {
+        lock_release(&cow->lock);
+        return -ENOTSUP;
+    }
+
+    end = MIN(pos + n, cow->size);
+    nwritten = 0;
+    result = 0;
+
+    while (pos < end) {
+        c = pos / COWBLK_CHUNKSZ;
+        off = pos % COWBLK_CHUNKSZ;
+        cnt = MIN(COWBLK_CHUNKSZ - off, end - pos);
+
+        if (cow->tab[c] != 0) {
+            result = dev_write(cow->delta,
+                (uint64_t)cow->tab[c] * COWBLK_CHUNKSZ + off, buf, cnt);
+        } else
+            result = copy_chunk(cow, c, off, buf, cnt);
+
+        if (result < 0)
+            break;
+
+        buf += cnt;
+        pos += cnt;
+        nwritten += cnt;
+    }
+
+    file->pos = pos;
+    lock_release(&cow->lock);
+
+    return (nwritten != 0 || result == 0) ? nwritten : result;
+}
+
+/**
+ * int cowblk_ioctl(struct io_intf * io, int cmd, void * arg);
+ *
+ * Handles the block device ioctls and IOCTL_COW_STAT and IOCTL_COW_COMMIT.
+ * Only init may commit, since it rewrites blk0 under every other process.
+ *
+ * Inputs:
+ *          io - the overlay
+ *          cmd - ioctl number
+ *          arg - argument of cmd
+ * Outputs:
+ *          0 or the result of cmd, -ENOTSUP for an unknown cmd, -EPERM
+ *          for IOCTL_COW_COMMIT from a process other than init
+ * Side Effects:
+ *          See commit for IOCTL_COW_COMMIT.
+ */
+int cowblk_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct cowblk_file * const file =
+        (void*)io - offsetof(struct cowblk_file, io_intf);
+    struct cowblk * const cow = file->cow;
+    struct cow_stat * st;
+    int result;
+
+    trace("%s(cmd=%d,arg=%p)", __func__, cmd, arg);
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t*)arg = cow->size;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t*)arg = file->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        lock_acquire(&cow->lock);
+        file->pos = *(uint64_t*)arg;
+        lock_release(&cow->lock);
+        return 0;
+    case IOCTL_GETBLKSZ:
+        *(uint32_t*)arg = cow->blksz;
+        return 0;
+    case IOCTL_COW_STAT:
+        st = arg;
+        st->chunksz = COWBLK_CHUNKSZ;
+        st->nchunks = cow->nchunks;
+        st->ncopied = cow->ncopied;
+        st->nfree = cow->dchunks - cow->next;
+        return 0;
+    case IOCTL_COW_COMMIT:
+        if (!current_privileged())
+            return -EPERM;
+        lock_acquire(&cow->lock);
+        result = commit(cow, arg);
+        lock_release(&cow->lock);
+        return result;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/**
+ * int copy_chunk(struct cowblk * cow, uint32_t c,
+ *     uint32_t off, const void * buf, uint32_t n);
+ *
+ * Copies base chunk c to the next free chunk of the delta with the n bytes at
+ * buf written over it at off, then points its table entry at the copy.
+ *
+ * Inputs:
+ *          cow - the overlay, locked
+ *          c - chunk of the base, not yet copied
+ *          off, buf, n - bytes being written to the chunk
+ * Outputs:
+ *          0, -ENOSPC if the delta is full, or -EIO
+ * Side Effects:
+ *          Writes the delta, including a chunk of the remap table.
+ */
+int copy_chunk(struct cowblk * cow, uint32_t c,
+    uint32_t off, const void * buf, uint32_t n)
+{
+    uint64_t pos = (uint64_t)c * COWBLK_CHUNKSZ;
+    uint32_t len = MIN(COWBLK_CHUNKSZ, cow->size - pos);
+    int result;
+
+    if (cow->next == cow->dchunks)
+        return -ENOSPC;
+
+    // A write of the whole chunk needs nothing from the base
+
+    if (n < len) {
+        result = dev_read(cow->base, pos, cow->chunkbuf, len);
+        if (result < 0)
+            return result;
+    }
+
+    memset(cow->chunkbuf + len, 0, COWBLK_CHUNKSZ - len);
+    memcpy(cow->chunkbuf + off, buf, n);
+
+    result = dev_write(cow->delta, (uint64_t)cow->next * COWBLK_CHUNKSZ,
+        cow->chunkbuf, COWBLK_CHUNKSZ);
+    if (result < 0)
+        return result;
+
+    cow->tab[c] = cow->next;
+    result = store_entry(cow, c);
+    if (result < 0) {
+        cow->tab[c] = 0;
+        return result;
+    }
+
+    debug("cow: chunk %u copied to %u", c, cow->next);
+    cow->next += 1;
+    cow->ncopied += 1;
+    return 0;
+}
+
+/**
+ * int store_entry(struct cowblk * cow, uint32_t c);
+ *
+ * Writes the chunk of the remap table that holds the entry of base chunk c.
+ *
+ * Inputs:
+ *          cow - the overlay, locked
+ *          c - chunk of the base
+ * Outputs:
+ *          0 or -EIO
+ * Side Effects:
+ *          Writes the delta.
+ */
+int store_entry(struct cowblk * cow, uint32_t c) {
+    const uint32_t t = c / (COWBLK_CHUNKSZ / sizeof(uint32_t));
+
+    return dev_write(cow->delta, (uint64_t)(1 + t) * COWBLK_CHUNKSZ,
+        (char*)cow->tab + (size_t)t * COWBLK_CHUNKSZ, COWBLK_CHUNKSZ);
+}
+
+/**
+ * int commit(struct cowblk * cow, uint64_t * nmerged);
+ *
+ * Writes every copied chunk back to the base, then empties the remap table
+ * and frees all chunks of the delta.
+ *
+ * Inputs:
+ *          cow - the overlay, locked
+ *          nmerged - receives the number of chunks written back; may be NULL
+ * Outputs:
+ *          0, or -EIO if the base could not be written (for example because
+ *          its disk is read-only), in which case nothing has changed for
+ *          readers of the overlay
+ * Side Effects:
+ *          Writes the base and the remap table.
+ */
+int commit(struct cowblk * cow, uint64_t * nmerged) {
+    uint64_t pos;
+    uint32_t c, len;
+    int result;
+
+    for (c = 0; c < cow->nchunks; c++) {
+        if (cow->tab[c] == 0)
+            continue;
+
+        pos = (uint64_t)c * COWBLK_CHUNKSZ;
+        len = MIN(COWBLK_CHUNKSZ, cow->size - pos);
+
+        result = dev_read(cow->delta, (uint64_t)cow->tab[c] * COWBLK_CHUNKSZ,
+            cow->chunkbuf, len);
+        if (result < 0)
+            return result;
+
+        result = dev_write(cow->base, pos, cow->chunkbuf, len);
+        if (result < 0)
+            return result;
+    }
+
+    // The base now holds everything; only then let go of the copies
+
+    memset(cow->tab, 0, (size_t)cow->tabchunks * COWBLK_CHUNKSZ);
+    result = dev_write(cow->delta, COWBLK_CHUNKSZ, cow->tab,
+        (size_t)cow->tabchunks * COWBLK_CHUNKSZ);
+    if (result < 0)
+        return result;
+
+    debug("cow: %u chunks merged", cow->ncopied);
+
+    if (nmerged != NULL)
+        *nmerged = cow->ncopied;
+
+    cow->ncopied = 0;
+    cow->next = 1 + cow->tabchunks;
+    return 0;
+}
+
+// Reads or writes len bytes at pos of a disk. Returns 0 or -EIO.
+
+int dev_read(struct io_intf * io, uint64_t pos, void * buf, size_t len) {
+    if (ioseek(io, pos) < 0 || ioread_full(io, buf, len) != (long)len)
+        return -EIO;
+    return 0;
+}
+
+int dev_write(struct io_intf * io, uint64_t pos, const void * buf, size_t len) {
+    if (ioseek(io, pos) < 0 || iowrite(io, buf, len) != (long)len)
+        return -EIO;
+    return 0;
+}
@@ -0,0 +1,85 @@
+// cowblk.h - Copy-on-write overlay block device
+//
+// The overlay presents a base block device, which it never writes, and a
+// delta device as one block device named "cow". Both are virtio disks: blk0
+// is the base and blk1 the delta. The first write to a chunk of the base
+// copies the chunk to the next free chunk of the delta and records where it
+// went in a remap table kept on the delta; reads of a copied chunk go to the
+// delta and all other reads to the base. Many machines can therefore share
+// one base image, each with a delta that only grows with what it writes.
+//
+// The delta starts with a header chunk, followed by the remap table, one
+// 32-bit entry per base chunk, then the copied chunks. util/mkcow creates an
+// empty delta for a given base image. A chunk is copied before the table
+// entry that points to it is written, so a crash can leak a delta chunk but
+// never exposes one that was not filled in.
+//
+// IOCTL_COW_COMMIT merges the delta into the base: it writes every copied
+// chunk back to its place on the base and then empties the remap table. The
+// base disk must be writable for this, and only init may do it. A crash part
+// way through leaves the table as it was, so reads are unaffected and the
+// commit can be repeated.
+//
+// main mounts the overlay in place of blk0 when blk1 holds a delta made for
+// a base of the size of blk0.
+//
+
+#ifndef _COWBLK_H_
+#define _COWBLK_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// COWBLK_CHUNKSZ is the copy-on-write granularity. It matches the KFS block
+// size, so a file system block write never copies more than it writes.
+
+#ifndef COWBLK_CHUNKSZ
+#define COWBLK_CHUNKSZ 4096
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// IOCTL numbers of the overlay. Mirrored in user/syscall.h.
+
+#define IOCTL_COW_STAT      28 // arg is pointer to struct cow_stat
+#define IOCTL_COW_COMMIT    29 // arg is pointer to uint64_t chunks merged, or NULL
+
+#define COWBLK_MAGIC        0x64776f63 // "cowd"
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Header chunk of a delta device. Mirrored in util/mkcow.c.
+
+struct cow_header {
+    uint32_t magic;             // COWBLK_MAGIC
+    uint32_t chunksz;           // COWBLK_CHUNKSZ
+    uint64_t base_size;         // size of the base device in bytes
+    uint32_t tabchunks;         // chunks of remap table after the header
+    uint32_t reserved;
+};
+
+// Argument of IOCTL_COW_STAT
+
+struct cow_stat {
+    uint32_t chunksz;
+    uint32_t nchunks;           // chunks in the base device
+    uint32_t ncopied;           // chunks copied to the delta
+    uint32_t nfree;             // chunks the delta has room for
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Looks for a delta on blk1 and, if it matches blk0, opens both and registers
+// the "cow" device. Returns 0 if the overlay is registered, -ENODEV if there
+// is no second disk, -EBADFMT if it holds no delta for blk0, or an error from
+// opening or reading the disks. Must be called with interrupts enabled, after
+// the virtio devices are attached.
+
+extern int cowblk_attach(void);
+
+#endif // _COWBLK_H_
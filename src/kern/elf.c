@@ -3,6 +3,13 @@
 #include "string.h"
 #include "config.h"
 #include "memory.h"
+#include "process.h"
+
+// Most program headers a loadable file may have. The headers are read into
+// an array on the kernel stack in one I/O.
+#ifndef ELF_MAXPHDRS
+#define ELF_MAXPHDRS 8
+#endif
 
 // Load address for ELF files
 // #define LOAD_MIN 0x80100000 // Lower bound for loading
@@ -91,6 +98,9 @@ typedef struct
 
 // Function declaration
 static int verify_elf_header(const Elf64_Ehdr *ehdr);
+static int verify_segment(const Elf64_Phdr *phdr);
+static uint_fast8_t segment_perms(const Elf64_Phdr *phdr);
+static int map_segment_lazy(struct io_intf *io, const Elf64_Phdr *phdr);
 
 /*******************************************************************************
  * Function: elf_load
@@ -108,11 +118,19 @@ static int verify_elf_header(const Elf64_Ehdr *ehdr);
  * - Loads data segments with PT_LOAD==1 into memory
  * - Zero-fill parts where memsz>filesz
  * - fill in entry point of function pointer
+ *
+ * Reads all program headers at once and checks every segment before mapping
+ * any. Outside a process, segments are loaded in stages (map all, read all in
+ * file order, zero all, protect all) so the reads are not interleaved with
+ * page table work.
  ******************************************************************************/
 int elf_load(struct io_intf *io, void (**entryptr)(void))
 {
     Elf64_Ehdr ehdr;
-    Elf64_Phdr phdr;
+    Elf64_Phdr phdrs[ELF_MAXPHDRS];
+    const Elf64_Phdr *segs[ELF_MAXPHDRS];
+    uintptr_t start, end;
+    int nseg;
     int result;
 
     debug("Starting ELF load\n");
@@ -148,110 +166,332 @@ int elf_load(struct io_intf *io, void (**entryptr)(void))
     *entryptr = (void (*)(void))(ehdr.e_entry);
     debug("Set entry point to: 0x%lx\n", (uintptr_t)*entryptr);
 
-    // Process program headers
-    for (int i = 0; i < ehdr.e_phnum; i++)
+    // Read all program headers in one I/O
+    if (ehdr.e_phnum > ELF_MAXPHDRS)
     {
-        debug("\nProcessing program header %d\n", i);
+        debug("Too many program headers: %d\n", ehdr.e_phnum);
+        return -ENOTSUP;
+    }
 
-        // Seek to program header
-        pos = ehdr.e_phoff + (i * sizeof(phdr));
-        debug("  Seeking to program header at offset: 0x%lx\n", pos);
+    if (ioseek(io, ehdr.e_phoff) < 0 ||
+        ioread_full(io, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr)) !=
+            ehdr.e_phnum * sizeof(Elf64_Phdr))
+    {
+        debug("Failed to read program headers\n");
+        return -EIO;
+    }
 
-        if (ioseek(io, pos) < 0)
-        {
-            debug("  Failed to seek to program header\n");
-            return -EIO;
-        }
+    // Keep the PT_LOAD segments, in file order, and check them all before
+    // anything is mapped
+    nseg = 0;
+    for (int i = 0; i < ehdr.e_phnum; i++)
+    {
+        debug("\nProgram header %d\n", i);
+        debug("     Type: 0x%lx\n", phdrs[i].p_type);
+        debug("     Flags: 0x%lx\n", phdrs[i].p_flags);
+        debug("     Offset: 0x%lx\n", phdrs[i].p_offset);
+        debug("     VAddr: 0x%lx\n", phdrs[i].p_vaddr);
+        debug("     FileSize: 0x%lx\n", phdrs[i].p_filesz);
+        debug("     MemSize: 0x%lx\n", phdrs[i].p_memsz);
 
-        // Read program header
-        if (ioread(io, &phdr, sizeof(phdr)) != sizeof(phdr))
+        // Only load PT_LOAD segments
+        if (phdrs[i].p_type != PT_LOAD)
         {
-            debug("  Failed to read program header\n");
-            return -EIO;
+            debug("  Skipping non-PT_LOAD segment\n");
+            continue;
         }
 
-        debug("  Program Header Info:\n");
-        debug("     Type: 0x%lx\n", phdr.p_type);
-        debug("     Flags: 0x%lx\n", phdr.p_flags);
-        debug("     Offset: 0x%lx\n", phdr.p_offset);
-        debug("     VAddr: 0x%lx\n", phdr.p_vaddr);
-        debug("     PAddr: 0x%lx\n", phdr.p_paddr);
-        debug("     FileSize: 0x%lx\n", phdr.p_filesz);
-        debug("     MemSize: 0x%lx\n", phdr.p_memsz);
-        debug("     Align: 0x%lx\n", phdr.p_align);
+        if ((result = verify_segment(&phdrs[i])) < 0)
+            return result;
 
-        // Only load PT_LOAD segments
-        if (phdr.p_type != PT_LOAD)
+        // Insertion sort by file offset
+        int j = nseg++;
+        while (j > 0 && phdrs[i].p_offset < segs[j-1]->p_offset)
         {
-            debug("  Skipping non-PT_LOAD segment\n");
-            continue;
+            segs[j] = segs[j-1];
+            j--;
         }
+        segs[j] = &phdrs[i];
+    }
 
-        // Verify memory range
-        if (phdr.p_vaddr < USER_START_VMA || phdr.p_vaddr + phdr.p_memsz > USER_END_VMA)
+    // In a process, each segment becomes a file-backed region of the
+    // process and is paged in from io on demand
+    if (procmgr_initialized)
+    {
+        for (int i = 0; i < nseg; i++)
         {
-            debug("  Invalid virtual address\n");
-            return -EINVAL;
+            if ((result = map_segment_lazy(io, segs[i])) < 0)
+                return result;
         }
 
-        // Seek to segment data
-        pos = phdr.p_offset;
-        debug("  Seeking to segment data at offset: 0x%lx\n", pos);
+        debug("ELF loading completed\n");
+        return 0;
+    }
+
+    // Otherwise (no process manager), load the segments eagerly. Build the
+    // page tables for all of them first, so that the reads that follow run
+    // back to back in file order, then zero the BSS and set the final
+    // permissions.
 
-        if (ioseek(io, pos) < 0)
+    for (int i = 0; i < nseg; i++)
+    {
+        start = segs[i]->p_vaddr & ~(PAGE_SIZE - 1);
+        end = (segs[i]->p_vaddr + segs[i]->p_memsz + PAGE_SIZE - 1) &
+            ~(PAGE_SIZE - 1);
+
+        if (memory_alloc_and_map_range(start, end - start, PTE_U | PTE_R | PTE_W) == NULL) {
+            debug("memory allocate fails in elf loader");
+            return -EBUSY;
+        }
+    }
+
+    pos = UINT64_MAX;
+    for (int i = 0; i < nseg; i++)
+    {
+        // Segments that follow each other in the file need no seek
+        if (segs[i]->p_offset != pos && ioseek(io, segs[i]->p_offset) < 0)
         {
             debug("  Failed to seek to segment data\n");
             return -EIO;
         }
 
-        // Use virtual address to load
-        uintptr_t load_addr = (uintptr_t)phdr.p_vaddr;
-        debug("  Loading at address: 0x%lx\n", (uintptr_t)load_addr);
+        long bytes_read = ioread_full(io, (void*)segs[i]->p_vaddr, segs[i]->p_filesz);
+        debug("  Read %ld of %ld bytes\n", bytes_read, segs[i]->p_filesz);
 
-        uint_fast8_t perms = PTE_U | PTE_R | PTE_W;
-
-        if (memory_alloc_and_map_range((uintptr_t) phdr.p_vaddr, phdr.p_memsz, perms) == NULL) {
-            debug("memory allocate fails in elf loader");
-            return -EBUSY;
+        if (bytes_read != segs[i]->p_filesz)
+        {
+            debug("  Failed to read segment data\n");
+            return -EIO;
         }
-        // Load segment into memory
-         size_t bytes_read = ioread_full(io, (void*) load_addr, phdr.p_filesz);
-         debug("  Read %ld of %ld bytes\n", bytes_read, phdr.p_filesz);
 
-         if (bytes_read != phdr.p_filesz)
-         {
-             debug("  Failed to read segment data\n");
-             return -EIO;
-         }
+        pos = segs[i]->p_offset + segs[i]->p_filesz;
+    }
 
+    for (int i = 0; i < nseg; i++)
+    {
         // Zero-fill the remaining memory
-        if (phdr.p_memsz > phdr.p_filesz)
+        if (segs[i]->p_memsz > segs[i]->p_filesz)
         {
-            size_t size = phdr.p_memsz - phdr.p_filesz;
-            memset((void*)(load_addr + phdr.p_filesz), 0, size);
+            size_t size = segs[i]->p_memsz - segs[i]->p_filesz;
+            memset((void*)(segs[i]->p_vaddr + segs[i]->p_filesz), 0, size);
             debug("  Zero-filled %ld bytes\n", size);
         }
-        // set the actucal page flag based on header flags
-        perms = PTE_U;
-
-        // COMMENT OUT THESE PORTIONS TO TEST PAGE FAULTING
-        if (phdr.p_flags & PF_X)
-            perms |= PTE_X;
-        if (phdr.p_flags & PF_W)
-            perms |= PTE_W;
-        if (phdr.p_flags & PF_R)
-            perms |= PTE_R;
-
-        memory_set_range_flags((void*)load_addr, phdr.p_memsz, perms);
     }
 
-    // test page faulting
-
+    // set the actual page flags based on header flags
+    for (int i = 0; i < nseg; i++)
+    {
+        start = segs[i]->p_vaddr & ~(PAGE_SIZE - 1);
+        end = (segs[i]->p_vaddr + segs[i]->p_memsz + PAGE_SIZE - 1) &
+            ~(PAGE_SIZE - 1);
+        memory_set_range_flags((void*)start, end - start,
+            PTE_U | segment_perms(segs[i]));
+    }
 
     debug("ELF loading completed\n");
     return 0;
 }
 
+/*******************************************************************************
+ * Function: elf_stage
+ *
+ * Description: Reads an executable elf into a buffer for a later copy to its
+ * physical load address, as kexec does with a kernel image
+ *
+ * Inputs:
+ * io (struct io_intf *) - io interface from which to read the elf
+ * base (uintptr_t) - physical address that buf stands for
+ * buf (void *) - where to put the segments
+ * bufsz (size_t) - size of buf
+ * ext (struct elf_extent *) - filled in with the entry point and extent
+ *
+ * Output:
+ * (int) 0 if successful, negative error code if not
+ *
+ * Side Effects:
+ * - Zeroes buf and reads each PT_LOAD segment to buf + (p_paddr - base)
+ ******************************************************************************/
+int elf_stage(struct io_intf *io, uintptr_t base, void *buf, size_t bufsz,
+    struct elf_extent *ext)
+{
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdrs[ELF_MAXPHDRS];
+    const Elf64_Phdr *phdr;
+    size_t end;
+    int result;
+
+    if (ioseek(io, 0) < 0 || ioread(io, &ehdr, sizeof(ehdr)) != sizeof(ehdr))
+    {
+        debug("Failed to read ELF header\n");
+        return -EIO;
+    }
+
+    if ((result = verify_elf_header(&ehdr)) < 0)
+        return result;
+
+    if (ehdr.e_phnum > ELF_MAXPHDRS)
+    {
+        debug("Too many program headers: %d\n", ehdr.e_phnum);
+        return -ENOTSUP;
+    }
+
+    if (ioseek(io, ehdr.e_phoff) < 0 ||
+        ioread_full(io, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr)) !=
+            ehdr.e_phnum * sizeof(Elf64_Phdr))
+    {
+        debug("Failed to read program headers\n");
+        return -EIO;
+    }
+
+    memset(buf, 0, bufsz);
+    ext->filelen = 0;
+    ext->memlen = 0;
+
+    for (int i = 0; i < ehdr.e_phnum; i++)
+    {
+        phdr = &phdrs[i];
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        // Physical addresses, unlike elf_load's virtual ones, must lie in buf
+        if (phdr->p_paddr < base || phdr->p_filesz > phdr->p_memsz ||
+            phdr->p_memsz > bufsz || phdr->p_paddr - base > bufsz - phdr->p_memsz)
+        {
+            debug("Segment at 0x%lx does not fit\n", phdr->p_paddr);
+            return -EINVAL;
+        }
+
+        if (phdr->p_filesz != 0 &&
+            (ioseek(io, phdr->p_offset) < 0 ||
+             ioread_full(io, buf + (phdr->p_paddr - base), phdr->p_filesz) !=
+                phdr->p_filesz))
+        {
+            debug("Failed to read segment at 0x%lx\n", phdr->p_paddr);
+            return -EIO;
+        }
+
+        end = phdr->p_paddr - base + phdr->p_filesz;
+        if (ext->filelen < end)
+            ext->filelen = end;
+
+        end = phdr->p_paddr - base + phdr->p_memsz;
+        if (ext->memlen < end)
+            ext->memlen = end;
+    }
+
+    if (ehdr.e_entry < base || ehdr.e_entry - base >= ext->memlen)
+    {
+        debug("Entry point 0x%lx outside the image\n", ehdr.e_entry);
+        return -EINVAL;
+    }
+
+    ext->entry = ehdr.e_entry;
+    return 0;
+}
+
+/*******************************************************************************
+ * Function: verify_segment
+ *
+ * Description: Checks that a PT_LOAD segment lies in user memory
+ *
+ * Inputs:
+ * phdr (const Elf64_Phdr *) - program header of the segment
+ *
+ * Output:
+ * (int) 0 if valid, -EINVAL if not
+ *
+ * Side Effects: None
+ ******************************************************************************/
+static int verify_segment(const Elf64_Phdr *phdr)
+{
+    if (phdr->p_vaddr < USER_START_VMA || phdr->p_vaddr >= memory_user_end ||
+        phdr->p_memsz > memory_user_end - phdr->p_vaddr ||
+        phdr->p_filesz > phdr->p_memsz)
+    {
+        debug("  Invalid virtual address\n");
+        return -EINVAL;
+    }
+
+    // The file data of a segment shares its page offset with the address
+    if (phdr->p_offset < (phdr->p_vaddr & (PAGE_SIZE - 1)))
+    {
+        debug("  Invalid file offset\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ * Function: segment_perms
+ *
+ * Description: Translates the p_flags of a segment to PTE permission bits
+ *
+ * Inputs:
+ * phdr (const Elf64_Phdr *) - program header of the segment
+ *
+ * Output:
+ * (uint_fast8_t) combination of PTE_R, PTE_W and PTE_X
+ *
+ * Side Effects: None
+ ******************************************************************************/
+static uint_fast8_t segment_perms(const Elf64_Phdr *phdr)
+{
+    uint_fast8_t perms = 0;
+
+    if (phdr->p_flags & PF_X)
+        perms |= PTE_X;
+    if (phdr->p_flags & PF_W)
+        perms |= PTE_W;
+    if (phdr->p_flags & PF_R)
+        perms |= PTE_R;
+
+    return perms;
+}
+
+/*******************************************************************************
+ * Function: map_segment_lazy
+ *
+ * Description: Adds a segment to the current process as a file-backed region
+ *
+ * Inputs:
+ * io (struct io_intf *) - io interface the segment is paged in from
+ * phdr (const Elf64_Phdr *) - program header of the segment
+ *
+ * Output:
+ * (int) 0 if successful, negative error code if not
+ *
+ * Side Effects:
+ * - Inserts a VMA_IMAGE region into the current process
+ ******************************************************************************/
+static int map_segment_lazy(struct io_intf *io, const Elf64_Phdr *phdr)
+{
+    uintptr_t load_addr = (uintptr_t)phdr->p_vaddr;
+    uintptr_t head = load_addr & (PAGE_SIZE - 1);
+    int result;
+
+    struct vma seg = {
+        .start = load_addr - head,
+        .end = (load_addr + phdr->p_memsz + PAGE_SIZE - 1) &
+            ~(PAGE_SIZE - 1),
+        .prot = segment_perms(phdr),
+        .flags = VMA_IMAGE,
+        .backing = VMA_FILE,
+        .io = io,
+        .offset = phdr->p_offset - head,
+        .filesz = phdr->p_filesz + head
+    };
+
+    if (vma_insert(&current_process()->vmas, &seg, &result) == NULL)
+    {
+        debug("  Overlapping or invalid segment\n");
+        return result;
+    }
+
+    debug("  Mapped on demand from offset 0x%lx\n", seg.offset);
+    return 0;
+}
+
 /*******************************************************************************
  * Function: verify_elf_header
  *
@@ -304,7 +544,8 @@ static int verify_elf_header(const Elf64_Ehdr *ehdr)
 
     // Validate program header offset and count
     // debug("Header Verification: Checking for program headers\n");
-    if (ehdr->e_phoff == 0 || ehdr->e_phnum == 0)
+    if (ehdr->e_phoff == 0 || ehdr->e_phnum == 0 ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr))
     {
         debug("No program headers found\n");
         return -EINVAL;
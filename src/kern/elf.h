@@ -5,6 +5,7 @@
 #define _ELF_H_
 
 #include "io.h"
+#include <stddef.h>
 #include <stdint.h>
 
 //            arg1: io interface from which to load the elf arg2: pointer to void
@@ -20,5 +21,23 @@
 
 int elf_load(struct io_intf *io, void (**entryptr)(void));
 
+//            Where an image staged by elf_stage lies, relative to its load address
+
+struct elf_extent {
+    uintptr_t entry;            // entry point
+    size_t filelen;             // end of the file data of the last segment
+    size_t memlen;              // end of the last segment
+};
+
+//            int elf_stage(struct io_intf *io, uintptr_t base, void *buf, size_t bufsz,
+//            struct elf_extent *ext) Reads the PT_LOAD segments of an executable ELF file
+//            into buf as they would lie in physical memory from base on, placed by
+//            p_paddr, and zeroes the rest of buf. Used by kexec, which copies buf to base.
+//            Return 0 on success or a negative error code; -EINVAL if a segment does not
+//            fit.
+
+int elf_stage(struct io_intf *io, uintptr_t base, void *buf, size_t bufsz,
+    struct elf_extent *ext);
+
 //            _ELF_H_
 #endif
@@ -6,6 +6,8 @@
 #include "halt.h"
 #include "memory.h"
 #include "syscall.h"
+#include "config.h"
+#include "process.h"
 
 #include <stddef.h>
 
@@ -49,8 +51,42 @@ static const char *const excp_names[] = {
 // EXPORTED FUNCTION DEFINITIONS
 //
 
+/*******************************************************************************
+ * Function: smode_excp_handler
+ *
+ * Description: Handles exceptions that occur in S mode.
+ *
+ * Inputs:
+ * code (unsigned int) - Exception code from scause register
+ * tfr (struct trap_frame *) - Trap frame containing exception information
+ *
+ * Output: None
+ *
+ * Side Effects:
+ * - Page faults on user addresses (the kernel touching a user buffer that has
+ *   not been populated yet) are handled as if the process had faulted
+ * - Anything else panics
+ ******************************************************************************/
 void smode_excp_handler(unsigned int code, struct trap_frame *tfr)
 {
+    const uintptr_t addr = csrr_stval();
+
+    switch (code)
+    {
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+        if (procmgr_initialized && current_process() != NULL &&
+            USER_START_VMA <= addr && addr < memory_user_end)
+        {
+            memory_handle_page_fault((void *)addr,
+                (code == RISCV_SCAUSE_STORE_PAGE_FAULT) ? PTE_W : PTE_R);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
     default_excp_handler(code, tfr);
 }
 
@@ -84,11 +120,15 @@ void umode_excp_handler(unsigned int code, struct trap_frame *tfr)
         debug("%s: After syscall with sepc=%p sp=%p", __func__, (void *)tfr->sepc, (void *)tfr->x[TFR_SP]);
         break;
     case RISCV_SCAUSE_STORE_PAGE_FAULT:
+        memory_handle_page_fault((void *)csrr_stval(), PTE_W);
+        break;
     case RISCV_SCAUSE_LOAD_PAGE_FAULT:
-        memory_handle_page_fault((void *)tfr->x[TFR_SP]);
+        memory_handle_page_fault((void *)csrr_stval(), PTE_R);
         break;
     case RISCV_SCAUSE_INSTR_PAGE_FAULT:
         debug("%s: Instruction page fault at sepc=%p sp=%p", __func__, (void *)tfr->sepc, (void *)tfr->x[TFR_SP]);
+        memory_handle_page_fault((void *)csrr_stval(), PTE_X);
+        break;
     default:
         default_excp_handler(code, tfr);
         break;
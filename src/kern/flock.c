@@ -0,0 +1,531 @@
+// flock.c - Byte-range file locks
+//
+
+#include "flock.h"
+
+#include "process.h"
+#include "thread.h"
+#include "string.h"
+#include "error.h"
+#include "console.h"
+
+#ifdef FLOCK_TRACE
+#define TRACE
+#endif
+
+#ifdef FLOCK_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A locked range [start,end) of one process
+
+struct flock_lock {
+    struct flock_lock * next;       // next range of the file, by start
+    uint64_t start;
+    uint64_t end;                   // UINT64_MAX for a range without end
+    int pid;
+    int mode;                       // FLOCK_SH or FLOCK_EX
+};
+
+// Locks of one inode. The entry is free when it holds no lock and nobody
+// waits on it, so a waiter's entry cannot be reused under it.
+
+struct flock_file {
+    uint32_t ino;
+    int inuse;
+    int nwaiters;
+    struct flock_lock * head;
+    struct condition released;      // broadcast when a range is freed
+};
+
+// The request a process is waiting on, for deadlock detection
+
+struct flock_wait {
+    struct flock_file * ff;         // NULL if the process is not waiting
+    uint64_t start;
+    uint64_t end;
+    int mode;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int lock_owner(void);
+
+static struct flock_file * find_file(uint32_t ino, int create);
+static void put_file(struct flock_file * ff);
+
+static struct flock_lock * conflict(const struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, int mode);
+static int waits_for(int pid, int target, int depth);
+static int would_deadlock(const struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, int mode);
+static int wait_free(struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, int mode, int nb);
+
+static void remove_range(struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, struct flock_lock ** spare);
+static void insert_sorted(struct flock_file * ff, struct flock_lock * lk);
+
+static struct flock_lock * alloc_lock(void);
+static void free_lock(struct flock_lock * lk);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct flock_lock lock_pool[FLOCK_MAXLOCKS];
+static struct flock_lock * free_locks;
+static int pool_initialized;
+
+static struct flock_file files[FLOCK_MAXFILES];
+static struct flock_wait waits[NPROC];
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * int flock_range(uint32_t ino, uint64_t off, uint64_t len, int mode);
+ *
+ * Locks or unlocks a byte range of a file for the current process.
+ *
+ * Inputs:
+ *          ino - inode of the file
+ *          off - first byte of the range
+ *          len - length of the range, 0 for no end
+ *          mode - FLOCK_UN, or FLOCK_SH or FLOCK_EX, optionally with FLOCK_NB
+ * Outputs:
+ *          0 on success, -EINVAL, -EBUSY, -EDEADLK or -ENOMEM
+ * Side Effects:
+ *          May block until the range is free. Wakes waiters when part of a
+ *          range is released or an exclusive lock becomes shared.
+ */
+int flock_range(uint32_t ino, uint64_t off, uint64_t len, int mode) {
+    const int pid = lock_owner();
+    const int nb = mode & FLOCK_NB;
+    struct flock_file * ff;
+    struct flock_lock * spare;
+    struct flock_lock * lk;
+    uint64_t end;
+    int result;
+
+    mode &= ~FLOCK_NB;
+    if (mode < FLOCK_UN || FLOCK_EX < mode)
+        return -EINVAL;
+
+    end = (len == 0 || off + len < off) ? UINT64_MAX : off + len;
+
+    trace("%s(ino=%u,start=%lu,end=%lu,mode=%d)", __func__, ino, off, end, mode);
+
+    ff = find_file(ino, mode != FLOCK_UN);
+    if (ff == NULL)
+        return (mode == FLOCK_UN) ? 0 : -ENOMEM;
+
+    if (mode != FLOCK_UN) {
+        result = wait_free(ff, pid, off, end, mode, nb);
+        if (result < 0) {
+            put_file(ff);
+            return result;
+        }
+    }
+
+    // Take the nodes first, so that nothing changes if there are none. A
+    // request splits at most one range of the process, since its own ranges
+    // never overlap.
+
+    spare = alloc_lock();
+    lk = (mode != FLOCK_UN) ? alloc_lock() : NULL;
+
+    if (spare == NULL || (mode != FLOCK_UN && lk == NULL)) {
+        free_lock(spare);
+        free_lock(lk);
+        put_file(ff);
+        return -ENOMEM;
+    }
+
+    remove_range(ff, pid, off, end, &spare);
+
+    if (lk != NULL) {
+        lk->start = off;
+        lk->end = end;
+        lk->pid = pid;
+        lk->mode = mode;
+        insert_sorted(ff, lk);
+    }
+
+    free_lock(spare);
+    condition_broadcast(&ff->released);
+    put_file(ff);
+    return 0;
+}
+
+/**
+ * int flock_wait(uint32_t ino, uint64_t off, uint64_t len, int mode);
+ *
+ * Waits until no other process holds a lock on the range that conflicts
+ * with mode.
+ *
+ * Inputs:
+ *          ino, off, len, mode - as for flock_range, without FLOCK_NB
+ * Outputs:
+ *          0, or -EDEADLK if waiting would deadlock
+ * Side Effects:
+ *          May block.
+ */
+int flock_wait(uint32_t ino, uint64_t off, uint64_t len, int mode) {
+    const uint64_t end = (len == 0 || off + len < off) ? UINT64_MAX : off + len;
+    struct flock_file * ff;
+    int result;
+
+    ff = find_file(ino, 0);
+    if (ff == NULL)
+        return 0;
+
+    result = wait_free(ff, lock_owner(), off, end, mode, 0);
+    put_file(ff);
+    return result;
+}
+
+/**
+ * int flock_conflict(uint32_t ino, uint64_t off, uint64_t len, int mode);
+ *
+ * Tells whether another process holds a lock on the range that conflicts
+ * with mode.
+ *
+ * Inputs:
+ *          ino, off, len, mode - as for flock_range, without FLOCK_NB
+ * Outputs:
+ *          Nonzero if there is a conflicting lock
+ * Side Effects:
+ *          None.
+ */
+int flock_conflict(uint32_t ino, uint64_t off, uint64_t len, int mode) {
+    const uint64_t end = (len == 0 || off + len < off) ? UINT64_MAX : off + len;
+    struct flock_file * ff;
+
+    ff = find_file(ino, 0);
+    return ff != NULL && conflict(ff, lock_owner(), off, end, mode) != NULL;
+}
+
+/**
+ * void flock_release(int pid);
+ *
+ * Drops all locks of a process.
+ *
+ * Inputs:
+ *          pid - the process
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Wakes the processes waiting on files the process had locks on.
+ */
+void flock_release(int pid) {
+    struct flock_file * ff;
+    int i;
+
+    for (i = 0; i < FLOCK_MAXFILES; i++) {
+        ff = &files[i];
+        if (!ff->inuse)
+            continue;
+
+        remove_range(ff, pid, 0, UINT64_MAX, NULL);
+
+        condition_broadcast(&ff->released);
+        put_file(ff);
+    }
+
+    if (0 <= pid && pid < NPROC)
+        waits[pid].ff = NULL;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Owner of the locks taken by the running thread; -1 for a kernel thread,
+// which never waits for deadlock detection to follow.
+
+int lock_owner(void) {
+    const struct process * const proc =
+        procmgr_initialized ? current_process() : NULL;
+
+    return (proc != NULL) ? proc->id : -1;
+}
+
+/**
+ * struct flock_file * find_file(uint32_t ino, int create);
+ *
+ * Looks up the lock list of an inode, optionally making one.
+ *
+ * Inputs:
+ *          ino - inode
+ *          create - make an entry if there is none
+ * Outputs:
+ *          The entry, or NULL if there is none or no room for one
+ * Side Effects:
+ *          None.
+ */
+struct flock_file * find_file(uint32_t ino, int create) {
+    struct flock_file * unused = NULL;
+    int i;
+
+    for (i = 0; i < FLOCK_MAXFILES; i++) {
+        if (files[i].inuse && files[i].ino == ino)
+            return &files[i];
+        if (!files[i].inuse && unused == NULL)
+            unused = &files[i];
+    }
+
+    if (!create || unused == NULL)
+        return NULL;
+
+    unused->ino = ino;
+    unused->inuse = 1;
+    unused->nwaiters = 0;
+    unused->head = NULL;
+    condition_init(&unused->released, "flock");
+    return unused;
+}
+
+// Frees a file entry that no longer has locks or waiters.
+
+void put_file(struct flock_file * ff) {
+    if (ff->head == NULL && ff->nwaiters == 0)
+        ff->inuse = 0;
+}
+
+/**
+ * struct flock_lock * conflict(const struct flock_file * ff,
+ *     int pid, uint64_t start, uint64_t end, int mode);
+ *
+ * Finds a range of another process that overlaps [start,end) and is
+ * exclusive or would be taken in exclusive mode.
+ *
+ * Inputs:
+ *          ff - locks of the file
+ *          pid - process asking
+ *          start, end - the range
+ *          mode - FLOCK_SH or FLOCK_EX
+ * Outputs:
+ *          The first such range, or NULL
+ * Side Effects:
+ *          None.
+ */
+struct flock_lock * conflict(const struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, int mode)
+{
+    struct flock_lock * lk;
+
+    for (lk = ff->head; lk != NULL && lk->start < end; lk = lk->next) {
+        if (start < lk->end && lk->pid != pid &&
+            (mode == FLOCK_EX || lk->mode == FLOCK_EX))
+            return lk;
+    }
+
+    return NULL;
+}
+
+/**
+ * int waits_for(int pid, int target, int depth);
+ *
+ * Tells whether process pid waits, directly or through a chain of waiting
+ * processes, for a range held by target.
+ *
+ * Inputs:
+ *          pid - process to start from
+ *          target - process looked for
+ *          depth - length of the chain so far
+ * Outputs:
+ *          Nonzero if it does
+ * Side Effects:
+ *          None.
+ */
+int waits_for(int pid, int target, int depth) {
+    const struct flock_wait * w;
+    const struct flock_lock * lk;
+
+    if (pid < 0 || NPROC <= pid || NPROC <= depth)
+        return 0;
+
+    w = &waits[pid];
+    if (w->ff == NULL)
+        return 0;
+
+    for (lk = w->ff->head; lk != NULL && lk->start < w->end; lk = lk->next) {
+        if (w->start < lk->end && lk->pid != pid &&
+            (w->mode == FLOCK_EX || lk->mode == FLOCK_EX))
+        {
+            if (lk->pid == target || waits_for(lk->pid, target, depth+1))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Tells whether waiting for [start,end) of ff would close a cycle: some
+// process holding a conflicting range waits, maybe indirectly, for pid.
+
+int would_deadlock(const struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, int mode)
+{
+    const struct flock_lock * lk;
+
+    for (lk = ff->head; lk != NULL && lk->start < end; lk = lk->next) {
+        if (start < lk->end && lk->pid != pid &&
+            (mode == FLOCK_EX || lk->mode == FLOCK_EX) &&
+            waits_for(lk->pid, pid, 0))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * int wait_free(struct flock_file * ff,
+ *     int pid, uint64_t start, uint64_t end, int mode, int nb);
+ *
+ * Waits until no other process holds a range that conflicts with the
+ * request.
+ *
+ * Inputs:
+ *          ff - locks of the file
+ *          pid - process asking
+ *          start, end, mode - the request
+ *          nb - fail instead of waiting
+ * Outputs:
+ *          0, -EBUSY if nb is set and the range is held, -EDEADLK
+ * Side Effects:
+ *          May block. The range is free when it returns 0, and stays so
+ *          until the caller blocks.
+ */
+int wait_free(struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, int mode, int nb)
+{
+    while (conflict(ff, pid, start, end, mode) != NULL) {
+        if (nb)
+            return -EBUSY;
+
+        if (would_deadlock(ff, pid, start, end, mode)) {
+            debug("flock: process %d would deadlock on inode %u", pid, ff->ino);
+            return -EDEADLK;
+        }
+
+        if (0 <= pid && pid < NPROC) {
+            waits[pid].ff = ff;
+            waits[pid].start = start;
+            waits[pid].end = end;
+            waits[pid].mode = mode;
+        }
+
+        ff->nwaiters += 1;
+        condition_wait(&ff->released);
+        ff->nwaiters -= 1;
+
+        if (0 <= pid && pid < NPROC)
+            waits[pid].ff = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * void remove_range(struct flock_file * ff,
+ *     int pid, uint64_t start, uint64_t end, struct flock_lock ** spare);
+ *
+ * Removes [start,end) from the ranges of a process. A range that sticks out
+ * on one side is trimmed; one that sticks out on both is split.
+ *
+ * Inputs:
+ *          ff - locks of the file
+ *          pid - the process
+ *          start, end - range to remove
+ *          spare - free node for a split, taken if used; NULL if the range
+ *                  removed has no end, which never splits
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Frees the nodes of ranges removed whole.
+ */
+void remove_range(struct flock_file * ff,
+    int pid, uint64_t start, uint64_t end, struct flock_lock ** spare)
+{
+    struct flock_lock * trimmed = NULL;
+    struct flock_lock ** pp;
+    struct flock_lock * lk;
+
+    // Trimmed ranges may move, so they are taken out and put back in order
+
+    pp = &ff->head;
+    while ((lk = *pp) != NULL && lk->start < end) {
+        if (lk->pid != pid || lk->end <= start) {
+            pp = &lk->next;
+            continue;
+        }
+
+        *pp = lk->next;
+
+        if (lk->start < start && end < lk->end) {
+            (*spare)->start = end;
+            (*spare)->end = lk->end;
+            (*spare)->pid = pid;
+            (*spare)->mode = lk->mode;
+            (*spare)->next = trimmed;
+            trimmed = *spare;
+            *spare = NULL;
+            lk->end = start;
+        } else if (lk->start < start)
+            lk->end = start;
+        else if (end < lk->end)
+            lk->start = end;
+        else {
+            free_lock(lk);
+            continue;
+        }
+
+        lk->next = trimmed;
+        trimmed = lk;
+    }
+
+    while ((lk = trimmed) != NULL) {
+        trimmed = lk->next;
+        insert_sorted(ff, lk);
+    }
+}
+
+// Puts a range into the list of its file, after those starting no later.
+
+void insert_sorted(struct flock_file * ff, struct flock_lock * lk) {
+    struct flock_lock ** pp = &ff->head;
+
+    while (*pp != NULL && (*pp)->start <= lk->start)
+        pp = &(*pp)->next;
+
+    lk->next = *pp;
+    *pp = lk;
+}
+
+struct flock_lock * alloc_lock(void) {
+    struct flock_lock * lk;
+    int i;
+
+    if (!pool_initialized) {
+        for (i = 0; i < FLOCK_MAXLOCKS; i++)
+            free_lock(&lock_pool[i]);
+        pool_initialized = 1;
+    }
+
+    lk = free_locks;
+    if (lk != NULL)
+        free_locks = lk->next;
+    return lk;
+}
+
+void free_lock(struct flock_lock * lk) {
+    if (lk == NULL)
+        return;
+
+    lk->next = free_locks;
+    free_locks = lk;
+}
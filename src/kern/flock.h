@@ -0,0 +1,76 @@
+// flock.h - Byte-range file locks
+//
+// A process can lock byte ranges of a KFS file shared (FLOCK_SH) or exclusive
+// (FLOCK_EX). Ranges of different processes conflict if they overlap and one
+// of them is exclusive. Locks belong to the process, not to the open file:
+// locking a range a process already holds converts its lock on the range,
+// unlocking part of a range splits it, and all of a process's locks go away
+// when it exits. A process that asks for a conflicting range waits until the
+// range is free, unless it passes FLOCK_NB. If waiting would close a cycle of
+// processes each waiting for the next, the request fails with -EDEADLK.
+//
+// The locks are advisory: they only order processes that take them. With
+// KFS_MANDATORY_LOCKS, fs_write also waits until no other process holds a
+// lock on the range it writes.
+//
+// Locks are kept per inode in a list sorted by start offset. The number of
+// locks is small and bounded by FLOCK_MAXLOCKS, so a scan that stops at the
+// first range starting past the end of the request is as fast as a tree.
+//
+
+#ifndef _FLOCK_H_
+#define _FLOCK_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// FLOCK_MAXLOCKS is the number of ranges all processes together can hold.
+// FLOCK_MAXFILES is the number of files that can have locks at the same time.
+
+#ifndef FLOCK_MAXLOCKS
+#define FLOCK_MAXLOCKS 64
+#endif
+
+#ifndef FLOCK_MAXFILES
+#define FLOCK_MAXFILES 16
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// Lock modes, mirrored in user/syscall.h. FLOCK_NB may be or'ed into
+// FLOCK_SH or FLOCK_EX.
+
+#define FLOCK_UN    0
+#define FLOCK_SH    1
+#define FLOCK_EX    2
+#define FLOCK_NB    4
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Locks or unlocks (FLOCK_UN) the len bytes at off of inode ino for the
+// current process; len 0 means up to the largest offset. Returns 0, -EINVAL
+// for a bad mode, -EBUSY if FLOCK_NB is set and the range is held by another
+// process, -EDEADLK if waiting would deadlock, or -ENOMEM if out of locks.
+
+extern int flock_range(uint32_t ino, uint64_t off, uint64_t len, int mode);
+
+// Waits until the current process could lock the range in the given mode
+// without taking the lock. Returns 0 or -EDEADLK. Used for mandatory locks.
+
+extern int flock_wait(uint32_t ino, uint64_t off, uint64_t len, int mode);
+
+// Returns nonzero if another process holds a lock on the range that
+// conflicts with mode. Does not block.
+
+extern int flock_conflict(uint32_t ino, uint64_t off, uint64_t len, int mode);
+
+// Drops every lock of process pid and wakes the processes waiting for them.
+// Called when a process exits.
+
+extern void flock_release(int pid);
+
+#endif // _FLOCK_H_
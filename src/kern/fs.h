@@ -11,6 +11,31 @@ extern char fs_initialized;
 extern void fs_init(void);
 extern int fs_mount(struct io_intf * blkio);
 extern int fs_open(const char * name, struct io_intf ** ioptr);
+extern int fs_open_ino(uint32_t ino, struct io_intf ** ioptr);
+
+//           Counters reported by fs_defrag. A run is a stretch of a file stored
+//           in consecutive data blocks; a defragmented file has one.
+
+struct kfs_defrag_stats {
+    uint64_t files;
+    uint64_t blocks;
+    uint64_t runs_before;
+    uint64_t runs_after;
+    uint64_t moved;
+};
+
+//           int fs_defrag(struct kfs_defrag_stats * stats)
+//           Moves the data blocks of every file into one contiguous run, in
+//           inode order, while the file system stays mounted. Fills in *stats
+//           if stats is not NULL. Returns 0 or a negative error code.
+
+extern int fs_defrag(struct kfs_defrag_stats * stats);
+
+//           int fs_quiesce(void)
+//           Makes all writes durable and holds off every later file operation
+//           for good, before kexec resets the disk. Returns 0 or -EIO.
+
+extern int fs_quiesce(void);
 
 //           _FS_H_
 #endif
\ No newline at end of file
@@ -21,6 +21,9 @@ void halt_failure(void) {
 }
 
 void panic(const char * msg) {
+	// Console input must not sleep from here on
+	com0_poll();
+
 	if (msg != NULL)
 		console_puts(msg);
 	
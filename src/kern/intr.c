@@ -15,6 +15,7 @@
 #include "csr.h"
 #include "plic.h"
 #include "timer.h"
+#include "task.h"
 
 #include <stddef.h>
 
@@ -25,6 +26,31 @@
 #define NIRQ 32
 #endif
 
+// INTR_CLAIM_BUDGET is the number of external interrupts served in one trap.
+// Sources still pending after that keep SEIP raised and take another trap,
+// after the interrupted thread has had a chance to yield.
+
+#ifndef INTR_CLAIM_BUDGET
+#define INTR_CLAIM_BUDGET 8
+#endif
+
+// A source that interrupts more than INTR_STORM_THRESHOLD times within
+// INTR_STORM_WINDOW_MS is masked at the PLIC, and a bottom half unmasks it
+// INTR_STORM_BACKOFF_MS later. The device keeps its interrupt pending while
+// masked, so everything that arrived meanwhile is served in one go.
+
+#ifndef INTR_STORM_THRESHOLD
+#define INTR_STORM_THRESHOLD 2000
+#endif
+
+#ifndef INTR_STORM_WINDOW_MS
+#define INTR_STORM_WINDOW_MS 10
+#endif
+
+#ifndef INTR_STORM_BACKOFF_MS
+#define INTR_STORM_BACKOFF_MS 10
+#endif
+
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
 // 
 
@@ -37,12 +63,22 @@ static struct {
     void (*isr)(int,void*);
     void * isr_aux;
     int prio;
+    char enabled;               // by intr_enable_irq
+    char throttled;             // masked until the bottom half runs
+    uint32_t window_count;      // interrupts since window_start
+    uint64_t window_start;
+    struct intr_irq_stats stats;
+    struct task unthrottle;     // bottom half
+    struct alarm backoff;
 } isrtab[NIRQ];
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
 static void extern_intr_handler(void);
+static void count_irq(int irqno);
+static void unthrottle_sleep(struct task * tk);
+static void unthrottle_run(struct task * tk);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -70,6 +106,13 @@ void intr_register_isr (
     if (prio <= 0)
         prio = 1;
 
+    // The backoff alarm is set up once, on first registration, so that
+    // count_irq only has to reset it. A source re-registered while throttled
+    // keeps its pending alarm.
+
+    if (isrtab[irqno].isr == NULL)
+        alarm_init(&isrtab[irqno].backoff, "intr_backoff");
+
     isrtab[irqno].isr = isr;
     isrtab[irqno].isr_aux = isr_aux;
     isrtab[irqno].prio = prio;
@@ -79,13 +122,24 @@ void intr_register_isr (
 void intr_enable_irq(int irqno) {
     if (isrtab[irqno].isr == NULL)
         panic("intr_enable_irq with no isr");
-    plic_enable_irq(irqno, isrtab[irqno].prio);
+    isrtab[irqno].enabled = 1;
+    // a throttled source is unmasked by its bottom half
+    if (!isrtab[irqno].throttled)
+        plic_enable_irq(irqno, isrtab[irqno].prio);
 }
 
 void intr_disable_irq(int irqno) {
+    isrtab[irqno].enabled = 0;
     plic_disable_irq(irqno);
 }
 
+void intr_get_stats(int irqno, struct intr_irq_stats * st) {
+    if (irqno < 0 || NIRQ <= irqno)
+        panic("irqno out of bounds");
+
+    *st = isrtab[irqno].stats;
+}
+
 // void intr_handler(int code, struct trap_frame * tfr)
 // Called from trapasm.s to handle an interrupt. Dispataches to
 // timer_intr_handler and extern_intr_handler.
@@ -112,21 +166,90 @@ void intr_handler(int code, struct trap_frame * tfr) {
 // INTERNAL FUNCTION DEFINITIONS
 //
 
+// Serves pending sources until the PLIC has none left or the budget is spent,
+// so a burst from several devices costs one trap instead of one each.
+
 void extern_intr_handler(void) {
     int irqno;
+    int n;
+
+    for (n = 0; n < INTR_CLAIM_BUDGET; n++) {
+        irqno = plic_claim_irq();
+
+        if (irqno < 0 || NIRQ <= irqno)
+            panic("invalid irq");
+        
+        if (irqno == 0)
+            return;
+        
+        if (isrtab[irqno].isr == NULL)
+            panic("unhandled irq");
+        
+        isrtab[irqno].isr(irqno, isrtab[irqno].isr_aux);
+
+        plic_close_irq(irqno);
+        count_irq(irqno);
+
+        if (n != 0)
+            isrtab[irqno].stats.batched += 1;
+    }
+}
 
-    irqno = plic_claim_irq();
+// Counts an interrupt of irqno and masks the source if it is storming.
 
-    if (irqno < 0 || NIRQ <= irqno)
-        panic("invalid irq");
-    
-    if (irqno == 0)
+void count_irq(int irqno) {
+    const uint64_t now = timer_ticks();
+    const uint64_t window = INTR_STORM_WINDOW_MS * (TIMER_FREQ / 1000);
+
+    isrtab[irqno].stats.count += 1;
+
+    if (now - isrtab[irqno].window_start >= window) {
+        isrtab[irqno].window_start = now;
+        isrtab[irqno].window_count = 0;
+    }
+
+    isrtab[irqno].window_count += 1;
+
+    if (isrtab[irqno].window_count <= INTR_STORM_THRESHOLD ||
+        isrtab[irqno].throttled)
         return;
-    
-    if (isrtab[irqno].isr == NULL)
-        panic("unhandled irq");
-    
-    isrtab[irqno].isr(irqno, isrtab[irqno].isr_aux);
 
-    plic_close_irq(irqno);
+    debug("irq %d: %u interrupts in %d ms, masking", irqno,
+        isrtab[irqno].window_count, INTR_STORM_WINDOW_MS);
+
+    plic_disable_irq(irqno);
+    isrtab[irqno].throttled = 1;
+    isrtab[irqno].stats.throttled += 1;
+
+    alarm_reset(&isrtab[irqno].backoff);
+    task_init(&isrtab[irqno].unthrottle, "intr_unthrottle",
+        &unthrottle_sleep, (void*)(intptr_t)irqno);
+    task_start(&isrtab[irqno].unthrottle);
+}
+
+// Steps of the bottom half of a throttled source: wait INTR_STORM_BACKOFF_MS,
+// then unmask the source with a fresh window, unless its driver disabled it
+// meanwhile. An interrupt left pending is taken right away.
+
+void unthrottle_sleep(struct task * tk) {
+    const int irqno = (intptr_t)tk->arg;
+
+    task_sleep(tk, &isrtab[irqno].backoff,
+        INTR_STORM_BACKOFF_MS * (TIMER_FREQ / 1000), &unthrottle_run);
+}
+
+void unthrottle_run(struct task * tk) {
+    const int irqno = (intptr_t)tk->arg;
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    isrtab[irqno].throttled = 0;
+    isrtab[irqno].window_start = timer_ticks();
+    isrtab[irqno].window_count = 0;
+
+    if (isrtab[irqno].enabled)
+        plic_enable_irq(irqno, isrtab[irqno].prio);
+
+    intr_restore(saved_intr_state);
 }
@@ -38,6 +38,19 @@ extern void intr_register_isr (
 extern void intr_enable_irq(int irqno);
 extern void intr_disable_irq(int irqno);
 
+// Counters of one interrupt source. A source that interrupts too often is
+// masked for a while (see INTR_STORM_THRESHOLD in intr.c); throttled counts
+// how many times. batched counts interrupts served in the same trap as an
+// earlier one, each a trap saved.
+
+struct intr_irq_stats {
+    uint64_t count;
+    uint64_t batched;
+    uint64_t throttled;
+};
+
+extern void intr_get_stats(int irqno, struct intr_irq_stats * st);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -29,6 +29,7 @@ static void iovprintf_putc(char c, void * aux);
 // io interface functions for iolit
 void iolit_close(struct io_intf* io);
 long iolit_read(struct io_intf * io, void * buf, unsigned long bufsz);
+long iolit_readat(struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz);
 long iolit_write(struct io_intf * io, const void * buf, unsigned long n);
 int iolit_ioctl(struct io_intf * io, int cmd, void * arg);
 // Helper function. return the io_lit of this io_intf
@@ -50,6 +51,7 @@ static const struct io_ops ops = {
     .read = iolit_read,
     .write = iolit_write,
     .ctl = iolit_ioctl,
+    .readat = iolit_readat,
 };
 
 
@@ -74,6 +76,24 @@ long ioread_full(struct io_intf * io, void * buf, unsigned long bufsz) {
     return acc;
 }
 
+long ioreadat(struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz) {
+    long cnt, acc = 0;
+
+    if (io->ops->readat == NULL)
+        return -ENOTSUP;
+
+    while (acc < bufsz) {
+        cnt = io->ops->readat(io, pos+acc, buf+acc, bufsz-acc);
+        if (cnt < 0)
+            return cnt;
+        else if (cnt == 0)
+            return acc;
+        acc += cnt;
+    }
+
+    return acc;
+}
+
 long iowrite(struct io_intf * io, const void * buf, unsigned long n) {
     long cnt, acc = 0;
 
@@ -189,6 +209,49 @@ long iolit_read(struct io_intf * io, void * buf, unsigned long bufsz) {
     return bytes_to_read;
 }
 
+/**
+ * long iolit_readat(struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz);
+ *
+ * Reads bufsz bytes from position pos of the iolit associated with io into buf.
+ * The position of the iolit is not changed.
+ *
+ * Inputs:
+ *          io - struct io_intf*, pointer of the io interface
+ *          pos - uint64_t, position to read from
+ *          buf - void*, the data buf that will be loaded the data we need to read
+ *          bufsz - unsigned long, number of bytes we need to read
+ *
+ * Outputs:
+ *          return the number of read bytes on success, 0 past the end.
+ *          return -EINVAL, if paramaters are invalid.
+ *          return -EIO, if can not get iolit
+ * Side Effects:
+ *          None
+ */
+long iolit_readat(struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz) {
+    // check valid inputs
+    if (buf == NULL || bufsz == 0) {
+        return -EINVAL;
+    }
+    // get the io_lit struct
+    struct io_lit *lit = get_iolit_by_io(io);
+    // check if it is NULL
+    if (lit == NULL) {
+        return -EIO;
+    }
+    if (pos >= lit->size) {
+        return 0;
+    }
+
+    // calculate the number of bytes that can be read
+    unsigned long bytes_remaining = lit->size - pos;
+    unsigned long bytes_to_read = (bufsz < bytes_remaining) ? bufsz : bytes_remaining;
+
+    // copy data into the buffer
+    memcpy(buf, lit->buf + pos, bytes_to_read);
+    return bytes_to_read;
+}
+
 /**
  * long iolit_write(struct io_intf * io, const void * buf, unsigned long n);
  *
@@ -21,7 +21,9 @@ struct io_intf; // forward decl.
 // from /read/ indicates an end-of-file condition. The /write/ function is
 // allowed to write fewer than /n/ bytes, but must write at least one. A return
 // value of 0 from /write/ indicates an end-of-file condition (for files that
-// cannot grow).
+// cannot grow). The optional /readat/ function reads from position /pos/
+// without moving the object's own position; like /read/ it may read fewer than
+// /bufsz/ bytes and returns 0 at the end of file.
 
 struct io_ops
 {
@@ -29,6 +31,7 @@ struct io_ops
     long (*read)(struct io_intf *io, void *buf, unsigned long bufsz);
     long (*write)(struct io_intf *io, const void *buf, unsigned long n);
     int (*ctl)(struct io_intf *io, int cmd, void *arg);
+    long (*readat)(struct io_intf *io, uint64_t pos, void *buf, unsigned long bufsz);
 };
 
 struct io_intf
@@ -53,7 +56,7 @@ struct io_term
     int8_t cr_in;
 };
 
-// IOCTL numbers (0..7 are reserved)
+// IOCTL numbers (0..15 are reserved)
 
 #define IOCTL_GETLEN 1   // arg is pointer to uint64_t
 #define IOCTL_SETLEN 2   // arg is pointer to uint64_t
@@ -61,6 +64,8 @@ struct io_term
 #define IOCTL_SETPOS 4   // arg is pointer to uint64_t
 #define IOCTL_FLUSH 5    // arg is ignored
 #define IOCTL_GETBLKSZ 6 // arg is pointer to uint32_t
+#define IOCTL_GETINO 7   // arg is pointer to uint32_t (files only)
+#define IOCTL_SETDIRECT 8 // arg is pointer to int (files only)
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -106,6 +111,17 @@ extern long
     ioread_full(
         struct io_intf *io, void *buf, unsigned long bufsz);
 
+// The ioreadat function reads data from position /pos/ of the I/O object into a
+// buffer until the buffer is full or it reaches the end of file, like
+// ioread_full. The object's current position is not used or changed, so the
+// kernel can read a file that a process is also reading. Objects without a
+// readat operation return -ENOTSUP.
+
+extern long
+    __attribute__((nonnull(1, 3)))
+    ioreadat(
+        struct io_intf *io, uint64_t pos, void *buf, unsigned long bufsz);
+
 // The iowrite function writes data from a buffer to the I/O object. The /buf/
 // argument is a pointer to the buffer to write, and /n/ the number of bytes to
 // write. This function will not return until it writes /n/ bytes or reaches the
@@ -0,0 +1,310 @@
+// ioprio.c - Per-process block I/O priorities and rate limits
+//
+
+#include "ioprio.h"
+
+#include "process.h"
+#include "timer.h"
+#include "intr.h"
+#include "console.h"
+#include "error.h"
+
+#ifdef IOPRIO_TRACE
+#define TRACE
+#endif
+
+#ifdef IOPRIO_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int current_key(void);
+static void refill(struct ioprio * iop, uint64_t now);
+static uint64_t deficit_ticks(int64_t tokens, uint32_t rate);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * void ioprio_init(struct ioprio * iop);
+ *
+ * Gives a process the default I/O settings.
+ *
+ * Inputs:
+ *          iop - I/O state of the process
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          None.
+ */
+void ioprio_init(struct ioprio * iop) {
+    iop->attr.class = IOPRIO_CLASS_BE;
+    iop->attr.level = IOPRIO_DEFAULT_LEVEL;
+    iop->attr.iops = 0;
+    iop->attr.bps = 0;
+    iop->io_tokens = 0;
+    iop->byte_tokens = 0;
+    iop->tlast = timer_ticks();
+}
+
+/**
+ * void ioprio_fork(struct ioprio * child, const struct ioprio * parent);
+ *
+ * Gives a forked process the settings of its parent, with full buckets.
+ *
+ * Inputs:
+ *          child - I/O state of the new process
+ *          parent - I/O state of the forking process
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          None.
+ */
+void ioprio_fork(struct ioprio * child, const struct ioprio * parent) {
+    child->attr = parent->attr;
+    child->io_tokens = (int64_t)parent->attr.iops * TIMER_FREQ;
+    child->byte_tokens = (int64_t)parent->attr.bps * TIMER_FREQ;
+    child->tlast = timer_ticks();
+}
+
+/**
+ * int ioprio_set(struct process * proc, const struct ioprio_attr * attr);
+ *
+ * Changes the I/O class, level and limits of a process.
+ *
+ * Inputs:
+ *          proc - process to change
+ *          attr - new settings; level is ignored for the idle class
+ * Outputs:
+ *          0 on success, -EINVAL for an unknown class or level
+ * Side Effects:
+ *          Refills the buckets of the process.
+ */
+int ioprio_set(struct process * proc, const struct ioprio_attr * attr) {
+    struct ioprio * const iop = &proc->ioprio;
+
+    if (attr->class < IOPRIO_CLASS_RT || IOPRIO_CLASS_IDLE < attr->class)
+        return -EINVAL;
+
+    if (attr->class != IOPRIO_CLASS_IDLE && IOPRIO_NLEVELS <= attr->level)
+        return -EINVAL;
+
+    iop->attr = *attr;
+    if (attr->class == IOPRIO_CLASS_IDLE)
+        iop->attr.level = 0;
+
+    iop->io_tokens = (int64_t)attr->iops * TIMER_FREQ;
+    iop->byte_tokens = (int64_t)attr->bps * TIMER_FREQ;
+    iop->tlast = timer_ticks();
+
+    debug("ioprio_set: pid %d class %d level %d iops %d bps %d", proc->id,
+        iop->attr.class, iop->attr.level, iop->attr.iops, iop->attr.bps);
+    return 0;
+}
+
+/**
+ * void ioprio_charge(unsigned long nios, unsigned long nbytes);
+ *
+ * Takes tokens for a block request from the current process's buckets. The
+ * buckets may go negative; the process pays in ioprio_throttle.
+ *
+ * Inputs:
+ *          nios - number of requests
+ *          nbytes - number of bytes transferred
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          None.
+ */
+void ioprio_charge(unsigned long nios, unsigned long nbytes) {
+    struct process * const proc = procmgr_initialized ? current_process() : NULL;
+    struct ioprio * iop;
+
+    if (proc == NULL)
+        return;
+
+    iop = &proc->ioprio;
+    if (iop->attr.iops == 0 && iop->attr.bps == 0)
+        return;
+
+    refill(iop, timer_ticks());
+
+    if (iop->attr.iops != 0)
+        iop->io_tokens -= (int64_t)nios * TIMER_FREQ;
+    if (iop->attr.bps != 0)
+        iop->byte_tokens -= (int64_t)nbytes * TIMER_FREQ;
+}
+
+/**
+ * void ioprio_throttle(void);
+ *
+ * Sleeps until the buckets of the current process are no longer overdrawn.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          May suspend the current thread.
+ */
+void ioprio_throttle(void) {
+    struct process * const proc = procmgr_initialized ? current_process() : NULL;
+    struct ioprio * iop;
+    struct alarm al;
+    uint64_t wait, w;
+
+    if (proc == NULL)
+        return;
+
+    iop = &proc->ioprio;
+    if (iop->attr.iops == 0 && iop->attr.bps == 0)
+        return;
+
+    refill(iop, timer_ticks());
+
+    wait = deficit_ticks(iop->io_tokens, iop->attr.iops);
+    w = deficit_ticks(iop->byte_tokens, iop->attr.bps);
+    if (wait < w)
+        wait = w;
+
+    if (wait == 0)
+        return;
+
+    trace("%s: pid %d sleeps %lu ticks", __func__, proc->id, wait);
+    alarm_init(&al, "ioprio");
+    alarm_sleep(&al, wait);
+    refill(iop, timer_ticks());
+}
+
+/**
+ * void iogate_init(struct iogate * g, const char * name);
+ *
+ * Initializes an iogate, open and with no waiters.
+ *
+ * Inputs:
+ *          g - gate to initialize
+ *          name - name of the gate's condition
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          None.
+ */
+void iogate_init(struct iogate * g, const char * name) {
+    int i;
+
+    g->busy = 0;
+    condition_init(&g->cond, name);
+    for (i = 0; i < IOPRIO_NKEYS; i++)
+        g->waiting[i] = 0;
+}
+
+/**
+ * void iogate_enter(struct iogate * g);
+ *
+ * Passes the gate. Waits while the gate is taken, or while a thread of higher
+ * priority is waiting for it.
+ *
+ * Inputs:
+ *          g - gate to pass
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          May suspend the current thread.
+ */
+void iogate_enter(struct iogate * g) {
+    const int key = current_key();
+    int saved_intr_state;
+    int better;
+    int i;
+
+    saved_intr_state = intr_disable();
+    g->waiting[key] += 1;
+
+    for (;;) {
+        better = 0;
+        for (i = 0; i < key && !better; i++)
+            better = (g->waiting[i] != 0);
+
+        if (!g->busy && !better)
+            break;
+
+        condition_wait(&g->cond);
+    }
+
+    g->waiting[key] -= 1;
+    g->busy = 1;
+    intr_restore(saved_intr_state);
+}
+
+/**
+ * void iogate_leave(struct iogate * g);
+ *
+ * Frees the gate and lets the waiters decide which of them goes next.
+ *
+ * Inputs:
+ *          g - gate to free, passed by the current thread
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Wakes the threads waiting at the gate.
+ */
+void iogate_leave(struct iogate * g) {
+    assert(g->busy);
+    g->busy = 0;
+    condition_broadcast(&g->cond);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Returns the priority key of the current thread; threads without a process
+// count as best-effort at the default level.
+
+int current_key(void) {
+    struct process * const proc = procmgr_initialized ? current_process() : NULL;
+
+    if (proc == NULL)
+        return IOPRIO_NLEVELS + IOPRIO_DEFAULT_LEVEL;
+
+    switch (proc->ioprio.attr.class) {
+    case IOPRIO_CLASS_RT:
+        return proc->ioprio.attr.level;
+    case IOPRIO_CLASS_IDLE:
+        return 2 * IOPRIO_NLEVELS;
+    default:
+        return IOPRIO_NLEVELS + proc->ioprio.attr.level;
+    }
+}
+
+// Adds the tokens earned since the last refill, up to one second's worth.
+// Buckets count in units of 1/TIMER_FREQ token, so that a refill every few
+// ticks does not round away what was earned.
+
+void refill(struct ioprio * iop, uint64_t now) {
+    uint64_t dt = now - iop->tlast;
+
+    if (TIMER_FREQ < dt)
+        dt = TIMER_FREQ;
+
+    iop->tlast = now;
+
+    iop->io_tokens += (int64_t)(dt * iop->attr.iops);
+    if ((int64_t)iop->attr.iops * TIMER_FREQ < iop->io_tokens)
+        iop->io_tokens = (int64_t)iop->attr.iops * TIMER_FREQ;
+
+    iop->byte_tokens += (int64_t)(dt * iop->attr.bps);
+    if ((int64_t)iop->attr.bps * TIMER_FREQ < iop->byte_tokens)
+        iop->byte_tokens = (int64_t)iop->attr.bps * TIMER_FREQ;
+}
+
+// Returns how long a bucket filling at rate tokens per second takes to climb
+// back to zero.
+
+uint64_t deficit_ticks(int64_t tokens, uint32_t rate) {
+    if (rate == 0 || 0 <= tokens)
+        return 0;
+
+    return ((uint64_t)-tokens + rate - 1) / rate;
+}
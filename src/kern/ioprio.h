@@ -0,0 +1,116 @@
+// ioprio.h - Per-process block I/O priorities and rate limits
+//
+// Every process has an I/O class: real-time, best-effort or idle, and within
+// the first two a level from 0 (highest) to IOPRIO_NLEVELS-1. Block requests
+// wait at an iogate, which admits the waiter with the highest priority when
+// the gate frees up instead of whichever thread runs first, so a process
+// streaming large reads cannot keep a higher-priority process's small reads
+// waiting behind it. An idle-class process gets the disk only when nobody
+// else is waiting for it. The KFS lock and the virtio block driver's request
+// lock are iogates. KFS passes its gate once per file block and the block
+// driver once per device request, so a higher-priority request gets in
+// between the blocks of a long read or write.
+//
+// A process may also be limited to a number of requests and bytes per second.
+// The block driver charges each request to the calling process's token
+// buckets, and a process that has overdrawn them sleeps in ioprio_throttle,
+// which read and write call on entry, before any lock is taken.
+//
+// The class, level and limits are set with the _ioprio system call and
+// inherited by forked children.
+//
+
+#ifndef _IOPRIO_H_
+#define _IOPRIO_H_
+
+#include <stdint.h>
+
+#include "thread.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// IOPRIO_NLEVELS is the number of levels of the real-time and best-effort
+// classes; IOPRIO_DEFAULT_LEVEL the best-effort level of a new process.
+
+#ifndef IOPRIO_NLEVELS
+#define IOPRIO_NLEVELS 8
+#endif
+
+#ifndef IOPRIO_DEFAULT_LEVEL
+#define IOPRIO_DEFAULT_LEVEL 4
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// I/O classes. Mirrored in user/syscall.h.
+
+#define IOPRIO_CLASS_RT     1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+
+// Priority keys, lowest first: real-time levels, best-effort levels, idle
+
+#define IOPRIO_NKEYS        (2 * IOPRIO_NLEVELS + 1)
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct process; // process.h
+
+// Settings of a process, as passed to _ioprio. A limit of 0 means none.
+
+struct ioprio_attr {
+    uint32_t class;
+    uint32_t level;
+    uint32_t iops;              // requests per second
+    uint32_t bps;               // bytes per second
+};
+
+// Per-process state. Each bucket holds up to one second's worth of tokens, in
+// units of 1/TIMER_FREQ token, and goes negative when a request overdraws it.
+
+struct ioprio {
+    struct ioprio_attr attr;
+    int64_t io_tokens;
+    int64_t byte_tokens;
+    uint64_t tlast;             // time of the last refill (ticks)
+};
+
+// A lock that admits waiters in priority order
+
+struct iogate {
+    int busy;
+    struct condition cond;
+    uint16_t waiting[IOPRIO_NKEYS];
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Gives a new process best-effort priority at IOPRIO_DEFAULT_LEVEL and no
+// limits, or the settings of its parent.
+
+extern void ioprio_init(struct ioprio * iop);
+extern void ioprio_fork(struct ioprio * child, const struct ioprio * parent);
+
+// Changes the settings of a process. Returns 0, or -EINVAL for an unknown
+// class or level.
+
+extern int ioprio_set(struct process * proc, const struct ioprio_attr * attr);
+
+// Charges nios requests and nbytes bytes to the current process. Never sleeps.
+
+extern void ioprio_charge(unsigned long nios, unsigned long nbytes);
+
+// Sleeps until the current process's buckets are no longer overdrawn. Must
+// not be called with an iogate or lock held.
+
+extern void ioprio_throttle(void);
+
+extern void iogate_init(struct iogate * g, const char * name);
+extern void iogate_enter(struct iogate * g);
+extern void iogate_leave(struct iogate * g);
+
+#endif // _IOPRIO_H_
@@ -0,0 +1,159 @@
+// kexec.c - Warm reboot into a new kernel image
+//
+
+#include "kexec.h"
+
+#include <stdint.h>
+
+#include "config.h"
+#include "console.h"
+#include "elf.h"
+#include "error.h"
+#include "fs.h"
+#include "halt.h"
+#include "intr.h"
+#include "memory.h"
+#include "plic.h"
+#include "string.h"
+#include "virtio.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// Layout of the staging megapage: the image as it will sit at RAM_START, the
+// handed-over region, and a page with the trampoline code at the start and
+// struct kexec_params at the end.
+
+#define STAGE_HANDOFF   (MEGA_SIZE - PAGE_SIZE - KEXEC_HANDOFF_MAX)
+#define STAGE_TRAMP     (MEGA_SIZE - PAGE_SIZE)
+
+#define NVIRTIO 8 // virtio-mmio slots probed by main
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Arguments of _kexec_trampoline, which reads them by offset (kexecasm.s)
+
+struct kexec_params {
+    uint64_t src;               // staged image
+    uint64_t dst;               // where it goes (RAM_START)
+    uint64_t copylen;           // bytes to copy, a multiple of 8
+    uint64_t zerolen;           // bytes to clear after them, a multiple of 8
+    uint64_t entry;             // entry point of the new kernel
+    uint64_t handoff;           // passed to the new kernel in a0
+    uint64_t handofflen;        // passed to the new kernel in a1
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+uintptr_t kexec_handoff_pa;
+size_t kexec_handoff_len;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void quiesce(void);
+
+// Position-independent copy loop, copied into the staging megapage
+
+extern char _kexec_trampoline[];        // kexecasm.s
+extern char _kexec_trampoline_end[];    // kexecasm.s
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int kexec_boot(struct io_intf * io, const void * data, size_t len) {
+    struct elf_extent ext;
+    struct kexec_params * params;
+    void * stage;
+    int result;
+
+    if (len > KEXEC_HANDOFF_MAX)
+        return -EINVAL;
+
+    // The image is staged in a megarange above the first, so that copying it
+    // to RAM_START cannot overwrite the staged bytes or the trampoline.
+
+    stage = memory_alloc_mega();
+    if (stage == NULL) {
+        memory_compact(1);
+        stage = memory_alloc_mega();
+    }
+
+    if (stage == NULL)
+        return -ENOMEM;
+
+    result = elf_stage(io, RAM_START_PMA, stage, STAGE_HANDOFF, &ext);
+    if (result < 0) {
+        memory_free_mega(stage);
+        return result;
+    }
+
+    memcpy(stage + STAGE_HANDOFF, data, len);
+    memcpy(stage + STAGE_TRAMP, _kexec_trampoline,
+        _kexec_trampoline_end - _kexec_trampoline);
+
+    params = stage + MEGA_SIZE - sizeof(struct kexec_params);
+    params->src = (uintptr_t)stage;
+    params->dst = RAM_START_PMA;
+    params->copylen = (ext.filelen + 7) & ~7UL;
+    params->zerolen = ((ext.memlen + 7) & ~7UL) - params->copylen;
+    params->entry = ext.entry;
+    params->handoff = (len != 0) ? (uintptr_t)stage + STAGE_HANDOFF : 0;
+    params->handofflen = len;
+
+    // The image has been read. Write out what the file system still holds
+    // and keep it idle, so that resetting the disk loses nothing.
+
+    result = fs_quiesce();
+    if (result < 0) {
+        memory_free_mega(stage);
+        return result;
+    }
+
+    kprintf("kexec: %lu byte image, entry %p, %zu bytes handed over\n",
+        params->copylen, (void*)ext.entry, len);
+
+    quiesce();
+
+    // The M-mode trap handler jumps to the trampoline with interrupts off
+
+    register uintptr_t a0 asm ("a0") = (uintptr_t)stage + STAGE_TRAMP;
+    register uintptr_t a1 asm ("a1") = (uintptr_t)params;
+    register uintptr_t a7 asm ("a7") = KEXEC_MAGIC;
+    asm volatile ("ecall" :: "r" (a0), "r" (a1), "r" (a7) : "memory");
+
+    panic("kexec: M-mode handler returned");
+}
+
+long kexec_handoff_read(void * buf, size_t len) {
+    if (len > kexec_handoff_len)
+        len = kexec_handoff_len;
+
+    memcpy(buf, (void*)kexec_handoff_pa, len);
+    return len;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Stops everything that could write memory or interrupt once the image is
+// being copied. Resetting a virtio device makes it forget its queues, so no
+// request completes into memory the new kernel owns.
+
+void quiesce(void) {
+    void * mmio_base;
+    int i;
+
+    intr_disable();
+
+    for (i = 0; i < NVIRTIO; i++) {
+        mmio_base = (void*)VIRT0_IOBASE;
+        mmio_base += (VIRT1_IOBASE-VIRT0_IOBASE)*i;
+        virtio_reset(mmio_base);
+    }
+
+    plic_reset();
+    com0_poll();
+}
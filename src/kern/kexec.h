@@ -0,0 +1,71 @@
+// kexec.h - Warm reboot into a new kernel image
+//
+// kexec_boot restarts the machine into a kernel ELF image read from a file,
+// without going back through QEMU. The image is staged in a free megapage,
+// the file system is flushed and left idle, devices are quiesced (virtio
+// devices reset, PLIC sources off, console input back to polling), and an
+// environment call asks the M-mode trap handler to jump to a small trampoline
+// in the staging megapage. The trampoline copies the image to RAM_START,
+// clears its bss, resets paging and S-mode interrupt state and enters the new
+// kernel at the top of start.s in M mode, so the new kernel boots as it would
+// from QEMU, minus the firmware and image loading.
+//
+// The old kernel may hand the new one a region of up to KEXEC_HANDOFF_MAX
+// bytes, which is left in the staging megapage. start.s records where it is
+// in kexec_handoff_pa and kexec_handoff_len, and memory_init keeps its pages
+// off the free list.
+//
+
+#ifndef _KEXEC_H_
+#define _KEXEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// KEXEC_HANDOFF_MAX is the largest region that survives a kexec.
+
+#ifndef KEXEC_HANDOFF_MAX
+#define KEXEC_HANDOFF_MAX (64 * 1024)
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// Passed in a7 to the M-mode trap handler (trapasm.s) to select kexec, and in
+// a2 to the new kernel (start.s) to mark a warm boot. Both files spell it out.
+
+#define KEXEC_MAGIC 0x6b65786563 // "kexec"
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+// Region handed over by the kernel that started this one; both are 0 after a
+// cold boot. Written by start.s.
+
+extern uintptr_t kexec_handoff_pa;
+extern size_t kexec_handoff_len;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int kexec_boot(struct io_intf * io, const void * data, size_t len)
+// Loads the kernel image from io and boots it, handing over the len bytes at
+// data. The file system is flushed first (fs_quiesce). Returns only on error:
+// -EINVAL if the image does not fit below the staging area or len is too
+// large, -ENOMEM if no megapage is free, -EIO if the file system cannot be
+// flushed, or the error of the image load.
+
+extern int kexec_boot(struct io_intf * io, const void * data, size_t len);
+
+// long kexec_handoff_read(void * buf, size_t len)
+// Copies up to len bytes of the handed-over region to buf. Returns the number
+// of bytes copied, 0 after a cold boot.
+
+extern long kexec_handoff_read(void * buf, size_t len);
+
+#endif // _KEXEC_H_
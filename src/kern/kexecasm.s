@@ -0,0 +1,68 @@
+# kexecasm.s - Trampoline into a new kernel image, used by kexec.c
+#
+
+# void _kexec_trampoline(void * self, const struct kexec_params * params)
+
+# Copies the staged kernel image to its load address, clears the rest of its
+# memory, and jumps to its entry point. kexec_boot copies this code into the
+# staging megapage, and the M-mode trap handler (trapasm.s) jumps to the copy
+# in M mode with interrupts off, since the copy overwrites the running kernel.
+# Everything here must therefore be position-independent and use no memory
+# outside the staging megapage and the destination.
+#
+# a1 = pointer to struct kexec_params (kexec.c):
+#
+#    0: src, 8: dst, 16: copylen, 24: zerolen, 32: entry,
+#   40: handoff, 48: handofflen
+#
+# The new kernel starts with a0 = handoff, a1 = handofflen and a2 =
+# KEXEC_MAGIC (kexec.h), which start.s checks for.
+
+        .text
+        .global _kexec_trampoline
+        .type   _kexec_trampoline, @function
+        .balign 8
+
+_kexec_trampoline:
+
+        # Leave no S mode interrupt enabled and paging off
+
+        csrw    sie, zero
+        csrci   sstatus, 2 # SIE
+        csrw    satp, zero
+        sfence.vma
+
+        ld      t0, 0(a1)
+        ld      t1, 8(a1)
+        ld      t2, 16(a1)
+        ld      t3, 24(a1)
+
+1:      beqz    t2, 2f
+        ld      t4, 0(t0)
+        sd      t4, 0(t1)
+        addi    t0, t0, 8
+        addi    t1, t1, 8
+        addi    t2, t2, -8
+        j       1b
+
+2:      beqz    t3, 3f
+        sd      zero, 0(t1)
+        addi    t1, t1, 8
+        addi    t3, t3, -8
+        j       2b
+
+        # Make the new text visible to instruction fetch
+
+3:      fence
+        fence.i
+
+        ld      t4, 32(a1)
+        ld      a0, 40(a1)
+        ld      a1, 48(a1)
+        li      a2, 0x6b65786563 # KEXEC_MAGIC
+        jr      t4
+
+        .global _kexec_trampoline_end
+_kexec_trampoline_end:
+
+        .end
@@ -8,6 +8,13 @@
 #include "console.h"
 #include <stdint.h>
 #include "lock.h"
+#include "ioprio.h"
+#include "memory.h"
+#include "fs.h"
+#include "thread.h"
+#include "timer.h"
+#include "flock.h"
+#include "viopmem.h"
 
 
 #define FS_NAMELEN      32      // max file name length
@@ -16,8 +23,64 @@
 #define MAX_OPEN_FILES  32      // each task can have up to 32 open files
 #define F_IN_USE        1       // file is in-use
 #define F_NOT_USE       0       // file is not in-use
+#define F_DIRECT        2       // file bypasses data_block (IOCTL_SETDIRECT)
 #define MAX_DB_PER_INODE 1023   // max number of the datablock per inode due to the restriction of block size
 
+// Number of inodes read into memory by fs_mount. The inode table follows the
+// boot block, so the first KFS_INODE_PRELOAD inodes are read in one sequential
+// I/O and later opens, reads and writes of those files need no I/O to find
+// their data blocks. Inodes past the limit are read from disk as before. The
+// table takes KFS_INODE_PRELOAD * 4 KB of kernel memory; 0 disables it.
+// Data block owners recorded by fs_defrag, one uint32_t per data block, packed
+// as inode number and block index within the inode
+#define DEFRAG_OWNERS_PER_PAGE  (PAGE_SIZE / sizeof(uint32_t))
+#define DEFRAG_FREE             UINT32_MAX
+#define DEFRAG_OWNER(ino, k)    ((ino) * (MAX_DB_PER_INODE + 1) + (k))
+#define DEFRAG_INO(o)           ((o) / (MAX_DB_PER_INODE + 1))
+#define DEFRAG_IDX(o)           ((o) % (MAX_DB_PER_INODE + 1))
+#define OWNER(owner, b)         ((owner)[(b) / DEFRAG_OWNERS_PER_PAGE][(b) % DEFRAG_OWNERS_PER_PAGE])
+
+#ifndef KFS_INODE_PRELOAD
+#define KFS_INODE_PRELOAD 32
+#endif
+
+// Log-structured write mode, used when mkfs reserved a log region after the
+// data blocks (mkfs -l). fs_write then collects dirty data blocks in a segment
+// of up to KFS_LOG_SEGBLKS blocks in memory and appends each full segment to
+// the log in one sequential write, instead of rewriting every block in place.
+// A block map in memory sends reads to the newest copy of a block. Every
+// KFS_LOG_CLEAN_MS a cleaner thread appends the segment being filled, so at
+// most that much of the written data is lost in a crash, and once the log is
+// half full it copies the live blocks home in block order and writes a
+// checkpoint that empties the log. fs_mount rebuilds the block map from the
+// segments appended since the last checkpoint.
+#ifndef KFS_LOG_SEGBLKS
+#define KFS_LOG_SEGBLKS 16
+#endif
+
+#ifndef KFS_LOG_CLEAN_MS
+#define KFS_LOG_CLEAN_MS 1000
+#endif
+
+// Direct access (DAX) mode, used when the file system is on a pmem device
+// (viopmem.h) and has no log. The data blocks are then in memory the kernel
+// can address, so fs_read and fs_write copy between the caller's buffer and
+// the block in device memory instead of going through data_block and the
+// device's read and write. IOCTL_FLUSH on a file makes its writes durable.
+
+// With KFS_MANDATORY_LOCKS, byte-range locks (flock.h) are mandatory for
+// writers: fs_write waits until no other process holds a lock on the range it
+// writes. Otherwise they only order processes that take them.
+#ifndef KFS_MANDATORY_LOCKS
+#define KFS_MANDATORY_LOCKS 0
+#endif
+
+#define KFS_LOG_MAGIC   0x474f4c4b      // "KLOG", boot block of a file system with a log
+#define LOG_CP_MAGIC    0x5043464b      // "KFCP", checkpoint in the first log block
+#define LOG_SEG_MAGIC   0x4745534b      // "KSEG", segment summary
+#define LOG_MAXBLKS     (PAGE_SIZE / sizeof(uint32_t))  // log_home fills a page
+#define LOG_FREE        UINT32_MAX
+
 //           INTERNAL TYPE DEFINITIONS
 //
 
@@ -27,7 +90,7 @@ typedef struct {
     uint32_t file_pos;          // Current position in the file
     uint32_t file_size;         // Total size of the file in bytes
     uint32_t inode_number;      // Inode number for the file
-    uint32_t flags;             // In-use status flag
+    uint32_t flags;             // In-use status flag, F_DIRECT
 } file_t;
 
 // Dentry structure
@@ -42,7 +105,9 @@ typedef struct {
     uint32_t num_dentry;        // number of dentry
     uint32_t num_inodes;        // number of inodes
     uint32_t num_data;          // number of data blocks
-    uint8_t reserved[52];
+    uint32_t log_magic;         // KFS_LOG_MAGIC if there is a log region
+    uint32_t log_blocks;        // number of blocks in the log region
+    uint8_t reserved[44];
     dentry_t dir_entries[MAX_DENTRY_NUM];   // dentries
 } __attribute__((packed)) boot_block_t;
 
@@ -57,6 +122,21 @@ typedef struct {
     uint8_t data[FS_BLKSZ];     // data in the data block
 }__attribute((packed)) data_block_t;
 
+// Summary of a log segment, the block in front of its data blocks
+typedef struct {
+    uint32_t magic;             // LOG_SEG_MAGIC
+    uint32_t seq;               // one more than the segment before it
+    uint32_t cnt;               // number of data blocks in the segment
+    uint32_t csum;              // log_checksum of the data blocks
+    uint32_t home[KFS_LOG_SEGBLKS]; // data block each one is a copy of
+} log_summary_t;
+
+// Checkpoint, the first block of the log region
+typedef struct {
+    uint32_t magic;             // LOG_CP_MAGIC
+    uint32_t seq;               // sequence number of the first segment after it
+} log_checkpoint_t;
+
 
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -64,12 +144,16 @@ typedef struct {
 
 // Takes the name of the file to be opened and modifies the given pointer to contain the io_intf of the file.
 int fs_open(const char * name, struct io_intf ** ioptr);
+// Opens the file with the given inode number, e.g. one recorded with IOCTL_GETINO.
+int fs_open_ino(uint32_t inode_number, struct io_intf ** ioptr);
 // Marks the file descriptor associated with io as unused.
 void fs_close(struct io_intf* io);
 // Writes n bytes from buf into the file associated with io. Updates metadata in the file descriptor as appropriate. Use fs open to get io.
 long fs_write(struct io_intf* io, const void* buf, unsigned long n);
 // Reads n bytes from the file associated with io into buf. Updates metadata in the file descriptor as appropriate. Use fs open to get io.
 long fs_read(struct io_intf* io, void* buf, unsigned long n);
+// Reads n bytes from position pos of the file into buf, leaving the file position alone.
+long fs_readat(struct io_intf* io, uint64_t pos, void* buf, unsigned long n);
 // Performs a device-specific function based on cmd. Note, ioctl functions should return values by using arg.
 int fs_ioctl(struct io_intf* io, int cmd, void* arg);
 
@@ -81,6 +165,14 @@ static int fs_getpos(file_t* fd, void* arg);
 static int fs_setpos(file_t* fd, void* arg);
 // Helper function for fs_ioctl. Returns the block size of the filesystem.
 static int fs_getblksz(file_t* fd, void* arg);
+// Helper function for fs_ioctl. Returns the inode number of the file.
+static int fs_getino(file_t* fd, void* arg);
+// Helper function for fs_ioctl. Turns direct I/O on or off for the file.
+static int fs_setdirect(file_t* fd, void* arg);
+// Helper function for fd_ioctl. Make the writes to the file system durable.
+static int fs_flush(file_t* fd);
+// Helper function for fs_flush and fs_quiesce. Append the log and flush the disk.
+static int flush_disk(void);
 // Helper function for fd_ioctl. Return file_t correspond to the io_intf.
 static file_t* get_fd_by_io(struct io_intf* io);
 // Helper function for fs_mount. Initialize the file_list
@@ -97,6 +189,56 @@ static int update_data_block(uint32_t data_block_num);
 static int write_data_block(uint32_t data_block_idx);
 // write the updated inode back to disk
 static int write_inode(uint32_t inode_number);
+// Helper function. Get the inode from kfs.raw by the inode_number into dst.
+static int read_inode(uint32_t inode_number, inode_t* dst);
+// write the inode src back to disk
+static int store_inode(uint32_t inode_number, const inode_t* src);
+// Helper function for fs_read and fs_readat. Read from a position with kfs_gate held.
+static long read_file(file_t* fd, uint64_t pos, void* buf, unsigned long n);
+// Helper function for fs_read and fs_write. Pass kfs_gate between blocks and reload the inode.
+static int pass_kfs_gate(file_t* fd, uint32_t inode_number, uint32_t* allocated_blocks);
+// Helper function for direct I/O. Count the blocks from block_idx that are contiguous on disk.
+static uint32_t direct_run(uint32_t block_idx, uint32_t max_cnt, uint32_t allocated_blocks);
+// Helper function for direct I/O. Read cnt data blocks from disk straight into buf.
+static int read_data_blocks(uint32_t data_block_idx, uint32_t cnt, void* buf);
+// Helper function for direct I/O. Write cnt data blocks from buf straight to disk.
+static int write_data_blocks(uint32_t data_block_idx, uint32_t cnt, const void* buf);
+// Helper function for fs_mount. Read the first inodes into inode_table.
+static int preload_inodes(void);
+// Helper function for fs_defrag. Check that a directory entry refers to the inode.
+static int inode_named(uint32_t inode_number);
+// Helper function for fs_defrag. Number of data blocks a file uses.
+static uint32_t inode_blocks(const inode_t* ino);
+// Helper function for fs_defrag. Count the runs of contiguous blocks in a file.
+static uint32_t count_runs(const inode_t* ino);
+// Helper function for fs_defrag. Copy the contents of one data block to another.
+static int copy_data_block(uint32_t dst, uint32_t src, data_block_t* scratch);
+// Helper function for fs_read. Get a data block into data_block, from the log if it has a copy.
+static int load_data_block(uint32_t data_block_idx);
+// Helper function for fs_write. Write data_block back, into the log in log mode.
+static int store_data_block(uint32_t data_block_idx);
+// Helper function for fs_mount. Set up DAX mode if the disk is device memory.
+static void dax_mount(struct io_intf* io);
+// Helper function for DAX mode. Address of a data block in device memory.
+static inline uint8_t* dax_block(uint32_t data_block_idx);
+// Helper function for fs_mount. Set up log mode and rebuild the block map.
+static int log_mount(void);
+// Helper function for log mode. Check whether the log has a copy of a data block.
+static int log_holds(uint32_t data_block_idx);
+// Helper function for log mode. Find a data block in the segment being filled.
+static data_block_t* log_pending(uint32_t data_block_idx);
+// Helper function for log mode. Find the log block holding a copy of a data block.
+static uint32_t log_find(uint32_t data_block_idx);
+// Helper function for log mode. Record that a log block holds a copy of a data block.
+static void log_map(uint32_t log_block, uint32_t data_block_idx);
+// Helper function for log mode. Append the segment being filled to the log.
+static int log_append(void);
+// Helper function for log mode. Copy the live log blocks home and empty the log.
+static int log_checkpoint(void);
+// Helper function for log mode. Checksum of a data block, chained from sum.
+static uint32_t log_checksum(uint32_t sum, const data_block_t* blk);
+// Body of the log cleaner thread.
+static void log_cleaner(void* arg);
 //// Helper function, get a 4KB data block from vioblk
 //static int read_block(struct io_intf* io, void* block);
 //// Helper function, write a data into 512B vioblk
@@ -110,13 +252,32 @@ static inode_t inode;                               // the inode the file is usi
 static data_block_t data_block;                     // the data block the file is using right now
 static file_t file_list[MAX_OPEN_FILES];            // file array holding the in-use files
 static struct io_intf* disk_io;                     // disk_io pointer to get the inodes and data bloks later
-static struct lock kfs_lock;                        // kfs lock
+static struct iogate kfs_gate;                      // kfs lock, in I/O priority order (ioprio.h)
+#if KFS_INODE_PRELOAD > 0
+static inode_t inode_table[KFS_INODE_PRELOAD];      // inodes read at mount time
+#endif
+static uint32_t inode_table_cnt;                    // number of valid inode_table entries
+static uint32_t log_blocks;                         // blocks in the log region, 0 if not in log mode
+static uint32_t log_start;                          // data block index of the first log block
+static uint32_t log_head;                           // log block the next segment goes to
+static uint32_t log_seq;                            // sequence number of the next segment
+static uint32_t* log_home;                          // data block copied in each log block, or LOG_FREE
+static uint32_t* log_order;                         // log_checkpoint's list of live log blocks
+static log_summary_t* log_sum;                      // summary of the segment being filled
+static data_block_t* log_seg[KFS_LOG_SEGBLKS];      // data blocks of the segment being filled
+// The segment being filled, its summary first, so that log_append writes it
+// in one request. The kernel heap is too small for it; being in the kernel
+// image, it is also physically contiguous.
+static data_block_t log_buf[1 + KFS_LOG_SEGBLKS] __attribute__((aligned(FS_BLKSZ)));
+static data_block_t* log_scratch;                   // buffer for log_mount and log_checkpoint
+static uint8_t* dax_base;                           // first data block in device memory, NULL if not in DAX mode
 
 // file system io operation struct
 static const struct io_ops fs_io_ops = {
     .close = fs_close,
     .read = fs_read,
     .write = fs_write,
+    .readat = fs_readat,
     .ctl = fs_ioctl
 };
 
@@ -128,7 +289,9 @@ static const struct io_ops fs_io_ops = {
  * Once you complete this checkpoint, io will come from the vioblk device struct.
  *
  * Disk layout:
- * [ boot block | inodes | data blocks ]
+ * [ boot block | inodes | data blocks | log ]
+ *
+ * The log is optional; when the boot block describes one, writes go through it.
  *
  * Inputs:
  *          io - struct io_intf *, pointer to the io interface struct.
@@ -137,14 +300,15 @@ static const struct io_ops fs_io_ops = {
  *          return -EINVAL, if io is NULL.
  *          return -ENOMEM, if fails in kmalloc
  *          return -EIO, if fails in IO related operations
+ *          return -EINVAL, if the log region is unusable
  * Side Effects:
- *          None.
+ *          starts the log cleaner thread in log mode.
  */
 int fs_mount(struct io_intf * io) {
     if (io == NULL) return -EINVAL;
 
     // initialize the lock
-    lock_init(&kfs_lock, "kfs_lock");
+    iogate_init(&kfs_gate, "kfs_gate");
 
     // Set the position to the beginning of the file
     uint64_t offset = 0;
@@ -171,6 +335,20 @@ int fs_mount(struct io_intf * io) {
 
     // store the kfs.raw io for later use.
     disk_io = io;
+
+    // read the inodes right after the boot block, while the position is there
+    ret = preload_inodes();
+    if (ret < 0) {
+        return ret;
+    }
+
+    // switch to log mode if mkfs made a log
+    if (boot_block.log_magic == KFS_LOG_MAGIC) {
+        return log_mount();
+    }
+
+    // otherwise copy data blocks straight to and from a pmem device
+    dax_mount(io);
     return 0;
 }
 
@@ -197,7 +375,7 @@ int fs_open(const char * name, struct io_intf ** ioptr) {
     if (name == NULL || ioptr == NULL) {
         return -EINVAL;
     }
-    lock_acquire(&kfs_lock);
+    iogate_enter(&kfs_gate);
     int inode_number = -1;
     // find the corresponding inode
     for (uint32_t i = 0; i < boot_block.num_dentry; i++) {
@@ -209,7 +387,7 @@ int fs_open(const char * name, struct io_intf ** ioptr) {
     // can not find the file with the name
     if (inode_number == -1) {
         debug("Can not find the file with name %s", name);
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -ENOENT;
     }
     debug("testtttt");
@@ -227,7 +405,7 @@ int fs_open(const char * name, struct io_intf ** ioptr) {
     // fail to get inode
     if (ret < 0) {
         
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EIO;
     }
 
@@ -236,7 +414,7 @@ int fs_open(const char * name, struct io_intf ** ioptr) {
     if (fd == NULL) {
         debug("No available file descriptor.");
 
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EBUSY;
     }
     // assign the fs operations to the file descriptor
@@ -245,10 +423,274 @@ int fs_open(const char * name, struct io_intf ** ioptr) {
     *ioptr = &fd->io;
     debug("Open file: %s (inode=%d)", name, inode_number);
 
-    lock_release(&kfs_lock);
+    iogate_leave(&kfs_gate);
+    return 0;
+}
+
+/**
+ * int fs_open_ino(uint32_t inode_number, struct io_intf ** ioptr);
+ *
+ * Opens a file by inode number instead of by name. Used to reopen files whose
+ * inode was recorded earlier with IOCTL_GETINO (see snap.c).
+ *
+ * Inputs:
+ *          inode_number - uint32_t, inode of the file to open.
+ *          ioptr - a double pointer that will point to a point of the io_intf of the file
+ * Outputs:
+ *          return 0, on success.
+ *          return -EINVAL, if parameter value is invalid
+ *          return -ENOENT, if no directory entry refers to the inode
+ *          return -EIO, if the inode cannot be read
+ *          return -EBUSY, if the fd_dec_list is full (all fd_desc_t is in-use)
+ * Side Effects:
+ *          overwrite the ioptr to contain the io_intf of the file.
+ */
+int fs_open_ino(uint32_t inode_number, struct io_intf ** ioptr) {
+    uint32_t i;
+
+    if (ioptr == NULL) {
+        return -EINVAL;
+    }
+    iogate_enter(&kfs_gate);
+    // only inodes that are still named in the directory may be opened
+    for (i = 0; i < boot_block.num_dentry; i++) {
+        if (boot_block.dir_entries[i].inode == inode_number)
+            break;
+    }
+    if (i == boot_block.num_dentry) {
+        iogate_leave(&kfs_gate);
+        return -ENOENT;
+    }
+    // update the inode so that allocate_file picks up the file size
+    if (update_inode(inode_number) < 0) {
+        iogate_leave(&kfs_gate);
+        return -EIO;
+    }
+    file_t *fd = allocate_file(inode_number);
+    if (fd == NULL) {
+        iogate_leave(&kfs_gate);
+        return -EBUSY;
+    }
+    fd->io.ops = &fs_io_ops;
+    *ioptr = &fd->io;
+
+    iogate_leave(&kfs_gate);
     return 0;
 }
 
+/**
+ * int fs_defrag(struct kfs_defrag_stats* stats);
+ *
+ * Rearranges the data blocks so that every file occupies one contiguous run,
+ * files following each other in inode order from data block 0. Works on the
+ * mounted file system: other file operations wait on kfs_gate until it is
+ * done, and open files keep working afterwards since they only hold inode
+ * numbers.
+ *
+ * Walking the files in order, the block that belongs at the next position is
+ * copied there. If that position holds a block of a file not yet placed, the
+ * block is first copied to a free block and the displaced file's inode is
+ * written to point at the copy. The inode of the file being placed is written
+ * after every block it gains. A block is only ever copied into a free block,
+ * and an inode is written only once its new block is on disk, so a crash at
+ * any point leaves every file readable: at worst a copied block is not used
+ * yet. KFS has no journal or free map, so nothing else needs fixing up.
+ * Moving needs one free data block when the next position is taken.
+ *
+ * Inputs:
+ *          stats - struct kfs_defrag_stats*, receives the counters; may be NULL
+ * Outputs:
+ *          return 0 on success.
+ *          return -EINVAL, if the file system is not mounted.
+ *          return -ENOMEM, if the block owner table cannot be allocated.
+ *          return -ENOSPC, if a block has to be moved and no data block is free.
+ *          return -EIO, if an inode or data block cannot be read or written,
+ *          or two inodes claim the same data block.
+ * Side Effects:
+ *          moves data blocks and rewrites inodes on disk.
+ */
+int fs_defrag(struct kfs_defrag_stats* stats) {
+    struct kfs_defrag_stats st;
+    uint32_t ** owner;
+    uint32_t npages;
+    inode_t * other;
+    data_block_t * scratch;
+    uint32_t ino, k, t, nblk, src, who, spare, nalloc;
+    int ret = 0;
+
+    if (disk_io == NULL) return -EINVAL;
+
+    memset(&st, 0, sizeof(st));
+    iogate_enter(&kfs_gate);
+
+    // the moves below go straight to the data blocks, so move the log home
+    if (log_blocks != 0 && (log_append() < 0 || log_checkpoint() < 0)) {
+        iogate_leave(&kfs_gate);
+        return -EIO;
+    }
+
+    // owner[b] tells which inode block sits in data block b, so that a
+    // displaced block can be followed back to its inode
+    npages = (boot_block.num_data + DEFRAG_OWNERS_PER_PAGE - 1) / DEFRAG_OWNERS_PER_PAGE;
+    if (npages > PAGE_SIZE / sizeof(uint32_t *)) {
+        iogate_leave(&kfs_gate);
+        return -EINVAL;
+    }
+    nalloc = 0;
+    owner = memory_alloc_page();
+    if (owner != NULL) {
+        for (nalloc = 0; nalloc < npages; nalloc++) {
+            owner[nalloc] = memory_alloc_page();
+            if (owner[nalloc] == NULL) break;
+            memset(owner[nalloc], 0xff, PAGE_SIZE);
+        }
+    }
+    other = memory_alloc_page();
+    scratch = memory_alloc_page();
+    if (owner == NULL || nalloc < npages || other == NULL || scratch == NULL) {
+        ret = -ENOMEM;
+    }
+
+    for (ino = 0; ino < boot_block.num_inodes && ret == 0; ino++) {
+        if (!inode_named(ino)) continue;
+        if (read_inode(ino, &inode) < 0) {
+            ret = -EIO;
+            break;
+        }
+        nblk = inode_blocks(&inode);
+        st.files++;
+        st.blocks += nblk;
+        st.runs_before += count_runs(&inode);
+        for (k = 0; k < nblk; k++) {
+            src = inode.data_block_num[k];
+            if (src >= boot_block.num_data || OWNER(owner, src) != DEFRAG_FREE) {
+                debug("Data block %d is invalid or shared", src);
+                ret = -EIO;
+                break;
+            }
+            OWNER(owner, src) = DEFRAG_OWNER(ino, k);
+        }
+    }
+
+    // a displaced block needs somewhere to go; any free block will do, and
+    // every move frees another one
+    spare = DEFRAG_FREE;
+    for (k = 0; k < boot_block.num_data && ret == 0; k++) {
+        if (OWNER(owner, k) == DEFRAG_FREE) {
+            spare = k;
+            break;
+        }
+    }
+
+    t = 0;
+    for (ino = 0; ino < boot_block.num_inodes && ret == 0; ino++) {
+        if (!inode_named(ino)) continue;
+        if (read_inode(ino, &inode) < 0) {
+            ret = -EIO;
+            break;
+        }
+        nblk = inode_blocks(&inode);
+        for (k = 0; k < nblk; k++, t++) {
+            src = inode.data_block_num[k];
+            if (src == t) continue;
+
+            // everything below t is placed, so whoever holds t is a file
+            // later in the order, or this one. Its block is copied to the
+            // spare block and its inode switched over before t is reused.
+            who = OWNER(owner, t);
+            if (who != DEFRAG_FREE) {
+                if (spare == DEFRAG_FREE) {
+                    ret = -ENOSPC;
+                    break;
+                }
+                if (copy_data_block(spare, t, scratch) < 0) {
+                    ret = -EIO;
+                    break;
+                }
+                OWNER(owner, spare) = who;
+                if (DEFRAG_INO(who) == ino) {
+                    inode.data_block_num[DEFRAG_IDX(who)] = spare;
+                    if (store_inode(ino, &inode) < 0) {
+                        ret = -EIO;
+                        break;
+                    }
+                } else if (read_inode(DEFRAG_INO(who), other) < 0) {
+                    ret = -EIO;
+                    break;
+                } else {
+                    other->data_block_num[DEFRAG_IDX(who)] = spare;
+                    if (store_inode(DEFRAG_INO(who), other) < 0) {
+                        ret = -EIO;
+                        break;
+                    }
+                }
+            }
+
+            // t is free now; the block moves there and the inode follows,
+            // which frees src for the next displaced block
+            if (copy_data_block(t, src, scratch) < 0) {
+                ret = -EIO;
+                break;
+            }
+            inode.data_block_num[k] = t;
+            if (store_inode(ino, &inode) < 0) {
+                ret = -EIO;
+                break;
+            }
+            OWNER(owner, t) = DEFRAG_OWNER(ino, k);
+            OWNER(owner, src) = DEFRAG_FREE;
+            spare = src;
+            st.moved++;
+        }
+        st.runs_after += count_runs(&inode);
+    }
+
+    for (k = 0; k < nalloc; k++) {
+        memory_free_page(owner[k]);
+    }
+    if (owner != NULL) memory_free_page(owner);
+    if (other != NULL) memory_free_page(other);
+    if (scratch != NULL) memory_free_page(scratch);
+
+    iogate_leave(&kfs_gate);
+
+    debug("defrag: %lu files, %lu blocks, %lu runs before, %lu after, %lu moved",
+        st.files, st.blocks, st.runs_before, st.runs_after, st.moved);
+    if (stats != NULL) {
+        *stats = st;
+    }
+    return ret;
+}
+
+/**
+ * int fs_quiesce(void);
+ *
+ * Makes everything written to the file system durable, as IOCTL_FLUSH does,
+ * and keeps every other file operation out from then on by not giving kfs_gate
+ * back. kexec calls it before resetting the disk, so that no segment of the
+ * log is lost and no request is in flight when the device forgets its queue.
+ * This covers whatever device the file system is mounted on, the copy-on-write
+ * overlay and the emulated pmem included.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          return 0 on success, also when no file system is mounted.
+ *          return -EIO if the log or the disk cannot be written; kfs_gate is
+ *          released again in that case.
+ * Side Effects:
+ *          may write the log and flush the disk; holds kfs_gate for good.
+ */
+int fs_quiesce(void) {
+    if (disk_io == NULL) return 0;
+    iogate_enter(&kfs_gate);
+    int ret = flush_disk();
+    if (ret < 0) {
+        iogate_leave(&kfs_gate);
+    }
+    return ret;
+}
+
 /**
  * void fs_close(struct io_intf* io);
  *
@@ -300,31 +742,43 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     // if nothing needs to be written, just return
     if (n == 0) return n;
     // try to acquire the lock
-    lock_acquire(&kfs_lock);
+    iogate_enter(&kfs_gate);
     // get the corresponding file_t by io
     file_t *fd = get_fd_by_io(io);
     // check if it is NULL
     // but theoritically it shouldnt be NULL, since it will be called using fd_desc_t.io->write
     if (fd == NULL) {
         // release the lock
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EIO;
     }
 
     trace("fs_write: Write %lu bytes to file (inode: %u, current pos: %u, file size: %u)\n",
           n, fd->inode_number, fd->file_pos, fd->file_size);
 
+#if KFS_MANDATORY_LOCKS
+    // wait outside the gate until no other process holds a lock on the range,
+    // then look again, since the range may have been locked meanwhile
+    while (flock_conflict(fd->inode_number, fd->file_pos, n, FLOCK_EX)) {
+        iogate_leave(&kfs_gate);
+        long lock_ret = flock_wait(fd->inode_number, fd->file_pos, n, FLOCK_EX);
+        if (lock_ret < 0)
+            return lock_ret;
+        iogate_enter(&kfs_gate);
+    }
+#endif
+
     // get inode from inode list
     if (fd->inode_number >= boot_block.num_inodes) {
         // release the lock
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EIO;
     }
     // update the inode based on the inode_number
     int ret = update_inode(fd->inode_number);
     if (ret < 0) {
         // release the lock
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EIO;
     }
 
@@ -332,13 +786,22 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     uint32_t allocated_blocks = (inode.byte_len + FS_BLKSZ - 1) / FS_BLKSZ;
 
     const uint8_t *write_buf = (const uint8_t*) buf; // data type of data in the datablock is uint_8
+    // the position and inode when the write started; fd may change between blocks
+    const uint32_t file_pos = fd->file_pos;
+    const uint32_t inode_number = fd->inode_number;
 
     // denote the number of bytes we have written
     unsigned long written_bytes = 0;
     // loop until we finish writing
     while (written_bytes < n) {
+        // let a request of higher priority in between blocks
+        if (written_bytes > 0 && pass_kfs_gate(fd, inode_number, &allocated_blocks) < 0) {
+            // release the lock
+            iogate_leave(&kfs_gate);
+            return -EIO;
+        }
         // get the current offset we are writing to
-        uint32_t byte_offset = fd->file_pos + written_bytes;
+        uint32_t byte_offset = file_pos + written_bytes;
         // get the index of data block in the inode->data_block_num we are writing to
         uint32_t block_idx = byte_offset / FS_BLKSZ;
         // get the offset in that data block
@@ -349,12 +812,44 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
             break;
         }
 
+        // in DAX mode, the data goes from buf straight into device memory
+        if (dax_base != NULL) {
+            if (inode.data_block_num[block_idx] >= boot_block.num_data) {
+                // release the lock
+                iogate_leave(&kfs_gate);
+                return -EIO;
+            }
+            uint32_t bytes_to_copy = FS_BLKSZ - block_offset;
+            if (n - written_bytes < bytes_to_copy) {
+                bytes_to_copy = n - written_bytes;
+            }
+            memcpy(dax_block(inode.data_block_num[block_idx]) + block_offset,
+                   write_buf + written_bytes, bytes_to_copy);
+            written_bytes += bytes_to_copy;
+            continue;
+        }
+
+        // in direct mode, whole blocks go from buf to the disk in one request
+        // per run of contiguous blocks; partial blocks take the path below
+        if ((fd->flags & F_DIRECT) && block_offset == 0 && n - written_bytes >= FS_BLKSZ &&
+            !log_holds(inode.data_block_num[block_idx])) {
+            uint32_t cnt = direct_run(block_idx, (n - written_bytes) / FS_BLKSZ, allocated_blocks);
+            ret = write_data_blocks(inode.data_block_num[block_idx], cnt, write_buf + written_bytes);
+            if (ret < 0) {
+                // release the lock
+                iogate_leave(&kfs_gate);
+                return -EIO;
+            }
+            written_bytes += cnt * FS_BLKSZ;
+            continue;
+        }
+
         // load the data block
-        ret = update_data_block(inode.data_block_num[block_idx]);
+        ret = load_data_block(inode.data_block_num[block_idx]);
         // fail to get next data block
         if (ret < 0) {
             // release the lock
-            lock_release(&kfs_lock);
+            iogate_leave(&kfs_gate);
             return -EIO;
         }
 
@@ -368,11 +863,11 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
         // copy data into the data block
         memcpy(data_block.data + block_offset, write_buf + written_bytes, bytes_to_copy);
 
-        // write the data block back to disk
-        ret = write_data_block(inode.data_block_num[block_idx]);
+        // write the data block back to disk, or to the log
+        ret = store_data_block(inode.data_block_num[block_idx]);
         if (ret < 0) {
             // release the lock
-            lock_release(&kfs_lock);
+            iogate_leave(&kfs_gate);
             return -EIO;
         }
 
@@ -381,18 +876,19 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     }
 
     // update file descriptor
-    fd->file_pos += written_bytes;
+    fd->file_pos = file_pos + written_bytes;
 
-    // Write the inode back to disk
-    ret = write_inode(fd->inode_number);
+    // Write the inode back to disk. fs_write never changes it, so log mode,
+    // which only carries data blocks, leaves it alone.
+    ret = (log_blocks == 0) ? write_inode(inode_number) : 0;
     if (ret < 0) {
         // release the lock
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EIO;
     }
 
     // release the lock
-    lock_release(&kfs_lock);
+    iogate_leave(&kfs_gate);
 
     return written_bytes;
 }
@@ -424,102 +920,67 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
     if (n == 0) return n;
 
     // try to acquire the lock
-    lock_acquire(&kfs_lock);
+    iogate_enter(&kfs_gate);
     // get the corresponding file_t by io
     file_t *fd = get_fd_by_io(io);
     // check if it is NULL
     // but theoritically it shouldnt be NULL, since it will be called using fd_desc_t.io->write
     if (fd == NULL) {
         // release the lock
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EIO;
     }
 
-    trace("fs_read: Reading %lu bytes from file (inode: %u, current pos: %u, file size: %u)\n",
-          n, fd->inode_number, fd->file_pos, fd->file_size);
-    // check if the file position is beyond the file size
-    if (fd->file_pos >= fd->file_size) {
-        // release the lock
-        lock_release(&kfs_lock);
-        return 0; // End of file
-    }
-
-    // check the inode number
-    if (fd->inode_number >= boot_block.num_inodes) {
-        // release the lock
-        lock_release(&kfs_lock);
-        return -EIO;
-    }
-    // get the inode based on the inode_number
-    int ret = update_inode(fd->inode_number);
-    if (ret < 0) {
-        // release the lock
-        lock_release(&kfs_lock);
-        return -EIO;
+    // the position when the read started; fd may change between blocks
+    const uint32_t file_pos = fd->file_pos;
+    long read_bytes = read_file(fd, file_pos, buf, n);
+    // update file descriptor
+    if (read_bytes > 0) {
+        fd->file_pos = file_pos + read_bytes;
     }
 
-    // Calculate the number of allocated data blocks (ceiling divide)
-    uint32_t allocated_blocks = (inode.byte_len + FS_BLKSZ - 1) / FS_BLKSZ;
-
-    // calculate the number of bytes that can be read
-    unsigned long bytes_remaining = fd->file_size - fd->file_pos;
-    unsigned long bytes_to_read = (n < bytes_remaining) ? n : bytes_remaining;
-
-    uint8_t *read_buf = (uint8_t *)buf; // data type of data in the datablock is uint_8
-
-    // denote the number of bytes we have read
-    unsigned long read_bytes = 0;
-    // loop until we finish reading
-    while (read_bytes < bytes_to_read) {
-        // get the current offset we are read from
-        uint32_t byte_offset = fd->file_pos + read_bytes;
-        // get the index of data block in the inode->data_block_num we are read from
-        uint32_t block_idx = byte_offset / FS_BLKSZ;
-        // get the offset in that data block
-        uint32_t block_offset = byte_offset % FS_BLKSZ;
-
-        // check if block_idx is within allocated data blocks
-        if (block_idx >= allocated_blocks || block_idx >= MAX_DB_PER_INODE) {
-            // release the lock
-            lock_release(&kfs_lock);
-            return -EIO; // Invalid block index
-        }
-
-        // get the data_block_num from inode
-        uint32_t data_block_idx = inode.data_block_num[block_idx];
-        if (data_block_idx >= boot_block.num_data) {
-            // release the lock
-            lock_release(&kfs_lock);
-            return -EIO; // Invalid data block number
-        }
-
-        // get the data block
-        ret = update_data_block(data_block_idx);
-        if (ret < 0) {
-            // release the lock
-            lock_release(&kfs_lock);
-            return -EIO;
-        }
+    // release the lock
+    iogate_leave(&kfs_gate);
 
-        // calculate the remaining space in the data block
-        uint32_t bytes_in_block = FS_BLKSZ - block_offset;
-        // calculate the number of byte hasnt written
-        unsigned long bytes_left_to_read = bytes_to_read - read_bytes;
-        // calculate the number of bytes will write
-        uint32_t bytes_to_copy = (bytes_in_block < bytes_left_to_read) ? bytes_in_block : bytes_left_to_read;
+    return read_bytes;
+}
 
-        // copy data into the buffer
-        memcpy(read_buf + read_bytes, data_block.data + block_offset, bytes_to_copy);
+/**
+ * long fs_readat(struct io_intf* io, uint64_t pos, void* buf, unsigned long n);
+ *
+ * Reads n bytes from position pos of the file associated with io into buf.
+ * Unlike fs_read, the position in the file descriptor stays where it is, so
+ * the kernel can page in a mapping of a file that is also open for reading.
+ *
+ * Inputs:
+ *          io - struct io_intf*, pointer of the io interface
+ *          pos - uint64_t, position in the file to read from
+ *          buf - void*, the buffer to read into
+ *          n - unsigned long, number of bytes to read
+ * Outputs:
+ *          return the number of read bytes on success, 0 at the end of the file.
+ *          return -EINVAL, if paramaters are invalid.
+ *          return -EIO, if can not get fd, inode or a data block.
+ * Side Effects:
+ *          None.
+ */
+long fs_readat(struct io_intf* io, uint64_t pos, void* buf, unsigned long n) {
+    long read_bytes;
+    file_t* fd;
 
-        // increase the read_bytes
-        read_bytes += bytes_to_copy;
+    if (io == NULL || buf == NULL) {
+        return -EINVAL;
     }
+    if (n == 0) return n;
 
-    // update file descriptor
-    fd->file_pos += read_bytes;
-
-    // release the lock
-    lock_release(&kfs_lock);
+    iogate_enter(&kfs_gate);
+    fd = get_fd_by_io(io);
+    if (fd == NULL) {
+        iogate_leave(&kfs_gate);
+        return -EIO;
+    }
+    read_bytes = read_file(fd, pos, buf, n);
+    iogate_leave(&kfs_gate);
 
     return read_bytes;
 }
@@ -539,8 +1000,8 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
  *          May modify file descriptor's values.
  */
 int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
-    // sanity check, also avoid dereference a nullptr
-    if (io == NULL || arg == NULL) return -EINVAL;
+    // sanity check, also avoid dereference a nullptr; IOCTL_FLUSH takes no arg
+    if (io == NULL || (arg == NULL && cmd != IOCTL_FLUSH)) return -EINVAL;
     // based on the cmd, choose the correct local helper function.
     switch (cmd) {
         case IOCTL_GETLEN:
@@ -551,6 +1012,12 @@ int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
             return fs_setpos(get_fd_by_io(io), arg);
         case IOCTL_GETBLKSZ:
             return fs_getblksz(get_fd_by_io(io), arg);
+        case IOCTL_GETINO:
+            return fs_getino(get_fd_by_io(io), arg);
+        case IOCTL_SETDIRECT:
+            return fs_setdirect(get_fd_by_io(io), arg);
+        case IOCTL_FLUSH:
+            return fs_flush(get_fd_by_io(io));
         default:
             debug("Not supported IOCTL");
             return -ENOTSUP;
@@ -718,16 +1185,16 @@ static int fs_setpos(file_t* fd, void* arg) {
     // sanity check, also avoid dereference a nullptr
     if (fd == NULL || arg == NULL) return -EINVAL;
     // type conversion
-    lock_acquire(&kfs_lock);
+    iogate_enter(&kfs_gate);
     uint32_t pos = *((uint32_t*) arg);
     // check pos is valid, it needs to be in between [0, fd->file_size]
     if (pos > fd->file_size) {
-        lock_release(&kfs_lock);
+        iogate_leave(&kfs_gate);
         return -EINVAL;
     }
     // assign the new file pos
     fd->file_pos = pos;
-    lock_release(&kfs_lock);
+    iogate_leave(&kfs_gate);
     return 0;
 }
 
@@ -754,97 +1221,233 @@ static int fs_getblksz(file_t* fd, void* arg) {
 }
 
 /**
- * static int update_inode(uint32_t inode_number);
+ * static int fs_getino(file_t* fd, void* arg);
  *
- * Helper function. Get the inode from kfs.raw by the inode_number.
+ * Helper function for fs_ioctl. Returns the inode number of the file, which
+ * identifies it for as long as the file system is mounted.
  *
  * Inputs:
- *          inode_number - uint32_t, index of the inode in the inode list.
+ *          fd - file_t*, pointer to the file descriptor.
+ *          arg - void*, store the return value.
  * Outputs:
  *          return 0 on success.
- *          return -EIO if fails to read the disk_io to get inode.
+ *          return -EINVAL if fd is NULL or arg is NULL.
  * Side Effects:
- *          update the inode.
+ *          None.
  */
-static int update_inode(uint32_t inode_number) {
-    uint32_t inode_offset = FS_BLKSZ; // boot block occupies one block
-    inode_offset += inode_number * FS_BLKSZ;
-    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &inode_offset);
-    if (ret < 0) {
-        return -EIO;
-    }
-    // read the inode from kfs.raw
-    ret = disk_io->ops->read(disk_io, &inode, FS_BLKSZ);
-    // check inode reading
-    if (ret != FS_BLKSZ) {
-        debug("Reading inode fail. ret=%d", ret);
-        return -EIO;
-    }
+static int fs_getino(file_t* fd, void* arg) {
+    // sanity check, also avoid dereference a nullptr
+    if (fd == NULL || arg == NULL) return -EINVAL;
+    // assign arg equals to the inode number
+    *((uint32_t *)arg) = fd->inode_number;
     return 0;
 }
 
 /**
- * static int update_data_block(uint32_t data_block_idx);
+ * static int fs_setdirect(file_t* fd, void* arg);
  *
- * Helper function. Get the data block from kfs.raw by the data_block_idx.
+ * Helper function for fs_ioctl. Turns direct I/O on (*arg != 0) or off for the
+ * file. In direct mode, the whole blocks of a read or write that starts on a
+ * block boundary move between the caller's buffer and the disk without going
+ * through data_block, in one disk read or write per run of blocks that are
+ * contiguous on disk. The virtio block driver turns that into as few device
+ * requests as it can, with the device using the caller's pages directly when
+ * they are pinned (sysread and syswrite pin them). A partial block at the start or end of a request, or a request that
+ * does not start on a block boundary, is copied through data_block as usual.
+ * data_block is reloaded before every use, so direct writes never leave it
+ * stale.
  *
  * Inputs:
- *          data_block_idx - uint32_t, index of the data block we need to get from disk_io
+ *          fd - file_t*, pointer to the file descriptor.
+ *          arg - void*, pointer to an int.
  * Outputs:
  *          return 0 on success.
- *          return -EIO if fails to read data block from data block list.
+ *          return -EINVAL if fd is NULL or arg is NULL.
  * Side Effects:
- *          update the data_block.
+ *          change the flags of the file descriptor.
  */
-static int update_data_block(uint32_t data_block_idx) {
-    // data block list starts after inode list in the disk
-    // boot_block_size + inode_numbers(N) * block_size
-    uint32_t data_block_offset = FS_BLKSZ + (boot_block.num_inodes) * FS_BLKSZ;
-    data_block_offset += data_block_idx * FS_BLKSZ;
-    // set the offset to the start of the data block
-    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &data_block_offset);
-    if (ret < 0) {
-        return -EIO;
-    }
-    // read the data block from kfs.raw
-    ret = disk_io->ops->read(disk_io, &data_block, FS_BLKSZ);
-    // check data block reading
-    if (ret != FS_BLKSZ) {
-        debug("Reading data block fail. ret=%d", ret);
-        return -EIO;
-    }
+static int fs_setdirect(file_t* fd, void* arg) {
+    // sanity check, also avoid dereference a nullptr
+    if (fd == NULL || arg == NULL) return -EINVAL;
+    if (*((int *)arg))
+        fd->flags |= F_DIRECT;
+    else
+        fd->flags &= ~F_DIRECT;
     return 0;
 }
 
 /**
- * static int write_data_block(uint32_t data_block_idx);
+ * static int fs_flush(file_t* fd);
  *
- * write the updated data block back to disk.
+ * Helper function for fs_ioctl. Makes everything written to the file system
+ * so far durable, not only the writes to this file: in log mode it appends the
+ * segment being filled to the log, then it flushes the disk. A disk that does
+ * not support IOCTL_FLUSH writes through, so there is nothing to flush.
  *
  * Inputs:
- *          data_block_idx - uint32_t, data block idx of the data block we need to write to
+ *          fd - file_t*, pointer to the file descriptor.
  * Outputs:
  *          return 0 on success.
- *          return -EIO if write fails.
+ *          return -EINVAL if fd is NULL.
+ *          return -EIO if the log or the disk cannot be written.
  * Side Effects:
- *          change the data block value in the disk.
+ *          may write the log and flush the disk.
  */
-static int write_data_block(uint32_t data_block_idx) {
-    // calculate the data block list offset
-    uint32_t data_block_offset = FS_BLKSZ + (boot_block.num_inodes * FS_BLKSZ);
-    // increment the offset to the beginning of the data block we need to write to
-    data_block_offset += data_block_idx * FS_BLKSZ;
-    // set the offset
-    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &data_block_offset);
-    if (ret < 0) {
-        return -EIO;
-    }
-    // write the data block
-    ret = disk_io->ops->write(disk_io, &data_block, FS_BLKSZ);
-    if (ret != FS_BLKSZ) {
-        debug("Writing data block failed. ret=%d", ret);
-        return -EIO;
-    }
+static int fs_flush(file_t* fd) {
+    // sanity check
+    if (fd == NULL) return -EINVAL;
+    // try to acquire the lock
+    iogate_enter(&kfs_gate);
+    int ret = flush_disk();
+    // release the lock
+    iogate_leave(&kfs_gate);
+    return ret;
+}
+
+/**
+ * static int flush_disk(void);
+ *
+ * Helper function for fs_flush and fs_quiesce, called with kfs_gate held. In
+ * log mode it appends the segment being filled to the log, then it flushes the
+ * disk. A disk that does not support IOCTL_FLUSH writes through, so there is
+ * nothing to flush.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if the log or the disk cannot be written.
+ * Side Effects:
+ *          may write the log and flush the disk.
+ */
+static int flush_disk(void) {
+    int ret = (log_blocks != 0) ? log_append() : 0;
+    if (ret == 0) {
+        ret = disk_io->ops->ctl(disk_io, IOCTL_FLUSH, NULL);
+        if (ret == -ENOTSUP) {
+            ret = 0;
+        }
+    }
+    return (ret < 0) ? -EIO : 0;
+}
+
+/**
+ * static int update_inode(uint32_t inode_number);
+ *
+ * Helper function. Get the inode from kfs.raw by the inode_number.
+ *
+ * Inputs:
+ *          inode_number - uint32_t, index of the inode in the inode list.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if fails to read the disk_io to get inode.
+ * Side Effects:
+ *          update the inode.
+ */
+static int update_inode(uint32_t inode_number) {
+    return read_inode(inode_number, &inode);
+}
+
+/**
+ * static int read_inode(uint32_t inode_number, inode_t* dst);
+ *
+ * Helper function. Get the inode from kfs.raw (or inode_table) into dst.
+ *
+ * Inputs:
+ *          inode_number - uint32_t, index of the inode in the inode list.
+ *          dst - inode_t*, where to put the inode.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if fails to read the disk_io to get inode.
+ * Side Effects:
+ *          None.
+ */
+static int read_inode(uint32_t inode_number, inode_t* dst) {
+#if KFS_INODE_PRELOAD > 0
+    // preloaded inodes need no I/O
+    if (inode_number < inode_table_cnt) {
+        memcpy(dst, &inode_table[inode_number], FS_BLKSZ);
+        return 0;
+    }
+#endif
+    uint64_t inode_offset = FS_BLKSZ; // boot block occupies one block
+    inode_offset += inode_number * FS_BLKSZ;
+    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &inode_offset);
+    if (ret < 0) {
+        return -EIO;
+    }
+    // read the inode from kfs.raw
+    ret = disk_io->ops->read(disk_io, dst, FS_BLKSZ);
+    // check inode reading
+    if (ret != FS_BLKSZ) {
+        debug("Reading inode fail. ret=%d", ret);
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * static int update_data_block(uint32_t data_block_idx);
+ *
+ * Helper function. Get the data block from kfs.raw by the data_block_idx.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block we need to get from disk_io
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if fails to read data block from data block list.
+ * Side Effects:
+ *          update the data_block.
+ */
+static int update_data_block(uint32_t data_block_idx) {
+    // data block list starts after inode list in the disk
+    // boot_block_size + inode_numbers(N) * block_size
+    uint64_t data_block_offset = FS_BLKSZ + (boot_block.num_inodes) * FS_BLKSZ;
+    data_block_offset += data_block_idx * FS_BLKSZ;
+    // set the offset to the start of the data block
+    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &data_block_offset);
+    if (ret < 0) {
+        return -EIO;
+    }
+    // read the data block from kfs.raw
+    ret = disk_io->ops->read(disk_io, &data_block, FS_BLKSZ);
+    // check data block reading
+    if (ret != FS_BLKSZ) {
+        debug("Reading data block fail. ret=%d", ret);
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * static int write_data_block(uint32_t data_block_idx);
+ *
+ * write the updated data block back to disk.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, data block idx of the data block we need to write to
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if write fails.
+ * Side Effects:
+ *          change the data block value in the disk.
+ */
+static int write_data_block(uint32_t data_block_idx) {
+    // calculate the data block list offset
+    uint64_t data_block_offset = FS_BLKSZ + (boot_block.num_inodes * FS_BLKSZ);
+    // increment the offset to the beginning of the data block we need to write to
+    data_block_offset += data_block_idx * FS_BLKSZ;
+    // set the offset
+    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &data_block_offset);
+    if (ret < 0) {
+        return -EIO;
+    }
+    // write the data block
+    ret = disk_io->ops->write(disk_io, &data_block, FS_BLKSZ);
+    if (ret != FS_BLKSZ) {
+        debug("Writing data block failed. ret=%d", ret);
+        return -EIO;
+    }
     return 0;
 }
 
@@ -860,20 +1463,855 @@ static int write_data_block(uint32_t data_block_idx) {
  *          return -EIO if write fails.
  * Side Effects:
  *          change the data block value in the disk.
+ *          update the preloaded copy of the inode, if there is one.
  */
 static int write_inode(uint32_t inode_number) {
+    return store_inode(inode_number, &inode);
+}
+
+/**
+ * static int store_inode(uint32_t inode_number, const inode_t* src);
+ *
+ * write src to disk as inode inode_number
+ *
+ * Inputs:
+ *          inode_number - uint32_t, inode number of the inode we need to write to
+ *          src - const inode_t*, the new contents of the inode
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if write fails.
+ * Side Effects:
+ *          change the inode in the disk.
+ *          update the preloaded copy of the inode, if there is one.
+ */
+static int store_inode(uint32_t inode_number, const inode_t* src) {
+#if KFS_INODE_PRELOAD > 0
+    // keep the preloaded copy in step with the disk
+    if (inode_number < inode_table_cnt) {
+        memcpy(&inode_table[inode_number], src, FS_BLKSZ);
+    }
+#endif
     // calculate the inode list offset
-    uint32_t inode_offset = FS_BLKSZ + (inode_number * FS_BLKSZ);
+    uint64_t inode_offset = FS_BLKSZ + (inode_number * FS_BLKSZ);
     // increment the offset to the beginning of the inode we need to write to
     int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &inode_offset);
     if (ret < 0) {
         return -EIO;
     }
     // set the offset
-    ret = disk_io->ops->write(disk_io, &inode, FS_BLKSZ);
+    ret = disk_io->ops->write(disk_io, src, FS_BLKSZ);
     if (ret < 0) {
         debug("Writing inode failed. ret=%d", ret);
         return -EIO;
     }
     return 0;
 }
+
+/**
+ * static int preload_inodes(void);
+ *
+ * Helper function for fs_mount. Reads the first KFS_INODE_PRELOAD inodes (or
+ * all of them, if there are fewer) into inode_table in one I/O. Must be called
+ * with the disk positioned right after the boot block.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if the inodes cannot be read.
+ * Side Effects:
+ *          fill in inode_table and inode_table_cnt.
+ */
+static int preload_inodes(void) {
+    inode_table_cnt = 0;
+#if KFS_INODE_PRELOAD > 0
+    uint32_t cnt = boot_block.num_inodes;
+    if (cnt > KFS_INODE_PRELOAD) {
+        cnt = KFS_INODE_PRELOAD;
+    }
+    if (cnt == 0) {
+        return 0;
+    }
+    // read the head of the inode list from kfs.raw
+    long ret = disk_io->ops->read(disk_io, inode_table, cnt * FS_BLKSZ);
+    if (ret != cnt * FS_BLKSZ) {
+        debug("Preloading inodes fail. ret=%ld", ret);
+        return -EIO;
+    }
+    inode_table_cnt = cnt;
+    debug("preloaded %d inodes", cnt);
+#endif
+    return 0;
+}
+
+/**
+ * static int pass_kfs_gate(file_t* fd, uint32_t inode_number, uint32_t* allocated_blocks);
+ *
+ * Helper function for fs_read and fs_write. Leaves kfs_gate and enters it
+ * again, so that a request of higher I/O priority waiting at the gate runs
+ * before the next block of a long read or write. Whatever ran meanwhile may
+ * have loaded another inode into inode, or moved this one's blocks
+ * (fs_defrag), so the inode is loaded again.
+ *
+ * Inputs:
+ *          fd - file_t*, the file being read or written, with kfs_gate held.
+ *          inode_number - uint32_t, the file's inode when the request started.
+ *          allocated_blocks - uint32_t*, receives the file's number of blocks.
+ * Outputs:
+ *          return 0 on success, with kfs_gate held.
+ *          return -EIO if the file was closed meanwhile or the inode cannot
+ *          be read, also with kfs_gate held.
+ * Side Effects:
+ *          may suspend the thread; changes inode.
+ */
+static int pass_kfs_gate(file_t* fd, uint32_t inode_number, uint32_t* allocated_blocks) {
+    iogate_leave(&kfs_gate);
+    iogate_enter(&kfs_gate);
+
+    if (!(fd->flags & F_IN_USE) || fd->inode_number != inode_number) {
+        return -EIO;
+    }
+    if (update_inode(inode_number) < 0) {
+        return -EIO;
+    }
+    *allocated_blocks = (inode.byte_len + FS_BLKSZ - 1) / FS_BLKSZ;
+    return 0;
+}
+
+/**
+ * static long read_file(file_t* fd, uint64_t pos, void* buf, unsigned long n);
+ *
+ * Helper function for fs_read and fs_readat. Reads up to n bytes from
+ * position pos of the file into buf, with kfs_gate held. The position in fd
+ * is not changed.
+ *
+ * Inputs:
+ *          fd - file_t*, the open file, with kfs_gate held.
+ *          pos - uint64_t, position in the file to read from.
+ *          buf - void*, the buffer to read into.
+ *          n - unsigned long, number of bytes to read, at least 1.
+ * Outputs:
+ *          return the number of read bytes, 0 at the end of the file.
+ *          return -EIO, if the inode or a data block cannot be read.
+ * Side Effects:
+ *          may pass kfs_gate between blocks; changes inode and data_block.
+ */
+static long read_file(file_t* fd, uint64_t pos, void* buf, unsigned long n) {
+    trace("fs_read: Reading %lu bytes from file (inode: %u, pos: %lu, file size: %u)\n",
+          n, fd->inode_number, (unsigned long)pos, fd->file_size);
+    // check if the position is beyond the file size
+    if (pos >= fd->file_size) {
+        return 0; // End of file
+    }
+
+    // check the inode number
+    if (fd->inode_number >= boot_block.num_inodes) {
+        return -EIO;
+    }
+    // get the inode based on the inode_number
+    int ret = update_inode(fd->inode_number);
+    if (ret < 0) {
+        return -EIO;
+    }
+
+    // Calculate the number of allocated data blocks (ceiling divide)
+    uint32_t allocated_blocks = (inode.byte_len + FS_BLKSZ - 1) / FS_BLKSZ;
+
+    // calculate the number of bytes that can be read
+    unsigned long bytes_remaining = fd->file_size - pos;
+    unsigned long bytes_to_read = (n < bytes_remaining) ? n : bytes_remaining;
+
+    uint8_t *read_buf = (uint8_t *)buf; // data type of data in the datablock is uint_8
+    // the position and inode when the read started; fd may change between blocks
+    const uint32_t file_pos = pos;
+    const uint32_t inode_number = fd->inode_number;
+
+    // denote the number of bytes we have read
+    unsigned long read_bytes = 0;
+    // loop until we finish reading
+    while (read_bytes < bytes_to_read) {
+        // let a request of higher priority in between blocks
+        if (read_bytes > 0 && pass_kfs_gate(fd, inode_number, &allocated_blocks) < 0) {
+            return -EIO;
+        }
+        // get the current offset we are read from
+        uint32_t byte_offset = file_pos + read_bytes;
+        // get the index of data block in the inode->data_block_num we are read from
+        uint32_t block_idx = byte_offset / FS_BLKSZ;
+        // get the offset in that data block
+        uint32_t block_offset = byte_offset % FS_BLKSZ;
+
+        // check if block_idx is within allocated data blocks
+        if (block_idx >= allocated_blocks || block_idx >= MAX_DB_PER_INODE) {
+            return -EIO; // Invalid block index
+        }
+
+        // get the data_block_num from inode
+        uint32_t data_block_idx = inode.data_block_num[block_idx];
+        if (data_block_idx >= boot_block.num_data) {
+            return -EIO; // Invalid data block number
+        }
+
+        // in DAX mode, the data comes straight from device memory
+        if (dax_base != NULL) {
+            uint32_t bytes_to_copy = FS_BLKSZ - block_offset;
+            if (bytes_to_read - read_bytes < bytes_to_copy) {
+                bytes_to_copy = bytes_to_read - read_bytes;
+            }
+            memcpy(read_buf + read_bytes, dax_block(data_block_idx) + block_offset, bytes_to_copy);
+            read_bytes += bytes_to_copy;
+            continue;
+        }
+
+        // in direct mode, whole blocks go from the disk to buf in one request
+        // per run of contiguous blocks; partial blocks take the path below
+        if ((fd->flags & F_DIRECT) && block_offset == 0 && bytes_to_read - read_bytes >= FS_BLKSZ &&
+            !log_holds(data_block_idx)) {
+            uint32_t cnt = direct_run(block_idx, (bytes_to_read - read_bytes) / FS_BLKSZ, allocated_blocks);
+            ret = read_data_blocks(data_block_idx, cnt, read_buf + read_bytes);
+            if (ret < 0) {
+                return -EIO;
+            }
+            read_bytes += cnt * FS_BLKSZ;
+            continue;
+        }
+
+        // get the data block
+        ret = load_data_block(data_block_idx);
+        if (ret < 0) {
+            return -EIO;
+        }
+
+        // calculate the remaining space in the data block
+        uint32_t bytes_in_block = FS_BLKSZ - block_offset;
+        // calculate the number of byte hasnt written
+        unsigned long bytes_left_to_read = bytes_to_read - read_bytes;
+        // calculate the number of bytes will write
+        uint32_t bytes_to_copy = (bytes_in_block < bytes_left_to_read) ? bytes_in_block : bytes_left_to_read;
+
+        // copy data into the buffer
+        memcpy(read_buf + read_bytes, data_block.data + block_offset, bytes_to_copy);
+
+        // increase the read_bytes
+        read_bytes += bytes_to_copy;
+    }
+
+    return read_bytes;
+}
+
+/**
+ * static uint32_t direct_run(uint32_t block_idx, uint32_t max_cnt, uint32_t allocated_blocks);
+ *
+ * Helper function for direct I/O. Counts how many blocks of the current inode,
+ * starting at block_idx, are stored in consecutive data blocks, so that they
+ * can be transferred in one disk request. The run ends before a block the log
+ * has a copy of.
+ *
+ * Inputs:
+ *          block_idx - uint32_t, index of the first block in the inode.
+ *          max_cnt - uint32_t, most blocks wanted, at least 1.
+ *          allocated_blocks - uint32_t, number of blocks of the file.
+ * Outputs:
+ *          return the number of blocks in the run, at least 1.
+ * Side Effects:
+ *          None.
+ */
+static uint32_t direct_run(uint32_t block_idx, uint32_t max_cnt, uint32_t allocated_blocks) {
+    uint32_t first = inode.data_block_num[block_idx];
+    uint32_t cnt = 1;
+
+    while (cnt < max_cnt && block_idx + cnt < allocated_blocks &&
+           block_idx + cnt < MAX_DB_PER_INODE &&
+           inode.data_block_num[block_idx + cnt] == first + cnt &&
+           first + cnt < boot_block.num_data && !log_holds(first + cnt)) {
+        cnt++;
+    }
+    return cnt;
+}
+
+/**
+ * static int read_data_blocks(uint32_t data_block_idx, uint32_t cnt, void* buf);
+ *
+ * Helper function for direct I/O. Reads cnt consecutive data blocks from
+ * kfs.raw straight into buf, with one read of the disk.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the first data block.
+ *          cnt - uint32_t, number of data blocks.
+ *          buf - void*, destination of cnt * FS_BLKSZ bytes.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if the read fails.
+ * Side Effects:
+ *          None.
+ */
+static int read_data_blocks(uint32_t data_block_idx, uint32_t cnt, void* buf) {
+    uint64_t data_block_offset = FS_BLKSZ + (boot_block.num_inodes * FS_BLKSZ);
+    data_block_offset += (uint64_t)data_block_idx * FS_BLKSZ;
+    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &data_block_offset);
+    if (ret < 0) {
+        return -EIO;
+    }
+    long len = disk_io->ops->read(disk_io, buf, cnt * FS_BLKSZ);
+    if (len != cnt * FS_BLKSZ) {
+        debug("Direct read of %d data blocks failed. ret=%ld", cnt, len);
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * static int write_data_blocks(uint32_t data_block_idx, uint32_t cnt, const void* buf);
+ *
+ * Helper function for direct I/O. Writes cnt consecutive data blocks from buf
+ * straight to kfs.raw, with one write to the disk.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the first data block.
+ *          cnt - uint32_t, number of data blocks.
+ *          buf - const void*, source of cnt * FS_BLKSZ bytes.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if the write fails.
+ * Side Effects:
+ *          change the data blocks in the disk.
+ */
+static int write_data_blocks(uint32_t data_block_idx, uint32_t cnt, const void* buf) {
+    uint64_t data_block_offset = FS_BLKSZ + (boot_block.num_inodes * FS_BLKSZ);
+    data_block_offset += (uint64_t)data_block_idx * FS_BLKSZ;
+    int ret = disk_io->ops->ctl(disk_io, IOCTL_SETPOS, &data_block_offset);
+    if (ret < 0) {
+        return -EIO;
+    }
+    long len = disk_io->ops->write(disk_io, buf, cnt * FS_BLKSZ);
+    if (len != cnt * FS_BLKSZ) {
+        debug("Direct write of %d data blocks failed. ret=%ld", cnt, len);
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * static int inode_named(uint32_t inode_number);
+ *
+ * Helper function for fs_defrag. Files are the inodes named by a directory
+ * entry; other inodes own no data blocks.
+ *
+ * Inputs:
+ *          inode_number - uint32_t, index of the inode in the inode list.
+ * Outputs:
+ *          return 1 if a directory entry refers to the inode, 0 otherwise.
+ * Side Effects:
+ *          None.
+ */
+static int inode_named(uint32_t inode_number) {
+    for (uint32_t i = 0; i < boot_block.num_dentry; i++) {
+        if (boot_block.dir_entries[i].inode == inode_number) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * static uint32_t inode_blocks(const inode_t* ino);
+ *
+ * Helper function for fs_defrag. Returns the number of data blocks holding the
+ * file's bytes, the same count fs_read and fs_write use.
+ *
+ * Inputs:
+ *          ino - const inode_t*, the inode of the file.
+ * Outputs:
+ *          return the number of data blocks.
+ * Side Effects:
+ *          None.
+ */
+static uint32_t inode_blocks(const inode_t* ino) {
+    uint32_t nblk = (ino->byte_len + FS_BLKSZ - 1) / FS_BLKSZ;
+    return (nblk < MAX_DB_PER_INODE) ? nblk : MAX_DB_PER_INODE;
+}
+
+/**
+ * static uint32_t count_runs(const inode_t* ino);
+ *
+ * Helper function for fs_defrag. Counts the runs of consecutive data blocks of
+ * a file; a file in one piece has one run, an empty file none.
+ *
+ * Inputs:
+ *          ino - const inode_t*, the inode of the file.
+ * Outputs:
+ *          return the number of runs.
+ * Side Effects:
+ *          None.
+ */
+static uint32_t count_runs(const inode_t* ino) {
+    uint32_t nblk = inode_blocks(ino);
+    uint32_t runs = (nblk > 0);
+    for (uint32_t k = 1; k < nblk; k++) {
+        if (ino->data_block_num[k] != ino->data_block_num[k - 1] + 1) {
+            runs++;
+        }
+    }
+    return runs;
+}
+
+/**
+ * static int copy_data_block(uint32_t dst, uint32_t src, data_block_t* scratch);
+ *
+ * Helper function for fs_defrag. Copies the contents of data block src to
+ * data block dst, using scratch as the buffer.
+ *
+ * Inputs:
+ *          dst - uint32_t, index of the data block to write.
+ *          src - uint32_t, index of the data block to read.
+ *          scratch - data_block_t*, a block-sized buffer.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if the read or write fails.
+ * Side Effects:
+ *          change data block dst in the disk.
+ */
+static int copy_data_block(uint32_t dst, uint32_t src, data_block_t* scratch) {
+    if (read_data_blocks(src, 1, scratch) < 0) {
+        return -EIO;
+    }
+    return write_data_blocks(dst, 1, scratch);
+}
+
+/**
+ * static int load_data_block(uint32_t data_block_idx);
+ *
+ * Helper function for fs_read and fs_write. Gets the data block into
+ * data_block like update_data_block, but in log mode takes the newest copy:
+ * the one in the segment being filled, else the one in the log, else the
+ * block itself.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if the read fails.
+ * Side Effects:
+ *          update the data_block.
+ */
+static int load_data_block(uint32_t data_block_idx) {
+    if (log_blocks != 0) {
+        data_block_t* pending = log_pending(data_block_idx);
+        if (pending != NULL) {
+            memcpy(&data_block, pending, FS_BLKSZ);
+            return 0;
+        }
+        uint32_t lb = log_find(data_block_idx);
+        if (lb != LOG_FREE) {
+            return read_data_blocks(log_start + lb, 1, &data_block);
+        }
+    }
+    return update_data_block(data_block_idx);
+}
+
+/**
+ * static int store_data_block(uint32_t data_block_idx);
+ *
+ * Helper function for fs_write. Writes data_block back like write_data_block,
+ * but in log mode copies it into the segment being filled instead, and
+ * appends the segment to the log once it is full.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if a write fails.
+ * Side Effects:
+ *          change the data block in the disk, or the log and block map.
+ */
+static int store_data_block(uint32_t data_block_idx) {
+    if (log_blocks == 0) {
+        return write_data_block(data_block_idx);
+    }
+    data_block_t* pending = log_pending(data_block_idx);
+    if (pending == NULL) {
+        // a segment left full by a failed append gets another try
+        if (log_sum->cnt == KFS_LOG_SEGBLKS && log_append() < 0) {
+            return -EIO;
+        }
+        pending = log_seg[log_sum->cnt];
+        log_sum->home[log_sum->cnt++] = data_block_idx;
+    }
+    memcpy(pending, &data_block, FS_BLKSZ);
+    if (log_sum->cnt == KFS_LOG_SEGBLKS) {
+        return log_append();
+    }
+    return 0;
+}
+
+/**
+ * static void dax_mount(struct io_intf* io);
+ *
+ * Helper function for fs_mount. Asks the disk for its device memory
+ * (IOCTL_PMEM_DAX) and, if it has some and the file system fits in it, turns
+ * on DAX mode. A disk that is not a pmem device rejects the ioctl, and the
+ * file system uses the disk's read and write as before.
+ *
+ * Inputs:
+ *          io - struct io_intf*, the disk.
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          change dax_base.
+ */
+static void dax_mount(struct io_intf* io) {
+    struct pmem_dax dax;
+    uint64_t data_offset = FS_BLKSZ + (uint64_t)boot_block.num_inodes * FS_BLKSZ;
+    uint64_t fs_size = data_offset + (uint64_t)boot_block.num_data * FS_BLKSZ;
+
+    dax_base = NULL;
+    if (io->ops->ctl(io, IOCTL_PMEM_DAX, &dax) == 0 && fs_size <= dax.size) {
+        dax_base = (uint8_t*)dax.base + data_offset;
+        debug("DAX mode, %u data blocks at %p", boot_block.num_data, dax_base);
+    }
+}
+
+/**
+ * static inline uint8_t* dax_block(uint32_t data_block_idx);
+ *
+ * Helper function for DAX mode. Returns the address of a data block in device
+ * memory.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block, below num_data.
+ * Outputs:
+ *          return the kernel address of the data block.
+ * Side Effects:
+ *          None.
+ */
+static inline uint8_t* dax_block(uint32_t data_block_idx) {
+    return dax_base + (uint64_t)data_block_idx * FS_BLKSZ;
+}
+
+/**
+ * static int log_mount(void);
+ *
+ * Helper function for fs_mount. Sets up log mode: allocates the block map and
+ * the segment buffer, rebuilds the block map by rolling forward through the
+ * segments appended since the last checkpoint, and starts the cleaner thread.
+ * A segment whose checksum does not match was being written during a crash;
+ * it and anything after it are ignored.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EINVAL if the log region is too small or too large.
+ *          return -EIO if the log cannot be read.
+ *          return -EBUSY if the cleaner thread cannot be started.
+ * Side Effects:
+ *          turns on log mode.
+ */
+static int log_mount(void) {
+    log_checkpoint_t* cp;
+    uint32_t lb, i, sum;
+
+    if (boot_block.log_blocks < 2 + KFS_LOG_SEGBLKS || boot_block.log_blocks > LOG_MAXBLKS) {
+        debug("Log of %u blocks is unusable", boot_block.log_blocks);
+        return -EINVAL;
+    }
+
+    log_home = memory_alloc_page();
+    log_order = memory_alloc_page();
+    log_scratch = memory_alloc_page();
+    log_sum = (log_summary_t*)&log_buf[0];
+    for (i = 0; i < KFS_LOG_SEGBLKS; i++) {
+        log_seg[i] = &log_buf[1 + i];
+    }
+    for (lb = 0; lb < LOG_MAXBLKS; lb++) {
+        log_home[lb] = LOG_FREE;
+    }
+    log_start = boot_block.num_data;
+
+    // the checkpoint gives the sequence number of the first segment; mkfs
+    // writes one with sequence number 1
+    if (read_data_blocks(log_start, 1, log_scratch) < 0) {
+        return -EIO;
+    }
+    cp = (log_checkpoint_t*)log_scratch->data;
+    log_seq = (cp->magic == LOG_CP_MAGIC) ? cp->seq : 1;
+    log_head = 1;
+
+    // roll forward until a block is not the summary of the next segment
+    while (log_head + 1 < boot_block.log_blocks) {
+        if (read_data_blocks(log_start + log_head, 1, log_sum) < 0) {
+            return -EIO;
+        }
+        if (log_sum->magic != LOG_SEG_MAGIC || log_sum->seq != log_seq ||
+            log_sum->cnt == 0 || log_sum->cnt > KFS_LOG_SEGBLKS ||
+            log_head + 1 + log_sum->cnt > boot_block.log_blocks) {
+            break;
+        }
+        sum = 0;
+        for (i = 0; i < log_sum->cnt; i++) {
+            if (log_sum->home[i] >= boot_block.num_data ||
+                read_data_blocks(log_start + log_head + 1 + i, 1, log_scratch) < 0) {
+                break;
+            }
+            sum = log_checksum(sum, log_scratch);
+        }
+        if (i < log_sum->cnt || sum != log_sum->csum) {
+            debug("Log segment %u is torn", log_seq);
+            break;
+        }
+        for (i = 0; i < log_sum->cnt; i++) {
+            log_map(log_head + 1 + i, log_sum->home[i]);
+        }
+        log_head += 1 + log_sum->cnt;
+        log_seq++;
+    }
+    log_sum->cnt = 0;
+
+    debug("Log of %u blocks, %u in use", boot_block.log_blocks, log_head);
+    log_blocks = boot_block.log_blocks;
+
+    if (thread_spawn("kfs_log", &log_cleaner, NULL) < 0) {
+        log_blocks = 0;
+        return -EBUSY;
+    }
+    return 0;
+}
+
+/**
+ * static int log_holds(uint32_t data_block_idx);
+ *
+ * Helper function for direct I/O. A data block the log has a copy of must not
+ * be read or written in place.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block.
+ * Outputs:
+ *          return 1 if the log has a copy of the block, 0 otherwise.
+ * Side Effects:
+ *          None.
+ */
+static int log_holds(uint32_t data_block_idx) {
+    return log_blocks != 0 &&
+        (log_pending(data_block_idx) != NULL || log_find(data_block_idx) != LOG_FREE);
+}
+
+/**
+ * static data_block_t* log_pending(uint32_t data_block_idx);
+ *
+ * Helper function for log mode. Looks for a data block in the segment being
+ * filled.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block.
+ * Outputs:
+ *          return the buffered copy of the block, or NULL.
+ * Side Effects:
+ *          None.
+ */
+static data_block_t* log_pending(uint32_t data_block_idx) {
+    for (uint32_t i = 0; i < log_sum->cnt; i++) {
+        if (log_sum->home[i] == data_block_idx) {
+            return log_seg[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * static uint32_t log_find(uint32_t data_block_idx);
+ *
+ * Helper function for log mode. Looks up a data block in the block map. Only
+ * the newest copy of a block is in the map.
+ *
+ * Inputs:
+ *          data_block_idx - uint32_t, index of the data block.
+ * Outputs:
+ *          return the log block holding the block, or LOG_FREE.
+ * Side Effects:
+ *          None.
+ */
+static uint32_t log_find(uint32_t data_block_idx) {
+    for (uint32_t lb = 1; lb < log_head; lb++) {
+        if (log_home[lb] == data_block_idx) {
+            return lb;
+        }
+    }
+    return LOG_FREE;
+}
+
+/**
+ * static void log_map(uint32_t log_block, uint32_t data_block_idx);
+ *
+ * Helper function for log mode. Records in the block map that log_block holds
+ * the newest copy of the data block, dropping the older copy if there is one.
+ *
+ * Inputs:
+ *          log_block - uint32_t, block of the log region.
+ *          data_block_idx - uint32_t, index of the data block.
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          update log_home.
+ */
+static void log_map(uint32_t log_block, uint32_t data_block_idx) {
+    uint32_t old = log_find(data_block_idx);
+    if (old != LOG_FREE) {
+        log_home[old] = LOG_FREE;
+    }
+    log_home[log_block] = data_block_idx;
+}
+
+/**
+ * static int log_append(void);
+ *
+ * Helper function for log mode. Writes the segment being filled at the head
+ * of the log, its summary first, with one request for the run of consecutive
+ * blocks, and points the block map at it. If the log has no room, log_checkpoint empties it
+ * first.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if a write fails; the segment stays in memory.
+ * Side Effects:
+ *          change the log in the disk, log_home, log_head and log_seq.
+ */
+static int log_append(void) {
+    uint32_t cnt = log_sum->cnt;
+    uint32_t i;
+
+    if (cnt == 0) {
+        return 0;
+    }
+    if (log_head + 1 + cnt > log_blocks && log_checkpoint() < 0) {
+        return -EIO;
+    }
+
+    log_sum->magic = LOG_SEG_MAGIC;
+    log_sum->seq = log_seq;
+    log_sum->csum = 0;
+    for (i = 0; i < cnt; i++) {
+        log_sum->csum = log_checksum(log_sum->csum, log_seg[i]);
+    }
+
+    if (write_data_blocks(log_start + log_head, 1 + cnt, log_buf) < 0) {
+        return -EIO;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        log_map(log_head + 1 + i, log_sum->home[i]);
+    }
+    log_head += 1 + cnt;
+    log_seq++;
+    log_sum->cnt = 0;
+    return 0;
+}
+
+/**
+ * static int log_checkpoint(void);
+ *
+ * Helper function for log mode. Copies every live block of the log to its
+ * home, in the order of the data blocks, then writes a checkpoint that makes
+ * the segments written so far stale. The segment being filled is not touched.
+ * A crash before the checkpoint is written leaves the log as it was, and the
+ * copying is done again after the next mount.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          return 0 on success.
+ *          return -EIO if a read or write fails.
+ * Side Effects:
+ *          change the data blocks and the log in the disk.
+ *          empty the block map.
+ */
+static int log_checkpoint(void) {
+    log_checkpoint_t* cp;
+    uint32_t n = 0;
+    uint32_t lb, i;
+
+    // insertion sort of the live log blocks by home
+    for (lb = 1; lb < log_head; lb++) {
+        if (log_home[lb] == LOG_FREE) continue;
+        for (i = n; i > 0 && log_home[log_order[i - 1]] > log_home[lb]; i--) {
+            log_order[i] = log_order[i - 1];
+        }
+        log_order[i] = lb;
+        n++;
+    }
+
+    for (i = 0; i < n; i++) {
+        lb = log_order[i];
+        if (read_data_blocks(log_start + lb, 1, log_scratch) < 0 ||
+            write_data_blocks(log_home[lb], 1, log_scratch) < 0) {
+            return -EIO;
+        }
+    }
+
+    cp = (log_checkpoint_t*)log_scratch->data;
+    memset(log_scratch, 0, FS_BLKSZ);
+    cp->magic = LOG_CP_MAGIC;
+    cp->seq = log_seq;
+    if (write_data_blocks(log_start, 1, log_scratch) < 0) {
+        return -EIO;
+    }
+
+    debug("Log checkpoint: %u blocks copied home", n);
+    for (lb = 0; lb < log_head; lb++) {
+        log_home[lb] = LOG_FREE;
+    }
+    log_head = 1;
+    return 0;
+}
+
+/**
+ * static uint32_t log_checksum(uint32_t sum, const data_block_t* blk);
+ *
+ * Helper function for log mode. Folds the words of a block into sum, so that
+ * log_mount can tell a segment whose blocks did not all reach the disk.
+ *
+ * Inputs:
+ *          sum - uint32_t, checksum of the blocks before this one.
+ *          blk - const data_block_t*, the block.
+ * Outputs:
+ *          return the new checksum.
+ * Side Effects:
+ *          None.
+ */
+static uint32_t log_checksum(uint32_t sum, const data_block_t* blk) {
+    const uint32_t* w = (const uint32_t*)blk->data;
+    for (uint32_t i = 0; i < FS_BLKSZ / sizeof(uint32_t); i++) {
+        sum = ((sum << 1) | (sum >> 31)) + w[i];
+    }
+    return sum;
+}
+
+/**
+ * static void log_cleaner(void* arg);
+ *
+ * Body of the log cleaner thread. Every KFS_LOG_CLEAN_MS it appends the
+ * segment being filled, however few blocks it has, and checkpoints the log
+ * once it is more than half full, so that fs_write seldom has to wait for a
+ * checkpoint.
+ *
+ * Inputs:
+ *          arg - void*, unused.
+ * Outputs:
+ *          None; does not return.
+ * Side Effects:
+ *          change the data blocks and the log in the disk.
+ */
+static void log_cleaner(void* arg) {
+    struct alarm al;
+
+    alarm_init(&al, "kfs_log");
+    for (;;) {
+        alarm_sleep(&al, KFS_LOG_CLEAN_MS * (TIMER_FREQ / 1000));
+        iogate_enter(&kfs_gate);
+        if (log_append() < 0 || (log_head > log_blocks / 2 && log_checkpoint() < 0)) {
+            debug("Log cleaner: I/O error");
+        }
+        iogate_leave(&kfs_gate);
+    }
+}
@@ -13,6 +13,7 @@
 
 #include "console.h"
 #include "thread.h"
+#include "task.h"
 #include "device.h"
 #include "uart.h"
 #include "timer.h"
@@ -26,6 +27,8 @@
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "cowblk.h"
+#include "viopmem.h"
 
 
 void main(void) {
@@ -42,6 +45,9 @@ void main(void) {
     thread_init();
     procmgr_init();
     timer_init();
+    taskmgr_init();
+
+    memory_compactd_start();
 
     // Attach NS16550a serial devices
 
@@ -61,7 +67,18 @@ void main(void) {
 
     intr_enable();
 
-    result = device_open(&blkio, "blk", 0);
+    // Mount a pmem device if there is one, or an emulated one if blk1 holds
+    // a pmem image, so that KFS runs in DAX mode. Otherwise mount the
+    // copy-on-write overlay of blk0 if blk1 holds a delta for it.
+
+    if (device_open(&blkio, "pmem", 0) == 0)
+        result = 0;
+    else if (viopmem_emul_attach() == 0)
+        result = device_open(&blkio, "pmem", 0);
+    else if (cowblk_attach() == 0)
+        result = device_open(&blkio, "cow", 0);
+    else
+        result = device_open(&blkio, "blk", 0);
 
     if (result != 0)
         panic("device_open failed");
@@ -77,6 +94,9 @@ void main(void) {
 
     if (result < 0)
         panic(INIT_PROC ": process image not found");
+
+    // process_exec drops the caller's reference, as it does for an fd
+    initio->refcnt = 1;
     
     result = process_exec(initio);
     panic(INIT_PROC ": process_exec failed");
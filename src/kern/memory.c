@@ -24,6 +24,10 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "timer.h"
+#include "task.h"
+#include "uffd.h"
+#include "kexec.h"
 
 #include <stdint.h>
 
@@ -32,6 +36,8 @@
 
 char memory_initialized = 0;
 uintptr_t main_mtag;
+int memory_pt_levels = 3;
+uintptr_t memory_user_end = USER_END_VMA;
 
 // IMPORTED VARIABLE DECLARATIONS
 //
@@ -51,7 +57,10 @@ extern char _kimg_end[];
 //
 
 union linked_page {
-    union linked_page * next;
+    struct {
+        union linked_page * next;
+        union linked_page * prev;
+    };
     char padding[PAGE_SIZE];
 };
 
@@ -64,15 +73,39 @@ struct pte {
     uint64_t n:1;
 };
 
+// Page frame descriptor. There is one for every physical page of RAM. User
+// pages are never shared between spaces (fork copies them), so the reverse
+// mapping of a frame is a single pointer to the PTE that maps it.
+
+struct page_frame {
+    uint8_t flags;          // PGF_*; 0 for kernel pages and page tables
+    uint8_t mapcount;       // number of PTEs mapping the frame (0 or 1)
+    uint8_t pincnt;         // holds of memory_pin_range; pinned pages stay put
+    struct pte * rmap;      // the PTE mapping the frame if mapcount is 1
+};
+
 // INTERNAL MACRO DEFINITIONS
 //
 
+#define VPN(vma,lvl) (((vma) >> (12+9*(lvl))) & 0x1FF)
+#define VPN3(vma) (((vma) >> (9+9+9+12)) & 0x1FF)
 #define VPN2(vma) (((vma) >> (9+9+12)) & 0x1FF)
 #define VPN1(vma) (((vma) >> (9+12)) & 0x1FF)
 #define VPN0(vma) (((vma) >> 12) & 0x1FF)
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
 
 #define PTE_PER_LEVEL   512
+
+#define PGF_FREE        (1 << 0) // on the free list
+#define PGF_USER        (1 << 1) // mapped user page, movable through rmap
+#define PGF_MEGA        (1 << 2) // part of a megapage mapping
+#define PGF_ISOLATED    (1 << 3) // held off the free list by compaction
+#define PGF_PINNED      (1 << 4) // allocated for a device (memory_alloc_pinned)
+#define PGF_ORPHAN      (1 << 5) // pinned page its driver has let go of
+
+#define FRAME_CNT       (RAM_SIZE / PAGE_SIZE)
+#define MEGA_CNT        (RAM_SIZE / MEGA_SIZE)
 #define ASID_SHIFT      44
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -90,6 +123,20 @@ static inline struct pte * active_space_root(void);
 
 static inline void * pagenum_to_pageptr(uintptr_t n);
 static inline uintptr_t pageptr_to_pagenum(const void * p);
+static inline struct page_frame * pageptr_to_frame(const void * p);
+static inline size_t pageptr_to_megaidx(const void * p);
+
+static void free_list_insert(void * pp, int tail);
+static void free_list_remove(void * pp);
+static inline void frame_map(const void * pp, struct pte * pte);
+static void frame_map_mega(const void * pp, struct pte * pte);
+static inline void frame_unmap(const void * pp);
+static size_t count_free_megas(void);
+static size_t count_movable(size_t idx);
+static int compact_one(void);
+static int migrate_page(void * pp);
+static void compactd_sleep(struct task * tk);
+static void compactd_run(struct task * tk);
 
 static inline void * round_up_ptr(void * p, size_t blksz);
 static inline uintptr_t round_up_addr(uintptr_t addr, size_t blksz);
@@ -100,17 +147,63 @@ static inline uintptr_t round_down_addr(uintptr_t addr, size_t blksz);
 
 static inline struct pte leaf_pte (
     const void * pptr, uint_fast8_t rwxug_flags);
+static inline struct pte user_pte (
+    const void * pptr, uint_fast8_t rwx_flags, uint_fast8_t ad_flags);
 static inline struct pte ptab_pte (
     const struct pte * ptab, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
 
 static inline void sfence_vma(void);
 
+static struct pte * new_space_root(void);
+static inline uintptr_t root_to_mtag(const struct pte * root, uint_fast16_t asid);
+static struct pte * walk_level (
+    struct pte * root, uintptr_t vma, int lvl, int create);
+static struct pte * walk_leaf(struct pte * root, uintptr_t vma);
+static void clone_user_level (
+    const struct pte * src, struct pte * dst, int lvl);
+static void clone_megapage(const struct pte * src, struct pte * dst);
+static int map_megapage (
+    struct pte * root, const struct vma * v, uintptr_t vma,
+    uint_fast8_t ad_flags);
+static void split_megapage(struct pte * pte);
+static void free_user_level(struct pte * pt, int lvl);
+static int fill_user_page(const struct vma * v, uintptr_t vma, void * pp);
+static long read_backing (
+    const struct vma * v, uint64_t off, void * buf, size_t len);
+static size_t populate_range (
+    struct pte * root, const struct vma * v, uintptr_t start, uintptr_t end);
+static size_t unmap_range (
+    struct pte * root, uintptr_t start, uintptr_t end, size_t max,
+    uint_fast8_t skip);
+static void idle_scan (
+    struct pte * root, uintptr_t start, uintptr_t end, int clear,
+    struct pgidle_info * info);
+static void fault_around(struct pte * root, const struct vma * v, uintptr_t vma);
+static inline int recoverable(const struct vma * v);
+static size_t prefetch_run (
+    struct pte * root, const struct vma * v, uintptr_t start, uintptr_t end);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
-static union linked_page * free_list;
-
+static union linked_page * free_list; // allocation end of the free list
+static union linked_page * free_tail;
+static size_t free_page_cnt;
+
+static struct page_frame * frametab;    // FRAME_CNT descriptors
+static uint16_t * mega_free_cnt;        // free pages in each megarange of RAM
+static size_t pool_mega_start;          // first megarange inside the page pool
+static struct compact_stats compact_stats;
+static struct task compactd_task;
+static struct alarm compactd_alarm;
+static uintptr_t devmap_next;           // next free address for memory_map_device
+static uint_fast8_t satp_mode = RISCV_SATP_MODE_Sv39;
+
+#if MEMORY_SV48
+static struct pte main_pt3[PTE_CNT]
+    __attribute__ ((section(".bss.pagetable"), aligned(4096)));
+#endif
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 static struct pte main_pt1_0x80000[PTE_CNT]
@@ -131,7 +224,7 @@ static struct pte main_pt0_0x80000[PTE_CNT]
  *  1. Sets up page tables and performs virtual-to-physical 1:1 mapping of the kernel megapage.
  *      a. The first two gigabytes of memory are made gigapages and maps the MMIO region
  *      b. The next gigarange is split into megapages that represents the kernel text, read-only, and data regions
- *  2. Enables Sv39 paging
+ *  2. Enables Sv48 paging if MEMORY_SV48 is set and the hart supports it, Sv39 otherwise
  *  3. Initializes the heap memory manager
  *  4. Puts free pages on the free pages list
  *  5. Allows S mode access of U mode memory
@@ -144,13 +237,12 @@ void memory_init(void) {
     const void * const rodata_start = _kimg_rodata_start;
     const void * const rodata_end = _kimg_rodata_end;
     const void * const data_start = _kimg_data_start;
-    union linked_page * page;
+    void * pool_start;
     void * heap_start;
     void * heap_end;
     size_t page_cnt;
     uintptr_t pma;
     const void * pp;
-    int i;
 
     trace("%s()", __func__);
 
@@ -212,14 +304,40 @@ void memory_init(void) {
     }
 
     // Enable paging. This part always makes me nervous.
+    //
+    // With Sv48 the kernel mapping above hangs off the first entry of an extra
+    // root table. A hart that does not implement Sv48 ignores the satp write
+    // entirely, so reading the mode back tells us whether it took. The root
+    // entry is not global because the main space may also hold user mappings.
+
+#if MEMORY_SV48
+    main_pt3[VPN3(0UL)] = ptab_pte(main_pt2, 0);
+    main_mtag =  // Sv48
+        ((uintptr_t)RISCV_SATP_MODE_Sv48 << RISCV_SATP_MODE_shift) |
+        pageptr_to_pagenum(main_pt3);
 
-    main_mtag =  // Sv39
-        ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
-        pageptr_to_pagenum(main_pt2);
-    
     csrw_satp(main_mtag);
+    if ((csrr_satp() >> RISCV_SATP_MODE_shift) == RISCV_SATP_MODE_Sv48) {
+        satp_mode = RISCV_SATP_MODE_Sv48;
+        memory_pt_levels = 4;
+        memory_user_end = USER_END_VMA_SV48;
+    }
+#endif
+
+    if (satp_mode == RISCV_SATP_MODE_Sv39) {
+        main_mtag =  // Sv39
+            ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
+            pageptr_to_pagenum(main_pt2);
+        
+        csrw_satp(main_mtag);
+    }
+
     sfence_vma();
 
+    kprintf("        Paging: Sv%d, user space [%p,%p)\n",
+        9 * memory_pt_levels + 12,
+        (void*)USER_START_VMA, (void*)memory_user_end);
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -241,25 +359,37 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    free_list = heap_end; // heap_end is page aligned
-    page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
+    // The page frame descriptors and the per-megarange free counts take the
+    // first pages after the heap (heap_end is page aligned).
+
+    frametab = heap_end;
+    mega_free_cnt = (uint16_t *)(frametab + FRAME_CNT);
+    pool_start = round_up_ptr(mega_free_cnt + MEGA_CNT, PAGE_SIZE);
+
+    if (RAM_END <= pool_start)
+        panic("Not enough memory");
+
+    memset(frametab, 0, pool_start - heap_end);
+    pool_mega_start = round_up_size(pool_start - RAM_START, MEGA_SIZE) / MEGA_SIZE;
+
+    page_cnt = (RAM_END - pool_start) / PAGE_SIZE;
 
     kprintf("Page allocator: [%p,%p): %lu pages free\n",
-        free_list, RAM_END, page_cnt);
+        pool_start, RAM_END, page_cnt);
 
-    // Put free pages on the free page list
-    for(i = 0; i < page_cnt; i++){
-        // calculate where the current free page is
-        page = (union linked_page *)((uintptr_t)free_list + i * PAGE_SIZE);
+    // Put free pages on the free page list, lowest address first. Pages
+    // handed over by kexec stay out.
 
-        // if there is room for a next page, set the next page to the next chunk of memory
-        if(i != (page_cnt - 1))
-            page->next = (union linked_page *)((uintptr_t)page + PAGE_SIZE);
-        // otherwise, the next page should be NULL
-        else
-            page->next = NULL;
+    if (kexec_handoff_len != 0) {
+        kprintf(" Kexec handoff: [%p,%p)\n", (void*)kexec_handoff_pa,
+            (void*)(kexec_handoff_pa + kexec_handoff_len));
+    }
+
+    for (pp = pool_start; pp < RAM_END; pp += PAGE_SIZE) {
+        if ((uintptr_t)pp - kexec_handoff_pa < kexec_handoff_len)
+            continue;
+        free_list_insert((void*)pp, 1);
     }
-    
 
 
     // Allow supervisor to access user memory. We could be more precise by only
@@ -271,42 +401,19 @@ void memory_init(void) {
     memory_initialized = 1;
 }
 
+/*
+ * Inputs:
+ *  uint_fast16_t asid: the ASID for the satp register
+ * Outputs: the new mtag
+ * Description:
+ *  1. Allocates a new root page table sharing the global kernel mappings
+ *  2. Switches to the new memory space
+ * Effects: Changes satp csr register
+*/
 uintptr_t memory_space_create(uint_fast16_t asid){
     uintptr_t new_mtag;
-    struct pte * new_pt0; 
-    struct pte * new_pt1; 
-    struct pte * new_pt2;
-
-    // shallow copy kernel memory
-    // since this memory is global, we can use the main global variables
-    // MMIO
-    new_pt2 = main_pt2;
-    new_pt2->flags = main_pt2->flags;
-    new_pt2->rsw = main_pt2->rsw;
-    new_pt2->ppn = main_pt2->ppn;
-    new_pt2->reserved = main_pt2->reserved;
-    new_pt2->pbmt = main_pt2->pbmt;
-    new_pt2->n = main_pt2->n;
-    
-    // RAM
-    new_pt1 = main_pt1_0x80000;
-    new_pt1->flags = main_pt1_0x80000->flags;
-    new_pt1->rsw = main_pt1_0x80000->rsw;
-    new_pt1->ppn = main_pt1_0x80000->ppn;
-    new_pt1->reserved = main_pt1_0x80000->reserved;
-    new_pt1->pbmt = main_pt1_0x80000->pbmt;
-    new_pt1->n = main_pt1_0x80000->n;
-
-    new_pt0 = main_pt0_0x80000;
-    new_pt0->flags = main_pt0_0x80000->flags;
-    new_pt0->rsw = main_pt0_0x80000->rsw;
-    new_pt0->ppn = main_pt0_0x80000->ppn;
-    new_pt0->reserved = main_pt0_0x80000->reserved;
-    new_pt0->pbmt = main_pt0_0x80000->pbmt;
-    new_pt0->n = main_pt0_0x80000->n;
-
-    // set up the new mtag with the asid provided
-    new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | ((uint64_t)asid << ASID_SHIFT) | pageptr_to_pagenum(new_pt2);
+
+    new_mtag = root_to_mtag(new_space_root(), asid);
 
     csrw_satp(new_mtag);
     sfence_vma();
@@ -319,72 +426,23 @@ uintptr_t memory_space_create(uint_fast16_t asid){
  *  uint_fast16_t asid: the ASID for the satp register
  * Outputs: the new mtag
  * Description:
- *  1. Shallow copies global memory
- *  2. Sets up a new mtag
- *  3. Deep copies all mapped user pages
+ *  1. Allocates a new root page table
+ *  2. Shallow copies global memory and deep copies all mapped user pages
+ *  3. Sets up a new mtag
  * Effects: None
 */
 uintptr_t memory_space_clone(uint_fast16_t asid){
+    struct pte * new_root;
 
-    uintptr_t new_mtag;
-    struct pte * new_pt2;
-    struct pte * entry;
-    struct pte * new_entry;
-    void * pma;
-    void * pp;
-    uint64_t i;
+    // The copy walks only valid entries, so an almost empty 256 GB (or
+    // 128 TB) user range costs a handful of page table scans. Global entries
+    // are the shared kernel mappings and are copied as-is.
 
-    // shallow copy kernel memory
-    // since this memory is global, we can use the main global variables
-    // MMIO
+    new_root = memory_alloc_page();
+    memset(new_root, 0, PAGE_SIZE);
+    clone_user_level(active_space_root(), new_root, memory_pt_levels - 1);
 
-    new_pt2 = (struct pte*) memory_alloc_page();
-    for (uintptr_t pma = 0; pma < RAM_START_PMA; pma += GIGA_SIZE)
-        // new_pt2[VPN2(pma)] = leaf_pte((void*)pma, PTE_R | PTE_W | PTE_G);
-        new_pt2[VPN2(pma)] = main_pt2[VPN2(pma)];
-    
-    // Third gigarange has a second-level page table
-    new_pt2[VPN2(RAM_START_PMA)] = ptab_pte(main_pt1_0x80000, PTE_G);
-    
-    new_pt2->flags = main_pt2->flags;
-    new_pt2->rsw = main_pt2->rsw;
-    new_pt2->ppn = main_pt2->ppn;
-    new_pt2->reserved = main_pt2->reserved;
-    new_pt2->pbmt = main_pt2->pbmt;
-    new_pt2->n = main_pt2->n;
-
-    // set up the new mtag with the asid provided
-     new_mtag =  // Sv39
-         ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
-         pageptr_to_pagenum(new_pt2);
-
-     debug("new_mtag: %lu", new_mtag);
-     debug("main_mtag: %lu", main_mtag);
-
-    // deep copy mapped user memory
-    for(i = USER_START_VMA; i < USER_END_VMA; i+=PAGE_SIZE){
-        // find the PTE for the mapped page
-        entry = walk_pt(active_space_root(), i, 0);
-        // if the page is not mapped, keep looking for mapped pages
-        // if the page is not valid, keep looking for valid mapped pages
-        if(entry == 0 || !(entry[VPN0(i)].flags & PTE_V))
-            continue;
-        if ((entry[VPN0(i)].flags & PTE_U)) {
-             debug("user flag checked, creating page @ vma = %x, with flag=%p", i, entry[VPN0(i)].flags);
-            // find the physical memory address of the mapped page
-            pma = pagenum_to_pageptr(entry[VPN0(i)].ppn);
-            // allocate a new page
-            pp = memory_alloc_page();
-            // debug("user allocd page @ %x", pp);
-            // copy the memory from the original page to the new page
-            memcpy(pp, pma, PAGE_SIZE);
-            // map the new page with the same flags
-            new_entry = walk_pt(mtag_to_root(new_mtag), i, 1);
-            new_entry[VPN0(i)].flags = entry[VPN0(i)].flags;
-            new_entry[VPN0(i)].ppn = pageptr_to_pagenum(pp);
-        }
-    }
-    return new_mtag;
+    return root_to_mtag(new_root, asid);
 }
 
 
@@ -395,9 +453,12 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
  *  1. Waits for all preceeding updates to active page table to complete
  *  2. Frees all user memory from active user space
  *  3. Switches the memory space to the main memory space
+ *  4. Frees the root page table of the reclaimed space
  * Effects: Changes satp csr register
 */
 void memory_space_reclaim(void){
+    struct pte * root;
+
     // sfence_vma ensures preceeding updates to the page table have completed
     sfence_vma();
 
@@ -405,29 +466,40 @@ void memory_space_reclaim(void){
     memory_unmap_and_free_user();
 
     // switch active memory space to main memory space
-    memory_space_switch(main_mtag);
+    root = mtag_to_root(memory_space_switch(main_mtag));
+    sfence_vma();
 
+    // the main space's tables are statically allocated
+    if (root == mtag_to_root(main_mtag))
+        return;
 
+    if (memory_pt_levels == 4)
+        memory_free_page(pagenum_to_pageptr(root[VPN3(0UL)].ppn));
+    memory_free_page(root);
 }
 
 /*
  * Inputs: None
  * Outputs: a void pointer to the page
- * Description: Checks if there are any free pages and panics if there are none. Otherwise, it will return the
- *  first available free page and replaces the beginning of the list with the next free page.
+ * Description: Checks if there are any free pages and tries to reclaim some if there are none. Otherwise, it
+ *  will return the first available free page and removes it from the list.
  * Effects: 
  *  1. May cause a panic if the request is not satisfiable
  *  2. Changes the free_list
+ *  3. May unmap clean file-backed user pages
 */
 void * memory_alloc_page(void){
     union linked_page * page;
 
+    // try to get pages back from file-backed mappings first
+    if(free_list == NULL)
+        memory_reclaim(MEMORY_RECLAIM_BATCH);
     // panics if there are no free pages available
     if(free_list == NULL)
         panic("No free pages available");
-    // replace head of the free_list
+    // take the head of the free_list
     page = free_list;
-    free_list = free_list -> next;
+    free_list_remove(page);
     // return a pointer to the allocated page
     return (void *)page;    
 
@@ -439,20 +511,198 @@ void * memory_alloc_page(void){
  * Outputs: None
  * Description: Ensure that the page was previously allocated by memory_alloc_page. If it was,
  *  return the page to the free_list. This function requires that the page was previously allocated
- *  using memory_alloc_page.
- * Effects: Changes the head of the free_list
+ *  using memory_alloc_page. A page whose megarange is at least half free goes to the tail of the
+ *  list, where it is taken last, so that the megarange has a chance to become free as a whole.
+ * Effects: Changes the free_list
 */
 void memory_free_page(void * pp){
-    union linked_page * page;
+    struct page_frame * const frame = pageptr_to_frame(pp);
+    const size_t idx = pageptr_to_megaidx(pp);
 
-    // cast pp as a linked_page
-    page = (union linked_page *)pp;
+    // A pinned page is freed only when both its driver and the user space
+    // mapping it are done with it; mapcount tells whether it is still mapped.
+
+    if (frame->flags & PGF_PINNED) {
+        frame->mapcount = 0;
+        if (!(frame->flags & PGF_ORPHAN))
+            return;
+        frame->flags = 0;
+    }
 
     // add page back to the free_list
-    page->next = free_list;
-    free_list = page;
-    
-    
+    free_list_insert(pp, PTE_CNT / 2 <= mega_free_cnt[idx]);
+}
+
+/*
+ * Inputs: None
+ * Outputs: pointer to a zeroed page, or NULL if no page is free
+ * Description: Allocates a page for a driver that maps it into a user space
+ *  and lets a device access it (see vioblk.h). The page is never migrated by
+ *  compaction, and freeing it through a user mapping (munmap, exit) leaves it
+ *  allocated, so the device cannot write into a page that has been reused.
+ * Effects: Changes the free_list
+*/
+void * memory_alloc_pinned(void){
+    void * const pp = memory_alloc_page();
+
+    if (pp == NULL)
+        return NULL;
+
+    memset(pp, 0, PAGE_SIZE);
+    pageptr_to_frame(pp)->flags = PGF_PINNED;
+    return pp;
+}
+
+/*
+ * Inputs:
+ *  void * pp: page returned by memory_alloc_pinned
+ * Outputs: None
+ * Description: Releases a pinned page on behalf of its driver; the device
+ *  must no longer access it. If the page is still mapped in a user space, it
+ *  is freed when that mapping goes away, otherwise now.
+ * Effects: Changes the free_list
+*/
+void memory_free_pinned(void * pp){
+    struct page_frame * const frame = pageptr_to_frame(pp);
+
+    frame->flags |= PGF_ORPHAN;
+    if (frame->mapcount == 0)
+        memory_free_page(pp);
+}
+
+/*
+ * Inputs:
+ *  uintptr_t pma: physical address of the device memory
+ *  size_t size: size of the device memory in bytes
+ * Outputs: kernel address of the device memory, or NULL
+ * Description: Maps device memory (see viopmem.c) into the kernel part of
+ *  every memory space. Memory below RAM is already mapped one to one. Other
+ *  memory is mapped in megapages after the end of RAM, in the rest of the
+ *  gigarange main_pt1_0x80000 covers: a one to one mapping of memory above
+ *  RAM would land in the user range. Returns NULL if pma is not megapage
+ *  aligned or the gigarange is full.
+ * Effects: Changes main_pt1_0x80000, which all memory spaces share
+*/
+void * memory_map_device(uintptr_t pma, size_t size){
+    uintptr_t vma;
+    size_t off;
+
+    trace("%s(pma=%p,size=%zu)", __func__, (void*)pma, size);
+
+    if (pma + size <= RAM_START_PMA)
+        return (void*)pma;
+
+    if (!aligned_addr(pma, MEGA_SIZE) || size == 0)
+        return NULL;
+
+    if (devmap_next == 0)
+        devmap_next = round_up_addr(RAM_END_PMA, MEGA_SIZE);
+
+    size = round_up_size(size, MEGA_SIZE);
+    if (RAM_START_PMA + GIGA_SIZE - devmap_next < size)
+        return NULL;
+
+    vma = devmap_next;
+    for (off = 0; off < size; off += MEGA_SIZE) {
+        main_pt1_0x80000[VPN1(vma + off)] =
+            leaf_pte((void*)(pma + off), PTE_R | PTE_W | PTE_G);
+    }
+
+    devmap_next += size;
+    sfence_vma();
+    return (void*)vma;
+}
+
+/*
+ * Inputs: None
+ * Outputs: pointer to a megapage-aligned run of PTE_CNT pages, or NULL
+ * Description: Takes the pages of the first megarange of RAM that is entirely
+ *  free off the free list. Does not compact; see memory_compact.
+ * Effects: Changes the free_list
+*/
+void * memory_alloc_mega(void){
+    size_t idx;
+    void * pp;
+    int i;
+
+    for (idx = pool_mega_start; idx < MEGA_CNT; idx++) {
+        if (mega_free_cnt[idx] == PTE_CNT)
+            break;
+    }
+
+    if (idx == MEGA_CNT)
+        return NULL;
+
+    pp = RAM_START + idx * MEGA_SIZE;
+    for (i = 0; i < PTE_CNT; i++)
+        free_list_remove(pp + i * PAGE_SIZE);
+
+    return pp;
+}
+
+/*
+ * Inputs:
+ *  void * pp: megapage returned by memory_alloc_mega
+ * Outputs: None
+ * Description: Returns the pages of a megapage to the free list.
+ * Effects: Changes the free_list
+*/
+void memory_free_mega(void * pp){
+    int i;
+
+    for (i = 0; i < PTE_CNT; i++)
+        free_list_insert(pp + i * PAGE_SIZE, 1);
+}
+
+/*
+ * Inputs:
+ *  size_t want: number of free megaranges wanted
+ * Outputs: number of free megaranges
+ * Description: Runs compaction passes until want megaranges of RAM are free
+ *  or a pass fails. Each pass picks the megarange that can be freed by moving
+ *  the fewest pages, i.e. one holding only free and movable (mapped user)
+ *  pages, and migrates its user pages elsewhere through their reverse
+ *  mappings.
+ * Effects: Moves user pages of any memory space
+*/
+size_t memory_compact(size_t want){
+    size_t cnt;
+
+    while ((cnt = count_free_megas()) < want) {
+        if (!compact_one())
+            break;
+    }
+
+    return cnt;
+}
+
+/*
+ * Inputs:
+ *  struct compact_stats * stats: filled in
+ * Outputs: None
+ * Description: Reports compaction and megapage allocation counters, and the
+ *  current number of free megaranges.
+ * Effects: None
+*/
+void memory_compact_stats(struct compact_stats * stats){
+    *stats = compact_stats;
+    stats->mega_free = count_free_megas();
+    stats->mega_total = MEGA_CNT - pool_mega_start;
+}
+
+/*
+ * Inputs: None
+ * Outputs: None
+ * Description: Starts the kcompactd task. Every MEMORY_COMPACT_MS it
+ *  compacts until MEMORY_COMPACT_WMARK megaranges are free, so that huge page
+ *  faults seldom have to compact directly. It runs on the task executor
+ *  rather than on a thread of its own, since it is asleep nearly always.
+ * Effects: Moves user pages of any memory space
+*/
+void memory_compactd_start(void){
+    alarm_init(&compactd_alarm, "kcompactd");
+    task_init(&compactd_task, "kcompactd", &compactd_sleep, NULL);
+    task_start(&compactd_task);
 }
 
 /*
@@ -485,6 +735,8 @@ void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
     // set flags
     pt0[VPN0(vma)].ppn = ppn;
     pt0[VPN0(vma)].flags |= PTE_V | rwxug_flags | PTE_A | PTE_D;
+    if (rwxug_flags & PTE_U)
+        frame_map(page, &pt0[VPN0(vma)]);
 
     // map physical page number to physical memory address
     pma = (uintptr_t)page | (vma & 0xFFF);
@@ -555,18 +807,25 @@ void memory_set_page_flags (const void * vp, uint_fast8_t rwxug_flags){
  * Description:
  *  1. Checks if size is page aligned
  *  2. Sets the flags for each page in the range
+ *  3. Flushes the TLB once for the whole range
  * Effects: May panic if size is unaligned
 */
 void memory_set_range_flags (const void * vp, size_t size, uint_fast8_t rwxug_flags){
+    uintptr_t vma;
+    struct pte * pt0;
     int i;
 
     // check if size is aligned
     if((size % PAGE_SIZE) != 0)
         panic("Cannot set flags on range of unaligned size");
-    // call memory_set_page_flags for all in the range
+    // set the flags of each page table entry in the range, as
+    // memory_set_page_flags does, but without a flush per page
     for(i = 0; i < size; i += PAGE_SIZE){
-        memory_set_page_flags(vp + i, rwxug_flags);
+        vma = (uintptr_t)vp + i;
+        pt0 = walk_pt(active_space_root(), vma, 0);
+        pt0[VPN0(vma)].flags = rwxug_flags | PTE_V | PTE_A | PTE_D;
     }
+    sfence_vma();
 }
 
 /*
@@ -583,6 +842,7 @@ void memory_unmap_and_free_user(void){
     root = active_space_root();
     // free all user pages
     walk_and_free_user(root);
+    sfence_vma();
 }
 
 /*
@@ -700,178 +960,959 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
 
 /*
  * Inputs:
- *  const void * vptr: pointer to the page that caused the fault
+ *  const void * vptr: faulting virtual address
+ *  uint_fast8_t access: PTE_R, PTE_W or PTE_X for a load, store or fetch
  * Outputs: None
- * Description: Allocates and maps a RW page at the faulting page number
- * Effects: May panic if the requested page is out of user bounds
+ * Description:
+ *  1. Looks up the region of the current process containing the address
+ *  2. Terminates the process if there is none or it does not allow the access
+ *  3. If the page is mapped already, sets its A bit (and D bit for a store),
+ *     for harts that fault on a clear A or D bit instead of setting it
+ *  4. In a range registered with a userfaultfd, reports the fault through it
+ *     and waits until the handler has installed the page
+ *  5. In an anonymous VMA_HUGEPAGE region, tries to map a whole megapage
+ *  6. Otherwise allocates a page, fills it from the region's backing object
+ *     and maps it with the region's permissions
+ * Effects: May call process_exit; may block
 */
-void memory_handle_page_fault(const void * vptr){
-    
-    // make sure the pointer is aligned
-    uintptr_t aligned_vptr = (uintptr_t)vptr & ~(PAGE_SIZE - 1);
+void memory_handle_page_fault(const void * vptr, uint_fast8_t access){
+    const uintptr_t vma = round_down_addr((uintptr_t)vptr, PAGE_SIZE);
+    const uint_fast8_t ad_flags = PTE_A | ((access == PTE_W) ? PTE_D : 0);
+    struct process * const proc = current_process();
+    struct pte * const root = active_space_root();
+    struct uffd * uf;
+    struct pte * pte;
+    struct pte * pt0;
+    struct vma * v;
+    void * pp;
+
+    debug("handle page fault @ %p, access=%x", vptr, access);
+
+    v = (proc != NULL) ? vma_find(&proc->vmas, vma) : NULL;
+
+    if (v == NULL || (v->prot & access) != access) {
+        kprintf("Thread <%s:%d>: %s fault at %p\n",
+            thread_name(running_thread()), running_thread(),
+            (v == NULL) ? "segmentation" : "protection", vptr);
+        process_exit();
+    }
+
+    // Another path may have mapped the page already (e.g. the kernel touched
+    // it on the process's behalf), or the page is mapped with A clear (idle
+    // tracking, speculative population) or D clear and the hart leaves
+    // updating them to software.
+
+    pte = walk_leaf(root, vma);
+
+    // Missing pages in a userfaultfd range come from its handler. If the
+    // object is closed meanwhile, proc->uffd is cleared and the fault is
+    // handled below instead.
+
+    uf = proc->uffd;
+    if (pte == NULL && uf != NULL && uffd_registered(uf, vma)) {
+        uffd_notify(uf, vma, access);
+        while (proc->uffd == uf && (pte = walk_leaf(root, vma)) == NULL)
+            uffd_wait(uf);
+    }
+
+    if (pte != NULL) {
+        pte->flags |= ad_flags;
+        sfence_vma();
+        return;
+    }
+
+    if ((v->flags & VMA_HUGEPAGE) && map_megapage(root, v, vma, ad_flags)) {
+        sfence_vma();
+        return;
+    }
+
+    pt0 = walk_pt(root, vma, 1);
+    if (pt0 == 0)
+        panic("Walk unable to create valid page");
 
-    // panic if the requested page is out of user bounds
-    if ((uintptr_t)aligned_vptr < USER_START_VMA || (uintptr_t)aligned_vptr + PAGE_SIZE > USER_END_VMA) {
-        panic("Out of USER bound");
+    pp = memory_alloc_page();
+    if (fill_user_page(v, vma, pp) < 0) {
+        memory_free_page(pp);
+        kprintf("Thread <%s:%d>: I/O error paging in %p\n",
+            thread_name(running_thread()), running_thread(), (void*)vma);
+        process_exit();
     }
 
-    // allocate and map RW page at the faulting page number
-    debug("handle page fault @ %p, aligned vptr=%p", vptr, aligned_vptr);
-    vptr = memory_alloc_and_map_page((uintptr_t)aligned_vptr, (PTE_R | PTE_W | PTE_U));
+    pt0[VPN0(vma)] = user_pte(pp, v->prot, ad_flags);
+    frame_map(pp, &pt0[VPN0(vma)]);
+
+    if (v->flags & VMA_IMAGE)
+        wset_note_fault(proc, vma);
+
+    // Readahead, drop-behind and huge page population per the region's advice
+    fault_around(root, v, vma);
+
     sfence_vma();
 }
 
-// HELPER FUNCTIONS
-//
+/*
+ * Inputs:
+ *  uintptr_t vma: page-aligned start of the range
+ *  size_t size: page-aligned size of the range
+ * Outputs: None
+ * Description: Unmaps and frees every user page mapped in the range. Leaf
+ *  tables that are absent are skipped a whole megarange at a time.
+ * Effects: Frees pages
+*/
+void memory_unmap_and_free_range(uintptr_t vma, size_t size){
+    unmap_range(active_space_root(), vma, vma + size, SIZE_MAX, 0);
+    sfence_vma();
+}
 
 /*
  * Inputs:
- *  struct pte * root: pointer to active root page table
- *  uintptr_t vma: virtual memory address
- *  int create: whether to create a page table or not
- * Outputs: pointer to the page table entry that represents the 4kB page containing vma
- * Description:
- *  1. Starts at the root (Level 2 of page table)
- *  2. Find level 1 of page table from the root. Check if it is valid, if not, allocs it depending on create.
- *  The alloced page will have V, A, and D flags set to 1.
- *  3. Find level 0 of page table from level 1. Check if it is valid, if not, allocs it depending on create.
- *  The alloced page will have V, A, and D flags set to 1.
- * Effects: May create new pages
+ *  uintptr_t vma: requested address (a hint unless MAP_FIXED is given)
+ *  size_t size: length of the mapping
+ *  uint_fast8_t rwx_flags: OR of PTE_R, PTE_W, PTE_X
+ *  int flags: OR of MAP_* flags
+ *  struct io_intf * io: backing file, NULL for MAP_ANON
+ *  uint64_t offset: page-aligned file offset
+ * Outputs: start of the new mapping, or a negative error code
+ * Description: Adds a region to the current process. No pages are allocated;
+ *  they are filled in by the page fault handler on first touch. A MAP_FIXED
+ *  request replaces any mappings in the range.
+ * Effects: Changes the region tree of the current process
 */
-struct pte * walk_pt(struct pte * root, uintptr_t vma, int create) {
-    struct pte *pte2 = &root[VPN2(vma)];
-    struct pte *pt1, *pt0;
-
-    // if the page is valid, change it to a page table pointer
-    if(pte2->flags & PTE_V)
-        pt1 = pagenum_to_pageptr(pte2->ppn);
-    // if it is not valid, decide what to do based on create
-    else{
-        // if create is set to 0, it is not a valid page and we return
-        if(!create){
-            debug("Level 1 of Page Table was not valid and create was not 1.");
-            return 0;
-        }
-        // if create is 1, allocate a new page table page and put its physical address in PTE
-        // mark that it is a valid page
-        pt1 = memory_alloc_page();
-        // set the PTE in level 2 to point to the new level 1 page table
-        pte2->ppn = pageptr_to_pagenum(pt1);
-        pte2->flags = PTE_V;
-    }
-
-    // get the PTE for VPN[1]
-    struct pte *pte1 = &pt1[VPN1(vma)];
-    // if the page is valid, change it to a page table pointer
-    if(pte1->flags & PTE_V) {
-        pt0 = pagenum_to_pageptr(pte1->ppn);
-    // if it is not valid, decide what to do based on create
-    }else{
-        // if create is set to 0, it is not a valid page and we return
-        if(!create){
-            // debug("Level 0 of Page Table was not valid and create was not 1. %x", vma);
-            return 0;
-        }
-        // if create is 1, allocate a new page table page and put its physical address in PTE
-        // mark that it is a valid page
-        pt0 = memory_alloc_page();
-        pte1->ppn = pageptr_to_pagenum(pt0);
-        pte1->flags = PTE_V;
+long memory_mmap (
+    uintptr_t vma, size_t size, uint_fast8_t rwx_flags, int flags,
+    struct io_intf * io, uint64_t offset)
+{
+    struct process * const proc = current_process();
+    struct vma tmpl;
+    uint64_t filelen;
+    int result;
+
+    if (size == 0 || !aligned_addr(vma, PAGE_SIZE) ||
+        !aligned_size(offset, PAGE_SIZE))
+        return -EINVAL;
+    
+    if (flags & MAP_SHARED)
+        return -ENOTSUP;
+    
+    size = round_up_size(size, PAGE_SIZE);
+
+    if (flags & MAP_FIXED) {
+        if (vma < USER_START_VMA || memory_user_end < vma ||
+            memory_user_end - vma < size)
+            return -EINVAL;
+        result = memory_munmap(vma, size);
+        if (result < 0)
+            return result;
+    } else {
+        if (vma < USER_MMAP_VMA || memory_user_end <= vma)
+            vma = USER_MMAP_VMA;
+        vma = vma_find_free(&proc->vmas, vma, memory_user_end, size);
+        if (vma == 0)
+            vma = vma_find_free(&proc->vmas,
+                USER_MMAP_VMA, memory_user_end, size);
+        if (vma == 0)
+            return -ENOMEM;
+    }
+
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.start = vma;
+    tmpl.end = vma + size;
+    tmpl.prot = rwx_flags & (PTE_R | PTE_W | PTE_X);
+    tmpl.backing = VMA_ANON;
+
+    if (!(flags & MAP_ANON)) {
+        if (io == NULL)
+            return -EBADFD;
+        
+        result = ioctl(io, IOCTL_GETLEN, &filelen);
+        if (result < 0)
+            return result;
+
+        tmpl.backing = VMA_FILE;
+        tmpl.io = io;
+        tmpl.offset = offset;
+        tmpl.filesz = (offset < filelen) ? MIN(filelen - offset, size) : 0;
     }
 
-    return pt0;
+    if (vma_insert(&proc->vmas, &tmpl, &result) == NULL)
+        return result;
+
+    return vma;
 }
 
 /*
  * Inputs:
- *  struct pte * root: pointer to active root page table
- * Outputs: None
+ *  uintptr_t vma: page-aligned start of the range
+ *  size_t size: length of the range
+ *  int advice: one of the MADV_* values
+ * Outputs: 0 on success, negative error code on failure
  * Description:
- *  1. Starts at the root
- *  2. For each page in the root, check if it is a user page and a leaf page
- *  3. If it is a user page, free that page
- * Effects: Frees all user pages
+ *  1. Checks that the range is completely covered by regions
+ *  2. For advice that is remembered (NORMAL, RANDOM, SEQUENTIAL, HUGEPAGE and
+ *     NOHUGEPAGE), splits regions at the range boundaries, updates them and
+ *     merges them back with compatible neighbours
+ *  3. WILLNEED populates the range now, DONTNEED frees its pages now
+ * Effects: Changes the region tree of the current process; may allocate or
+ *  free pages
 */
-void walk_and_free_user(struct pte * root){
-    int i;
-    uint64_t page_num;
-    uint64_t page_flags;
-    //struct pte * page;
-    uintptr_t lower_page;
-
-    for(i = 0; i < PTE_PER_LEVEL; i++){
-        //page = root[i];
-        page_num = root[i].ppn;
-        page_flags = root[i].flags;
-        // check if page is for the user
-        if(page_flags & PTE_U){
-            // check if entry is not a leaf and recurse
-            if((page_flags & PTE_V) && (page_flags & (PTE_R | PTE_W | PTE_X)) == 0){
-                lower_page = (uintptr_t)pagenum_to_pageptr(page_num);
-                walk_and_free_user((struct pte*)lower_page);
-            }
-            // free page by its page ptr
-            memory_free_page((void*)pagenum_to_pageptr(page_num));
-        }
+int memory_madvise(uintptr_t vma, size_t size, int advice){
+    struct process * const proc = current_process();
+    struct pte * const root = active_space_root();
+    const uintptr_t start = vma;
+    uintptr_t end;
+    struct vma * next;
+    struct vma * v;
+
+    if (!aligned_addr(vma, PAGE_SIZE) || vma < USER_START_VMA ||
+        memory_user_end < vma)
+        return -EINVAL;
+    
+    size = round_up_size(size, PAGE_SIZE);
+    if (memory_user_end - vma < size)
+        return -EINVAL;
+    if (size == 0)
+        return 0;
+    end = vma + size;
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+    case MADV_HUGEPAGE:
+    case MADV_NOHUGEPAGE:
+        break;
+    default:
+        return -EINVAL;
     }
-}
-// INTERNAL FUNCTION DEFINITIONS
-//
 
-static inline int wellformed_vma(uintptr_t vma) {
-    // Address bits 63:38 must be all 0 or all 1
-    uintptr_t const bits = (intptr_t)vma >> 38;
-    return (!bits || !(bits+1));
-}
+    // The whole range must be mapped
 
-static inline int wellformed_vptr(const void * vp) {
-    return wellformed_vma((uintptr_t)vp);
-}
+    v = vma_find(&proc->vmas, start);
+    if (v == NULL)
+        return -ENOMEM;
 
-static inline int aligned_addr(uintptr_t vma, size_t blksz) {
-    return ((vma % blksz) == 0);
-}
+    while (v->end < end) {
+        next = vma_next(&proc->vmas, v);
+        if (next == NULL || next->start != v->end)
+            return -ENOMEM;
+        v = next;
+    }
 
-static inline int aligned_ptr(const void * p, size_t blksz) {
-    return (aligned_addr((uintptr_t)p, blksz));
-}
+    for (v = vma_find(&proc->vmas, start); v != NULL && v->start < end; v = next) {
+        switch (advice) {
+        case MADV_WILLNEED:
+            populate_range(root, v, MAX(v->start, start), MIN(v->end, end));
+            next = vma_next(&proc->vmas, v);
+            continue;
+        case MADV_DONTNEED:
+            unmap_range(root, MAX(v->start, start), MIN(v->end, end),
+                SIZE_MAX, 0);
+            next = vma_next(&proc->vmas, v);
+            continue;
+        default:
+            break;
+        }
 
-static inline int aligned_size(size_t size, size_t blksz) {
-    return ((size % blksz) == 0);
-}
+        // Remembered advice applies to whole regions, so carve out the part
+        // of v inside the range
 
-static inline uintptr_t active_space_mtag(void) {
-    return csrr_satp();
-}
+        if (v->start < start) {
+            next = vma_split(&proc->vmas, v, start);
+            if (next == NULL)
+                return -ENOMEM;
+            continue;
+        }
 
-static inline struct pte * mtag_to_root(uintptr_t mtag) {
-    return (struct pte *)((mtag << 20) >> 8);
-}
+        if (end < v->end && vma_split(&proc->vmas, v, end) == NULL)
+            return -ENOMEM;
+
+        switch (advice) {
+        case MADV_HUGEPAGE:
+            v->flags |= VMA_HUGEPAGE;
+            break;
+        case MADV_NOHUGEPAGE:
+            v->flags &= ~VMA_HUGEPAGE;
+            break;
+        default:
+            v->advice = advice;
+            break;
+        }
 
+        v = vma_merge(&proc->vmas, v);
+        next = vma_next(&proc->vmas, v);
+    }
 
-static inline struct pte * active_space_root(void) {
-    return mtag_to_root(active_space_mtag());
-}
+    // Merge the region following the range back if it matches again
+    if (v != NULL)
+        vma_merge(&proc->vmas, v);
 
-static inline void * pagenum_to_pageptr(uintptr_t n) {
-    return (void*)(n << PAGE_ORDER);
+    sfence_vma();
+    return 0;
 }
 
-static inline uintptr_t pageptr_to_pagenum(const void * p) {
-    return (uintptr_t)p >> PAGE_ORDER;
-}
+/*
+ * Inputs:
+ *  size_t target: number of pages wanted
+ * Outputs: number of pages freed
+ * Description: Frees user pages that can be read back from their backing
+ *  file: any page of a read-only file region, and pages of a writable one
+ *  whose D bit is clear. The first pass only takes regions advised
+ *  MADV_SEQUENTIAL, whose pages are least likely to be touched again; the
+ *  second pass takes pages whose A bit is clear, i.e. pages populated
+ *  speculatively and never used, or idle since the last PGIDLE_MARK; the
+ *  third pass takes any. Page tables are left in place.
+ * Effects: Frees pages in any process's memory space
+*/
+size_t memory_reclaim(size_t target){
+    struct process * proc;
+    uint_fast8_t skip;
+    struct vma * v;
+    size_t cnt = 0;
+    int pass, pid;
+
+    for (pass = 0; pass < 3 && cnt < target; pass++) {
+        for (pid = 0; pid < NPROC && cnt < target; pid++) {
+            proc = proctab[pid];
+            if (proc == NULL)
+                continue;
+            
+            for (v = vma_find_ge(&proc->vmas, 0); v != NULL && cnt < target;
+                v = vma_next(&proc->vmas, v))
+            {
+                if (v->backing != VMA_FILE ||
+                    (pass == 0 && v->advice != MADV_SEQUENTIAL))
+                    continue;
+                skip = recoverable(v) ? 0 : PTE_D;
+                if (pass == 1)
+                    skip |= PTE_A;
+                cnt += unmap_range(mtag_to_root(proc->mtag),
+                    v->start, v->end, target - cnt, skip);
+            }
+        }
+    }
 
-static inline void * round_up_ptr(void * p, size_t blksz) {
-    return (void*)((uintptr_t)(p + blksz-1) / blksz * blksz);
-}
+    if (cnt != 0)
+        sfence_vma();
 
-static inline uintptr_t round_up_addr(uintptr_t addr, size_t blksz) {
-    return ((addr + blksz-1) / blksz * blksz);
+    debug("%s: reclaimed %zu pages", __func__, cnt);
+    return cnt;
 }
 
-static inline size_t round_up_size(size_t n, size_t blksz) {
-    return (n + blksz-1) / blksz * blksz;
-}
+/*
+ * Inputs:
+ *  struct process * proc: process whose memory space to scan
+ *  int cmd: PGIDLE_MARK or PGIDLE_QUERY
+ *  struct pgidle_info * info: range to scan and results
+ * Outputs: 0 on success, negative error code on failure
+ * Description:
+ *  1. Visits every page mapped in the regions of proc inside the range and
+ *     counts the ones with the A bit set, i.e. accessed since the last MARK
+ *     (or since they were mapped)
+ *  2. QUERY stops there. MARK also clears the A bits and flushes the TLB, so
+ *     that the next access sets them again, and restarts the interval
+ *  Both commands report on the interval that ends with the call.
+ *  info must have been checked by the caller; the bitmap is checked here.
+ * Effects: Writes info and the bitmap; MARK changes PTEs of proc
+*/
+int memory_pgidle(struct process * proc, int cmd, struct pgidle_info * info){
+    const uint64_t now = timer_ticks();
+    uintptr_t start, end;
+    struct vma * v;
+    size_t npages;
+
+    start = info->start;
+    end = (info->end != 0) ? info->end : memory_user_end;
+
+    if (cmd != PGIDLE_MARK && cmd != PGIDLE_QUERY)
+        return -EINVAL;
+    if (!aligned_addr(start, PAGE_SIZE) || !aligned_addr(end, PAGE_SIZE) ||
+        end <= start || memory_user_end < end)
+        return -EINVAL;
+    
+    // A bitmap of the whole address range would be absurdly large
+
+    if (info->bitmap != NULL) {
+        if (info->end == 0)
+            return -EINVAL;
+        npages = (end - start) / PAGE_SIZE;
+        // the bitmap is in the calling process, which need not be proc
+        if (memory_check_range((uintptr_t)info->bitmap,
+            (npages + 63) / 64 * sizeof(uint64_t), PTE_R | PTE_W) < 0)
+            return -EINVAL;
+        memset(info->bitmap, 0, (npages + 63) / 64 * sizeof(uint64_t));
+    }
+
+    info->mapped = 0;
+    info->accessed = 0;
+
+    for (v = vma_find_ge(&proc->vmas, start); v != NULL && v->start < end;
+        v = vma_next(&proc->vmas, v))
+    {
+        idle_scan(mtag_to_root(proc->mtag), MAX(v->start, start),
+            MIN(v->end, end), cmd == PGIDLE_MARK, info);
+    }
+
+    info->idle = info->mapped - info->accessed;
+    info->age = (now - proc->idle_mark) / (TIMER_FREQ / 1000);
+
+    if (cmd == PGIDLE_MARK) {
+        proc->idle_mark = now;
+        sfence_vma();
+    }
+
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  struct process * proc: process to install the pages in
+ *  uintptr_t vma: page-aligned start of the range
+ *  const void * src: data to copy, in the active space; NULL for zero pages
+ *  size_t size: page-aligned length of the range
+ * Outputs: number of bytes installed, or a negative error code
+ * Description: Maps new pages holding the data at src in the range of proc,
+ *  with the permissions of the regions containing them. Stops at the first
+ *  page that is already mapped or outside any region; fails with -EBUSY or
+ *  -EINVAL if that is the first page. Used by userfaultfd handlers, so proc
+ *  is usually not the current process.
+ * Effects: Allocates pages
+*/
+long memory_install(struct process * proc, uintptr_t vma, const void * src, size_t size){
+    struct pte * const root = mtag_to_root(proc->mtag);
+    struct pte * pt0;
+    struct vma * v;
+    size_t done;
+    void * pp;
+    long err;
+
+    for (done = 0; done < size; done += PAGE_SIZE, vma += PAGE_SIZE) {
+        v = vma_find(&proc->vmas, vma);
+        err = -EINVAL;
+        if (v == NULL)
+            break;
+
+        // a megapage covers the address if there is no leaf table
+        pt0 = walk_pt(root, vma, 1);
+        err = -EBUSY;
+        if (pt0 == 0 || (pt0[VPN0(vma)].flags & PTE_V))
+            break;
+
+        pp = memory_alloc_page();
+        if (src != NULL)
+            memcpy(pp, src + done, PAGE_SIZE);
+        else
+            memset(pp, 0, PAGE_SIZE);
+
+        pt0[VPN0(vma)] = user_pte(pp, v->prot, 0);
+        frame_map(pp, &pt0[VPN0(vma)]);
+    }
+
+    sfence_vma();
+    return (done != 0) ? (long)done : err;
+}
+
+/*
+ * Inputs:
+ *  const uintptr_t * pages: page-aligned addresses, sorted
+ *  size_t cnt: number of addresses
+ * Outputs: number of pages mapped
+ * Description: Splits the list into runs of consecutive pages in the same
+ *  region and populates each run with prefetch_run, so that a run of file
+ *  pages costs one seek and one read.
+ * Effects: Allocates pages in the current memory space
+*/
+size_t memory_prefetch(const uintptr_t * pages, size_t cnt){
+    struct process * const proc = current_process();
+    struct pte * const root = active_space_root();
+    size_t total = 0;
+    struct vma * v;
+    size_t i, j;
+
+    for (i = 0; i < cnt; i = j) {
+        j = i + 1;
+
+        v = vma_find(&proc->vmas, pages[i]);
+        if (v == NULL)
+            continue;
+        
+        while (j < cnt && pages[j] == pages[j-1] + PAGE_SIZE &&
+            pages[j] < v->end)
+            j += 1;
+
+        total += prefetch_run(root, v, pages[i], pages[j-1] + PAGE_SIZE);
+    }
+
+    sfence_vma();
+    return total;
+}
+
+/*
+ * Inputs:
+ *  uintptr_t vma: page-aligned start of the range
+ *  size_t cnt: number of pages
+ *  void ** pages: receives the pages, in address order
+ * Outputs: 0 on success, -EINVAL if the range is not readable, -EBUSY if a
+ *  page is pinned, -EIO if a page cannot be faulted in
+ * Description: Moves the pages of a range out of the current process without
+ *  copying them. Mapped pages are unmapped and handed over as they are
+ *  (a megapage is split first); pages that are not mapped yet are faulted in
+ *  first through memory_handle_page_fault, so a range registered with a
+ *  userfaultfd is filled by its handler. The regions stay, so the next touch
+ *  of the range sees fresh pages. On failure the range is left as it was.
+ * Effects: Changes the page tables of the current space; allocates pages;
+ *  may block
+*/
+int memory_take_pages(uintptr_t vma, size_t cnt, void ** pages){
+    struct process * const proc = current_process();
+    struct pte * const root = active_space_root();
+    struct pte * pte;
+    struct pte * pt0;
+    struct vma * v;
+    size_t i;
+
+    if (memory_check_range(vma, cnt * PAGE_SIZE, PTE_R) < 0)
+        return -EINVAL;
+
+    // Pages a device may be writing to cannot change owner
+
+    for (i = 0; i < cnt; i++) {
+        pte = walk_leaf(root, vma + i * PAGE_SIZE);
+        if (pte != NULL &&
+            (pageptr_to_frame(pagenum_to_pageptr(pte->ppn))->flags & PGF_PINNED))
+            return -EBUSY;
+    }
+
+    for (i = 0; i < cnt; i++, vma += PAGE_SIZE) {
+        pte = walk_leaf(root, vma);
+
+        // A fault in a userfaultfd range waits for its handler, which may
+        // fail to install the page
+        if (pte == NULL) {
+            memory_handle_page_fault((const void*)vma, PTE_R);
+            pte = walk_leaf(root, vma);
+        }
+
+        if (pte == NULL) {
+            // Put back what was taken so far
+
+            while (i-- > 0) {
+                vma -= PAGE_SIZE;
+                v = vma_find(&proc->vmas, vma);
+                pt0 = walk_pt(root, vma, 1);
+                pt0[VPN0(vma)] = user_pte(pages[i], v->prot, PTE_A | PTE_D);
+                frame_map(pages[i], &pt0[VPN0(vma)]);
+            }
+
+            sfence_vma();
+            return -EIO;
+        }
+
+        if (walk_pt(root, vma, 0) == 0) {
+            split_megapage(pte);
+            pte = walk_leaf(root, vma);
+        }
+
+        pages[i] = pagenum_to_pageptr(pte->ppn);
+        *pte = null_pte();
+        frame_unmap(pages[i]);
+    }
+
+    sfence_vma();
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  void * const * pages: pages to map, not mapped anywhere
+ *  size_t cnt: number of pages
+ * Outputs: the address at which the pages are mapped, or a negative error
+ *  code
+ * Description: Creates an anonymous read/write region of cnt pages in the
+ *  current process at an address of the kernel's choosing and maps the pages
+ *  there in order. The pages are mapped accessed and dirty, as their contents
+ *  cannot be recreated. On failure the caller keeps the pages.
+ * Effects: Changes the region tree and page tables of the current space
+*/
+long memory_give_pages(void * const * pages, size_t cnt){
+    struct pte * const root = active_space_root();
+    struct pte * pt0;
+    uintptr_t vma;
+    size_t i;
+    long result;
+
+    result = memory_mmap(0, cnt * PAGE_SIZE, PTE_R | PTE_W,
+        MAP_PRIVATE | MAP_ANON, NULL, 0);
+    if (result < 0)
+        return result;
+
+    for (i = 0, vma = result; i < cnt; i++, vma += PAGE_SIZE) {
+        pt0 = walk_pt(root, vma, 1);
+        pt0[VPN0(vma)] = user_pte(pages[i], PTE_R | PTE_W, PTE_A | PTE_D);
+        if (pageptr_to_frame(pages[i])->flags & PGF_PINNED)
+            pageptr_to_frame(pages[i])->mapcount = 1;
+        else
+            frame_map(pages[i], &pt0[VPN0(vma)]);
+    }
+
+    sfence_vma();
+    return result;
+}
+
+/*
+ * Inputs:
+ *  const struct vma * v: region of the current process containing the page
+ *  uintptr_t vma: page-aligned virtual address of the page
+ *  void * buf: page-sized kernel buffer
+ * Outputs: 1 if buf was filled, 0 for an untouched anonymous page, or -EIO
+ * Description: Reads a page of the current process the way a later fault
+ *  would see it. A mapped page (possibly part of a megapage) is copied; a
+ *  missing page within the file data of a file region is read from the file.
+ *  Missing anonymous pages and pages past the file data are zero and are not
+ *  copied, so that callers can leave them out of what they save.
+ * Effects: None
+*/
+int memory_read_page(const struct vma * v, uintptr_t vma, void * buf){
+    struct pte * const root = active_space_root();
+    struct pte * pte;
+    void * pp;
+
+    pte = walk_leaf(root, vma);
+    if (pte != NULL) {
+        pp = pagenum_to_pageptr(pte->ppn);
+        // a leaf above level 0 is a megapage; pick the page inside it
+        if (walk_pt(root, vma, 0) == 0)
+            pp += VPN0(vma) * PAGE_SIZE;
+        memcpy(buf, pp, PAGE_SIZE);
+        return 1;
+    }
+
+    if (v->backing == VMA_FILE && vma - v->start < v->filesz)
+        return (fill_user_page(v, vma, buf) < 0) ? -EIO : 1;
+
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  uintptr_t vma: page-aligned start of the range
+ *  size_t size: length of the range
+ * Outputs: 0 on success, negative error code on failure
+ * Description: Removes the range from the region tree of the current process
+ *  and frees the pages mapped in it. Unmapped parts of the range are ignored.
+ * Effects: Frees pages
+*/
+int memory_munmap(uintptr_t vma, size_t size){
+    struct process * const proc = current_process();
+    int result;
+
+    if (size == 0 || !aligned_addr(vma, PAGE_SIZE) ||
+        vma < USER_START_VMA || memory_user_end < vma)
+        return -EINVAL;
+    
+    size = round_up_size(size, PAGE_SIZE);
+    if (memory_user_end - vma < size)
+        return -EINVAL;
+    
+    result = vma_remove_range(&proc->vmas, vma, vma + size);
+    if (result < 0)
+        return result;
+
+    memory_unmap_and_free_range(vma, size);
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  uintptr_t vma: start of the range
+ *  size_t size: length of the range
+ *  uint_fast8_t rwx_flags: accesses that must be allowed
+ * Outputs: 0 if the range is covered by regions of the current process that
+ *  allow rwx_flags, -EINVAL otherwise
+ * Description: Checks a user buffer against the region tree rather than the
+ *  page tables, so pages that are not populated yet count as valid; touching
+ *  them from the kernel faults them in.
+ * Effects: None
+*/
+int memory_check_range(uintptr_t vma, size_t size, uint_fast8_t rwx_flags){
+    struct process * const proc = current_process();
+    const uintptr_t end = vma + size;
+    struct vma * v;
+
+    if (end < vma || memory_user_end < end)
+        return -EINVAL;
+
+    while (vma < end) {
+        v = vma_find(&proc->vmas, vma);
+        if (v == NULL || (v->prot & rwx_flags) != rwx_flags)
+            return -EINVAL;
+        vma = v->end;
+    }
+
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  uintptr_t vma: start of the range
+ *  size_t size: length of the range
+ *  uint_fast8_t rwx_flags: accesses that must be allowed, PTE_R or PTE_W
+ * Outputs: 0 on success, -EINVAL if the range is not accessible
+ * Description: Faults in every page of a user buffer of the current process
+ *  and pins it, so that a driver can copy to or from the buffer while holding
+ *  a lock without taking a page fault: the fault handler may have to read a
+ *  file, which would take the same lock again. A pinned page is not freed by
+ *  reclaim or drop-behind and not moved by compaction until
+ *  memory_unpin_range. Megapages are never reclaimed or moved, so only 4 KB
+ *  pages are counted.
+ * Effects: May block to fill pages; changes page frames
+*/
+int memory_pin_range(uintptr_t vma, size_t size, uint_fast8_t rwx_flags){
+    const uint_fast8_t access = (rwx_flags & PTE_W) ? PTE_W : PTE_R;
+    const uintptr_t end = vma + size;
+    struct pte * pt0;
+    uintptr_t pg;
+
+    if (size == 0)
+        return 0;
+
+    if (memory_check_range(vma, size, rwx_flags) < 0)
+        return -EINVAL;
+
+    for (pg = round_down_addr(vma, PAGE_SIZE); pg < end; pg += PAGE_SIZE) {
+        // sets A (and D for a store) on a mapped page, fills a missing one;
+        // pages pinned before are safe from what this allocates
+        memory_handle_page_fault((const void*)pg, access);
+
+        pt0 = walk_pt(active_space_root(), pg, 0);
+        if (pt0 != 0 && (pt0[VPN0(pg)].flags & PTE_V))
+            pageptr_to_frame(pagenum_to_pageptr(pt0[VPN0(pg)].ppn))->pincnt += 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  uintptr_t vma: start of the range
+ *  size_t size: length of the range
+ * Outputs: None
+ * Description: Drops the pins memory_pin_range took on the range.
+ * Effects: Changes page frames
+*/
+void memory_unpin_range(uintptr_t vma, size_t size){
+    const uintptr_t end = vma + size;
+    struct page_frame * frame;
+    struct pte * pt0;
+    uintptr_t pg;
+
+    if (size == 0)
+        return;
+
+    for (pg = round_down_addr(vma, PAGE_SIZE); pg < end; pg += PAGE_SIZE) {
+        pt0 = walk_pt(active_space_root(), pg, 0);
+        if (pt0 == 0 || !(pt0[VPN0(pg)].flags & PTE_V))
+            continue;
+        frame = pageptr_to_frame(pagenum_to_pageptr(pt0[VPN0(pg)].ppn));
+        if (frame->pincnt != 0)
+            frame->pincnt -= 1;
+    }
+}
+
+/*
+ * Inputs:
+ *  uintptr_t vma: address in the current process
+ * Outputs: direct-mapped address of the byte at vma, or NULL
+ * Description: Translates an address in a page pinned by memory_pin_range, so
+ *  that a driver can hand the page to a device. Returns NULL if the page is
+ *  not mapped or not pinned, as the page could then move under the device.
+ * Effects: None
+*/
+void * memory_pinned_addr(uintptr_t vma){
+    struct pte * const pt0 = walk_pt(active_space_root(), vma, 0);
+    void * pp;
+
+    if (pt0 == 0 || !(pt0[VPN0(vma)].flags & PTE_V))
+        return NULL;
+
+    pp = pagenum_to_pageptr(pt0[VPN0(vma)].ppn);
+    if (pageptr_to_frame(pp)->pincnt == 0)
+        return NULL;
+
+    return pp + vma % PAGE_SIZE;
+}
+
+// HELPER FUNCTIONS
+//
+
+/*
+ * Inputs:
+ *  struct pte * root: pointer to active root page table
+ *  uintptr_t vma: virtual memory address
+ *  int create: whether to create a page table or not
+ * Outputs: pointer to the page table entry that represents the 4kB page containing vma
+ * Description: Returns the level 0 page table (see walk_level). Returns 0 if a level is missing and
+ *  create is not set, or if the address is covered by a superpage.
+ * Effects: May create new pages
+*/
+struct pte * walk_pt(struct pte * root, uintptr_t vma, int create) {
+    return walk_level(root, vma, 0, create);
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: pointer to active root page table
+ * Outputs: None
+ * Description:
+ *  1. Starts at the root
+ *  2. Recursively visits every valid non-global entry
+ *  3. Frees user leaf pages and the page tables that mapped them
+ * Effects: Frees all user pages
+*/
+void walk_and_free_user(struct pte * root){
+    free_user_level(root, memory_pt_levels - 1);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/*
+ * Inputs:
+ *  struct pte * root: pointer to active root page table
+ *  uintptr_t vma: virtual memory address
+ *  int lvl: level of the table wanted (0 is the leaf level)
+ *  int create: whether to create a page table or not
+ * Outputs: pointer to the page table at level lvl on the path to vma
+ * Description:
+ *  1. Starts at the root (Level 3 for Sv48, Level 2 for Sv39)
+ *  2. At each level above lvl, finds the next level of the page table. Checks if it is valid, if not,
+ *  allocs a zeroed page table depending on create. The new entry has only the V flag set.
+ *  3. Returns the table at level lvl. Returns 0 if a level is missing and create is not set, or if
+ *  the address is covered by a superpage above lvl.
+ * Effects: May create new pages
+*/
+static struct pte * walk_level (
+    struct pte * root, uintptr_t vma, int lvl, int create)
+{
+    struct pte * pt = root;
+    struct pte * pte;
+    int i;
+
+    for (i = memory_pt_levels - 1; i > lvl; i--) {
+        pte = &pt[VPN(vma, i)];
+
+        // if the page is valid, change it to a page table pointer
+        if (pte->flags & PTE_V) {
+            // a leaf above lvl is a superpage; there is no table at lvl
+            if (pte->flags & (PTE_R | PTE_W | PTE_X))
+                return 0;
+            pt = pagenum_to_pageptr(pte->ppn);
+            continue;
+        }
+
+        // if create is set to 0, it is not a valid page and we return
+        if (!create)
+            return 0;
+
+        // if create is 1, allocate a new page table page and put its physical address in PTE
+        // mark that it is a valid page
+        pt = memory_alloc_page();
+        memset(pt, 0, PAGE_SIZE);
+        *pte = ptab_pte(pt, 0);
+    }
+
+    return pt;
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: pointer to active root page table
+ *  uintptr_t vma: virtual memory address
+ * Outputs: pointer to the leaf PTE mapping vma at any level, or NULL
+ * Description: Walks down from the root until it finds a leaf (an entry with
+ *  any of R, W, X set) or an invalid entry.
+ * Effects: None
+*/
+static struct pte * walk_leaf(struct pte * root, uintptr_t vma) {
+    struct pte * pt = root;
+    struct pte * pte;
+    int lvl;
+
+    for (lvl = memory_pt_levels - 1; lvl >= 0; lvl--) {
+        pte = &pt[VPN(vma, lvl)];
+        if (!(pte->flags & PTE_V))
+            return NULL;
+        if (pte->flags & (PTE_R | PTE_W | PTE_X))
+            return pte;
+        pt = pagenum_to_pageptr(pte->ppn);
+    }
+
+    return NULL;
+}
+
+static inline int wellformed_vma(uintptr_t vma) {
+    // Address bits 63:38 (63:47 for Sv48) must be all 0 or all 1
+    uintptr_t const bits = (intptr_t)vma >> (9 * memory_pt_levels + 11);
+    return (!bits || !(bits+1));
+}
+
+static inline int wellformed_vptr(const void * vp) {
+    return wellformed_vma((uintptr_t)vp);
+}
+
+static inline int aligned_addr(uintptr_t vma, size_t blksz) {
+    return ((vma % blksz) == 0);
+}
+
+static inline int aligned_ptr(const void * p, size_t blksz) {
+    return (aligned_addr((uintptr_t)p, blksz));
+}
+
+static inline int aligned_size(size_t size, size_t blksz) {
+    return ((size % blksz) == 0);
+}
+
+static inline uintptr_t active_space_mtag(void) {
+    return csrr_satp();
+}
+
+static inline struct pte * mtag_to_root(uintptr_t mtag) {
+    return (struct pte *)((mtag << 20) >> 8);
+}
+
+
+static inline struct pte * active_space_root(void) {
+    return mtag_to_root(active_space_mtag());
+}
+
+static inline void * pagenum_to_pageptr(uintptr_t n) {
+    return (void*)(n << PAGE_ORDER);
+}
+
+static inline uintptr_t pageptr_to_pagenum(const void * p) {
+    return (uintptr_t)p >> PAGE_ORDER;
+}
+
+static inline struct page_frame * pageptr_to_frame(const void * p) {
+    return &frametab[(p - RAM_START) / PAGE_SIZE];
+}
+
+static inline size_t pageptr_to_megaidx(const void * p) {
+    return (p - RAM_START) / MEGA_SIZE;
+}
+
+static inline void * round_up_ptr(void * p, size_t blksz) {
+    return (void*)((uintptr_t)(p + blksz-1) / blksz * blksz);
+}
+
+static inline uintptr_t round_up_addr(uintptr_t addr, size_t blksz) {
+    return ((addr + blksz-1) / blksz * blksz);
+}
+
+static inline size_t round_up_size(size_t n, size_t blksz) {
+    return (n + blksz-1) / blksz * blksz;
+}
 
 static inline void * round_down_ptr(void * p, size_t blksz) {
     return (void*)((uintptr_t)p / blksz * blksz);
@@ -894,12 +1935,24 @@ static inline struct pte leaf_pte (
     };
 }
 
-static inline struct pte ptab_pte (
-    const struct pte * ptab, uint_fast8_t g_flag)
+// User pages are mapped with A and D set only when they have actually been
+// accessed or written, so that idle tracking and reclaim can tell.
+
+static inline struct pte user_pte (
+    const void * pptr, uint_fast8_t rwx_flags, uint_fast8_t ad_flags)
 {
     return (struct pte) {
-        .flags = g_flag | PTE_V,
-        .ppn = pageptr_to_pagenum(ptab)
+        .flags = rwx_flags | PTE_U | ad_flags | PTE_V,
+        .ppn = pageptr_to_pagenum(pptr)
+    };
+}
+
+static inline struct pte ptab_pte (
+    const struct pte * ptab, uint_fast8_t g_flag)
+{
+    return (struct pte) {
+        .flags = g_flag | PTE_V,
+        .ppn = pageptr_to_pagenum(ptab)
     };
 }
 
@@ -910,3 +1963,849 @@ static inline struct pte null_pte(void) {
 static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
+
+/*
+ * Inputs:
+ *  void * pp: page to put on the free list
+ *  int tail: whether to append the page rather than push it
+ * Outputs: None
+ * Description: Links the page into the free list, marks its frame free and
+ *  counts it in its megarange.
+ * Effects: Changes the free_list
+*/
+static void free_list_insert(void * pp, int tail) {
+    union linked_page * const page = pp;
+    struct page_frame * const frame = pageptr_to_frame(pp);
+
+    frame->flags = PGF_FREE;
+    frame->mapcount = 0;
+    frame->pincnt = 0;
+    frame->rmap = NULL;
+
+    if (tail) {
+        page->next = NULL;
+        page->prev = free_tail;
+        if (free_tail != NULL)
+            free_tail->next = page;
+        else
+            free_list = page;
+        free_tail = page;
+    } else {
+        page->prev = NULL;
+        page->next = free_list;
+        if (free_list != NULL)
+            free_list->prev = page;
+        else
+            free_tail = page;
+        free_list = page;
+    }
+
+    free_page_cnt += 1;
+    mega_free_cnt[pageptr_to_megaidx(pp)] += 1;
+}
+
+/*
+ * Inputs:
+ *  void * pp: page on the free list
+ * Outputs: None
+ * Description: Unlinks a page from anywhere in the free list. The frame is left
+ *  marked as an unmovable kernel page until the caller maps it.
+ * Effects: Changes the free_list
+*/
+static void free_list_remove(void * pp) {
+    union linked_page * const page = pp;
+
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        free_list = page->next;
+    
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+    else
+        free_tail = page->prev;
+
+    pageptr_to_frame(pp)->flags = 0;
+    free_page_cnt -= 1;
+    mega_free_cnt[pageptr_to_megaidx(pp)] -= 1;
+}
+
+// Records that a user page is mapped by pte, which makes it movable.
+
+static inline void frame_map(const void * pp, struct pte * pte) {
+    struct page_frame * const frame = pageptr_to_frame(pp);
+
+    frame->flags = PGF_USER;
+    frame->mapcount = 1;
+    frame->rmap = pte;
+}
+
+// Records that a user page is no longer mapped; it is held by the kernel (e.g.
+// queued in a message) and is not movable until it is mapped again.
+
+static inline void frame_unmap(const void * pp) {
+    struct page_frame * const frame = pageptr_to_frame(pp);
+
+    frame->flags = 0;
+    frame->mapcount = 0;
+    frame->rmap = NULL;
+}
+
+// Records that a megapage is mapped by pte. The frames of a megapage are not
+// moved individually.
+
+static void frame_map_mega(const void * pp, struct pte * pte) {
+    struct page_frame * const frame = pageptr_to_frame(pp);
+    int i;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        frame[i].flags = PGF_MEGA;
+        frame[i].mapcount = 0;
+        frame[i].rmap = NULL;
+    }
+
+    frame->mapcount = 1;
+    frame->rmap = pte;
+}
+
+static size_t count_free_megas(void) {
+    size_t idx, cnt = 0;
+
+    for (idx = pool_mega_start; idx < MEGA_CNT; idx++) {
+        if (mega_free_cnt[idx] == PTE_CNT)
+            cnt += 1;
+    }
+
+    return cnt;
+}
+
+// Returns the number of pages that must be migrated to free megarange idx, or
+// SIZE_MAX if it holds a page that cannot be moved.
+
+static size_t count_movable(size_t idx) {
+    const struct page_frame * const frame =
+        pageptr_to_frame(RAM_START + idx * MEGA_SIZE);
+    size_t cnt = 0;
+    int i;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (frame[i].flags == PGF_FREE)
+            continue;
+        if (frame[i].flags != PGF_USER || frame[i].mapcount != 1 ||
+            frame[i].pincnt != 0)
+            return SIZE_MAX;
+        cnt += 1;
+    }
+
+    return cnt;
+}
+
+/*
+ * Inputs: None
+ * Outputs: 1 if a megarange was freed, 0 otherwise
+ * Description:
+ *  1. Picks the megarange of the page pool with the fewest movable pages that
+ *     holds nothing but free and movable pages and is not free already
+ *  2. Takes its free pages off the free list, so that the destination pages
+ *     of the migration all come from other megaranges
+ *  3. Migrates its user pages and returns the whole megarange to the tail of
+ *     the free list
+ *  Fails without changing anything if there is no candidate or too few free
+ *  pages elsewhere. If a page turns out not to be movable after all, the pages
+ *  moved so far stay moved and the megarange stays in use.
+ * Effects: Moves user pages of any memory space
+*/
+static int compact_one(void) {
+    size_t idx, best = 0, cnt, best_cnt = SIZE_MAX;
+    struct page_frame * frame;
+    size_t moved = 0;
+    void * base;
+    int i;
+
+    compact_stats.runs += 1;
+
+    for (idx = pool_mega_start; idx < MEGA_CNT; idx++) {
+        if (mega_free_cnt[idx] == PTE_CNT)
+            continue;
+        cnt = count_movable(idx);
+        if (cnt < best_cnt) {
+            best = idx;
+            best_cnt = cnt;
+        }
+    }
+
+    if (best_cnt == SIZE_MAX ||
+        free_page_cnt - mega_free_cnt[best] < best_cnt + MEMORY_SPECULATE_MIN)
+    {
+        compact_stats.failures += 1;
+        return 0;
+    }
+
+    base = RAM_START + best * MEGA_SIZE;
+    frame = pageptr_to_frame(base);
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (frame[i].flags == PGF_FREE) {
+            free_list_remove(base + i * PAGE_SIZE);
+            frame[i].flags = PGF_ISOLATED;
+        }
+    }
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (frame[i].flags == PGF_USER)
+            moved += migrate_page(base + i * PAGE_SIZE);
+    }
+
+    sfence_vma();
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (frame[i].flags == PGF_ISOLATED)
+            free_list_insert(base + i * PAGE_SIZE, 1);
+    }
+
+    compact_stats.migrated += moved;
+    if (moved < best_cnt) {
+        compact_stats.failures += 1;
+        return 0;
+    }
+
+    compact_stats.successes += 1;
+
+    trace("%s: freed megarange %p, %zu pages moved", __func__, base, best_cnt);
+    return 1;
+}
+
+// Steps of the kcompactd task: sleep for MEMORY_COMPACT_MS, then compact if
+// fewer than MEMORY_COMPACT_WMARK megaranges are free, and sleep again.
+
+static void compactd_sleep(struct task * tk) {
+    task_sleep(tk, &compactd_alarm,
+        MEMORY_COMPACT_MS * (TIMER_FREQ / 1000), &compactd_run);
+}
+
+static void compactd_run(struct task * tk) {
+    if (count_free_megas() < MEMORY_COMPACT_WMARK)
+        memory_compact(MEMORY_COMPACT_WMARK);
+    compactd_sleep(tk);
+}
+
+// Copies a mapped user page to a new page and points its PTE there. The old
+// page is left isolated. A page mapped more than once (a fork shares it) is
+// left alone, since the reverse map only knows one of its PTEs. Returns 1 if
+// the page was moved. The caller must issue sfence_vma.
+
+static int migrate_page(void * pp) {
+    struct page_frame * const frame = pageptr_to_frame(pp);
+    struct pte * const pte = frame->rmap;
+    void * newpp;
+
+    if (frame->mapcount != 1 || frame->pincnt != 0 || pte == NULL ||
+        pte->ppn != pageptr_to_pagenum(pp))
+        return 0;
+
+    newpp = memory_alloc_page();
+    memcpy(newpp, pp, PAGE_SIZE);
+    pte->ppn = pageptr_to_pagenum(newpp);
+    frame_map(newpp, pte);
+
+    frame->flags = PGF_ISOLATED;
+    frame->mapcount = 0;
+    frame->rmap = NULL;
+    return 1;
+}
+
+/*
+ * Inputs: None
+ * Outputs: pointer to a new root page table
+ * Description: Allocates a root page table containing the global kernel
+ *  mappings of the main memory space and nothing else. Under Sv48 the kernel
+ *  mappings live in the level 2 table below the first root entry, so the new
+ *  space gets its own copy of that table too, leaving the rest of the
+ *  gigaranges in it free for user mappings.
+ * Effects: Allocates one or two pages
+*/
+static struct pte * new_space_root(void) {
+    const struct pte * main_root = mtag_to_root(main_mtag);
+    struct pte * root;
+    struct pte * pt2;
+    int i;
+
+    root = memory_alloc_page();
+    memset(root, 0, PAGE_SIZE);
+
+    pt2 = root;
+    if (memory_pt_levels == 4) {
+        pt2 = memory_alloc_page();
+        memset(pt2, 0, PAGE_SIZE);
+        root[VPN3(0UL)] = ptab_pte(pt2, 0);
+        main_root = main_pt2;
+    }
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (main_root[i].flags & PTE_G)
+            pt2[i] = main_root[i];
+    }
+
+    return root;
+}
+
+static inline uintptr_t root_to_mtag(const struct pte * root, uint_fast16_t asid) {
+    return ((uintptr_t)satp_mode << RISCV_SATP_MODE_shift) |
+        ((uintptr_t)asid << ASID_SHIFT) |
+        pageptr_to_pagenum(root);
+}
+
+/*
+ * Inputs:
+ *  const struct pte * src: page table of the active space at level lvl
+ *  struct pte * dst: zeroed page table of the new space at level lvl
+ *  int lvl: level of the tables (0 is the leaf level)
+ * Outputs: None
+ * Description: Copies global entries as-is, deep copies user leaf pages and
+ *  megapages and recursively copies non-global page tables. Invalid entries
+ *  are skipped, so unpopulated parts of the address space cost nothing.
+ * Effects: Allocates pages for the copied tables and user pages
+*/
+static void clone_user_level (
+    const struct pte * src, struct pte * dst, int lvl)
+{
+    struct pte * child;
+    void * pp;
+    int i;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (!(src[i].flags & PTE_V))
+            continue;
+        
+        if (src[i].flags & PTE_G) {
+            dst[i] = src[i];
+            continue;
+        }
+
+        if (src[i].flags & (PTE_R | PTE_W | PTE_X)) {
+            if ((src[i].flags & PTE_U) && lvl == 1)
+                clone_megapage(&src[i], &dst[i]);
+            else if (src[i].flags & PTE_U) {
+                pp = memory_alloc_page();
+                // the allocation may have reclaimed this very page
+                if (!(src[i].flags & PTE_V)) {
+                    memory_free_page(pp);
+                    continue;
+                }
+                memcpy(pp, pagenum_to_pageptr(src[i].ppn), PAGE_SIZE);
+                dst[i] = src[i];
+                dst[i].ppn = pageptr_to_pagenum(pp);
+                frame_map(pp, &dst[i]);
+            }
+            continue;
+        }
+
+        if (lvl == 0)
+            continue;
+
+        child = memory_alloc_page();
+        memset(child, 0, PAGE_SIZE);
+        clone_user_level(pagenum_to_pageptr(src[i].ppn), child, lvl - 1);
+        dst[i] = ptab_pte(child, 0);
+    }
+}
+
+/*
+ * Inputs:
+ *  const struct pte * src: megapage leaf of the active space
+ *  struct pte * dst: entry of the new space's level 1 table
+ * Outputs: None
+ * Description: Copies a megapage into a new megapage, or into PTE_CNT single
+ *  pages under a new leaf table if no free megarange is available.
+ * Effects: Allocates pages
+*/
+static void clone_megapage(const struct pte * src, struct pte * dst) {
+    const void * const srcpp = pagenum_to_pageptr(src->ppn);
+    struct pte * pt0;
+    void * pp;
+    int i;
+
+    pp = memory_alloc_mega();
+    if (pp != NULL) {
+        memcpy(pp, srcpp, MEGA_SIZE);
+        *dst = *src;
+        dst->ppn = pageptr_to_pagenum(pp);
+        frame_map_mega(pp, dst);
+        return;
+    }
+
+    pt0 = memory_alloc_page();
+    for (i = 0; i < PTE_CNT; i++) {
+        pp = memory_alloc_page();
+        memcpy(pp, srcpp + i * PAGE_SIZE, PAGE_SIZE);
+        pt0[i] = user_pte(pp, src->flags & (PTE_R | PTE_W | PTE_X),
+            src->flags & (PTE_A | PTE_D));
+        frame_map(pp, &pt0[i]);
+    }
+
+    *dst = ptab_pte(pt0, 0);
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: root page table of the active space
+ *  const struct vma * v: region containing vma
+ *  uintptr_t vma: page-aligned faulting address
+ *  uint_fast8_t ad_flags: A and D bits for the new mapping
+ * Outputs: 1 if a megapage now maps vma, 0 if the caller should map a page
+ * Description: Maps a zeroed megapage at the megarange containing vma if the
+ *  region is anonymous, covers the whole megarange, and nothing is mapped in
+ *  it yet. If no free megarange is available, compacts for one first.
+ * Effects: Allocates pages; may move user pages; the caller must issue
+ *  sfence_vma
+*/
+static int map_megapage (
+    struct pte * root, const struct vma * v, uintptr_t vma,
+    uint_fast8_t ad_flags)
+{
+    const uintptr_t start = round_down_addr(vma, MEGA_SIZE);
+    struct pte * pt1;
+    void * pp;
+
+    if (v->backing != VMA_ANON || start < v->start ||
+        v->end - start < MEGA_SIZE)
+        return 0;
+
+    pt1 = walk_level(root, vma, 1, 1);
+    if (pt1 == 0 || (pt1[VPN1(vma)].flags & PTE_V))
+        return 0;
+
+    if (free_page_cnt < MEMORY_SPECULATE_MIN + PTE_CNT) {
+        compact_stats.mega_fails += 1;
+        return 0;
+    }
+
+    pp = memory_alloc_mega();
+    if (pp == NULL && memory_compact(1) != 0)
+        pp = memory_alloc_mega();
+    if (pp == NULL) {
+        compact_stats.mega_fails += 1;
+        return 0;
+    }
+
+    memset(pp, 0, MEGA_SIZE);
+    pt1[VPN1(vma)] = user_pte(pp, v->prot, ad_flags);
+    frame_map_mega(pp, &pt1[VPN1(vma)]);
+    compact_stats.mega_allocs += 1;
+    return 1;
+}
+
+/*
+ * Inputs:
+ *  struct pte * pte: megapage leaf
+ * Outputs: None
+ * Description: Replaces a megapage mapping by a leaf table mapping the same
+ *  PTE_CNT pages individually, with the same permissions and A and D bits, so
+ *  that part of it can be unmapped. The pages become ordinary movable pages.
+ * Effects: Allocates a page table; the caller must issue sfence_vma
+*/
+static void split_megapage(struct pte * pte) {
+    void * const pp = pagenum_to_pageptr(pte->ppn);
+    struct pte * pt0;
+    int i;
+
+    pt0 = memory_alloc_page();
+    for (i = 0; i < PTE_CNT; i++) {
+        pt0[i] = user_pte(pp + i * PAGE_SIZE, pte->flags & (PTE_R | PTE_W | PTE_X),
+            pte->flags & (PTE_A | PTE_D));
+        frame_map(pp + i * PAGE_SIZE, &pt0[i]);
+    }
+
+    *pte = ptab_pte(pt0, 0);
+}
+
+/*
+ * Inputs:
+ *  struct pte * pt: page table at level lvl
+ *  int lvl: level of the table (0 is the leaf level)
+ * Outputs: None
+ * Description: Frees user leaf pages and non-global page tables below pt and
+ *  clears the entries that referred to them. Under Sv48 the level 2 table in
+ *  the first root entry also holds the kernel mappings, so it is descended
+ *  into but left in place; memory_space_reclaim frees it with the root.
+ * Effects: Frees pages
+*/
+static void free_user_level(struct pte * pt, int lvl) {
+    struct pte * child;
+    int i;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (!(pt[i].flags & PTE_V) || (pt[i].flags & PTE_G))
+            continue;
+
+        child = pagenum_to_pageptr(pt[i].ppn);
+
+        if (pt[i].flags & (PTE_R | PTE_W | PTE_X)) {
+            if (pt[i].flags & PTE_U) {
+                if (lvl == 0)
+                    memory_free_page(child);
+                else
+                    memory_free_mega(child);
+                pt[i] = null_pte();
+            }
+            continue;
+        }
+
+        if (lvl == 0)
+            continue;
+
+        free_user_level(child, lvl - 1);
+
+        if (lvl == 3 && i == VPN3(0UL))
+            continue;
+
+        memory_free_page(child);
+        pt[i] = null_pte();
+    }
+}
+
+/*
+ * Inputs:
+ *  const struct vma * v: region containing the page
+ *  uintptr_t vma: page-aligned virtual address of the page
+ *  void * pp: direct-mapped pointer to the newly allocated physical page
+ * Outputs: 0 on success, -EIO if the file could not be read
+ * Description: Initializes the contents of a page from the region's backing
+ *  object. Anonymous pages are zeroed; file pages are read from the file at
+ *  the corresponding offset, zero-filling past the end of the file data.
+ * Effects: None
+*/
+static int fill_user_page(const struct vma * v, uintptr_t vma, void * pp) {
+    const uint64_t pgoff = vma - v->start;
+    size_t len = 0;
+
+    if (v->backing == VMA_FILE && pgoff < v->filesz) {
+        len = MIN(v->filesz - pgoff, PAGE_SIZE);
+        if (read_backing(v, pgoff, pp, len) != len)
+            return -EIO;
+    }
+
+    memset(pp + len, 0, PAGE_SIZE - len);
+    return 0;
+}
+
+/*
+ * Inputs:
+ *  const struct vma * v: file-backed region
+ *  uint64_t off: offset of the data relative to the start of the region
+ *  void * buf: buffer to read into
+ *  size_t len: number of bytes to read
+ * Outputs: number of bytes read, or a negative error code
+ * Description: Reads region data from the backing file with ioreadat, which
+ *  leaves the file position alone; the position is shared with the file
+ *  descriptor the mapping was created from, and another thread may be reading
+ *  through it. Objects without a positional read (devices) are read by
+ *  seeking, and their position is restored afterwards.
+ * Effects: None
+*/
+static long read_backing (
+    const struct vma * v, uint64_t off, void * buf, size_t len)
+{
+    uint64_t savepos;
+    long cnt;
+
+    cnt = ioreadat(v->io, v->offset + off, buf, len);
+    if (cnt != -ENOTSUP)
+        return cnt;
+
+    ioctl(v->io, IOCTL_GETPOS, &savepos);
+    cnt = (ioseek(v->io, v->offset + off) < 0) ? -EIO :
+        ioread_full(v->io, buf, len);
+    ioseek(v->io, savepos);
+    return cnt;
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: root page table of the space
+ *  const struct vma * v: region containing the range
+ *  uintptr_t start, end: page-aligned range inside v
+ * Outputs: number of pages mapped
+ * Description: Allocates, fills and maps every page of the range that is not
+ *  mapped yet. Stops early when free memory runs low or a page cannot be read,
+ *  since population is only ever speculative. The pages are mapped with A and
+ *  D clear, so that idle tracking and reclaim see them as unused and clean.
+ * Effects: Allocates pages; the caller must issue sfence_vma
+*/
+static size_t populate_range (
+    struct pte * root, const struct vma * v, uintptr_t start, uintptr_t end)
+{
+    size_t cnt = 0;
+    struct pte * pt0;
+    uintptr_t vma;
+    void * pp;
+
+    for (vma = start; vma < end; vma += PAGE_SIZE) {
+        if (free_page_cnt < MEMORY_SPECULATE_MIN)
+            break;
+
+        // a megapage covers the address if there is no leaf table
+        pt0 = walk_pt(root, vma, 1);
+        if (pt0 == 0 || (pt0[VPN0(vma)].flags & PTE_V))
+            continue;
+
+        pp = memory_alloc_page();
+        if (fill_user_page(v, vma, pp) < 0) {
+            memory_free_page(pp);
+            break;
+        }
+
+        pt0[VPN0(vma)] = user_pte(pp, v->prot, 0);
+        frame_map(pp, &pt0[VPN0(vma)]);
+        cnt += 1;
+    }
+
+    return cnt;
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: root page table of the space
+ *  uintptr_t start, end: page-aligned range
+ *  size_t max: maximum number of pages to free
+ *  uint_fast8_t skip: pages with any of these PTE flags are left mapped
+ * Outputs: number of pages freed
+ * Description: Unmaps and frees user pages in the range. Leaf tables that are
+ *  absent are skipped a whole megarange at a time. Pinned pages are left
+ *  mapped (memory_pin_range). A megapage inside the range
+ *  is freed whole (which may overshoot max); one straddling a boundary of the
+ *  range is split first.
+ * Effects: Frees pages; the caller must issue sfence_vma
+*/
+static size_t unmap_range (
+    struct pte * root, uintptr_t start, uintptr_t end, size_t max,
+    uint_fast8_t skip)
+{
+    uintptr_t vma, mstart;
+    size_t cnt = 0;
+    struct pte * pt0;
+    struct pte * pte;
+
+    vma = start;
+    while (vma < end && cnt < max) {
+        pt0 = walk_pt(root, vma, 0);
+        if (pt0 == 0) {
+            mstart = round_down_addr(vma, MEGA_SIZE);
+            pte = walk_leaf(root, vma);
+
+            if (pte != NULL && (pte->flags & (PTE_U | skip)) == PTE_U) {
+                if (mstart < start || end - mstart < MEGA_SIZE) {
+                    split_megapage(pte);
+                    continue;
+                }
+                memory_free_mega(pagenum_to_pageptr(pte->ppn));
+                *pte = null_pte();
+                cnt += PTE_CNT;
+            }
+
+            vma = mstart + MEGA_SIZE;
+            continue;
+        }
+
+        if ((pt0[VPN0(vma)].flags & (PTE_V | PTE_U)) == (PTE_V | PTE_U) &&
+            !(pt0[VPN0(vma)].flags & skip) &&
+            pageptr_to_frame(pagenum_to_pageptr(pt0[VPN0(vma)].ppn))->pincnt == 0)
+        {
+            memory_free_page(pagenum_to_pageptr(pt0[VPN0(vma)].ppn));
+            pt0[VPN0(vma)] = null_pte();
+            cnt += 1;
+        }
+
+        vma += PAGE_SIZE;
+    }
+
+    return cnt;
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: root page table of the space
+ *  uintptr_t start, end: page-aligned range
+ *  int clear: whether to clear the A bits
+ *  struct pgidle_info * info: counters and bitmap to update
+ * Outputs: None
+ * Description: Counts the user pages mapped in the range and those with the A
+ *  bit set, and records the latter in the bitmap (indexed from info->start).
+ *  Absent leaf tables are skipped a whole megarange at a time. Every page of a
+ *  megapage counts as accessed if the megapage is.
+ * Effects: Clears A bits if clear is set; the caller must issue sfence_vma
+*/
+static void idle_scan (
+    struct pte * root, uintptr_t start, uintptr_t end, int clear,
+    struct pgidle_info * info)
+{
+    uintptr_t vma, next;
+    uint_fast8_t flags;
+    struct pte * pt0;
+    struct pte * pte;
+    size_t n;
+
+    vma = start;
+    while (vma < end) {
+        pt0 = walk_pt(root, vma, 0);
+        next = vma + PAGE_SIZE;
+
+        if (pt0 != 0)
+            pte = &pt0[VPN0(vma)];
+        else {
+            next = MIN(round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE, end);
+            pte = walk_leaf(root, vma);
+            if (pte == NULL) {
+                vma = next;
+                continue;
+            }
+        }
+
+        flags = pte->flags;
+        if ((flags & (PTE_V | PTE_U)) != (PTE_V | PTE_U)) {
+            vma = next;
+            continue;
+        }
+
+        if (clear)
+            pte->flags &= ~PTE_A;
+
+        for (; vma < next; vma += PAGE_SIZE) {
+            info->mapped += 1;
+            if (flags & PTE_A) {
+                info->accessed += 1;
+                if (info->bitmap != NULL) {
+                    n = (vma - info->start) / PAGE_SIZE;
+                    info->bitmap[n / 64] |= 1UL << (n % 64);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: root page table of the space
+ *  const struct vma * v: region that took the fault
+ *  uintptr_t vma: page-aligned faulting address, already mapped
+ * Outputs: None
+ * Description: Speculative work done after a fault according to the region:
+ *  1. VMA_HUGEPAGE: populates the rest of the aligned megapage extent
+ *  2. File-backed: reads ahead MEMORY_READAHEAD pages, or
+ *     MEMORY_READAHEAD_SEQ for MADV_SEQUENTIAL, and none for MADV_RANDOM
+ *  3. MADV_SEQUENTIAL on a recoverable region: frees pages more than one
+ *     readahead window behind the fault (drop behind)
+ * Effects: Allocates and frees pages; the caller must issue sfence_vma
+*/
+static void fault_around(struct pte * root, const struct vma * v, uintptr_t vma) {
+    uintptr_t start, end;
+    size_t window;
+
+    if (v->flags & VMA_HUGEPAGE) {
+        start = round_down_addr(vma, MEGA_SIZE);
+        end = start + MEGA_SIZE;
+        populate_range(root, v, (start < v->start) ? v->start : start,
+            (v->end < end) ? v->end : end);
+        return;
+    }
+
+    if (v->backing != VMA_FILE || v->advice == MADV_RANDOM)
+        return;
+
+    window = (v->advice == MADV_SEQUENTIAL) ?
+        MEMORY_READAHEAD_SEQ : MEMORY_READAHEAD;
+
+    // Read ahead only through the end of the file data; zero pages are cheap
+    // to fault in later.
+
+    end = v->start + round_up_size(v->filesz, PAGE_SIZE);
+    end = MIN(end, v->end);
+    end = MIN(end, vma + window * PAGE_SIZE);
+    if (vma + PAGE_SIZE < end)
+        populate_range(root, v, vma + PAGE_SIZE, end);
+
+    if (v->advice == MADV_SEQUENTIAL && recoverable(v) &&
+        v->start + window * PAGE_SIZE <= vma)
+    {
+        end = vma - window * PAGE_SIZE;
+        start = (v->start + window * PAGE_SIZE <= end) ?
+            end - window * PAGE_SIZE : v->start;
+        unmap_range(root, start, end, SIZE_MAX, 0);
+    }
+}
+
+// Pages of a read-only file mapping can always be read back from the file, so
+// they may be dropped at any time.
+
+static inline int recoverable(const struct vma * v) {
+    return (v->backing == VMA_FILE && !(v->prot & PTE_W));
+}
+
+/*
+ * Inputs:
+ *  struct pte * root: root page table of the active space
+ *  const struct vma * v: region containing the range
+ *  uintptr_t start, end: page-aligned range inside v
+ * Outputs: number of pages mapped
+ * Description:
+ *  1. Maps a fresh page at every address of the range, temporarily writable
+ *  2. Reads the file data of the whole range with one read through the new
+ *     mappings and zeroes the rest of each page
+ *  3. Sets the final permissions of the region, with A and D clear as in
+ *     populate_range
+ *  Falls back to populate_range if part of the range is already mapped or
+ *  free memory is low. Nothing stays mapped if the read fails.
+ * Effects: Allocates pages; the caller must issue sfence_vma
+*/
+static size_t prefetch_run (
+    struct pte * root, const struct vma * v, uintptr_t start, uintptr_t end)
+{
+    const size_t npages = (end - start) / PAGE_SIZE;
+    uint64_t fstart, fend;
+    struct pte * pt0;
+    uintptr_t vma;
+    size_t len;
+    long cnt = 0;
+    void * pp;
+
+    if (v->backing != VMA_FILE || free_page_cnt < MEMORY_SPECULATE_MIN + npages)
+        return populate_range(root, v, start, end);
+
+    for (vma = start; vma < end; vma += PAGE_SIZE) {
+        pt0 = walk_pt(root, vma, 1);
+        if (pt0 == 0 || (pt0[VPN0(vma)].flags & PTE_V))
+            return populate_range(root, v, start, end);
+    }
+
+    for (vma = start; vma < end; vma += PAGE_SIZE) {
+        pt0 = walk_pt(root, vma, 0);
+        pp = memory_alloc_page();
+        pt0[VPN0(vma)] = leaf_pte(pp, PTE_R | PTE_W | PTE_U);
+        frame_map(pp, &pt0[VPN0(vma)]);
+    }
+
+    sfence_vma();
+
+    // File data of the run, relative to the start of the region
+
+    fstart = start - v->start;
+    fend = MIN(end - v->start, v->filesz);
+
+    if (fstart < fend) {
+        cnt = read_backing(v, fstart, (void*)start, fend - fstart);
+        if (cnt != fend - fstart) {
+            unmap_range(root, start, end, SIZE_MAX, 0);
+            return 0;
+        }
+    }
+
+    for (vma = start; vma < end; vma += PAGE_SIZE) {
+        pt0 = walk_pt(root, vma, 0);
+        len = (fstart < fend) ? MIN(fend - fstart, PAGE_SIZE) : 0;
+        fstart += len;
+        memset(pagenum_to_pageptr(pt0[VPN0(vma)].ppn) + len, 0, PAGE_SIZE - len);
+        pt0[VPN0(vma)].flags = v->prot | PTE_U | PTE_V;
+    }
+
+    return npages;
+}
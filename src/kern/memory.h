@@ -5,6 +5,7 @@
 #define _MEMORY_H_
 
 #include "csr.h"
+#include "io.h"
 
 #include <stddef.h> // size_t
 #include <stdint.h> // uint_fast32_t
@@ -33,6 +34,46 @@
 #define HEAP_INIT_MIN 256
 #endif
 
+// If non-zero, memory_init probes the hart for Sv48 support and uses four-level
+// translation when it is available. Otherwise the kernel always runs in Sv39.
+
+#ifndef MEMORY_SV48
+#define MEMORY_SV48 1
+#endif
+
+// Number of pages read ahead on a fault in a file-backed region, normally and
+// for regions advised MADV_SEQUENTIAL. Readahead and other speculative
+// population stop when fewer than MEMORY_SPECULATE_MIN pages are free.
+
+#ifndef MEMORY_READAHEAD
+#define MEMORY_READAHEAD 4
+#endif
+
+#ifndef MEMORY_READAHEAD_SEQ
+#define MEMORY_READAHEAD_SEQ 16
+#endif
+
+#ifndef MEMORY_SPECULATE_MIN
+#define MEMORY_SPECULATE_MIN 64
+#endif
+
+// Number of pages memory_alloc_page tries to reclaim when it runs out.
+
+#ifndef MEMORY_RECLAIM_BATCH
+#define MEMORY_RECLAIM_BATCH 32
+#endif
+
+// The kcompactd task wakes every MEMORY_COMPACT_MS milliseconds and compacts
+// physical memory until at least MEMORY_COMPACT_WMARK megaranges are free.
+
+#ifndef MEMORY_COMPACT_MS
+#define MEMORY_COMPACT_MS 1000
+#endif
+
+#ifndef MEMORY_COMPACT_WMARK
+#define MEMORY_COMPACT_WMARK 1
+#endif
+
 // CONSTANT DEFINITIONS
 //
 
@@ -41,14 +82,58 @@
 
 #define PTE_CNT (PAGE_SIZE/8) // number of PTEs per page table
 
+// Commands of memory_pgidle. Both report which pages mapped in the range have
+// been accessed since the last MARK; MARK then clears their accessed bits and
+// starts a new interval. Mirrored in user/syscall.h.
+
+#define PGIDLE_MARK     0
+#define PGIDLE_QUERY    1
+
 // EXPORTED TYPE DEFINITIONS
 //
 
+// Argument of memory_pgidle. The range is [start,end); an end of 0 selects the
+// whole user address range. If bitmap is not NULL, one bit per page of the
+// range is stored in it (bit n of word n/64 for the nth page), set if the
+// page was accessed since the last MARK. Mirrored in user/syscall.h.
+
+struct pgidle_info {
+    uintptr_t start;        // in: page-aligned start of the range
+    uintptr_t end;          // in: page-aligned end of the range, or 0
+    uint64_t * bitmap;      // in: optional, not with end 0
+    uint64_t mapped;        // out: pages mapped in the range
+    uint64_t accessed;      // out: pages accessed since the last MARK
+    uint64_t idle;          // out: pages not accessed since the last MARK
+    uint64_t age;           // out: milliseconds since the last MARK
+};
+
+// Counters reported by memory_compact_stats. Mirrored in user/syscall.h.
+
+struct compact_stats {
+    uint64_t runs;          // compaction passes
+    uint64_t successes;     // passes that freed a megarange
+    uint64_t failures;      // passes that found nothing to free
+    uint64_t migrated;      // pages moved by compaction
+    uint64_t mega_allocs;   // huge page faults mapped with a megapage
+    uint64_t mega_fails;    // huge page faults that fell back to pages
+    uint64_t mega_free;     // free megaranges now
+    uint64_t mega_total;    // megaranges in the page pool
+};
+
+struct process; // process.h
+struct vma;     // vma.h
+
 // EXPORTED VARIABLE DECLARATIONS
 //
 
 extern uintptr_t main_mtag;
 
+// Number of page table levels in use (3 for Sv39, 4 for Sv48) and the end of
+// the user virtual address range for that mode. Both are set by memory_init.
+
+extern int memory_pt_levels;
+extern uintptr_t memory_user_end;
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -59,7 +144,7 @@ extern uintptr_t main_mtag;
 extern void memory_init(void);
 extern char memory_initialized;
 
-// uintptr_t memory_space_create(void)
+// uintptr_t memory_space_create(uint_fast16_t asid)
 // Creates a new memory space and makes it the currently active space. Returns a
 // memory space tag (type uintptr_t) that may be used to refer to the memory
 // space. The created memory space contains the same identity mapping of MMIO
@@ -71,14 +156,16 @@ extern uintptr_t memory_space_create(uint_fast16_t asid);
 
 // uintptr_t memory_space_clone(uint_fast16_t asid)
 // Clones the memory space for current process and returns the
-// mtag of the new memory space.
+// mtag of the new memory space. Only page tables that are actually populated
+// are visited, so the cost is proportional to the mapped user memory rather
+// than to the size of the user address range.
 
 extern uintptr_t memory_space_clone(uint_fast16_t asid);
 
-// void memory_space_reclaim(uintptr_t mtag)
+// void memory_space_reclaim(void)
 // Switches the active memory space to the main memory space and reclaims the
 // memory space that was active on entry. All physical pages mapped by a user
-// mapping are reclaimed.
+// mapping are reclaimed, along with the page tables of the space.
 
 extern void memory_space_reclaim(void);
 
@@ -95,7 +182,8 @@ static inline uintptr_t memory_space_switch(uintptr_t mtag);
 
 // void * memory_alloc_page(void)
 // Allocates a physical page of memory. Returns a pointer to the direct-mapped
-// address of the page. Does not fail; panics if there are no free pages available.
+// address of the page. Does not fail; if there are no free pages, it tries
+// memory_reclaim and panics if that does not help.
 
 extern void * memory_alloc_page(void);
 
@@ -105,6 +193,24 @@ extern void * memory_alloc_page(void);
 
 extern void memory_free_page(void * pp);
 
+// void * memory_alloc_mega(void)
+// Allocates a megapage: PTE_CNT physically contiguous pages starting on a
+// megapage boundary. Returns NULL if no megarange of RAM is entirely free;
+// memory_compact can make one. Release with memory_free_mega.
+
+extern void * memory_alloc_mega(void);
+extern void memory_free_mega(void * pp);
+
+// size_t memory_compact(size_t want)
+// Migrates user pages out of partly used megaranges of RAM until /want/
+// megaranges are entirely free or no more can be freed. Returns the number of
+// free megaranges. Runs on demand (system call, huge page faults) and from
+// the kcompactd task (memory_compactd_start).
+
+extern size_t memory_compact(size_t want);
+extern void memory_compact_stats(struct compact_stats * stats);
+extern void memory_compactd_start(void);
+
 // void * memory_alloc_and_map_page (
 //        uintptr_t vma, uint_fast8_t rwxug_flags)
 // Allocates and maps a physical page.
@@ -128,10 +234,15 @@ extern void * memory_alloc_and_map_page (
 extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
 
-// void memory_unmap_and_free_range(void * vp, size_t size)
+// void memory_unmap_and_free_range(uintptr_t vma, size_t size)
+// Unmaps and frees all user pages mapped in a page-aligned range of the active
+// memory space.
+
+extern void memory_unmap_and_free_range(uintptr_t vma, size_t size);
 
 // void memory_unmap_and_free_user(void)
-// Unmaps and frees all pages with the U bit set in the PTE flags.
+// Unmaps and frees all pages with the U bit set in the PTE flags, together with
+// the non-global page tables that mapped them.
 
 extern void memory_unmap_and_free_user(void);
 
@@ -169,10 +280,134 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
-// Called from excp.c to handle a page fault at the specified address. Either
-// maps a page containing the faulting address, or calls process_exit().
-
-extern void memory_handle_page_fault(const void * vptr);
+// Called from excp.c to handle a page fault at the specified address. The
+// /access/ argument is PTE_R, PTE_W or PTE_X for a load, store or instruction
+// fetch. Either maps a page containing the faulting address according to the
+// current process's region tree, or calls process_exit().
+
+extern void memory_handle_page_fault(const void * vptr, uint_fast8_t access);
+
+// long memory_mmap (
+//      uintptr_t vma, size_t size, uint_fast8_t rwx_flags, int flags,
+//      struct io_intf * io, uint64_t offset)
+// Adds an anonymous (MAP_ANON) or file-backed region to the current process.
+// Pages are populated lazily by the page fault handler. Returns the start of
+// the region or a negative error code.
+
+extern long memory_mmap (
+    uintptr_t vma, size_t size, uint_fast8_t rwx_flags, int flags,
+    struct io_intf * io, uint64_t offset);
+
+// int memory_madvise(uintptr_t vma, size_t size, int advice)
+// Applies access pattern advice (MADV_*, vma.h) to a range of the current
+// process. The range must be completely covered by regions.
+
+extern int memory_madvise(uintptr_t vma, size_t size, int advice);
+
+// size_t memory_reclaim(size_t target)
+// Frees up to /target/ user pages that can be restored from their backing
+// file: pages of read-only file regions, and clean pages of writable ones.
+// Prefers regions advised MADV_SEQUENTIAL, then pages not accessed since the
+// last PGIDLE_MARK. Called by the page allocator before it gives up. Returns
+// the number of pages freed.
+
+extern size_t memory_reclaim(size_t target);
+
+// int memory_pgidle(struct process * proc, int cmd, struct pgidle_info * info)
+// Idle page tracking for the memory space of /proc/ (PGIDLE_MARK or
+// PGIDLE_QUERY, see above). Sampling QUERY some time after MARK gives the
+// working set of the process over that interval. Returns 0 or a negative
+// error code.
+
+extern int memory_pgidle (
+    struct process * proc, int cmd, struct pgidle_info * info);
+
+// size_t memory_prefetch(const uintptr_t * pages, size_t cnt)
+// Maps the listed pages of the current process, which must be sorted by
+// address, reading runs of consecutive file-backed pages with one read each.
+// Pages that are outside any region or already mapped are skipped. Returns
+// the number of pages mapped.
+
+extern size_t memory_prefetch(const uintptr_t * pages, size_t cnt);
+
+// long memory_install (
+//      struct process * proc, uintptr_t vma, const void * src, size_t size)
+// Maps new pages filled from src (in the active space), or zeroed if src is
+// NULL, in a range of proc that has regions but no pages yet. Returns the
+// number of bytes installed or a negative error code. Used to resolve
+// userfaultfd faults (uffd.h).
+
+extern long memory_install (
+    struct process * proc, uintptr_t vma, const void * src, size_t size);
+
+// void * memory_alloc_pinned(void)
+// void memory_free_pinned(void * pp)
+// Allocate and free zeroed pages that a driver maps into a user space for a
+// device to access. A pinned page is never migrated, and it returns to the
+// free list only once the driver has called memory_free_pinned and no user
+// space maps it any more, in either order.
+
+extern void * memory_alloc_pinned(void);
+extern void memory_free_pinned(void * pp);
+
+// void * memory_map_device(uintptr_t pma, size_t size)
+// Maps size bytes of device memory at physical address pma into the kernel
+// and returns its kernel address, which differs from pma for memory above
+// RAM. The mapping is shared by all memory spaces and never removed. Returns
+// NULL if the memory cannot be mapped.
+
+extern void * memory_map_device(uintptr_t pma, size_t size);
+
+// int memory_take_pages(uintptr_t vma, size_t cnt, void ** pages)
+// long memory_give_pages(void * const * pages, size_t cnt)
+// Move whole pages between processes without copying (msgq.h). take unmaps
+// cnt pages starting at vma from the current process and returns them in
+// pages; the regions remain and refill on the next touch. give maps pages
+// in a new anonymous region of the current process and returns its address.
+// Both return a negative error code on failure, leaving the pages where they
+// were. Pinned pages can be given but not taken (-EBUSY).
+
+extern int memory_take_pages(uintptr_t vma, size_t cnt, void ** pages);
+extern long memory_give_pages(void * const * pages, size_t cnt);
+
+// int memory_read_page(const struct vma * v, uintptr_t vma, void * buf)
+// Copies the current contents of a page of region v of the current process
+// into buf without faulting it in: the mapped page if there is one, otherwise
+// the page as the fault handler would fill it from the backing file. Returns
+// 1 if buf was filled, 0 if the page is an untouched anonymous (zero) page,
+// or -EIO.
+
+extern int memory_read_page(const struct vma * v, uintptr_t vma, void * buf);
+
+// int memory_munmap(uintptr_t vma, size_t size)
+// Removes a range from the current process's region tree and frees the pages
+// mapped in it.
+
+extern int memory_munmap(uintptr_t vma, size_t size);
+
+// int memory_check_range(uintptr_t vma, size_t size, uint_fast8_t rwx_flags)
+// Returns 0 if [vma,vma+size) lies in regions of the current process that
+// allow the accesses in rwx_flags, -EINVAL otherwise. Unlike
+// memory_validate_vptr_len, pages need not be populated yet.
+
+extern int memory_check_range(uintptr_t vma, size_t size, uint_fast8_t rwx_flags);
+
+// int memory_pin_range(uintptr_t vma, size_t size, uint_fast8_t rwx_flags)
+// void memory_unpin_range(uintptr_t vma, size_t size)
+// Fault in a user buffer of the current process and keep its pages mapped
+// and in place until unpinned, so that a driver can copy to or from it while
+// holding a lock that the page fault handler might need (syscall.c). pin
+// returns -EINVAL if the range is not accessible as rwx_flags asks.
+
+extern int memory_pin_range(uintptr_t vma, size_t size, uint_fast8_t rwx_flags);
+extern void memory_unpin_range(uintptr_t vma, size_t size);
+
+// void * memory_pinned_addr(uintptr_t vma)
+// Returns the direct-mapped address of the byte at vma if its page is pinned,
+// NULL otherwise. A pinned user buffer can be given to a DMA device page by
+// page this way (vioblk.c).
+
+extern void * memory_pinned_addr(uintptr_t vma);
 
 // HELPER FUNCTION DEFINITIONS
 //
@@ -181,12 +416,13 @@ extern void memory_handle_page_fault(const void * vptr);
 // This function takes a pointer to your active root page table and a virtual memory address. It walks down the
 // page table structure using the VPN fields of vma, and if create is non-zero, it will create the appropriate
 // page tables to walk to the leaf page table (”level 0”). It returns a pointer to the page table entry that represents
-// the 4 kB page containing vma.
+// the 4 kB page containing vma. Handles both three-level (Sv39) and four-level (Sv48) tables.
 extern struct pte * walk_pt(struct pte * root, uintptr_t vma, int create);
 
 // void walk_and_free_user(struct pte * root)
 // This function takes a pointer to a root page table entry and recursively frees all
-// pages in that page table with the U flag set
+// pages in that page table with the U flag set. Non-global page tables below the
+// root are freed as well; global (kernel) tables are skipped.
 extern void walk_and_free_user(struct pte * root);
 
 // INLINE FUNCTION DEFINITIONS
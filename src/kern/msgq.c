@@ -0,0 +1,331 @@
+// msgq.c - Page-transfer message queues
+//
+
+#include "msgq.h"
+
+#include "memory.h"
+#include "thread.h"
+#include "heap.h"
+#include "string.h"
+#include "error.h"
+#include "console.h"
+#include "halt.h"
+
+#ifdef MSGQ_TRACE
+#define TRACE
+#endif
+
+#ifdef MSGQ_DEBUG
+#define DEBUG
+#endif
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+#define PAGE_DOWN(a) ((a) & ~(uintptr_t)(PAGE_SIZE-1))
+#define PAGE_UP(a) PAGE_DOWN((a) + PAGE_SIZE-1)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct msgq_msg {
+    size_t len;                     // bytes in the message
+    unsigned int offset;            // offset of the first byte in its page
+    unsigned int npages;
+};
+
+// The pages of all queued messages are kept in one ring, in message order.
+// Space for a message is reserved before its pages are gathered, since that
+// may block, so a sender that found room cannot be overtaken.
+
+struct msgq {
+    struct io_intf io_intf;
+    struct condition not_empty;     // signalled when a message is queued
+    struct condition not_full;      // signalled when space is released
+
+    unsigned int head;              // oldest queued message
+    unsigned int cnt;               // number of queued messages
+    unsigned int resv_msgs;         // messages being gathered
+    struct msgq_msg msgs[MSGQ_MAXMSGS];
+
+    unsigned int page_head;         // first page of the oldest message
+    unsigned int page_cnt;          // number of queued pages
+    unsigned int resv_pages;        // pages of messages being gathered
+    void * pages[MSGQ_MAXPAGES];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void msgq_close(struct io_intf * io);
+
+static inline int has_room(const struct msgq * q, unsigned int npages);
+static int copy_ends (
+    uintptr_t start, uintptr_t end, void ** pages, unsigned int npages);
+static void free_ends (
+    uintptr_t start, uintptr_t end, void ** pages, unsigned int npages);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct io_ops msgq_ops = {
+    .close = msgq_close
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int msgq_open(struct io_intf ** ioptr) {
+    struct msgq * q;
+
+    q = kmalloc(sizeof(struct msgq));
+    if (q == NULL)
+        return -ENOMEM;
+
+    memset(q, 0, sizeof(struct msgq));
+    q->io_intf.ops = &msgq_ops;
+    q->io_intf.refcnt = 1;
+    condition_init(&q->not_empty, "msgq.not_empty");
+    condition_init(&q->not_full, "msgq.not_full");
+
+    *ioptr = &q->io_intf;
+    return 0;
+}
+
+/**
+ * long msgq_send(struct io_intf * io, const void * buf, size_t len, int flags);
+ *
+ * Moves a buffer of the current process onto a queue.
+ *
+ * Inputs:
+ *          io - queue
+ *          buf, len - buffer in the current process
+ *          flags - MSG_DONTWAIT or 0
+ * Outputs:
+ *          0 on success, or a negative error code.
+ * Side Effects:
+ *          Unmaps the whole pages of the buffer from the current process. May
+ *          block until the queue has room, and to fault the buffer in.
+ */
+long msgq_send(struct io_intf * io, const void * buf, size_t len, int flags) {
+    struct msgq * const q = (struct msgq *)io;
+    const uintptr_t start = (uintptr_t)buf;
+    const uintptr_t end = start + len;
+    unsigned int npages;
+    unsigned int i;
+    struct msgq_msg * msg;
+    void ** pages;
+    int result;
+
+    if (io->ops != &msgq_ops)
+        return -EBADFD;
+
+    if (len == 0 || memory_check_range(start, len, PTE_R) < 0)
+        return -EINVAL;
+
+    npages = (PAGE_UP(end) - PAGE_DOWN(start)) / PAGE_SIZE;
+    if (MSGQ_MAXPAGES < npages)
+        return -EINVAL;
+
+    // A page can hold 512 pointers, more than MSGQ_MAXPAGES
+
+    pages = memory_alloc_page();
+    if (pages == NULL)
+        return -ENOMEM;
+
+    // The partial pages at either end are copied before space is reserved,
+    // so a copy that fails holds nothing up
+
+    result = copy_ends(start, end, pages, npages);
+    if (result < 0) {
+        memory_free_page(pages);
+        return result;
+    }
+
+    while (!has_room(q, npages)) {
+        if (flags & MSG_DONTWAIT) {
+            free_ends(start, end, pages, npages);
+            memory_free_page(pages);
+            return -EBUSY;
+        }
+        condition_wait(&q->not_full);
+    }
+
+    q->resv_msgs += 1;
+    q->resv_pages += npages;
+
+    result = 0;
+    if (PAGE_UP(start) < PAGE_DOWN(end)) {
+        result = memory_take_pages(PAGE_UP(start),
+            (PAGE_DOWN(end) - PAGE_UP(start)) / PAGE_SIZE,
+            pages + (PAGE_UP(start) - PAGE_DOWN(start)) / PAGE_SIZE);
+    }
+
+    q->resv_msgs -= 1;
+    q->resv_pages -= npages;
+
+    if (result < 0) {
+        free_ends(start, end, pages, npages);
+        memory_free_page(pages);
+        condition_broadcast(&q->not_full);
+        return result;
+    }
+
+    msg = &q->msgs[(q->head + q->cnt) % MSGQ_MAXMSGS];
+    msg->len = len;
+    msg->offset = start % PAGE_SIZE;
+    msg->npages = npages;
+    q->cnt += 1;
+
+    for (i = 0; i < npages; i++) {
+        q->pages[(q->page_head + q->page_cnt) % MSGQ_MAXPAGES] = pages[i];
+        q->page_cnt += 1;
+    }
+
+    memory_free_page(pages);
+
+    trace("%s: %zu bytes in %u pages", __func__, len, npages);
+    condition_broadcast(&q->not_empty);
+    return 0;
+}
+
+/**
+ * long msgq_recv(struct io_intf * io, size_t * lenp, int flags);
+ *
+ * Maps the oldest message of a queue into the current process.
+ *
+ * Inputs:
+ *          io - queue
+ *          lenp - receives the length of the message (in the current process)
+ *          flags - MSG_DONTWAIT or 0
+ * Outputs:
+ *          address of the message, or a negative error code.
+ * Side Effects:
+ *          Adds a region to the current process. May block until a message
+ *          is queued.
+ */
+long msgq_recv(struct io_intf * io, size_t * lenp, int flags) {
+    struct msgq * const q = (struct msgq *)io;
+    struct msgq_msg * msg;
+    unsigned int i;
+    void ** pages;
+    long result;
+
+    if (io->ops != &msgq_ops)
+        return -EBADFD;
+
+    while (q->cnt == 0) {
+        if (flags & MSG_DONTWAIT)
+            return -EBUSY;
+        condition_wait(&q->not_empty);
+    }
+
+    msg = &q->msgs[q->head];
+
+    pages = memory_alloc_page();
+    for (i = 0; i < msg->npages; i++)
+        pages[i] = q->pages[(q->page_head + i) % MSGQ_MAXPAGES];
+
+    result = memory_give_pages(pages, msg->npages);
+    memory_free_page(pages);
+
+    if (result < 0)
+        return result;
+
+    q->head = (q->head + 1) % MSGQ_MAXMSGS;
+    q->cnt -= 1;
+    q->page_head = (q->page_head + msg->npages) % MSGQ_MAXPAGES;
+    q->page_cnt -= msg->npages;
+    condition_broadcast(&q->not_full);
+
+    // msg stays intact until the next send, which cannot run before we return
+
+    *lenp = msg->len;
+    return result + msg->offset;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void msgq_close(struct io_intf * io) {
+    struct msgq * const q = (struct msgq *)io;
+
+    while (q->page_cnt != 0) {
+        memory_free_page(q->pages[q->page_head]);
+        q->page_head = (q->page_head + 1) % MSGQ_MAXPAGES;
+        q->page_cnt -= 1;
+    }
+
+    kfree(q);
+}
+
+static inline int has_room(const struct msgq * q, unsigned int npages) {
+    return (q->cnt + q->resv_msgs < MSGQ_MAXMSGS &&
+        q->page_cnt + q->resv_pages + npages <= MSGQ_MAXPAGES);
+}
+
+// Fills the entries of pages for the partial pages at either end of
+// [start,end) with copies, zero outside the range; the entries for pages
+// wholly inside the range are left for memory_take_pages. The source is
+// pinned while it is copied, so the copy cannot fault. On failure nothing
+// stays allocated.
+
+static int copy_ends (
+    uintptr_t start, uintptr_t end, void ** pages, unsigned int npages)
+{
+    const uintptr_t first = PAGE_DOWN(start);
+    uintptr_t pstart, pend;
+    unsigned int i;
+    int result;
+
+    for (i = 0; i < npages; i++) {
+        pstart = first + i * PAGE_SIZE;
+        pend = pstart + PAGE_SIZE;
+
+        if (start <= pstart && pend <= end) {
+            pages[i] = NULL;
+            continue;
+        }
+
+        pstart = MAX(pstart, start);
+        pend = MIN(pend, end);
+
+        result = memory_pin_range(pstart, pend - pstart, PTE_R);
+        if (result < 0)
+            break;
+
+        pages[i] = memory_alloc_page();
+        if (pages[i] == NULL) {
+            memory_unpin_range(pstart, pend - pstart);
+            result = -ENOMEM;
+            break;
+        }
+
+        memset(pages[i], 0, PAGE_SIZE);
+        memcpy(pages[i] + pstart % PAGE_SIZE, (void *)pstart, pend - pstart);
+        memory_unpin_range(pstart, pend - pstart);
+    }
+
+    if (i < npages) {
+        free_ends(start, first + i * PAGE_SIZE, pages, i);
+        return result;
+    }
+
+    return 0;
+}
+
+// Frees the copies copy_ends made of the partial pages of [start,end).
+
+static void free_ends (
+    uintptr_t start, uintptr_t end, void ** pages, unsigned int npages)
+{
+    const uintptr_t first = PAGE_DOWN(start);
+    uintptr_t pstart;
+    unsigned int i;
+
+    for (i = 0; i < npages; i++) {
+        pstart = first + i * PAGE_SIZE;
+        if (pstart < start || end < pstart + PAGE_SIZE)
+            memory_free_page(pages[i]);
+    }
+}
@@ -0,0 +1,69 @@
+// msgq.h - Page-transfer message queues
+//
+// A message queue carries buffers between processes that share its file
+// descriptor (e.g. across fork). Sending a buffer moves the physical pages
+// that lie entirely inside it from the sender to the queue, and receiving
+// maps them into the receiver at an address chosen by the kernel, so a large
+// message costs page table updates rather than copies. The pages leave the
+// sender: its region stays, but the range reads as freshly zeroed (or
+// reloaded from its file) afterwards. Partial pages at the head and tail of
+// the buffer are copied into new pages, at the same offsets, so the message
+// is contiguous in the receiver and keeps the alignment it had in the sender.
+//
+// A receiver owns the region its message arrives in and releases it with
+// munmap.
+//
+
+#ifndef _MSGQ_H_
+#define _MSGQ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// MSGQ_MAXMSGS is the number of messages a queue holds and MSGQ_MAXPAGES the
+// number of pages queued in all of them; a sender blocks when either limit
+// would be exceeded. A single message may span at most MSGQ_MAXPAGES pages.
+
+#ifndef MSGQ_MAXMSGS
+#define MSGQ_MAXMSGS 8
+#endif
+
+#ifndef MSGQ_MAXPAGES
+#define MSGQ_MAXPAGES 256
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// Flags of msgq_send and msgq_recv. Mirrored in user/syscall.h.
+
+#define MSG_DONTWAIT    (1 << 0) // fail with -EBUSY instead of blocking
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Creates an empty queue. Returns 0 and the io interface in *ioptr, or
+// -ENOMEM.
+
+extern int msgq_open(struct io_intf ** ioptr);
+
+// Sends len bytes at buf (in the current process) on the queue io. Blocks
+// while the queue is full. Returns 0, -EBADFD if io is not a queue, -EINVAL
+// for an empty, unreadable or too large buffer, or -EBUSY (MSG_DONTWAIT).
+
+extern long msgq_send (
+    struct io_intf * io, const void * buf, size_t len, int flags);
+
+// Receives the oldest message on the queue io into a new region of the
+// current process. Blocks while the queue is empty. Returns the address of
+// the message and its length in *lenp, or a negative error code, in which
+// case the message stays queued.
+
+extern long msgq_recv(struct io_intf * io, size_t * lenp, int flags);
+
+#endif // _MSGQ_H_
@@ -98,6 +98,14 @@ extern void plic_close_irq(int irqno)
     plic_complete_context_interrupt(1, irqno);
 }
 
+void plic_reset(void)
+{
+    int i;
+
+    for (i = 0; i < PLIC_SRCCNT; i++)
+        plic_set_source_priority(i, 0);
+}
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
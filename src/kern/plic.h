@@ -11,6 +11,10 @@
 
 extern void plic_init(void);
 
+// Turns off every source again, as plic_init leaves them. Used by kexec.
+
+extern void plic_reset(void);
+
 extern void plic_enable_irq(int irqno, int prio);
 extern void plic_disable_irq(int irqno);
 
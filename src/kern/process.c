@@ -2,6 +2,7 @@
 //
 
 #include "process.h"
+#include "flock.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -15,10 +16,11 @@
 // COMPILE-TIME PARAMETERS
 //
 
-// NPROC is the maximum number of processes
+// USER_STACK_SIZE is the size of the region reserved for the user stack below
+// USER_STACK_VMA. Stack pages are allocated on first touch.
 
-#ifndef NPROC
-#define NPROC 16
+#ifndef USER_STACK_SIZE
+#define USER_STACK_SIZE (8*1024*1024)
 #endif
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -27,8 +29,6 @@
 // INTERNAL GLOBAL VARIABLES
 //
 
-#define MAIN_PID 0
-
 // The main user process struct
 
 static struct process main_proc;
@@ -68,6 +68,11 @@ void procmgr_init(void) {
     for (int i = 0; i < PROCESS_IOMAX; i++) {
         main_proc.iotab[i] = NULL;
     }
+    vma_tree_init(&main_proc.vmas);
+    main_proc.ws.active = 0;
+    main_proc.idle_mark = 0;
+    main_proc.uffd = NULL;
+    ioprio_init(&main_proc.ioprio);
 
     // mark process as initialized
     procmgr_initialized = 1;
@@ -87,10 +92,19 @@ void procmgr_init(void) {
  */
 int process_exec(struct io_intf * exeio) {
     // get current process, "convert" the current running process to to-be-executed thread
-//    struct process *proc = current_process();
+    struct process *proc = current_process();
+    struct vma stack = {
+        .start = USER_STACK_VMA - USER_STACK_SIZE,
+        .end = USER_STACK_VMA,
+        .prot = PTE_R | PTE_W,
+        .flags = VMA_STACK,
+        .backing = VMA_ANON
+    };
 
     // Step 1: any virtual memory mappings belonging to other user processes should be unmapped.
     memory_unmap_and_free_user();
+    vma_clear(&proc->vmas);
+    uffd_detach(proc);
 
     // Step 2: a fresh 2nd level (root) page table should be created and initialized with the default mappings for a user process
     // proc->mtag = memory_space_create(proc->id);
@@ -110,6 +124,18 @@ int process_exec(struct io_intf * exeio) {
     }
     debug("Pass elf loader with entry_point = %p", entry_point);
 
+    // The stack is the only region not described by the executable
+    if (vma_insert(&proc->vmas, &stack, &ret) == NULL)
+        return ret;
+
+    // Image pages are paged in from exeio on demand; prefetch the ones this
+    // program needed early on last time
+    wset_exec(proc, exeio);
+
+    // The image regions hold their own references to exeio. The caller's
+    // reference (the fd sysexec took it from) is dropped here.
+    ioclose(exeio);
+
     // Step 4: the thread associated with the process needs to be started in user-mode. 
     // (Hint: An assembly function in thrasm.s would be useful here)
     // It is up to the process exec function to fill in the proper values for SPP and SPIE
@@ -140,13 +166,24 @@ int process_exec(struct io_intf * exeio) {
 void __attribute__ ((noreturn)) process_exit(void) {
     trace("%s: process %d exits.", __func__, current_process()->id);
     // release memory space
+    struct process* proc = current_process();
+    wset_commit(proc);
+    uffd_detach(proc);
     memory_unmap_and_free_user();
     memory_space_reclaim();
-    // terminate current process
-    struct process* proc = current_process();
+    vma_clear(&proc->vmas);
+    // drop byte-range locks, waking processes that wait for them
+    flock_release(proc->id);
+    // hand orphaned children to init so a recycled pid does not adopt them
+    for (int i = 0; i < NPROC; i++) {
+        if (proctab[i] != NULL && proctab[i] != proc && proctab[i]->ppid == proc->id)
+            proctab[i]->ppid = MAIN_PID;
+    }
+    // terminate current process; objects shared with other processes (e.g.
+    // inherited across fork) stay open until their last reference is dropped
     for (int i = 0; i < PROCESS_IOMAX; i++) {
         if (proc->iotab[i]) {
-            proc->iotab[i]->ops->close(proc->iotab[i]);
+            ioclose(proc->iotab[i]);
             proc->iotab[i] = NULL;
         }
     }
@@ -185,6 +222,17 @@ struct process* process_fork(int pid) {
     // create child process
     struct process* child_proc = kmalloc(sizeof(struct process));
     child_proc->id = new_pid;
+    child_proc->ppid = pid;
+    child_proc->ws.active = 0;
+    child_proc->idle_mark = proctab[pid]->idle_mark;
+    child_proc->uffd = NULL;
+    ioprio_fork(&child_proc->ioprio, &proctab[pid]->ioprio);
+
+    // copy the region tree first; it is the only step that can fail
+    if (vma_clone(&child_proc->vmas, &proctab[pid]->vmas) < 0) {
+        kfree(child_proc);
+        return NULL;
+    }
 
     // clone parent memory space to child's
     child_proc->mtag = memory_space_clone(child_proc->id);
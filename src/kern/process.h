@@ -8,6 +8,16 @@
 #define PROCESS_IOMAX 16
 #endif
 
+// NPROC is the maximum number of processes
+
+#ifndef NPROC
+#define NPROC 16
+#endif
+
+// init always runs as MAIN_PID; it alone may use privileged operations
+
+#define MAIN_PID 0
+
 #include "config.h"
 #include "io.h"
 #include "thread.h"
@@ -20,22 +30,32 @@
 #include "config.h"
 #include "intr.h"
 #include "heap.h"
+#include "vma.h"
+#include "wset.h"
+#include "uffd.h"
+#include "ioprio.h"
 
 // EXPORTED TYPE DEFINITIONS
 //
 
 struct process {
     int id; // process id of this process
+    int ppid; // process id of the parent (init is its own parent)
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct vma_tree vmas; // valid user regions and their backing
+    struct wset_record ws; // image faults recorded after exec
+    uint64_t idle_mark; // time of the last PGIDLE_MARK (ticks)
+    struct uffd * uffd; // userfaultfd handling missing pages, or NULL
+    struct ioprio ioprio; // block I/O class and rate limits
 };
 
 // EXPORTED VARIABLES DECLARATIONS
 //
 
 extern char procmgr_initialized;
-extern struct process * proctab[];
+extern struct process * proctab[NPROC];
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -53,6 +73,8 @@ extern void process_terminate(int pid);
 static inline struct process * current_process(void);
 // Returns the process ID of the process associated with the currently running thread.
 static inline int current_pid(void);
+// Returns 1 if the currently running thread belongs to init, 0 otherwise.
+static inline int current_privileged(void);
 // Fork a child process
 extern struct process * process_fork(int pid);
 
@@ -91,4 +113,23 @@ static inline int current_pid(void) {
     return thread_process(running_thread())->id;
 }
 
+/**
+ * static inline int current_privileged(void);
+ *
+ * Checks whether the currently running thread may use privileged operations,
+ * such as kexec, which only init (MAIN_PID) may.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          1 if the thread belongs to init, 0 otherwise (including kernel
+ *          threads without a process).
+ * Side Effects:
+ *          None.
+ */
+static inline int current_privileged(void) {
+    const struct process * const proc = current_process();
+    return (proc != NULL && proc->id == MAIN_PID);
+}
+
 #endif // _PROCESS_H_
@@ -22,5 +22,21 @@
 #define SYSCALL_WAIT    41
 #define SYSCALL_PIOREF  42
 
+#define SYSCALL_MMAP    50
+#define SYSCALL_MUNMAP  51
+#define SYSCALL_MADVISE 52
+#define SYSCALL_PGIDLE  53
+#define SYSCALL_COMPACT 54
+#define SYSCALL_UFFD    55
+#define SYSCALL_SNAPSHOT 56
+#define SYSCALL_RESTORE 57
+#define SYSCALL_MSGQ    58
+#define SYSCALL_MSGSEND 59
+#define SYSCALL_MSGRECV 60
+#define SYSCALL_DEFRAG  61
+#define SYSCALL_IOPRIO  62
+#define SYSCALL_KEXEC   63
+#define SYSCALL_FLOCK   64
+
 
 #endif // _SCNUM_H_
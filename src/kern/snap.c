@@ -0,0 +1,462 @@
+// snap.c - Process snapshot and restore
+//
+
+#include "snap.h"
+
+#include "process.h"
+#include "memory.h"
+#include "vma.h"
+#include "fs.h"
+#include "string.h"
+#include "error.h"
+#include "console.h"
+
+#ifdef SNAP_TRACE
+#define TRACE
+#endif
+
+#ifdef SNAP_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define SNAP_MAGIC      0x50414e53 // "SNAP"
+#define SNAP_VERSION    1
+
+// Kinds of address ranges
+
+#define SNAP_REG_ANON   0 // untouched pages, zero-filled on first touch
+#define SNAP_REG_DATA   1 // pages saved in the file at offset
+
+// Kinds of descriptors
+
+#define SNAP_FD_NONE    0 // not open
+#define SNAP_FD_FILE    1 // KFS file, reopened by inode
+#define SNAP_FD_KEEP    2 // device, taken over from the restoring process
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// The first page of a snapshot file holds the header. The saved pages follow
+// it, the pages of each SNAP_REG_DATA range contiguously and in address order.
+
+struct snap_range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;    // file offset of the first page (SNAP_REG_DATA)
+    uint8_t kind;       // SNAP_REG_ANON or SNAP_REG_DATA
+    uint8_t prot;       // from the region (struct vma)
+    uint8_t flags;
+    uint8_t advice;
+    uint32_t reserved;
+};
+
+struct snap_fd {
+    uint32_t kind;      // SNAP_FD_NONE, SNAP_FD_FILE or SNAP_FD_KEEP
+    uint32_t ino;       // inode of the file (SNAP_FD_FILE)
+    uint64_t pos;       // file position (SNAP_FD_FILE)
+};
+
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nranges;
+    uint32_t npages;    // number of saved pages
+    uint64_t x[32];     // registers, as in struct trap_frame
+    uint64_t sepc;      // return address of the snapshot system call
+    struct snap_fd fds[PROCESS_IOMAX];
+    struct snap_range ranges[SNAP_MAXREGIONS];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int open_file(const char * path, struct io_intf ** ioptr);
+static int write_at (
+    struct io_intf * io, uint64_t pos, const void * buf, size_t len);
+static int save_region (
+    struct snap_header * hdr, const struct vma * v, struct io_intf * io,
+    uint64_t * posp, void * buf);
+static int add_page (
+    struct snap_header * hdr, const struct vma * v, uintptr_t vma,
+    int kind, uint64_t pos);
+static int check_header(const struct snap_header * hdr, uint64_t len);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * int snap_save(const char * path, const struct trap_frame * tfr);
+ *
+ * Writes a snapshot of the current process to a KFS file.
+ *
+ * Inputs:
+ *          path - name of the snapshot file (in the caller's space)
+ *          tfr - trap frame of the snapshot system call
+ * Outputs:
+ *          0 on success, or a negative error code.
+ * Side Effects:
+ *          Overwrites the file. A snapshot that fails part way leaves the
+ *          file without a valid header.
+ */
+int snap_save(const char * path, const struct trap_frame * tfr) {
+    struct process * const proc = current_process();
+    struct snap_header * hdr;
+    struct io_intf * io;
+    struct vma * v;
+    uint32_t ino, vino;
+    uint64_t pos;
+    void * buf;
+    int result;
+    int i;
+
+    result = open_file(path, &io);
+    if (result < 0)
+        return result;
+
+    if (ioctl(io, IOCTL_GETINO, &ino) < 0) {
+        ioclose(io);
+        return -EINVAL;
+    }
+
+    // Pages of a process restored from this file may still be read from it.
+    // Overwriting the file under them would mix old and new contents.
+
+    for (v = vma_find_ge(&proc->vmas, 0); v != NULL;
+        v = vma_next(&proc->vmas, v))
+    {
+        if (v->backing == VMA_FILE &&
+            ioctl(v->io, IOCTL_GETINO, &vino) == 0 && vino == ino)
+        {
+            ioclose(io);
+            return -EBUSY;
+        }
+    }
+
+    hdr = memory_alloc_page();
+    buf = memory_alloc_page();
+    memset(hdr, 0, PAGE_SIZE);
+
+    // Invalidate the old snapshot before overwriting its pages
+
+    result = write_at(io, 0, hdr, PAGE_SIZE);
+    if (result < 0)
+        goto done;
+
+    pos = PAGE_SIZE;
+
+    for (v = vma_find_ge(&proc->vmas, 0); v != NULL;
+        v = vma_next(&proc->vmas, v))
+    {
+        result = save_region(hdr, v, io, &pos, buf);
+        if (result < 0)
+            goto done;
+    }
+
+    for (i = 0; i < PROCESS_IOMAX; i++) {
+        if (proc->iotab[i] == NULL)
+            hdr->fds[i].kind = SNAP_FD_NONE;
+        else if (ioctl(proc->iotab[i], IOCTL_GETINO, &hdr->fds[i].ino) == 0 &&
+            ioctl(proc->iotab[i], IOCTL_GETPOS, &hdr->fds[i].pos) == 0)
+            hdr->fds[i].kind = SNAP_FD_FILE;
+        else
+            hdr->fds[i].kind = SNAP_FD_KEEP;
+    }
+
+    memcpy(hdr->x, tfr->x, sizeof(hdr->x));
+    hdr->sepc = tfr->sepc;
+    hdr->npages = (pos - PAGE_SIZE) / PAGE_SIZE;
+    hdr->version = SNAP_VERSION;
+    hdr->magic = SNAP_MAGIC;
+
+    result = write_at(io, 0, hdr, PAGE_SIZE);
+
+    trace("%s: %s: %u pages in %u ranges", __func__,
+        path, hdr->npages, hdr->nranges);
+
+done:
+    memory_free_page(buf);
+    memory_free_page(hdr);
+    ioclose(io);
+    return result;
+}
+
+/**
+ * int snap_restore(const char * path, struct trap_frame * tfr);
+ *
+ * Replaces the image of the current process with a snapshot.
+ *
+ * Inputs:
+ *          path - name of the snapshot file (in the caller's space)
+ *          tfr - trap frame of the restore system call
+ * Outputs:
+ *          1 on success, or a negative error code.
+ * Side Effects:
+ *          Frees the user memory and regions of the process, replaces its
+ *          open files and overwrites the registers in tfr. Calls
+ *          process_exit if the snapshot cannot be installed.
+ */
+int snap_restore(const char * path, struct trap_frame * tfr) {
+    struct process * const proc = current_process();
+    struct io_intf * fdio[PROCESS_IOMAX] = { NULL };
+    const struct snap_range * r;
+    struct snap_header * hdr;
+    struct io_intf * io;
+    struct vma tmpl;
+    uint64_t len;
+    long cnt;
+    int result;
+    int i;
+
+    result = open_file(path, &io);
+    if (result < 0)
+        return result;
+
+    hdr = memory_alloc_page();
+
+    cnt = (ioseek(io, 0) < 0) ? -EIO : ioread_full(io, hdr, PAGE_SIZE);
+    if (cnt != PAGE_SIZE) {
+        result = (cnt < 0) ? (int)cnt : -EBADFMT;
+        goto fail;
+    }
+
+    len = 0; // KFS reports 32 bits
+    if (ioctl(io, IOCTL_GETLEN, &len) < 0) {
+        result = -EIO;
+        goto fail;
+    }
+
+    result = check_header(hdr, len);
+    if (result < 0)
+        goto fail;
+
+    // Reopen the files while the old image is still intact, so that a missing
+    // file can be reported to it
+
+    for (i = 0; i < PROCESS_IOMAX; i++) {
+        if (hdr->fds[i].kind != SNAP_FD_FILE)
+            continue;
+
+        result = fs_open_ino(hdr->fds[i].ino, &fdio[i]);
+        if (result < 0)
+            goto fail;
+
+        fdio[i]->refcnt = 1;
+        result = ioseek(fdio[i], hdr->fds[i].pos);
+        if (result < 0)
+            goto fail;
+    }
+
+    // Release the old image (path is not accessible after this)
+
+    wset_commit(proc);
+    uffd_detach(proc);
+    memory_unmap_and_free_user();
+    vma_clear(&proc->vmas);
+
+    for (i = 0; i < PROCESS_IOMAX; i++) {
+        if (hdr->fds[i].kind == SNAP_FD_KEEP)
+            continue;
+        if (proc->iotab[i] != NULL)
+            ioclose(proc->iotab[i]);
+        proc->iotab[i] = fdio[i];
+    }
+
+    // Saved pages become a private mapping of the snapshot file
+
+    for (i = 0; i < hdr->nranges; i++) {
+        r = &hdr->ranges[i];
+
+        memset(&tmpl, 0, sizeof(tmpl));
+        tmpl.start = r->start;
+        tmpl.end = r->end;
+        tmpl.prot = r->prot;
+        tmpl.flags = r->flags;
+        tmpl.advice = r->advice;
+
+        if (r->kind == SNAP_REG_DATA) {
+            tmpl.backing = VMA_FILE;
+            tmpl.io = io;
+            tmpl.offset = r->offset;
+            tmpl.filesz = r->end - r->start;
+        } else
+            tmpl.backing = VMA_ANON;
+
+        if (vma_insert(&proc->vmas, &tmpl, &result) == NULL) {
+            kprintf("Thread <%s:%d>: cannot restore snapshot (error %d)\n",
+                thread_name(running_thread()), running_thread(), result);
+            memory_free_page(hdr);
+            ioclose(io);
+            process_exit();
+        }
+    }
+
+    memcpy(tfr->x, hdr->x, sizeof(tfr->x));
+    tfr->sepc = hdr->sepc;
+
+    trace("%s: restored %u ranges, %u pages", __func__,
+        hdr->nranges, hdr->npages);
+
+    // The regions hold their own references to the file
+
+    memory_free_page(hdr);
+    ioclose(io);
+    return 1;
+
+fail:
+    for (i = 0; i < PROCESS_IOMAX; i++) {
+        if (fdio[i] != NULL)
+            ioclose(fdio[i]);
+    }
+
+    memory_free_page(hdr);
+    ioclose(io);
+    return result;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static int open_file(const char * path, struct io_intf ** ioptr) {
+    int result;
+
+    if (path == NULL)
+        return -EINVAL;
+
+    result = fs_open(path, ioptr);
+    if (result < 0)
+        return result;
+
+    (*ioptr)->refcnt = 1;
+    return 0;
+}
+
+// Writes len bytes at pos. A KFS file ends its writes at the last allocated
+// block, so a short write means the file is too small.
+
+static int write_at (
+    struct io_intf * io, uint64_t pos, const void * buf, size_t len)
+{
+    long cnt;
+
+    if (ioseek(io, pos) < 0)
+        return -EIO;
+
+    cnt = iowrite(io, buf, len);
+    if (cnt < 0)
+        return (int)cnt;
+
+    return (cnt == len) ? 0 : -ENOSPC;
+}
+
+// Saves the pages of one region. Every page is classified with
+// memory_read_page, which also fills buf; saved pages are appended to the
+// file at *posp.
+
+static int save_region (
+    struct snap_header * hdr, const struct vma * v, struct io_intf * io,
+    uint64_t * posp, void * buf)
+{
+    uintptr_t vma;
+    int result;
+    int saved;
+
+    for (vma = v->start; vma < v->end; vma += PAGE_SIZE) {
+        saved = memory_read_page(v, vma, buf);
+        if (saved < 0)
+            return saved;
+
+        if (saved) {
+            result = write_at(io, *posp, buf, PAGE_SIZE);
+            if (result < 0)
+                return result;
+        }
+
+        result = add_page(hdr, v, vma,
+            saved ? SNAP_REG_DATA : SNAP_REG_ANON, *posp);
+        if (result < 0)
+            return result;
+
+        if (saved)
+            *posp += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+// Adds a page to the last range if it continues it (same kind and attributes,
+// and for saved pages the next page in the file), or starts a new range.
+
+static int add_page (
+    struct snap_header * hdr, const struct vma * v, uintptr_t vma,
+    int kind, uint64_t pos)
+{
+    struct snap_range * r;
+
+    if (hdr->nranges != 0) {
+        r = &hdr->ranges[hdr->nranges-1];
+
+        if (r->end == vma && r->kind == kind && r->prot == v->prot &&
+            r->flags == v->flags && r->advice == v->advice &&
+            (kind == SNAP_REG_ANON || r->offset + (r->end - r->start) == pos))
+        {
+            r->end += PAGE_SIZE;
+            return 0;
+        }
+    }
+
+    if (hdr->nranges == SNAP_MAXREGIONS)
+        return -ENOSPC;
+
+    r = &hdr->ranges[hdr->nranges++];
+    r->start = vma;
+    r->end = vma + PAGE_SIZE;
+    r->offset = (kind == SNAP_REG_DATA) ? pos : 0;
+    r->kind = kind;
+    r->prot = v->prot;
+    r->flags = v->flags;
+    r->advice = v->advice;
+    return 0;
+}
+
+// Checks everything restore relies on before the old image is released:
+// ranges are page aligned, sorted, inside the user address range, and their
+// saved pages lie within the file.
+
+static int check_header(const struct snap_header * hdr, uint64_t len) {
+    const struct snap_range * r;
+    uint64_t prev_end = 0;
+    int i;
+
+    if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION ||
+        hdr->nranges > SNAP_MAXREGIONS)
+        return -EBADFMT;
+
+    for (i = 0; i < hdr->nranges; i++) {
+        r = &hdr->ranges[i];
+
+        if (r->end <= r->start || r->start < prev_end ||
+            r->start % PAGE_SIZE != 0 || r->end % PAGE_SIZE != 0 ||
+            r->start < USER_START_VMA || memory_user_end < r->end ||
+            (r->prot & ~(PTE_R | PTE_W | PTE_X)) != 0)
+            return -EBADFMT;
+
+        if (r->kind == SNAP_REG_DATA) {
+            if (r->offset < PAGE_SIZE || r->offset % PAGE_SIZE != 0 ||
+                len < r->offset || len - r->offset < r->end - r->start)
+                return -EBADFMT;
+        } else if (r->kind != SNAP_REG_ANON)
+            return -EBADFMT;
+
+        prev_end = r->end;
+    }
+
+    for (i = 0; i < PROCESS_IOMAX; i++) {
+        if (hdr->fds[i].kind > SNAP_FD_KEEP)
+            return -EBADFMT;
+    }
+
+    return 0;
+}
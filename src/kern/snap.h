@@ -0,0 +1,56 @@
+// snap.h - Process snapshot and restore
+//
+// A snapshot saves the state of a user process in a KFS file: the contents of
+// every page that differs from zero, the regions of its address space, the
+// files it has open and its registers at the snapshot system call. Restoring
+// a snapshot replaces the image of the calling process, much like exec, and
+// resumes it where the snapshot was taken. Page contents are not read at
+// restore time: the saved pages become file-backed regions on the snapshot
+// file and are faulted in on first touch, so a warm start costs a header read
+// plus whatever the program touches afterwards.
+//
+// The snapshot system call returns 0 to the process that took the snapshot
+// and 1 in a process that was restored from it, so a program can skip its
+// initialization when it is started from a snapshot.
+//
+// KFS files cannot grow, so the snapshot file must exist and be large enough
+// to hold a page of metadata plus the saved pages.
+//
+
+#ifndef _SNAP_H_
+#define _SNAP_H_
+
+#include "trap.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// SNAP_MAXREGIONS is the number of address ranges a snapshot can describe.
+// Each region of the process takes at least one; a region with both saved and
+// untouched pages takes one per run of either.
+
+#ifndef SNAP_MAXREGIONS
+#define SNAP_MAXREGIONS 96
+#endif
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Saves the current process in the KFS file /path/. tfr is the trap frame of
+// the system call, whose registers are saved. Returns 0 or a negative error
+// code: -ENOSPC if the file is too small or the address space too fragmented,
+// -EBUSY if the process has pages backed by the file itself.
+
+extern int snap_save(const char * path, const struct trap_frame * tfr);
+
+// Replaces the image of the current process with the snapshot in /path/.
+// Open files are reopened at their saved positions; devices that were open
+// are taken over from the calling process at the same descriptor. On success
+// tfr holds the saved registers and the function returns 1, which becomes the
+// return value of the snapshot system call in the restored program. Errors
+// found before the old image is released are returned (-EBADFMT for a file
+// that does not hold a snapshot); a failure after that ends the process.
+
+extern int snap_restore(const char * path, struct trap_frame * tfr);
+
+#endif // _SNAP_H_
@@ -1,5 +1,16 @@
         .section	.text
         
+        # A warm boot from kexec (kexecasm.s) passes the region handed over by
+        # the old kernel in a0 and a1, and KEXEC_MAGIC (kexec.h) in a2.
+
+        li      t0, 0x6b65786563
+        bne     a2, t0, 2f
+        la      t0, kexec_handoff_pa
+        sd      a0, 0(t0)
+        la      t0, kexec_handoff_len
+        sd      a1, 0(t0)
+2:
+
         # Delegate to S mode all S mode interrupts and all exceptions except
         # ecall from S mode and M mode; ecalls from S mode are used to provide
         # access to the timer to S mode. Enable M mode interrupts.
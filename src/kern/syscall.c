@@ -10,6 +10,22 @@
 #include "memory.h"
 #include "timer.h"
 #include "thread.h"
+#include "snap.h"
+#include "msgq.h"
+#include "fs.h"
+#include "ioprio.h"
+#include "kexec.h"
+#include "flock.h"
+#include "uffd.h"
+#include "vioblk.h"
+#include "cowblk.h"
+
+// Largest part of a read or write buffer pinned at a time (see sysread)
+#ifndef SYSCALL_PIN_MAX
+#define SYSCALL_PIN_MAX (64 * PAGE_SIZE)
+#endif
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
 
 // Add declarations
 extern int fs_open(const char *name, struct io_intf **io_ptr);
@@ -317,13 +333,36 @@ static long sysread(int fd, void *buf, size_t bufsz)
         return -EINVAL;
     }
 
-    // Perform read operation
-    long bytes_read = ioread(io, buf, bufsz);
+    // Pay for earlier block I/O if the process is rate limited
+    ioprio_throttle();
 
-    if (bytes_read < 0)
+    // Perform read operation. The buffer is faulted in and pinned first, a
+    // part at a time, so that the driver never takes a page fault on it:
+    // filling a page of a file mapping reads the file, and fs_read holds the
+    // file system lock while it copies. A part that comes back short ends
+    // the read.
+    long bytes_read = 0;
+    while (bytes_read < bufsz)
     {
-        debug("sysread: Read failed with error %ld\n", bytes_read);
-        return bytes_read;
+        size_t n = MIN(bufsz - bytes_read, SYSCALL_PIN_MAX);
+        if (memory_pin_range((uintptr_t)buf + bytes_read, n, PTE_W) < 0)
+        {
+            debug("sysread: Invalid buffer\n");
+            return (bytes_read != 0) ? bytes_read : -EINVAL;
+        }
+
+        long result = ioread(io, buf + bytes_read, n);
+        memory_unpin_range((uintptr_t)buf + bytes_read, n);
+
+        if (result < 0)
+        {
+            debug("sysread: Read failed with error %ld\n", result);
+            return (bytes_read != 0) ? bytes_read : result;
+        }
+
+        bytes_read += result;
+        if (result < n)
+            break;
     }
 
     debug("sysread: Successfully read %ld bytes\n", bytes_read);
@@ -373,19 +412,112 @@ static long syswrite(int fd, const void *buf, size_t len)
         return -EINVAL;
     }
 
-    // Perform write operation
-    long bytes_written = iowrite(io, buf, len);
+    // Pay for earlier block I/O if the process is rate limited
+    ioprio_throttle();
 
-    if (bytes_written < 0)
+    // Perform write operation, pinning the buffer as sysread does
+    long bytes_written = 0;
+    while (bytes_written < len)
     {
-        debug("syswrite: Write failed with error %ld\n", bytes_written);
-        return bytes_written;
+        size_t n = MIN(len - bytes_written, SYSCALL_PIN_MAX);
+        if (memory_pin_range((uintptr_t)buf + bytes_written, n, PTE_R) < 0)
+        {
+            debug("syswrite: Invalid buffer\n");
+            return (bytes_written != 0) ? bytes_written : -EINVAL;
+        }
+
+        long result = iowrite(io, buf + bytes_written, n);
+        memory_unpin_range((uintptr_t)buf + bytes_written, n);
+
+        if (result < 0)
+        {
+            debug("syswrite: Write failed with error %ld\n", result);
+            return (bytes_written != 0) ? bytes_written : result;
+        }
+
+        bytes_written += result;
+        if (result < n)
+            break;
     }
 
     debug("syswrite: Successfully wrote %ld bytes\n", bytes_written);
     return bytes_written;
 }
 
+/*******************************************************************************
+ * Function: ioctl_arg
+ *
+ * Description: Looks up the argument of an ioctl command a process may issue.
+ *
+ * Inputs:
+ * cmd (int) - ioctl command
+ * sizeptr (size_t *) - Receives the size of the object arg points to, 0 if
+ *   the argument is ignored
+ * flagsptr (uint_fast8_t *) - Receives PTE_R, plus PTE_W if the driver
+ *   writes to the object
+ *
+ * Output:
+ * Returns 1 if arg may be NULL, 0 if it may not, -EINVAL for a command that
+ * is not known here
+ *
+ * Side Effects: None
+ ******************************************************************************/
+static int ioctl_arg(int cmd, size_t *sizeptr, uint_fast8_t *flagsptr)
+{
+    *flagsptr = PTE_R;
+
+    switch (cmd)
+    {
+    case IOCTL_FLUSH:
+    case IOCTL_BLKQ_NOTIFY:
+        *sizeptr = 0;
+        return 1;
+    case IOCTL_GETLEN:
+    case IOCTL_GETPOS:
+        *flagsptr = PTE_R | PTE_W;
+        // fall through
+    case IOCTL_SETLEN:
+    case IOCTL_SETPOS:
+        *sizeptr = sizeof(uint64_t);
+        return 0;
+    case IOCTL_GETBLKSZ:
+    case IOCTL_GETINO:
+        *flagsptr = PTE_R | PTE_W;
+        *sizeptr = sizeof(uint32_t);
+        return 0;
+    case IOCTL_SETDIRECT:
+        *sizeptr = sizeof(int);
+        return 0;
+    case IOCTL_UFFD_REGISTER:
+    case IOCTL_UFFD_UNREGISTER:
+        *sizeptr = sizeof(struct uffd_range);
+        return 0;
+    case IOCTL_UFFD_COPY:
+    case IOCTL_UFFD_ZERO:
+        *sizeptr = sizeof(struct uffd_copy);
+        return 0;
+    case IOCTL_BLKQ_CLAIM:
+        *flagsptr = PTE_R | PTE_W;
+        *sizeptr = sizeof(struct blkq_claim);
+        return 0;
+    case IOCTL_BLKQ_WAIT:
+        *flagsptr = PTE_R | PTE_W;
+        *sizeptr = sizeof(uint16_t);
+        return 0;
+    case IOCTL_COW_STAT:
+        *flagsptr = PTE_R | PTE_W;
+        *sizeptr = sizeof(struct cow_stat);
+        return 0;
+    case IOCTL_COW_COMMIT:
+        *flagsptr = PTE_R | PTE_W;
+        *sizeptr = sizeof(uint64_t);
+        return 1;
+    default:
+        // including IOCTL_PMEM_DAX, whose kernel address is for the kernel only
+        return -EINVAL;
+    }
+}
+
 /*******************************************************************************
  * Function: sysioctl
  *
@@ -397,7 +529,9 @@ static long syswrite(int fd, const void *buf, size_t len)
  * arg (void *) - Argument for ioctl command
  *
  * Output:
- * Returns 0 on success, negative error code on failure
+ * Returns the driver's result: 0 or a count (e.g. bytes installed by
+ * IOCTL_UFFD_COPY) on success, -EINVAL for an unknown command or an arg that
+ * is not accessible user memory, negative error code on failure
  *
  * Side Effects:
  * - Performs ioctl operation and may modify the io object
@@ -422,9 +556,33 @@ static int sysioctl(int fd, int cmd, void *arg)
         return -EBADFD;
     }
 
+    // Drivers use arg directly, some while holding a lock, so the object it
+    // points to is checked and pinned as in sysread
+    size_t argsz;
+    uint_fast8_t argflags;
+    int optional = ioctl_arg(cmd, &argsz, &argflags);
+    if (optional < 0)
+    {
+        debug("sysioctl: Unknown command %d\n", cmd);
+        return -EINVAL;
+    }
+    if (argsz == 0)
+        arg = NULL;
+    else if (arg == NULL && !optional)
+        return -EINVAL;
+    if (arg != NULL &&
+        memory_pin_range((uintptr_t)arg, argsz, argflags) < 0)
+    {
+        debug("sysioctl: Bad arg=%p\n", arg);
+        return -EINVAL;
+    }
+
     // Run ioctl
     int result = ioctl(io, cmd, arg);
 
+    if (arg != NULL)
+        memory_unpin_range((uintptr_t)arg, argsz);
+
     if (result < 0)
     {
         debug("sysioctl: Command failed with error %ld\n", result);
@@ -432,7 +590,7 @@ static int sysioctl(int fd, int cmd, void *arg)
     }
 
     debug("sysioctl: Command completed\n");
-    return 0;
+    return result;
 }
 
 /*******************************************************************************
@@ -602,6 +760,549 @@ static int syspioref(){
     return 0;
 }
 
+/*******************************************************************************
+ * Function: sysmmap
+ *
+ * Description: Maps anonymous memory or a file into the address space of the
+ * current process. Pages are populated on first touch.
+ *
+ * Inputs:
+ * addr (void *) - Requested address; exact if MAP_FIXED is set, else a hint
+ * len (size_t) - Length of the mapping
+ * prot (int) - OR of PROT_READ, PROT_WRITE, PROT_EXEC
+ * flags (int) - OR of MAP_PRIVATE, MAP_FIXED, MAP_ANON
+ * fd (int) - File to map (ignored with MAP_ANON)
+ * offset (long) - Page-aligned offset into the file
+ *
+ * Output:
+ * Returns start address of the mapping, negative error code on failure
+ *
+ * Side Effects:
+ * - Adds a region to the process's region tree
+ ******************************************************************************/
+static long sysmmap(void *addr, size_t len, int prot, int flags, int fd, long offset)
+{
+    debug("sysmmap: addr=%p, len=%zu, prot=%x, flags=%x, fd=%d\n",
+          addr, len, prot, flags, fd);
+    struct process *proc = current_process();
+    struct io_intf *io = NULL;
+    uint_fast8_t rwx = 0;
+
+    if (prot & PROT_READ)
+        rwx |= PTE_R;
+    if (prot & PROT_WRITE)
+        rwx |= PTE_R | PTE_W; // W without R is reserved in the PTE encoding
+    if (prot & PROT_EXEC)
+        rwx |= PTE_X;
+
+    // Validate fd of a file mapping
+    if (!(flags & MAP_ANON))
+    {
+        if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+        {
+            debug("sysmmap: Bad fd=%d\n", fd);
+            return -EBADFD;
+        }
+        io = proc->iotab[fd];
+    }
+
+    if (offset < 0)
+        return -EINVAL;
+
+    return memory_mmap((uintptr_t)addr, len, rwx, flags, io, offset);
+}
+
+/*******************************************************************************
+ * Function: sysmunmap
+ *
+ * Description: Removes mappings in an address range of the current process.
+ *
+ * Inputs:
+ * addr (void *) - Page-aligned start of the range
+ * len (size_t) - Length of the range
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure
+ *
+ * Side Effects:
+ * - Frees the pages mapped in the range
+ ******************************************************************************/
+static int sysmunmap(void *addr, size_t len)
+{
+    debug("sysmunmap: addr=%p, len=%zu\n", addr, len);
+    return memory_munmap((uintptr_t)addr, len);
+}
+
+/*******************************************************************************
+ * Function: sysmadvise
+ *
+ * Description: Gives the kernel a hint about how a range will be accessed.
+ *
+ * Inputs:
+ * addr (void *) - Page-aligned start of the range
+ * len (size_t) - Length of the range
+ * advice (int) - One of the MADV_* values
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure
+ *
+ * Side Effects:
+ * - May change readahead of the range, populate it, or free its pages
+ ******************************************************************************/
+static int sysmadvise(void *addr, size_t len, int advice)
+{
+    debug("sysmadvise: addr=%p, len=%zu, advice=%d\n", addr, len, advice);
+    return memory_madvise((uintptr_t)addr, len, advice);
+}
+
+/*******************************************************************************
+ * Function: syspgidle
+ *
+ * Description: Idle page tracking. Marks the pages of a process idle, or
+ * reports which pages it has accessed since the last mark. A process may only
+ * track itself or its direct children.
+ *
+ * Inputs:
+ * pid (int) - Process to scan
+ * cmd (int) - PGIDLE_MARK or PGIDLE_QUERY
+ * info (struct pgidle_info *) - Range to scan; receives the page counts
+ *
+ * Output:
+ * Returns 0 on success, -EPERM if pid is neither the caller nor one of its
+ * children, negative error code on other failures
+ *
+ * Side Effects:
+ * - PGIDLE_MARK clears the accessed bits of the process's pages
+ ******************************************************************************/
+static int syspgidle(int pid, int cmd, struct pgidle_info *info)
+{
+    debug("syspgidle: pid=%d, cmd=%d\n", pid, cmd);
+
+    if (pid < 0 || pid >= NPROC || proctab[pid] == NULL)
+        return -EINVAL;
+
+    if (proctab[pid] != current_process() &&
+        proctab[pid]->ppid != current_process()->id)
+        return -EPERM;
+
+    if (memory_check_range((uintptr_t)info,
+        sizeof(struct pgidle_info), PTE_R | PTE_W) < 0)
+        return -EINVAL;
+
+    return memory_pgidle(proctab[pid], cmd, info);
+}
+
+/*******************************************************************************
+ * Function: syscompact
+ *
+ * Description: Compacts physical memory on demand and reports compaction
+ * statistics.
+ *
+ * Inputs:
+ * want (size_t) - Number of free megaranges wanted; 0 only reports
+ * stats (struct compact_stats *) - Receives the counters; may be NULL
+ *
+ * Output:
+ * Returns the number of free megaranges, or -EINVAL if stats is not writable
+ *
+ * Side Effects:
+ * - May move user pages of any process
+ ******************************************************************************/
+static long syscompact(size_t want, struct compact_stats *stats)
+{
+    long cnt;
+
+    debug("syscompact: want=%zu\n", want);
+
+    if (stats != NULL && memory_check_range((uintptr_t)stats,
+        sizeof(struct compact_stats), PTE_R | PTE_W) < 0)
+        return -EINVAL;
+
+    cnt = memory_compact(want);
+    if (stats != NULL)
+        memory_compact_stats(stats);
+
+    return cnt;
+}
+
+/*******************************************************************************
+ * Function: sysuffd
+ *
+ * Description: Creates a userfaultfd object and associates it with a file
+ * descriptor.
+ *
+ * Inputs:
+ * fd (int) - Requested fd number (negative to auto-assign)
+ *
+ * Output:
+ * Returns fd number on success, negative error code on failure
+ *
+ * Side Effects:
+ * - Updates process's iotab
+ ******************************************************************************/
+static int sysuffd(int fd)
+{
+    struct process *proc = current_process();
+    struct io_intf *io;
+    int ret;
+
+    debug("sysuffd: fd=%d\n", fd);
+
+    if (fd >= PROCESS_IOMAX)
+        return -EMFILE;
+
+    if (fd < 0)
+    {
+        // Find next available fd
+        for (fd = 0; fd < PROCESS_IOMAX; fd++)
+        {
+            if (proc->iotab[fd] == NULL)
+                break;
+        }
+        if (fd == PROCESS_IOMAX)
+            return -EMFILE;
+    }
+    else if (proc->iotab[fd] != NULL)
+        return -EBADFD;
+
+    ret = uffd_open(&io);
+    if (ret < 0)
+        return ret;
+
+    proc->iotab[fd] = io;
+    return fd;
+}
+
+/*******************************************************************************
+ * Function: sysmsgq
+ *
+ * Description: Creates a message queue and associates it with a file
+ * descriptor. Processes forked afterwards share the queue.
+ *
+ * Inputs:
+ * fd (int) - Requested fd number (negative to auto-assign)
+ *
+ * Output:
+ * Returns fd number on success, negative error code on failure
+ *
+ * Side Effects:
+ * - Updates process's iotab
+ ******************************************************************************/
+static int sysmsgq(int fd)
+{
+    struct process *proc = current_process();
+    struct io_intf *io;
+    int ret;
+
+    debug("sysmsgq: fd=%d\n", fd);
+
+    if (fd >= PROCESS_IOMAX)
+        return -EMFILE;
+
+    if (fd < 0)
+    {
+        // Find next available fd
+        for (fd = 0; fd < PROCESS_IOMAX; fd++)
+        {
+            if (proc->iotab[fd] == NULL)
+                break;
+        }
+        if (fd == PROCESS_IOMAX)
+            return -EMFILE;
+    }
+    else if (proc->iotab[fd] != NULL)
+        return -EBADFD;
+
+    ret = msgq_open(&io);
+    if (ret < 0)
+        return ret;
+
+    proc->iotab[fd] = io;
+    return fd;
+}
+
+/*******************************************************************************
+ * Function: sysmsgsend
+ *
+ * Description: Sends a buffer on a message queue. The pages lying entirely
+ * inside the buffer are moved to the queue instead of copied.
+ *
+ * Inputs:
+ * fd (int) - Message queue
+ * buf (const void *) - Buffer to send
+ * len (size_t) - Length of the buffer
+ * flags (int) - MSG_DONTWAIT or 0
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure
+ *
+ * Side Effects:
+ * - Unmaps the whole pages of the buffer from the current process
+ * - May block while the queue is full
+ ******************************************************************************/
+static int sysmsgsend(int fd, const void *buf, size_t len, int flags)
+{
+    struct process *proc = current_process();
+
+    debug("sysmsgsend: fd=%d, buf=%p, len=%zu\n", fd, buf, len);
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+        return -EBADFD;
+
+    return msgq_send(proc->iotab[fd], buf, len, flags);
+}
+
+/*******************************************************************************
+ * Function: sysmsgrecv
+ *
+ * Description: Receives the oldest message on a message queue into a new
+ * region of the current process.
+ *
+ * Inputs:
+ * fd (int) - Message queue
+ * lenp (size_t *) - Receives the length of the message
+ * flags (int) - MSG_DONTWAIT or 0
+ *
+ * Output:
+ * Returns address of the message, negative error code on failure
+ *
+ * Side Effects:
+ * - Adds a region to the process's region tree
+ * - May block while the queue is empty
+ ******************************************************************************/
+static long sysmsgrecv(int fd, size_t *lenp, int flags)
+{
+    struct process *proc = current_process();
+
+    debug("sysmsgrecv: fd=%d\n", fd);
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+        return -EBADFD;
+
+    if (memory_check_range((uintptr_t)lenp, sizeof(size_t), PTE_R | PTE_W) < 0)
+        return -EINVAL;
+
+    return msgq_recv(proc->iotab[fd], lenp, flags);
+}
+
+/*******************************************************************************
+ * Function: syssnapshot
+ *
+ * Description: Saves the current process in a file, to be resumed later with
+ * sysrestore.
+ *
+ * Inputs:
+ * path (const char *) - Name of the snapshot file, which must exist
+ * tfr (const struct trap_frame *) - Trap frame of the calling process
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure. A process restored
+ * from the snapshot returns from this call with 1.
+ *
+ * Side Effects:
+ * - Overwrites the snapshot file
+ ******************************************************************************/
+static int syssnapshot(const char *path, const struct trap_frame *tfr)
+{
+    // Validate path
+    if (path == NULL)
+    {
+        debug("syssnapshot: NULL path\n");
+        return -EINVAL;
+    }
+
+    debug("syssnapshot: path=%s\n", path);
+
+    return snap_save(path, tfr);
+}
+
+/*******************************************************************************
+ * Function: sysrestore
+ *
+ * Description: Replaces the current process with a snapshot taken by
+ * syssnapshot.
+ *
+ * Inputs:
+ * path (const char *) - Name of the snapshot file
+ * tfr (struct trap_frame *) - Trap frame of the calling process
+ *
+ * Output:
+ * Returns negative error code on failure (does not return on success; the
+ * restored process returns 1 from its snapshot call instead)
+ *
+ * Side Effects:
+ * - Replaces the memory, open files and registers of the process
+ ******************************************************************************/
+static int sysrestore(const char *path, struct trap_frame *tfr)
+{
+    // Validate path
+    if (path == NULL)
+    {
+        debug("sysrestore: NULL path\n");
+        return -EINVAL;
+    }
+
+    debug("sysrestore: path=%s\n", path);
+
+    return snap_restore(path, tfr);
+}
+
+/*******************************************************************************
+ * Function: sysdefrag
+ *
+ * Description: Defragments the mounted file system and reports how scattered
+ * the files were before and after.
+ *
+ * Inputs:
+ * stats (struct kfs_defrag_stats *) - Receives the counters; may be NULL
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure
+ *
+ * Side Effects:
+ * - Moves data blocks and rewrites inodes on disk
+ * - Blocks all other file system calls while it runs
+ ******************************************************************************/
+static int sysdefrag(struct kfs_defrag_stats *stats)
+{
+    debug("sysdefrag\n");
+
+    if (stats != NULL && memory_check_range((uintptr_t)stats,
+        sizeof(struct kfs_defrag_stats), PTE_R | PTE_W) < 0)
+        return -EINVAL;
+
+    return fs_defrag(stats);
+}
+
+/*******************************************************************************
+ * Function: sysioprio
+ *
+ * Description: Reports and changes the I/O class, level and rate limits of a
+ * process.
+ *
+ * Inputs:
+ * pid (int) - Process to change, or negative for the calling process
+ * attr (const struct ioprio_attr *) - New settings; may be NULL
+ * old (struct ioprio_attr *) - Receives the previous settings; may be NULL
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure
+ *
+ * Side Effects:
+ * - Changes the order in which the process's block requests are served
+ ******************************************************************************/
+static int sysioprio(int pid, const struct ioprio_attr *attr, struct ioprio_attr *old)
+{
+    struct process *proc;
+
+    debug("sysioprio: pid=%d\n", pid);
+
+    if (pid < 0)
+        proc = current_process();
+    else if (pid < NPROC && proctab[pid] != NULL)
+        proc = proctab[pid];
+    else
+        return -EINVAL;
+
+    if (attr != NULL && memory_check_range((uintptr_t)attr,
+        sizeof(struct ioprio_attr), PTE_R) < 0)
+        return -EINVAL;
+
+    if (old != NULL && memory_check_range((uintptr_t)old,
+        sizeof(struct ioprio_attr), PTE_R | PTE_W) < 0)
+        return -EINVAL;
+
+    if (old != NULL)
+        *old = proc->ioprio.attr;
+
+    if (attr == NULL)
+        return 0;
+
+    return ioprio_set(proc, attr);
+}
+
+/*******************************************************************************
+ * Function: syskexec
+ *
+ * Description: Boots the kernel image open on fd in place of the running
+ * kernel, handing it len bytes from data. With a negative fd, instead copies
+ * up to len bytes of the region handed to this kernel into data.
+ *
+ * Inputs:
+ * fd (int) - File descriptor of the kernel ELF image, or negative
+ * data (void *) - Bytes to hand over, or buffer for the handed-over bytes
+ * len (size_t) - Size of data
+ *
+ * Output:
+ * Does not return on success with fd >= 0. With a negative fd, returns the
+ * number of bytes copied. Returns a negative error code on failure, -EPERM
+ * if a process other than init asks to boot an image.
+ *
+ * Side Effects:
+ * - Resets all devices and replaces the running kernel and every process
+ ******************************************************************************/
+static long syskexec(int fd, void *data, size_t len)
+{
+    struct process *proc = current_process();
+
+    debug("syskexec: fd=%d len=%zu\n", fd, len);
+
+    if (fd < 0) {
+        if (memory_check_range((uintptr_t)data, len, PTE_R | PTE_W) < 0)
+            return -EINVAL;
+        return kexec_handoff_read(data, len);
+    }
+
+    // replacing the kernel ends every process, so only init may do it
+    if (!current_privileged())
+        return -EPERM;
+
+    if (fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+        return -EBADFD;
+
+    if (len != 0 && memory_check_range((uintptr_t)data, len, PTE_R) < 0)
+        return -EINVAL;
+
+    return kexec_boot(proc->iotab[fd], data, len);
+}
+
+/*******************************************************************************
+ * Function: sysflock
+ *
+ * Description: Locks or unlocks a byte range of an open file for the calling
+ * process (see flock.h).
+ *
+ * Inputs:
+ * fd (int) - File descriptor of a KFS file
+ * off (uint64_t) - First byte of the range
+ * len (uint64_t) - Length of the range, 0 for up to the largest offset
+ * mode (int) - FLOCK_UN, FLOCK_SH or FLOCK_EX, optionally with FLOCK_NB
+ *
+ * Output:
+ * Returns 0 on success, negative error code on failure
+ *
+ * Side Effects:
+ * - May block until the range is free
+ ******************************************************************************/
+static int sysflock(int fd, uint64_t off, uint64_t len, int mode)
+{
+    struct process *proc = current_process();
+    uint32_t ino;
+    int result;
+
+    debug("sysflock: fd=%d off=%lu len=%lu mode=%d\n", fd, off, len, mode);
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+        return -EBADFD;
+
+    // only files have an inode
+    result = ioctl(proc->iotab[fd], IOCTL_GETINO, &ino);
+    if (result < 0)
+        return (result == -ENOTSUP) ? -EBADFD : result;
+
+    return flock_range(ino, off, len, mode);
+}
+
 /*******************************************************************************
  * Function: syscall_handler
  *
@@ -626,6 +1327,9 @@ void syscall_handler(struct trap_frame *tfr)
     uint64_t a0 = tfr->x[TFR_A0];
     uint64_t a1 = tfr->x[TFR_A1];
     uint64_t a2 = tfr->x[TFR_A2];
+    uint64_t a3 = tfr->x[TFR_A3];
+    uint64_t a4 = tfr->x[TFR_A4];
+    uint64_t a5 = tfr->x[TFR_A5];
 
     debug("syscall_handler: syscall=%lu, a0=%lu, a1=%lu, a2=%lu\n",
           syscall_num, a0, a1, a2);
@@ -688,6 +1392,66 @@ void syscall_handler(struct trap_frame *tfr)
         ret = syspioref();
         break;
 
+    case SYSCALL_MMAP:
+        ret = sysmmap((void *)a0, (size_t)a1, (int)a2, (int)a3, (int)a4, (long)a5);
+        break;
+
+    case SYSCALL_MUNMAP:
+        ret = sysmunmap((void *)a0, (size_t)a1);
+        break;
+
+    case SYSCALL_MADVISE:
+        ret = sysmadvise((void *)a0, (size_t)a1, (int)a2);
+        break;
+
+    case SYSCALL_PGIDLE:
+        ret = syspgidle((int)a0, (int)a1, (struct pgidle_info *)a2);
+        break;
+
+    case SYSCALL_COMPACT:
+        ret = syscompact((size_t)a0, (struct compact_stats *)a1);
+        break;
+
+    case SYSCALL_UFFD:
+        ret = sysuffd((int)a0);
+        break;
+
+    case SYSCALL_MSGQ:
+        ret = sysmsgq((int)a0);
+        break;
+
+    case SYSCALL_MSGSEND:
+        ret = sysmsgsend((int)a0, (const void *)a1, (size_t)a2, (int)a3);
+        break;
+
+    case SYSCALL_MSGRECV:
+        ret = sysmsgrecv((int)a0, (size_t *)a1, (int)a2);
+        break;
+
+    case SYSCALL_SNAPSHOT:
+        ret = syssnapshot((const char *)a0, tfr);
+        break;
+
+    case SYSCALL_RESTORE:
+        ret = sysrestore((const char *)a0, tfr);
+        break;
+
+    case SYSCALL_DEFRAG:
+        ret = sysdefrag((struct kfs_defrag_stats *)a0);
+        break;
+
+    case SYSCALL_IOPRIO:
+        ret = sysioprio((int)a0, (const struct ioprio_attr *)a1, (struct ioprio_attr *)a2);
+        break;
+
+    case SYSCALL_KEXEC:
+        ret = syskexec((int)a0, (void *)a1, (size_t)a2);
+        break;
+
+    case SYSCALL_FLOCK:
+        ret = sysflock((int)a0, (uint64_t)a1, (uint64_t)a2, (int)a3);
+        break;
+
     default:
         debug("syscall_handler: Invalid syscall number %lu\n", syscall_num);
         ret = -ENOTSUP;
@@ -0,0 +1,197 @@
+// task.c - Stackless kernel tasks
+//
+
+#include "task.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread.h"
+#include "timer.h"
+#include "intr.h"
+#include "halt.h"
+#include "console.h"
+
+#ifdef TASK_TRACE
+#define TRACE
+#endif
+
+#ifdef TASK_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Tasks ready to run a step, in FIFO order. Modified from ISRs through
+// condition_broadcast, so only touched with interrupts disabled.
+
+static struct task * ready_head;
+static struct task * ready_tail;
+
+// Broadcast when the ready list becomes non-empty; idle workers wait on it.
+
+static struct condition task_ready;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void task_worker(void * arg);
+static void make_ready(struct task * tk);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void taskmgr_init(void) {
+    int i;
+
+    condition_init(&task_ready, "task.ready");
+
+    for (i = 0; i < TASK_NWORKERS; i++) {
+        if (thread_spawn("taskd", &task_worker, NULL) < 0)
+            panic("taskmgr_init: thread_spawn failed");
+    }
+}
+
+void task_init (
+    struct task * tk, const char * name,
+    void (*step)(struct task * tk), void * arg)
+{
+    tk->step = step;
+    tk->arg = arg;
+    tk->name = name ? name : "task";
+    tk->next = NULL;
+    tk->state = TASK_IDLE;
+}
+
+void task_start(struct task * tk) {
+    int saved_intr_state;
+
+    assert (tk->state == TASK_IDLE && tk->step != NULL);
+
+    saved_intr_state = intr_disable();
+    make_ready(tk);
+    intr_restore(saved_intr_state);
+}
+
+void task_wait (
+    struct task * tk, struct condition * cond,
+    void (*next)(struct task * tk))
+{
+    int saved_intr_state;
+
+    trace("%s(tk=<%s>, cond=<%s>)", __func__, tk->name, cond->name);
+    assert (tk->state == TASK_IDLE);
+
+    tk->step = next;
+
+    saved_intr_state = intr_disable();
+    tk->state = TASK_WAITING;
+    tk->next = cond->task_list;
+    cond->task_list = tk;
+    intr_restore(saved_intr_state);
+}
+
+void task_sleep (
+    struct task * tk, struct alarm * al, uint64_t tcnt,
+    void (*next)(struct task * tk))
+{
+    int saved_intr_state;
+
+    trace("%s(tk=<%s>, tcnt=%lu)", __func__, tk->name, tcnt);
+
+    // The alarm must be queued and the task put on its wait list without an
+    // intervening timer interrupt, or the wake-up could be missed.
+
+    saved_intr_state = intr_disable();
+
+    if (alarm_arm(al, tcnt))
+        task_wait(tk, &al->cond, next);
+    else
+        task_yield(tk, next);
+
+    intr_restore(saved_intr_state);
+}
+
+void task_yield(struct task * tk, void (*next)(struct task * tk)) {
+    int saved_intr_state;
+
+    assert (tk->state == TASK_IDLE);
+
+    tk->step = next;
+
+    saved_intr_state = intr_disable();
+    make_ready(tk);
+    intr_restore(saved_intr_state);
+}
+
+void task_wake_list(struct task * list) {
+    struct task * prev = NULL;
+    struct task * next;
+
+    // The wait list is LIFO; reverse it so tasks run in the order they waited
+
+    while (list != NULL) {
+        next = list->next;
+        list->next = prev;
+        prev = list;
+        list = next;
+    }
+
+    while (prev != NULL) {
+        next = prev->next;
+        assert (prev->state == TASK_WAITING);
+        make_ready(prev);
+        prev = next;
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Body of an executor thread. The task is marked idle before its step runs,
+// so a step that returns without arranging to continue leaves its task ended
+// and the worker never touches the struct task again; the last step may free
+// or reuse it.
+
+void task_worker(void * arg) {
+    void (*step)(struct task * tk);
+    int saved_intr_state;
+    struct task * tk;
+
+    for (;;) {
+        saved_intr_state = intr_disable();
+
+        while (ready_head == NULL)
+            condition_wait(&task_ready);
+
+        tk = ready_head;
+        ready_head = tk->next;
+        if (ready_head == NULL)
+            ready_tail = NULL;
+
+        tk->next = NULL;
+        tk->state = TASK_IDLE;
+        step = tk->step;
+
+        intr_restore(saved_intr_state);
+
+        debug("%s: running step of <%s>", __func__, tk->name);
+        step(tk);
+    }
+}
+
+// Appends tk to the ready list. Must be called with interrupts disabled.
+
+void make_ready(struct task * tk) {
+    tk->state = TASK_READY;
+    tk->next = NULL;
+
+    if (ready_tail != NULL)
+        ready_tail->next = tk;
+    else
+        ready_head = tk;
+    ready_tail = tk;
+
+    condition_broadcast(&task_ready);
+}
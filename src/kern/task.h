@@ -0,0 +1,100 @@
+// task.h - Stackless kernel tasks
+//
+// A task is a kernel activity that spends most of its life waiting, written
+// as a chain of steps instead of a thread body. Each step is a function that
+// runs to completion on one of a few executor threads; before returning it
+// names the step to run next and what to wait for (a condition, an alarm or
+// nothing). A step that returns without doing so ends the task. Since no
+// stack is kept between steps, a task costs only its struct task, so
+// thousands of pending timers or I/O completions fit where NTHR threads with
+// a stack page each would not.
+//
+// Steps must not block: no condition_wait, alarm_sleep, lock_acquire or
+// blocking I/O. State that must survive a wait lives in the structure that
+// embeds the struct task (see tk->arg).
+//
+
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include <stdint.h>
+
+#include "thread.h"
+#include "timer.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// TASK_NWORKERS is the number of executor threads. Steps of different tasks
+// may run on different workers; the steps of one task never overlap.
+
+#ifndef TASK_NWORKERS
+#define TASK_NWORKERS 1
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+enum task_state {
+    TASK_IDLE = 0,  // not started, ended, or running a step that has not
+                    // arranged to continue yet
+    TASK_READY,     // queued for an executor
+    TASK_WAITING    // on the task wait list of a condition
+};
+
+struct task {
+    void (*step)(struct task * tk); // step to run when next scheduled
+    void * arg;
+    const char * name;
+    struct task * next;             // ready list or condition wait list
+    enum task_state state;
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Spawns the executor threads. Called once at boot after thread_init.
+
+extern void taskmgr_init(void);
+
+// Initializes a task whose first step is /step/. The /name/ argument is
+// optional. It is valid to initialize a struct task with all zeroes and set
+// step and arg directly.
+
+extern void task_init (
+    struct task * tk, const char * name,
+    void (*step)(struct task * tk), void * arg);
+
+// Queues an idle task to run its next step. May be called from an ISR.
+
+extern void task_start(struct task * tk);
+
+// The following three functions are called from a step of tk, as its last
+// action, and make /next/ the step that runs when tk is resumed.
+
+// Resumes tk at the next broadcast of cond. As with condition_wait, call with
+// interrupts disabled if cond is signalled by an ISR and the step tested a
+// predicate the ISR changes.
+
+extern void task_wait (
+    struct task * tk, struct condition * cond,
+    void (*next)(struct task * tk));
+
+// Resumes tk tcnt timer ticks after the previous wake-up of al (see
+// alarm_sleep). The alarm must not be used by a thread at the same time.
+
+extern void task_sleep (
+    struct task * tk, struct alarm * al, uint64_t tcnt,
+    void (*next)(struct task * tk));
+
+// Resumes tk after the tasks that are ready now have run a step.
+
+extern void task_yield(struct task * tk, void (*next)(struct task * tk));
+
+// Moves the tasks waiting on a condition to the ready list. Called by
+// condition_broadcast with interrupts disabled; list is the condition's task
+// wait list, most recent waiter first.
+
+extern void task_wake_list(struct task * list);
+
+#endif // _TASK_H_
@@ -0,0 +1,144 @@
+// test_intr.c - Tests of interrupt batching and storm throttling
+//
+// The PLIC's pending bits cannot be set from software, so the test replaces
+// the claim and completion calls of intr.c with a queue it fills itself and
+// raises its bursts on an unused source, TEST_IRQNO. The storm threshold is
+// lowered so that a burst stays short.
+
+#include "console.h"
+#include "halt.h"
+#include "heap.h"
+#include "thread.h"
+#include "timer.h"
+#include "task.h"
+
+#define INTR_STORM_THRESHOLD 16
+
+#define plic_claim_irq test_claim_irq
+#define plic_close_irq test_close_irq
+#include "intr.c"
+#undef plic_claim_irq
+#undef plic_close_irq
+
+#define TEST_IRQNO 20
+#define USER_START 0x80100000UL
+
+extern char _kimg_end[];
+
+// pending sources handed out by test_claim_irq, in order
+
+static int pending[INTR_CLAIM_BUDGET];
+static int npending;
+static int nclaimed;
+static int nserved;
+
+/*
+Inputs: None
+Outputs: Next queued irq number, 0 if the queue is empty
+Description: Stands in for plic_claim_irq.
+*/
+int test_claim_irq(void) {
+    if (nclaimed == npending)
+        return 0;
+    return pending[nclaimed++];
+}
+
+/*
+Inputs: int irqno: source being completed
+Outputs: None
+Description: Stands in for plic_close_irq.
+*/
+void test_close_irq(int irqno) {
+}
+
+/*
+Inputs: int irqno: source number
+        void * aux: unused
+Outputs: None
+Description: Counts the interrupts served.
+*/
+static void test_isr(int irqno, void * aux) {
+    nserved += 1;
+}
+
+/*
+Inputs: int n: number of interrupts to raise
+Outputs: None
+Description: Queues n interrupts of TEST_IRQNO and serves them as one trap
+            would.
+*/
+static void raise_burst(int n) {
+    for (npending = 0; npending < n; npending++)
+        pending[npending] = TEST_IRQNO;
+    nclaimed = 0;
+    extern_intr_handler();
+}
+
+/*
+Inputs: None
+Outputs: 0
+Description: Raises a burst of three interrupts in one trap, then enough
+            traps to exceed INTR_STORM_THRESHOLD within one window, and
+            checks the counters of intr_get_stats after each. Then waits out
+            the backoff and checks that the bottom half unmasked the source.
+*/
+int main(void) {
+    struct intr_irq_stats st;
+    struct alarm al;
+    int fail = 0;
+    int i;
+
+    console_init();
+    intr_init();
+    thread_init();
+    heap_init(_kimg_end, (void*)USER_START);
+    timer_init();
+    taskmgr_init();
+
+    intr_register_isr(TEST_IRQNO, 1, test_isr, NULL);
+    intr_enable_irq(TEST_IRQNO);
+
+    // three sources pending at once are served in one trap
+
+    raise_burst(3);
+    intr_get_stats(TEST_IRQNO, &st);
+
+    if (nserved != 3 || st.count != 3 || st.batched != 2 || st.throttled != 0) {
+        debug("batch: served %d, count %lu, batched %lu, throttled %lu",
+            nserved, st.count, st.batched, st.throttled);
+        fail = 1;
+    }
+
+    // one interrupt per trap, past the threshold; the source is masked once
+
+    for (i = 0; i < 2 * INTR_STORM_THRESHOLD; i++)
+        raise_burst(1);
+    intr_get_stats(TEST_IRQNO, &st);
+
+    if (st.count != 3 + 2 * INTR_STORM_THRESHOLD || st.batched != 2 ||
+        st.throttled != 1 || !isrtab[TEST_IRQNO].throttled)
+    {
+        debug("storm: count %lu, batched %lu, throttled %lu",
+            st.count, st.batched, st.throttled);
+        fail = 1;
+    }
+
+    // the bottom half unmasks the source after the backoff
+
+    intr_enable();
+    alarm_init(&al, "test_intr");
+    alarm_sleep_ms(&al, 2 * INTR_STORM_BACKOFF_MS);
+
+    if (isrtab[TEST_IRQNO].throttled) {
+        debug("source still throttled after %d ms", 2 * INTR_STORM_BACKOFF_MS);
+        fail = 1;
+    }
+
+    intr_disable_irq(TEST_IRQNO);
+
+    if (fail)
+        panic("intr tests failed");
+
+    kprintf("intr tests complete.\n");
+    return 0;
+}
@@ -14,6 +14,7 @@
 #include "intr.h"
 #include "process.h"
 #include "memory.h"
+#include "task.h"
 
 // COMPILE-TIME PARAMETERS
 //
@@ -325,6 +326,7 @@ const char * thread_name(int tid) {
 void condition_init(struct condition * cond, const char * name) {
     cond->name = name;
     tlclear(&cond->wait_list);
+    cond->task_list = NULL;
 }
 
 void condition_wait(struct condition * cond) {
@@ -350,10 +352,11 @@ void condition_wait(struct condition * cond) {
 void condition_broadcast(struct condition * cond) {
     int saved_intr_state;
     struct thread * thr;
+    struct task * tasks;
 
-    // Fast path: if there are no threads waiting, return.
+    // Fast path: if there are no threads or tasks waiting, return.
 
-    if (tlempty(&cond->wait_list))
+    if (tlempty(&cond->wait_list) && cond->task_list == NULL)
         return;
 
     // Mark all waiting threads runnable. This is *not* a constant-time
@@ -374,6 +377,14 @@ void condition_broadcast(struct condition * cond) {
     tlappend(&ready_list, &cond->wait_list);
     tlclear(&cond->wait_list);
 
+    // Hand waiting tasks to the executor
+
+    if (cond->task_list != NULL) {
+        tasks = cond->task_list;
+        cond->task_list = NULL;
+        task_wake_list(tasks);
+    }
+
     intr_restore(saved_intr_state);
 }
 
@@ -8,6 +8,7 @@
 #include <stddef.h>
 
 struct thread; // forward decl.
+struct task; // task.h
 
 struct thread_stack_anchor {
     struct thread * thread;
@@ -23,6 +24,7 @@ struct thread_list {
 struct condition {
     const char * name;
 	struct thread_list wait_list;
+    struct task * task_list; // waiting tasks (task.h), most recent first
 };
 
 // EXPORTED GLOBAL VARIABLES
@@ -107,9 +109,9 @@ extern void condition_wait(struct condition * cond);
 
 // void condition_broadcast(struct condition * cond)
 
-// Wakes up all threads waiting on a condition. This function may be called from
-// an ISR. Calling condition_broadcast() does not cause a context switch from
-// the currently running thread.
+// Wakes up all threads and tasks waiting on a condition. This function may be
+// called from an ISR. Calling condition_broadcast() does not cause a context
+// switch from the currently running thread.
 // Waiting threads are added to the ready-to-run list in the order they were
 // added to the wait queue.
 
@@ -61,8 +61,22 @@ void alarm_init(struct alarm * al, const char * name) {
 }
 
 void alarm_sleep(struct alarm * al, uint64_t tcnt) {
-    struct alarm * prev;
     int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
+    // prevent a race condition where an alarm is signalled before we call
+    // condition_wait.
+
+    if (alarm_arm(al, tcnt))
+        condition_wait(&al->cond);
+
+    intr_restore(saved_intr_state);
+}
+
+int alarm_arm(struct alarm * al, uint64_t tcnt) {
+    struct alarm * prev;
     uint64_t now;
 
     now = get_mtime();
@@ -77,9 +91,7 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
     // If the wake-up time has already passed, return
 
     if (al->twake < now)
-        return;
-    
-    saved_intr_state = intr_disable();
+        return 0;
 
     if (sleep_list == NULL || al->twake <= sleep_list->twake) {
         debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
@@ -122,13 +134,7 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
 
     debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
 
-    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
-    // prevent a race condition where an alarm is signalled before we call
-    // condition_wait.
-
-    condition_wait(&al->cond);
-
-    intr_restore(saved_intr_state);
+    return 1;
 }
 
 // Resets the alarm so that the next sleep increment is relative to the time
@@ -32,6 +32,14 @@ extern void alarm_init(struct alarm * al, const char * name);
 
 extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
 
+// Advances the wake-up time of an alarm by /tcnt/ ticks, as alarm_sleep does,
+// and queues it without sleeping. Returns 1 if the alarm is queued, in which
+// case al->cond is broadcast at the wake-up time, or 0 if that time has
+// already passed. Must be called with interrupts disabled, and the caller
+// must start waiting on al->cond before enabling them.
+
+extern int alarm_arm(struct alarm * al, uint64_t tcnt);
+
 // Resets the alarm so that the next sleep increment is relative to the time
 // of this function call.
 
@@ -39,6 +47,10 @@ extern void alarm_reset(struct alarm * al);
 
 extern void timer_intr_handler(struct trap_frame * tfr); // called from intr.c
 
+// Returns the current time in timer ticks (TIMER_FREQ per second).
+
+static inline uint64_t timer_ticks(void);
+
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec);
 static inline void alarm_sleep_ms(struct alarm * al, unsigned long ms);
 static inline void alarm_sleep_us(struct alarm * al, unsigned long us);
@@ -46,6 +58,12 @@ static inline void alarm_sleep_us(struct alarm * al, unsigned long us);
 // INLINE FUNCTION DEFINITIONS
 //
 
+static inline uint64_t timer_ticks(void) {
+    uint64_t t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec) {
     alarm_sleep(al, sec * TIMER_FREQ);
 }
@@ -288,12 +288,15 @@ mmode_intr_handler:
         j                             mmode_trap_done
 
 mmode_excp_handler:
-# We support one S mode to M mode environment call, which is to re-arm
-# the timer interrupt.
+# We support two S mode to M mode environment calls. One re-arms the timer
+# interrupt; the other, with KEXEC_MAGIC in a7, is kexec (see kexec.c).
 
         addi                          t0, t0, -9
         bnez                          t0, unexpected_mmode_trap
 
+        li                            t0, 0x6b65786563                  # KEXEC_MAGIC (kexec.h)
+        beq                           a7, t0, mmode_kexec
+
 # Clear STIP, set MTIE
 
         li                            t0, 0x20                          # STIP
@@ -311,6 +314,16 @@ mmode_trap_done:
         csrr                          t0, mscratch
         mret
 
+mmode_kexec:
+# Turn off M mode interrupts and drop a pending S mode timer interrupt, then
+# jump, staying in M mode, to the trampoline in a0 (kexecasm.s). It starts the
+# new kernel at the top of start.s, which sets up M mode again.
+
+        csrw                          mie, zero
+        li                            t0, 0x20                          # STIP
+        csrc                          mip, t0
+        jr                            a0
+
 
 unexpected_mmode_trap:
 # We can call panic in M mode since panic does not rely on any kernel
@@ -62,6 +62,8 @@ struct uart_regs {
 #define IER_DREIE (1 << 0)
 #define IER_THREIE (1 << 1)
 
+#define UART0 (*(volatile struct uart_regs*)UART0_IOBASE)
+
 struct ringbuf {
     uint16_t hpos; // head of queue (from where elements are removed)
     uint16_t tpos; // tail of queue (where elements are inserted)
@@ -95,12 +97,26 @@ static void uart_isr(int irqno, void * driver_private);
 
 static int uart_open_ebusy(struct io_intf ** ioptr, void * aux);
 
+static void com0_isr(int irqno, void * aux);
+
 static void rbuf_init(struct ringbuf * rbuf);
 static int rbuf_empty(const struct ringbuf * rbuf);
 static int rbuf_full(const struct ringbuf * rbuf);
 static void rbuf_put(struct ringbuf * rbuf, char c);
 static char rbuf_get(struct ringbuf * rbuf);
 
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Console input. Once uart_attach has given UART0 an ISR, received bytes go
+// into com0_rxbuf and com0_getc sleeps on com0_rxnotempty instead of
+// spinning. com0_rxintr is cleared again by com0_poll.
+
+static struct ringbuf com0_rxbuf;
+static struct condition com0_rxnotempty;
+static int com0_irqno;
+static int com0_rxintr;
+
 // EXPORTED FUNCTION DEFINITIONS
 // 
 
@@ -113,9 +129,17 @@ void uart_attach(void * mmio_base, int irqno) {
 
 	struct uart_device * dev;
 
-	// UART0 is used for the console, so can't be opened
+	// UART0 is used for the console, so can't be opened. Its receive
+	// interrupt feeds console input.
 
 	if (mmio_base == (void*)UART0_IOBASE) {
+		rbuf_init(&com0_rxbuf);
+		condition_init(&com0_rxnotempty, "com0.rxnotempty");
+		com0_irqno = irqno;
+		intr_register_isr(irqno, UART_IRQ_PRIO, com0_isr, NULL);
+		com0_rxintr = 1;
+		UART0.ier = IER_DREIE;
+		intr_enable_irq(irqno);
 		device_register("ser", &uart_open_ebusy, NULL);
 		return;
 	}
@@ -319,10 +343,10 @@ char rbuf_get(struct ringbuf * rbuf) {
     return c;
 }
 
-// The functions below provide polled uart input and output. They are used
-// by the console functions to produce output from pritnf().
+// The functions below provide uart input and output for the console
+// functions. Output is polled, so that printf() works anywhere. Input is
+// polled until uart_attach installs com0_isr, and again after com0_poll.
 
-#define UART0 (*(volatile struct uart_regs*)UART0_IOBASE)
 
 void com0_init(void) {
 	UART0.ier = 0x00;
@@ -350,9 +374,54 @@ void com0_putc(char c) {
 }
 
 char com0_getc(void) {
+	int saved_intr_state;
+	char c;
+
+	// Sleep until the ISR has buffered a byte. The ISR turns off the receive
+	// interrupt when the buffer fills, so turn it back on after taking one.
+
+	if (com0_rxintr && thrmgr_initialized) {
+		saved_intr_state = intr_disable();
+		while (rbuf_empty(&com0_rxbuf))
+			condition_wait(&com0_rxnotempty);
+		c = rbuf_get(&com0_rxbuf);
+		UART0.ier |= IER_DREIE;
+		intr_restore(saved_intr_state);
+		return c;
+	}
+
+	// Bytes the ISR buffered before input went back to polling come first
+
+	if (!rbuf_empty(&com0_rxbuf))
+		return rbuf_get(&com0_rxbuf);
+
 	// Spin until RBR contains a byte
 	while (!(UART0.lsr & LSR_DR))
 		continue;
 	
 	return UART0.rbr;
+}
+
+void com0_poll(void) {
+	if (!com0_rxintr)
+		return;
+
+	com0_rxintr = 0;
+	UART0.ier = 0;
+	intr_disable_irq(com0_irqno);
+}
+
+void com0_isr(int irqno, void * __attribute__ ((unused)) aux) {
+	// Take every byte the UART holds; stop when the buffer is full and leave
+	// the rest in the UART until com0_getc makes room.
+
+	while (UART0.lsr & LSR_DR) {
+		if (rbuf_full(&com0_rxbuf)) {
+			UART0.ier &= ~IER_DREIE;
+			break;
+		}
+		if (rbuf_empty(&com0_rxbuf))
+			condition_broadcast(&com0_rxnotempty);
+		rbuf_put(&com0_rxbuf, UART0.rbr);
+	}
 }
\ No newline at end of file
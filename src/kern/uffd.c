@@ -0,0 +1,345 @@
+// uffd.c - User-space page fault handling (userfaultfd)
+//
+
+#include "uffd.h"
+
+#include "process.h"
+#include "memory.h"
+#include "thread.h"
+#include "heap.h"
+#include "string.h"
+#include "error.h"
+#include "console.h"
+#include "halt.h"
+
+#ifdef UFFD_TRACE
+#define TRACE
+#endif
+
+#ifdef UFFD_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct uffd {
+    struct io_intf io_intf;
+    struct process * owner;         // process whose faults are handled
+    struct condition ready;         // signalled when an event is queued
+    struct condition resolved;      // signalled when pages are installed
+
+    unsigned int head;              // oldest queued event
+    unsigned int cnt;               // number of queued events
+    struct uffd_msg events[UFFD_MAXEVENTS];
+
+    unsigned int nranges;
+    struct {
+        uintptr_t start;
+        uintptr_t end;
+    } ranges[UFFD_MAXRANGES];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void uffd_close(struct io_intf * io);
+static long uffd_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static int uffd_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static int uffd_register(struct uffd * uf, const struct uffd_range * rng);
+static int uffd_unregister(struct uffd * uf, const struct uffd_range * rng);
+static long uffd_copy(struct uffd * uf, const struct uffd_copy * cp, int zero);
+static void uffd_drop_events(struct uffd * uf, uintptr_t start, uintptr_t end);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct io_ops uffd_ops = {
+    .close = uffd_close,
+    .read = uffd_read,
+    .ctl = uffd_ioctl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int uffd_open(struct io_intf ** ioptr) {
+    struct uffd * uf;
+
+    uf = kmalloc(sizeof(struct uffd));
+    if (uf == NULL)
+        return -ENOMEM;
+
+    memset(uf, 0, sizeof(struct uffd));
+    uf->io_intf.ops = &uffd_ops;
+    uf->io_intf.refcnt = 1;
+    condition_init(&uf->ready, "uffd.ready");
+    condition_init(&uf->resolved, "uffd.resolved");
+
+    *ioptr = &uf->io_intf;
+    return 0;
+}
+
+int uffd_registered(const struct uffd * uf, uintptr_t vma) {
+    unsigned int i;
+
+    for (i = 0; i < uf->nranges; i++) {
+        if (uf->ranges[i].start <= vma && vma < uf->ranges[i].end)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * void uffd_notify(struct uffd * uf, uintptr_t vma, uint_fast8_t access);
+ *
+ * Queues a fault event and wakes readers of the object. An event already
+ * queued for the page is updated instead. Events the handler resolved
+ * without reading them are dropped by uffd_copy, so the queue only fills up
+ * if the handler neither reads nor resolves; the oldest event is then
+ * dropped.
+ *
+ * Inputs:
+ *          uf - object of the faulting process
+ *          vma - page-aligned faulting address
+ *          access - PTE_R, PTE_W or PTE_X
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Wakes threads blocked in a read of the object.
+ */
+void uffd_notify(struct uffd * uf, uintptr_t vma, uint_fast8_t access) {
+    struct uffd_msg * msg = NULL;
+    unsigned int i;
+
+    for (i = 0; i < uf->cnt; i++) {
+        if (uf->events[(uf->head + i) % UFFD_MAXEVENTS].addr == vma)
+            msg = &uf->events[(uf->head + i) % UFFD_MAXEVENTS];
+    }
+
+    if (msg == NULL) {
+        if (uf->cnt == UFFD_MAXEVENTS) {
+            debug("%s: queue full, dropping event for %p", __func__,
+                (void*)uf->events[uf->head].addr);
+            uf->head = (uf->head + 1) % UFFD_MAXEVENTS;
+            uf->cnt -= 1;
+        }
+
+        msg = &uf->events[(uf->head + uf->cnt) % UFFD_MAXEVENTS];
+        msg->flags = 0;
+        uf->cnt += 1;
+    }
+
+    msg->addr = vma;
+    msg->pid = uf->owner->id;
+    if (access == PTE_W)
+        msg->flags |= UFFD_MSG_WRITE;
+
+    trace("%s: pid %d, addr %p", __func__, msg->pid, (void*)vma);
+    condition_broadcast(&uf->ready);
+}
+
+void uffd_wait(struct uffd * uf) {
+    condition_wait(&uf->resolved);
+}
+
+void uffd_detach(struct process * proc) {
+    if (proc->uffd == NULL)
+        return;
+
+    proc->uffd->owner = NULL;
+    proc->uffd->nranges = 0;
+    proc->uffd = NULL;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void uffd_close(struct io_intf * io) {
+    struct uffd * const uf = (struct uffd *)io;
+
+    // A waiting owner finds its uffd pointer cleared and handles the fault
+    // itself; it does not touch the object again.
+
+    if (uf->owner != NULL)
+        uf->owner->uffd = NULL;
+    condition_broadcast(&uf->resolved);
+
+    kfree(uf);
+}
+
+static long uffd_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct uffd * const uf = (struct uffd *)io;
+    struct uffd_msg * msg = buf;
+    long n = 0;
+
+    if (bufsz < sizeof(struct uffd_msg))
+        return -EINVAL;
+
+    while (uf->cnt == 0)
+        condition_wait(&uf->ready);
+
+    while (uf->cnt != 0 && (n + 1) * sizeof(struct uffd_msg) <= bufsz) {
+        msg[n++] = uf->events[uf->head];
+        uf->head = (uf->head + 1) % UFFD_MAXEVENTS;
+        uf->cnt -= 1;
+    }
+
+    return n * sizeof(struct uffd_msg);
+}
+
+static int uffd_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct uffd * const uf = (struct uffd *)io;
+
+    switch (cmd) {
+    case IOCTL_UFFD_REGISTER:
+        return uffd_register(uf, arg);
+    case IOCTL_UFFD_UNREGISTER:
+        return uffd_unregister(uf, arg);
+    case IOCTL_UFFD_COPY:
+        return uffd_copy(uf, arg, 0);
+    case IOCTL_UFFD_ZERO:
+        return uffd_copy(uf, arg, 1);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/**
+ * static int uffd_register(struct uffd * uf, const struct uffd_range * rng);
+ *
+ * Registers a range of the calling process, making it the owner.
+ *
+ * Inputs:
+ *          uf - object to register with
+ *          rng - page-aligned range, covered by regions of the caller
+ * Outputs:
+ *          0 on success, -EINVAL for a bad range, -EBUSY if the object or the
+ *          process is already bound elsewhere, -ENOMEM if there are too many
+ *          ranges.
+ * Side Effects:
+ *          Missing pages in the range are reported through the object.
+ */
+static int uffd_register(struct uffd * uf, const struct uffd_range * rng) {
+    struct process * const proc = current_process();
+    uintptr_t start, end;
+    struct vma * next;
+    struct vma * v;
+
+    if (memory_check_range((uintptr_t)rng, sizeof(struct uffd_range), PTE_R) < 0)
+        return -EINVAL;
+
+    start = rng->start;
+    end = rng->start + rng->len;
+
+    if (rng->len == 0 || start % PAGE_SIZE != 0 || rng->len % PAGE_SIZE != 0 ||
+        start < USER_START_VMA || end < start || memory_user_end < end)
+        return -EINVAL;
+
+    if ((uf->owner != NULL && uf->owner != proc) ||
+        (proc->uffd != NULL && proc->uffd != uf))
+        return -EBUSY;
+
+    if (uf->nranges == UFFD_MAXRANGES)
+        return -ENOMEM;
+
+    // The whole range must be covered by regions
+
+    v = vma_find(&proc->vmas, start);
+    if (v == NULL)
+        return -EINVAL;
+
+    while (v->end < end) {
+        next = vma_next(&proc->vmas, v);
+        if (next == NULL || next->start != v->end)
+            return -EINVAL;
+        v = next;
+    }
+
+    uf->ranges[uf->nranges].start = start;
+    uf->ranges[uf->nranges].end = end;
+    uf->nranges += 1;
+
+    uf->owner = proc;
+    proc->uffd = uf;
+
+    trace("%s: pid %d registered [%p,%p)", __func__,
+        proc->id, (void*)start, (void*)end);
+    return 0;
+}
+
+// Removes the registered ranges that lie within rng.
+
+static int uffd_unregister(struct uffd * uf, const struct uffd_range * rng) {
+    unsigned int i = 0;
+    uintptr_t end;
+
+    if (uf->owner != current_process() ||
+        memory_check_range((uintptr_t)rng, sizeof(struct uffd_range), PTE_R) < 0)
+        return -EINVAL;
+
+    end = rng->start + rng->len;
+
+    while (i < uf->nranges) {
+        if (rng->start <= uf->ranges[i].start && uf->ranges[i].end <= end)
+            uf->ranges[i] = uf->ranges[--uf->nranges];
+        else
+            i += 1;
+    }
+
+    return 0;
+}
+
+static long uffd_copy(struct uffd * uf, const struct uffd_copy * cp, int zero) {
+    uintptr_t vma;
+    long cnt;
+
+    if (memory_check_range((uintptr_t)cp, sizeof(struct uffd_copy), PTE_R) < 0)
+        return -EINVAL;
+
+    if (uf->owner == NULL)
+        return -ENOENT;
+
+    // src is read from the caller's space, like any other buffer argument
+    if (!zero && memory_check_range((uintptr_t)cp->src, cp->len, PTE_R) < 0)
+        return -EINVAL;
+
+    if (cp->dst % PAGE_SIZE != 0 || cp->len % PAGE_SIZE != 0 ||
+        cp->dst + cp->len < cp->dst)
+        return -EINVAL;
+
+    for (vma = cp->dst; vma < cp->dst + cp->len; vma += PAGE_SIZE) {
+        if (!uffd_registered(uf, vma))
+            return -EINVAL;
+    }
+
+    cnt = memory_install(uf->owner, cp->dst, zero ? NULL : cp->src, cp->len);
+
+    // Events for the pages just installed are resolved whether the handler
+    // read them or not. Wake the owner even on a partial install; it
+    // re-checks its page.
+
+    if (cnt > 0)
+        uffd_drop_events(uf, cp->dst, cp->dst + cnt);
+
+    condition_broadcast(&uf->resolved);
+    return cnt;
+}
+
+// Removes the queued events for pages in [start,end), keeping the others in
+// order.
+
+static void uffd_drop_events(struct uffd * uf, uintptr_t start, uintptr_t end) {
+    struct uffd_msg * msg;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < uf->cnt; i++) {
+        msg = &uf->events[(uf->head + i) % UFFD_MAXEVENTS];
+        if (msg->addr < start || end <= msg->addr)
+            uf->events[(uf->head + n++) % UFFD_MAXEVENTS] = *msg;
+    }
+
+    uf->cnt = n;
+}
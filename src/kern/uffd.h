@@ -0,0 +1,112 @@
+// uffd.h - User-space page fault handling (userfaultfd)
+//
+// A userfaultfd object lets one process supply the contents of pages of
+// another process (its owner) on demand, for example to fetch a large data
+// file lazily or to restore a process after it has started running. The owner
+// registers ranges of its regions with the object. A fault on a page that is
+// not mapped in a registered range suspends the owner's thread and queues an
+// event, which the handler reads from the object's file descriptor. The
+// handler resolves the fault by installing the page with IOCTL_UFFD_COPY or
+// IOCTL_UFFD_ZERO, which wakes the owner.
+//
+// If the object is closed while the owner waits, the fault is handled as if
+// the range had not been registered.
+//
+
+#ifndef _UFFD_H_
+#define _UFFD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// UFFD_MAXRANGES is the number of ranges that can be registered with one
+// object. UFFD_MAXEVENTS is the length of its event queue. Installing a page
+// removes the events queued for it; if the handler lets the queue fill up
+// anyway, the oldest event is dropped.
+
+#ifndef UFFD_MAXRANGES
+#define UFFD_MAXRANGES 8
+#endif
+
+#ifndef UFFD_MAXEVENTS
+#define UFFD_MAXEVENTS 4
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// IOCTL numbers of a userfaultfd object. Mirrored in user/syscall.h.
+
+#define IOCTL_UFFD_REGISTER     16 // arg is pointer to struct uffd_range
+#define IOCTL_UFFD_UNREGISTER   17 // arg is pointer to struct uffd_range
+#define IOCTL_UFFD_COPY         18 // arg is pointer to struct uffd_copy
+#define IOCTL_UFFD_ZERO         19 // arg is pointer to struct uffd_copy
+
+#define UFFD_MSG_WRITE  (1 << 0) // the faulting access was a store
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct process; // process.h
+struct uffd;    // uffd.c
+
+// Argument of IOCTL_UFFD_REGISTER and IOCTL_UFFD_UNREGISTER. The range must be
+// page aligned and, for REGISTER, completely covered by regions of the
+// calling process, which becomes the owner of the object.
+
+struct uffd_range {
+    uintptr_t start;
+    size_t len;
+};
+
+// Argument of IOCTL_UFFD_COPY (src is a buffer in the caller's space) and
+// IOCTL_UFFD_ZERO (src is ignored). dst and len must be page aligned and the
+// range must be registered. The ioctl returns the number of bytes installed,
+// or -EBUSY if the first page is mapped already.
+
+struct uffd_copy {
+    uintptr_t dst;
+    const void * src;
+    size_t len;
+};
+
+// Event read from the object. A read blocks until at least one event is
+// queued and returns as many whole events as fit in the buffer.
+
+struct uffd_msg {
+    uint64_t addr;      // page-aligned faulting address
+    uint32_t pid;       // owner
+    uint32_t flags;     // UFFD_MSG_WRITE
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Creates a new object without an owner. Returns 0 and the io interface in
+// *ioptr, or -ENOMEM.
+
+extern int uffd_open(struct io_intf ** ioptr);
+
+// Returns 1 if the page at vma lies in a range registered with the object.
+
+extern int uffd_registered(const struct uffd * uf, uintptr_t vma);
+
+// Called by the page fault handler of the owner. uffd_notify queues an event
+// for the faulting page; uffd_wait suspends the thread until some pages have
+// been installed or the object has been closed. The caller re-checks its page
+// table after every wakeup.
+
+extern void uffd_notify(struct uffd * uf, uintptr_t vma, uint_fast8_t access);
+extern void uffd_wait(struct uffd * uf);
+
+// Ends the ownership of proc's object, if any. Called when proc execs or
+// exits. Later COPY and ZERO requests on the object fail with -ENOENT.
+
+extern void uffd_detach(struct process * proc);
+
+#endif // _UFFD_H_
@@ -1,6 +1,7 @@
 //            vioblk.c - VirtIO serial port (console)
 //           
 
+#include "config.h"
 #include "virtio.h"
 #include "intr.h"
 #include "halt.h"
@@ -11,12 +12,25 @@
 #include "string.h"
 #include "thread.h"
 #include "lock.h"
+#include "memory.h"
+#include "vioblk.h"
+#include "ioprio.h"
+#include "process.h"
 
 //            COMPILE-TIME PARAMETERS
 //           
 
 #define VIOBLK_IRQ_PRIO 1
 
+//            Most data descriptors in one request that reads or writes the caller's
+//            buffer directly (vioblk_dma_blks). A request covers at least
+//            VIOBLK_MAX_SEGS-1 pages, and a request of higher priority waits for at
+//            most one of them.
+
+#ifndef VIOBLK_MAX_SEGS
+#define VIOBLK_MAX_SEGS 16
+#endif
+
 //            INTERNAL CONSTANT DEFINITIONS
 //           
 
@@ -116,15 +130,38 @@ struct vioblk_device
         struct virtq_desc desc[4];
         struct vioblk_request_header req_header;
         uint8_t req_status;
+
+//            Indirect table of a direct request: the header, up to VIOBLK_MAX_SEGS
+//            data descriptors pointing into the caller's buffer, and the status.
+
+        struct virtq_desc dma_desc[VIOBLK_MAX_SEGS + 2];
     } vq;
 
     //            Block currently in block buffer
     uint64_t bufblkno;
     //            Block buffer
     char *blkbuf;
+
+    //            Queue claimed by a process (vioblk.h), NULL if none
+    struct vioblk_uq *uq;
 };
 
-static struct lock vio_lock;                        // vioblk lock
+//            A claimed queue: the pinned pages mapped into the claiming process,
+//            laid out as described by the BLKQ_*_PAGE offsets in vioblk.h. The
+//            device does not read the process's descriptor table and available
+//            ring; it reads the kernel's copies in desc and avail, which
+//            vioblk_uq_notify fills with the entries it has checked.
+
+struct vioblk_uq
+{
+    uint32_t qsize;
+    uint32_t npages;
+    void *pages[BLKQ_BUF_PAGE + BLKQ_MAXBUFS];
+    struct virtq_desc *desc;                        // checked descriptors
+    struct virtq_avail *avail;                      // checked ring entries
+};
+
+static struct iogate vio_gate;                      // vioblk request gate (ioprio.h)
 
 //            INTERNAL FUNCTION DECLARATIONS
 //           
@@ -136,6 +173,8 @@ static void vioblk_close(struct io_intf *io);
 static long vioblk_read(struct io_intf *restrict io, void *restrict buf, unsigned long bufsz);
 
 static long operation_single_blk(struct vioblk_device * dev, uint32_t sector, unsigned long datasz, uint32_t type);
+static long vioblk_dma_blks(struct vioblk_device * dev, uint64_t sector, const void * buf, unsigned long len, uint32_t type);
+static uint64_t vioblk_dma_addr(const void * p);
 
 static long vioblk_write(
     struct io_intf *restrict io,
@@ -146,12 +185,20 @@ static int vioblk_ioctl(struct io_intf *restrict io, int cmd, void *restrict arg
 
 static void vioblk_isr(int irqno, void *aux);
 
+static void vioblk_attach_kernel_vq(struct vioblk_device *dev);
+
 //            IOCTLs
 
 static int vioblk_getlen(const struct vioblk_device *dev, uint64_t *lenptr);
 static int vioblk_getpos(const struct vioblk_device *dev, uint64_t *posptr);
 static int vioblk_setpos(struct vioblk_device *dev, const uint64_t *posptr);
 static int vioblk_getblksz(const struct vioblk_device *dev, uint32_t *blkszptr);
+static int vioblk_claim(struct vioblk_device *dev, struct blkq_claim *claim);
+static void vioblk_unclaim(struct vioblk_device *dev);
+static void free_uq(struct vioblk_uq *uq);
+static int vioblk_uq_notify(struct vioblk_device *dev);
+static int vioblk_uq_copy_chain(struct vioblk_uq *uq, uint16_t head);
+static int vioblk_uq_wait(struct vioblk_device *dev, uint16_t *idxptr);
 
 //            EXPORTED FUNCTION DEFINITIONS
 //           
@@ -280,13 +327,8 @@ void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
     dev->vq.desc[1].next = 1;
     dev->vq.desc[2].next = 2;
 
-    // initialize the ring idx
-    dev->vq.avail.idx = 0;
-    dev->vq.used.idx = 0;
-
-    // attach virtq_avail and virtq_used structs using the virtio_attach_virtq function
-    // length is 4 here because we have 4 descriptors in the struct
-    virtio_attach_virtq(regs, VIRTIO_QUEUE_ID, VIRTIO_QUEUE_SZ, (uint64_t)&dev->vq.desc, (uint64_t)&dev->vq.used, (uint64_t)&dev->vq.avail);
+    // initialize the ring idx and attach the virtqueue
+    vioblk_attach_kernel_vq(dev);
 
     // register interrupt service routine and device
     intr_register_isr(irqno, VIOBLK_IRQ_PRIO, vioblk_isr, dev);
@@ -299,7 +341,7 @@ void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
     __sync_synchronize();
 
     // initialize the lock
-    lock_init(&vio_lock, "vio_lock");
+    iogate_init(&vio_gate, "vio_gate");
 }
 
 /*
@@ -313,11 +355,13 @@ Description: Enables the virtqueues so they are ready for use (using qid 0 as no
 */
 int vioblk_open(struct io_intf ** ioptr, void * aux) {
     struct vioblk_device * const dev = aux; 
-    // set virtq_avail and virtq_used queues so they are available for use
-    virtio_enable_virtq(dev->regs, 0);
     // if device is already opened, return an error code
     if(dev->opened)
         return -EBUSY;
+    // set virtq_avail and virtq_used queues so they are available for use;
+    // closing reset the queue, which forgets its addresses
+    vioblk_attach_kernel_vq(dev);
+    virtio_enable_virtq(dev->regs, 0);
 
     // enable the interrupt line for the virtio device and set necessary flags in vioblk_device
     intr_enable_irq(dev->irqno);
@@ -345,6 +389,9 @@ void vioblk_close(struct io_intf * io) {
     // ensure close is valid
 	assert (io != NULL);
 	assert(dev->opened);
+    // give a claimed queue back to the driver
+    if (dev->uq != NULL)
+        vioblk_unclaim(dev);
     // reset the virtq_avail and virtio_used queues
     virtio_reset_virtq(dev->regs, 0);
 
@@ -358,8 +405,10 @@ Inputs: struct io_intf *restrict io: pointer to io_intf struct io
         unsigned long bufsz: number of bytes to read from buf
 Output: number of bytes successfully read from buf
 Effect: Calls the helper function to perform a read
-Description: Reads a buf of size bufsz. It will split the buf into blocks of size 512 bytes and 
-            keep track of how many blocks (and therefore bytes) have been read.
+Description: Reads a buf of size bufsz. Where buf is kernel memory or pinned user memory, the
+            device writes into it directly, many sectors per request (vioblk_dma_blks);
+            otherwise it will split the buf into blocks of size 512 bytes, read through the
+            block buffer, and keep track of how many blocks (and therefore bytes) have been read.
 */
 long vioblk_read(struct io_intf *restrict io, void *restrict buf, unsigned long bufsz) {
     struct vioblk_device * const dev =(void*)io - offsetof(struct vioblk_device, io_intf);
@@ -379,17 +428,36 @@ long vioblk_read(struct io_intf *restrict io, void *restrict buf, unsigned long
         debug("bufsz was 0");
 		return 0;
     }
+    // the queue belongs to a process that claimed it
+    if (dev->uq != NULL)
+        return -EBUSY;
     // if the request size is not aligned, return not supported
     if(bufsz % dev->blksz != 0){
         debug("Buf Size not valid");
         return -ENOTSUP;
     }
 
-    // try to acquire the lock
-    lock_acquire(&vio_lock);
+    // charge the request to the calling process's rate limits
+    ioprio_charge(1, bufsz);
 
     // Read in sectors until we've read the requested number of bytes
     while (bufsz > 0) {
+        // pass the gate for each request, so that a request of higher
+        // priority can get in between the requests of this one
+        iogate_enter(&vio_gate);
+        // read straight into buf if the device can reach it
+        result = vioblk_dma_blks(dev, dev->bufblkno, buf, bufsz, VIRTIO_BLK_T_IN);
+        if (result != 0) {
+            iogate_leave(&vio_gate);
+            if (result < 0)
+                return -EIO;
+            bytes_read += result;
+            buf += result;
+            bufsz -= result;
+            dev->bufblkno += result / dev->blksz;
+            dev->pos += result;
+            continue;
+        }
         // Calculate how much to read in this sector (up to `sector_size` or remaining bytes)
         sector_size = (bufsz < dev->blksz) ? bufsz : dev->blksz;
 
@@ -399,12 +467,13 @@ long vioblk_read(struct io_intf *restrict io, void *restrict buf, unsigned long
         // ensure that the read happened without an error
         if(result < 0){
             debug("Error with read");
-            // release the lock
-            lock_release(&vio_lock);
+            // release the gate
+            iogate_leave(&vio_gate);
             return -EIO;
         }
         // copy the reading sector to buf
         memcpy(buf, dev->blkbuf, dev->blksz);
+        iogate_leave(&vio_gate);
         // update the number of bytes we have left to read
         bytes_read += result;
         buf += result;
@@ -414,8 +483,6 @@ long vioblk_read(struct io_intf *restrict io, void *restrict buf, unsigned long
 //        debug("Total bytes read so far: %d", bytes_read);
     }
 
-    // release the lock
-    lock_release(&vio_lock);
     // return the number of bytes successfully read
     return bytes_read;
 }
@@ -427,19 +494,22 @@ Inputs: struct io_intf *restrict io: pointer to io_intf strcut io
 Output: number of bytes successfully written to buf
 Effect: Signals for a condtion_wait and therefore switches threads. Also fills out data descriptor of dev
         and sets flags for the descriptors and virtqueues to allow for notification.
-Description: Writes a single block (size 512 bytes) of data. Achieves this by following the steps laid out in 
+Description: Writes buf to the disk. Where buf is kernel memory or pinned user memory, the device
+            reads it directly, many sectors per request (vioblk_dma_blks); otherwise it writes a single
+            block (size 512 bytes) at a time through the block buffer. Achieves this by following the steps laid out in 
             Section 7.7.13 of the specifications. The thread sleeps while waiting for the device to make the
             buffer used, and this is signaled using the virtqueue condtion used_updated.
 */
 long vioblk_write(struct io_intf *restrict io, const void *restrict buf, unsigned long n) {
     struct vioblk_device * const dev =(void*)io - offsetof(struct vioblk_device, io_intf);
     long bytes_written = 0;
-    int sector = 0;
+    uint32_t sector;
     unsigned long sector_size;
     long result;
 
     // calculate the start sector based on pos
     dev->bufblkno = dev->pos / (uint64_t) dev->blksz;
+    sector = dev->bufblkno;
 
     // assert requirements for write
 	trace("%s(n=%ld)", __func__, n);
@@ -449,31 +519,51 @@ long vioblk_write(struct io_intf *restrict io, const void *restrict buf, unsigne
     // if device is supposed to be read-only, return an error
     if(dev->readonly)
         return -EIO;
+
+    // the queue belongs to a process that claimed it
+    if (dev->uq != NULL)
+        return -EBUSY;
     
     // if n is 0, there are no bytes to write
     if(n == 0)
         return 0;
 
-    // try to acquire the lock
-    lock_acquire(&vio_lock);
+    // charge the request to the calling process's rate limits
+    ioprio_charge(1, n);
 
     // Read in sectors until we've read the requested number of bytes
     while (n > 0) {
+        // pass the gate for each request, as vioblk_read does
+        iogate_enter(&vio_gate);
+        // write straight from buf if the device can reach it
+        result = vioblk_dma_blks(dev, sector, buf, n - n % dev->blksz, VIRTIO_BLK_T_OUT);
+        if (result != 0) {
+            iogate_leave(&vio_gate);
+            if (result < 0)
+                return -EIO;
+            bytes_written += result;
+            buf += result;
+            n -= result;
+            sector += result / dev->blksz;
+            dev->pos += result;
+            continue;
+        }
         // Calculate how much to read in this sector (up to `sector_size` or remaining bytes)
         sector_size = (n < dev->blksz) ? n : dev->blksz;
         // copy data from the buffer into the block buffer
         memcpy(dev->blkbuf, buf, dev->blksz);
 
-        debug("Writing to sector %d from address %p with chunk size %lu", sector, buf, sector_size);
+        debug("Writing to sector %u from address %p with chunk size %lu", sector, buf, sector_size);
         // write a simgle block
         result = operation_single_blk(dev, sector, sector_size, VIRTIO_BLK_T_OUT);
         // ensure that the write did not produce an error
         if(result < 0){
             debug("Error with write");
-            // release the lock
-            lock_release(&vio_lock);
+            // release the gate
+            iogate_leave(&vio_gate);
             return -EIO;
         }
+        iogate_leave(&vio_gate);
 
         // update the remaining number of bytes to be written
         bytes_written += result;
@@ -486,8 +576,6 @@ long vioblk_write(struct io_intf *restrict io, const void *restrict buf, unsigne
 //        debug("Total bytes written so far: %d", bytes_written);
     }
 
-    // release the lock
-    lock_release(&vio_lock);
     // return the number of bytes successfully read
     return bytes_written;
 }
@@ -519,8 +607,12 @@ long operation_single_blk(struct vioblk_device * dev, uint32_t sector, unsigned
     request->type = type;
     request->sector = sector;
 
+    // the data buffer is written by the device on a read only; a write
+    // following a read must not leave the flag set
     if(type == VIRTIO_BLK_T_IN)
         dev->vq.desc[2].flags |= VIRTQ_DESC_F_WRITE;
+    else
+        dev->vq.desc[2].flags &= ~VIRTQ_DESC_F_WRITE;
 
     // place index of head of descriptor into next ring entry of avail virtqueue
     dev->vq.avail.ring[dev->vq.avail.idx % VIRTIO_QUEUE_SZ] = 0;
@@ -547,6 +639,129 @@ long operation_single_blk(struct vioblk_device * dev, uint32_t sector, unsigned
     return dev->blksz;
 }
 
+/*
+Inputs: struct vioblk_device * dev: the device, with vio_gate held
+        uint64_t sector: the first sector
+        const void * buf: the caller's buffer
+        unsigned long len: most bytes to transfer
+        uint32_t type: VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT
+Output: number of bytes transferred, a multiple of the sector size; 0 if not even one sector of buf
+        can be handed to the device; -EIO if the device fails the request
+Effect: Signals for a condtion_wait and therefore switches threads
+Description: Transfers as many whole sectors as fit in VIOBLK_MAX_SEGS data descriptors in one
+            request, the device reading or writing buf itself instead of the block buffer. Each
+            data descriptor covers a physically contiguous piece of buf. The request ends early at
+            a page the device cannot be given: a user page that is not pinned could be moved by
+            compaction or reclaimed while the device uses it, so it is left to the block buffer.
+*/
+long vioblk_dma_blks(struct vioblk_device * dev, uint64_t sector, const void * buf, unsigned long len, uint32_t type) {
+    struct virtq_desc * const d = dev->vq.dma_desc;
+    unsigned long total = 0;
+    unsigned long seglen;
+    unsigned long excess;
+    int saved_intr_state;
+    uint64_t pa;
+    int n = 0;
+
+    // collect the pieces of buf, merging physically adjacent ones
+    while (total < len) {
+        seglen = PAGE_SIZE - ((uintptr_t)buf + total) % PAGE_SIZE;
+        if (len - total < seglen)
+            seglen = len - total;
+        pa = vioblk_dma_addr(buf + total);
+        if (pa == 0)
+            break;
+        if (n > 0 && d[n].addr + d[n].len == pa) {
+            d[n].len += seglen;
+        } else {
+            if (n == VIOBLK_MAX_SEGS)
+                break;
+            n += 1;
+            d[n].addr = pa;
+            d[n].len = seglen;
+        }
+        total += seglen;
+    }
+
+    // trim the request to whole sectors
+    excess = total % dev->blksz;
+    total -= excess;
+    while (excess > 0) {
+        if (d[n].len > excess) {
+            d[n].len -= excess;
+            excess = 0;
+        } else {
+            excess -= d[n].len;
+            n -= 1;
+        }
+    }
+
+    if (total == 0)
+        return 0;
+
+    // header, data descriptors and status, chained in table order
+    d[0].addr = (uint64_t)&dev->vq.req_header;
+    d[0].len = VIRTIO_REQUEST_HEADER_SIZE;
+    d[0].flags = VIRTQ_DESC_F_NEXT;
+    d[0].next = 1;
+    for (int i = 1; i <= n; i++) {
+        d[i].flags = VIRTQ_DESC_F_NEXT | ((type == VIRTIO_BLK_T_IN) ? VIRTQ_DESC_F_WRITE : 0);
+        d[i].next = i + 1;
+    }
+    d[n+1].addr = (uint64_t)&dev->vq.req_status;
+    d[n+1].len = VIRTIO_STATUS_SIZE;
+    d[n+1].flags = VIRTQ_DESC_F_WRITE;
+    d[n+1].next = 0;
+
+    dev->vq.req_header.type = type;
+    dev->vq.req_header.sector = sector;
+    dev->vq.req_status = 0;
+    dev->vq.avail.flags = 0;
+
+    // point the ring's descriptor at this table for one request
+    dev->vq.desc[0].addr = (uint64_t)d;
+    dev->vq.desc[0].len = (n + 2) * VIRTIO_DESC_SIZE;
+
+    dev->vq.avail.ring[dev->vq.avail.idx % VIRTIO_QUEUE_SZ] = 0;
+    __sync_synchronize();
+    dev->vq.avail.idx += 1;
+    __sync_synchronize();
+
+    saved_intr_state = intr_disable();
+    virtio_notify_avail(dev->regs, 0);
+    condition_wait(&dev->vq.used_updated);
+    intr_restore(saved_intr_state);
+
+    // back to the single-sector table operation_single_blk uses
+    dev->vq.desc[0].addr = (uint64_t)&dev->vq.desc[1];
+    dev->vq.desc[0].len = 3 * VIRTIO_DESC_SIZE;
+
+    if (dev->vq.req_status != VIRTIO_BLK_S_OK) {
+        debug("Error: VIRTIO status= %d", dev->vq.req_status);
+        return -EIO;
+    }
+
+    return total;
+}
+
+/*
+Inputs: const void * p: an address in the caller's buffer
+Output: the physical address of p, or 0 if the device must not be given it
+Effect: None
+Description: RAM is direct-mapped in the kernel, so its addresses are physical. A user address is
+            translated if its page is pinned (memory_pinned_addr). Other kernel addresses, such as
+            device memory mapped outside RAM, are not given to the device.
+*/
+uint64_t vioblk_dma_addr(const void * p) {
+    if (RAM_START <= p && p < RAM_END)
+        return (uint64_t)p;
+
+    if ((uintptr_t)p < USER_START_VMA)
+        return 0;
+
+    return (uint64_t)memory_pinned_addr((uintptr_t)p);
+}
+
 int vioblk_ioctl(struct io_intf *restrict io, int cmd, void *restrict arg)
 {
     struct vioblk_device *const dev = (void *)io -
@@ -564,6 +779,12 @@ int vioblk_ioctl(struct io_intf *restrict io, int cmd, void *restrict arg)
         return vioblk_setpos(dev, arg);
     case IOCTL_GETBLKSZ:
         return vioblk_getblksz(dev, arg);
+    case IOCTL_BLKQ_CLAIM:
+        return vioblk_claim(dev, arg);
+    case IOCTL_BLKQ_NOTIFY:
+        return vioblk_uq_notify(dev);
+    case IOCTL_BLKQ_WAIT:
+        return vioblk_uq_wait(dev, arg);
     default:
         return -ENOTSUP;
     }
@@ -592,54 +813,334 @@ void vioblk_isr(int irqno, void * aux) {
 /*
 Inputs: const struct vioblk_device * dev: the device to get the size of
         uint64_t * lenptr: a pointer to the length
-Outputs: The size of the device in bytes
+Outputs: 0
 Effect: None
-Description: Finds and returns the device size
+Description: Stores the device size in bytes at lenptr
 */
 int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr) {
     // return the device size in bytes
     *lenptr = dev->size;
-    return dev->size;
+    return 0;
 }
 
 /*
 Inputs: const struct vioblk_device * dev: the device to get the size of
         uint64_t * posptr: a pointer to the position
-Outputs: The current position of the device
+Outputs: 0
 Effect: None
-Description: Finds and returns the device position
+Description: Stores the device position at posptr
 */
 int vioblk_getpos(const struct vioblk_device * dev, uint64_t * posptr) {
     // return the current position in the disk which is currently being written to or read from
     *posptr = dev->pos;
-    return dev->pos;
+    return 0;
 }
 
 /*
 Inputs: const struct vioblk_device * dev: the device to get the size of
         uint64_t * posptr: a pointer to the position
-Outputs: The new position of the device
+Outputs: 0
 Effect: None
 Description: Changes the position of the device
 */
 int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr) {
     // set the current position in the disk which is currently being written to or read from
-    lock_acquire(&vio_lock);
+    iogate_enter(&vio_gate);
     dev->pos = *posptr;
-    // return that position
-    lock_release(&vio_lock);
-    return dev->pos;
+    iogate_leave(&vio_gate);
+    return 0;
 }
 
 /*
 Inputs: const struct vioblk_device * dev: the device to get the size of
         uint64_t * blkszptr: a pointer to the block size
-Outputs: the block size in bytes
+Outputs: 0
 Effect: none
-Description: finds and returns the block size
+Description: stores the block size at blkszptr
 */
 int vioblk_getblksz (const struct vioblk_device * dev, uint32_t * blkszptr){
     // return the device block size
     *blkszptr = dev->blksz;
-    return dev->blksz;
+    return 0;
+}
+
+/*
+Inputs: struct vioblk_device * dev: the device
+Outputs: None
+Effect: Writes the queue address and size registers of the device
+Description: Points queue 0 at the driver's own virtqueue and resets its ring
+            indices, as the device does when the queue is reset.
+*/
+void vioblk_attach_kernel_vq(struct vioblk_device * dev) {
+    dev->vq.avail.idx = 0;
+    dev->vq.used.idx = 0;
+
+    // length is 4 here because we have 4 descriptors in the struct
+    virtio_attach_virtq(dev->regs, VIRTIO_QUEUE_ID, VIRTIO_QUEUE_SZ,
+        (uint64_t)&dev->vq.desc, (uint64_t)&dev->vq.used, (uint64_t)&dev->vq.avail);
+}
+
+/*
+Inputs: struct vioblk_device * dev: the device, opened by the current process
+        struct blkq_claim * claim: requested queue size and buffer count; base is
+            filled in. sysioctl has checked that it is writable user memory.
+Outputs: 0 on success, -EPERM if the current process is not init, -EBUSY if
+        the queue is claimed already, -EINVAL for a bad size or a NULL claim,
+        -ENOMEM, or the error of mapping the region
+Effect: Maps pinned pages into the current process and reprograms the device
+Description: Hands queue 0 to the current process. The descriptor table, rings,
+            info page and buffer pages are allocated pinned and mapped as one
+            region, then the queue is reset and pointed at the used ring there
+            and at the kernel's own descriptor table and available ring. Passing
+            vio_gate first waits out a request the driver has in flight. Only
+            init may claim, since the queue reaches the whole disk under the
+            file system.
+*/
+int vioblk_claim(struct vioblk_device * dev, struct blkq_claim * claim) {
+    struct blkq_info * info;
+    struct vioblk_uq * uq;
+    uint32_t qsize, nbufs;
+    uint32_t i;
+    long base;
+
+    if (!current_privileged())
+        return -EPERM;
+
+    if (claim == NULL)
+        return -EINVAL;
+
+    qsize = claim->qsize;
+    nbufs = claim->nbufs;
+
+    if (dev->uq != NULL)
+        return -EBUSY;
+
+    if (qsize == 0 || (qsize & (qsize - 1)) != 0 || BLKQ_MAXQSIZE < qsize)
+        return -EINVAL;
+
+    if (nbufs == 0 || BLKQ_MAXBUFS < nbufs)
+        return -EINVAL;
+
+    dev->regs->queue_sel = VIRTIO_QUEUE_ID;
+    //           fence o,i
+    __sync_synchronize();
+    if (dev->regs->queue_num_max < qsize)
+        return -EINVAL;
+
+    uq = kmalloc(sizeof(struct vioblk_uq));
+    if (uq == NULL)
+        return -ENOMEM;
+
+    memset(uq, 0, sizeof(struct vioblk_uq));
+    uq->qsize = qsize;
+    uq->npages = BLKQ_BUF_PAGE + nbufs;
+    uq->desc = memory_alloc_pinned();
+    uq->avail = memory_alloc_pinned();
+    for (i = 0; i < uq->npages; i++) {
+        uq->pages[i] = memory_alloc_pinned();
+        if (uq->pages[i] == NULL)
+            break;
+    }
+
+    if (uq->desc == NULL || uq->avail == NULL || i < uq->npages) {
+        uq->npages = i;
+        free_uq(uq);
+        return -ENOMEM;
+    }
+
+    uq->avail->flags = 0;
+    uq->avail->idx = 0;
+
+    info = uq->pages[BLKQ_INFO_PAGE];
+    info->qsize = qsize;
+    info->nbufs = nbufs;
+    info->blksz = dev->blksz;
+    info->capacity = dev->regs->config.blk.capacity;
+    for (i = 0; i < nbufs; i++)
+        info->buf_pa[i] = (uint64_t)uq->pages[BLKQ_BUF_PAGE + i];
+
+    base = memory_give_pages(uq->pages, uq->npages);
+    if (base < 0) {
+        free_uq(uq);
+        return base;
+    }
+
+    iogate_enter(&vio_gate);
+
+    virtio_reset_virtq(dev->regs, VIRTIO_QUEUE_ID);
+    virtio_attach_virtq(dev->regs, VIRTIO_QUEUE_ID, qsize,
+        (uint64_t)uq->desc,
+        (uint64_t)uq->pages[BLKQ_USED_PAGE],
+        (uint64_t)uq->avail);
+    virtio_enable_virtq(dev->regs, VIRTIO_QUEUE_ID);
+    dev->uq = uq;
+
+    iogate_leave(&vio_gate);
+
+    claim->base = (void *)base;
+    return 0;
+}
+
+/*
+Inputs: struct vioblk_device * dev: the device, with a claimed queue
+Outputs: None
+Effect: Resets the queue and releases the claimed pages
+Description: Takes queue 0 back from a process. The device stops using the
+            pages before they are released; pages still mapped in the process
+            are freed when it unmaps them or exits.
+*/
+void vioblk_unclaim(struct vioblk_device * dev) {
+    struct vioblk_uq * const uq = dev->uq;
+
+    virtio_reset_virtq(dev->regs, VIRTIO_QUEUE_ID);
+    dev->uq = NULL;
+
+    // wake anyone in vioblk_uq_wait so it sees the queue is gone
+    condition_broadcast(&dev->vq.used_updated);
+
+    free_uq(uq);
+}
+
+/*
+Inputs: struct vioblk_uq * uq: a claimed queue the device no longer uses, or
+            one vioblk_claim is giving up on; npages pages are allocated, and
+            desc and avail may be NULL
+Outputs: None
+Effect: Releases the pinned pages and frees uq
+Description: Helper for vioblk_claim and vioblk_unclaim.
+*/
+static void free_uq(struct vioblk_uq * uq) {
+    uint32_t i;
+
+    for (i = 0; i < uq->npages; i++)
+        memory_free_pinned(uq->pages[i]);
+    if (uq->desc != NULL)
+        memory_free_pinned(uq->desc);
+    if (uq->avail != NULL)
+        memory_free_pinned(uq->avail);
+    kfree(uq);
+}
+
+/*
+Inputs: struct vioblk_device * dev: the device, with a claimed queue
+Outputs: 0, or -EINVAL if the queue is not claimed or a new entry is refused
+Effect: Fills the kernel's available ring and writes the queue notify register
+Description: Passes the requests the claiming process has added to its
+            available ring on to the device. Each new entry's descriptor chain
+            is copied into the kernel's table and checked there, so the process
+            cannot change it afterwards; a chain with a buffer outside the
+            claimed buffer pages stops the copy, and it and the entries after it
+            are not passed on. Entries passed on before it are.
+*/
+int vioblk_uq_notify(struct vioblk_device * dev) {
+    struct vioblk_uq * const uq = dev->uq;
+    volatile struct virtq_avail * uavail;
+    uint16_t idx, end;
+    int result = 0;
+
+    if (uq == NULL)
+        return -EINVAL;
+
+    uavail = uq->pages[BLKQ_AVAIL_PAGE];
+    end = uavail->idx;
+    // read the ring entries only after the index that publishes them
+    __sync_synchronize();
+
+    if ((uint16_t)(end - uq->avail->idx) > uq->qsize)
+        return -EINVAL;
+
+    for (idx = uq->avail->idx; idx != end; idx++) {
+        result = vioblk_uq_copy_chain(uq, uavail->ring[idx % uq->qsize]);
+        if (result < 0)
+            break;
+        uq->avail->ring[idx % uq->qsize] = uavail->ring[idx % uq->qsize];
+    }
+
+    // polling processes suppress interrupts in their own ring
+    uq->avail->flags = uavail->flags;
+    __sync_synchronize();
+    uq->avail->idx = idx;
+
+    virtio_notify_avail(dev->regs, VIRTIO_QUEUE_ID);
+    return result;
+}
+
+/*
+Inputs: struct vioblk_uq * uq: the claimed queue
+        uint16_t head: first descriptor of a chain in the process's table
+Outputs: 0, or -EINVAL if the chain is refused
+Effect: Writes the chain's descriptors into the kernel's table
+Description: Copies a descriptor chain and checks the copy: every index must be
+            in the queue, the chain no longer than the queue, no descriptor
+            indirect, and every buffer within one of the claimed buffer pages.
+*/
+int vioblk_uq_copy_chain(struct vioblk_uq * uq, uint16_t head) {
+    const volatile struct virtq_desc * const udesc = uq->pages[BLKQ_DESC_PAGE];
+    struct virtq_desc * d;
+    uint16_t j = head;
+    uint32_t n, i;
+    uint64_t pa;
+
+    for (n = 0; n < uq->qsize; n++) {
+        if (uq->qsize <= j)
+            return -EINVAL;
+
+        d = &uq->desc[j];
+        d->addr = udesc[j].addr;
+        d->len = udesc[j].len;
+        d->flags = udesc[j].flags;
+        d->next = udesc[j].next;
+
+        if (d->flags & VIRTQ_DESC_F_INDIRECT)
+            return -EINVAL;
+
+        for (i = BLKQ_BUF_PAGE; i < uq->npages; i++) {
+            pa = (uint64_t)uq->pages[i];
+            if (pa <= d->addr && d->len <= PAGE_SIZE - (d->addr - pa))
+                break;
+        }
+
+        if (i == uq->npages)
+            return -EINVAL;
+
+        if (!(d->flags & VIRTQ_DESC_F_NEXT))
+            return 0;
+
+        j = (uint16_t)d->next;
+    }
+
+    return -EINVAL;
+}
+
+/*
+Inputs: struct vioblk_device * dev: the device, with a claimed queue
+        uint16_t * idxptr: used index the caller has seen; receives the new one
+Outputs: 0, or -EINVAL if the queue is not claimed
+Effect: May suspend the calling thread
+Description: Sleeps until the used index differs from *idxptr. The process must
+            not have suppressed interrupts with VIRTQ_AVAIL_F_NO_INTERRUPT, or
+            the wait may never end.
+*/
+int vioblk_uq_wait(struct vioblk_device * dev, uint16_t * idxptr) {
+    const uint16_t seen = *idxptr;
+    volatile struct virtq_used * used;
+    int saved_intr_state;
+    uint16_t idx;
+
+    if (dev->uq == NULL)
+        return -EINVAL;
+
+    used = dev->uq->pages[BLKQ_USED_PAGE];
+
+    saved_intr_state = intr_disable();
+    while (dev->uq != NULL && used->idx == seen)
+        condition_wait(&dev->vq.used_updated);
+    idx = used->idx;
+    intr_restore(saved_intr_state);
+
+    if (dev->uq == NULL)
+        return -EINVAL;
+
+    *idxptr = idx;
+    return 0;
 }
@@ -0,0 +1,84 @@
+// vioblk.h - VirtIO block device, user-driven queue interface
+//
+// A process that has a block device open can claim its request queue with
+// IOCTL_BLKQ_CLAIM; only init may, since the queue reaches the whole disk. The
+// driver then stops serving read and write on the device and hands the queue
+// to the process: the descriptor table, the available and used rings and a
+// set of DMA buffer pages are allocated by the driver and mapped into the
+// process, and the device is reprogrammed to use them. The process builds
+// requests and collects completions in its own memory, so submitting a batch
+// costs one IOCTL_BLKQ_NOTIFY (the doorbell register is not mapped) and
+// completions cost no system call at all when polled. A process that prefers
+// to sleep waits with IOCTL_BLKQ_WAIT, which returns when the device has
+// interrupted and the used ring has moved.
+//
+// Descriptors hold physical addresses, which the process finds in struct
+// blkq_info. The device never reads the process's descriptor table or
+// available ring: IOCTL_BLKQ_NOTIFY copies the new entries into the driver's
+// own and refuses a chain whose buffers are not within the claimed buffer
+// pages, so the device only ever reaches memory the claim owns.
+// The pages stay with the driver until the device is closed, even if the
+// process unmaps them or exits; closing the device resets the queue and
+// gives it back to the driver.
+//
+
+#ifndef _VIOBLK_H_
+#define _VIOBLK_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// BLKQ_MAXBUFS is the largest number of DMA buffer pages a claim can ask for.
+
+#ifndef BLKQ_MAXBUFS
+#define BLKQ_MAXBUFS 64
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// IOCTL numbers of a block device. Mirrored in user/blkq.h.
+
+#define IOCTL_BLKQ_CLAIM    24 // arg is pointer to struct blkq_claim
+#define IOCTL_BLKQ_NOTIFY   25 // arg is ignored
+#define IOCTL_BLKQ_WAIT     26 // arg is pointer to uint16_t used index
+
+// Largest queue that can be claimed; its descriptor table fills a page.
+
+#define BLKQ_MAXQSIZE       256
+
+// Page offsets of the claimed region
+
+#define BLKQ_DESC_PAGE      0 // descriptor table
+#define BLKQ_AVAIL_PAGE     1 // available ring
+#define BLKQ_USED_PAGE      2 // used ring
+#define BLKQ_INFO_PAGE      3 // struct blkq_info
+#define BLKQ_BUF_PAGE       4 // first DMA buffer page
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Argument of IOCTL_BLKQ_CLAIM. qsize must be a power of two no larger than
+// BLKQ_MAXQSIZE or the device's limit. On success the ioctl fills in base,
+// the address of the region in the calling process.
+
+struct blkq_claim {
+    uint32_t qsize;
+    uint32_t nbufs;             // DMA buffer pages wanted
+    void * base;
+};
+
+// Contents of the info page
+
+struct blkq_info {
+    uint32_t qsize;
+    uint32_t nbufs;
+    uint32_t blksz;             // sector size of the device
+    uint32_t reserved;
+    uint64_t capacity;          // in 512-byte sectors
+    uint64_t buf_pa[BLKQ_MAXBUFS]; // physical address of each buffer page
+};
+
+#endif // _VIOBLK_H_
@@ -0,0 +1,595 @@
+// viopmem.c - VirtIO persistent memory device
+//
+
+#include "viopmem.h"
+
+#include "config.h"
+#include "virtio.h"
+#include "intr.h"
+#include "io.h"
+#include "device.h"
+#include "heap.h"
+#include "lock.h"
+#include "thread.h"
+#include "memory.h"
+#include "string.h"
+#include "error.h"
+#include "console.h"
+
+#ifdef VIOPMEM_TRACE
+#define TRACE
+#endif
+
+#ifdef VIOPMEM_DEBUG
+#define DEBUG
+#endif
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+// COMPILE-TIME PARAMETERS
+//
+
+#define VIOPMEM_IRQ_PRIO 1
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// Feature bit (number, not mask): the range is shared memory region 0 rather
+// than the start and size in the config space.
+
+#define VIRTIO_PMEM_F_SHMEM_REGION  0
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH  0
+#define VIRTIO_PMEM_RESP_OK         0
+
+#define VIOPMEM_QUEUE_ID            0
+
+// An emulated device's range starts right after the kernel's RAM
+
+#define PMEM_EMUL_PMA               RAM_END_PMA
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A flush is a two-descriptor chain: the request, which the device reads, and
+// the response, which it writes.
+
+struct viopmem_req {
+    uint32_t type;
+};
+
+struct viopmem_resp {
+    uint32_t ret;
+};
+
+struct viopmem_device {
+    volatile struct virtio_mmio_regs * regs;    // NULL if emulated
+    struct io_intf * backing;                   // blk1 if emulated
+    uint16_t irqno;
+
+    char * base;                    // kernel address of the range
+    uint64_t size;                  // size of the range in bytes
+    struct lock flush_lock;         // one flush at a time
+
+    struct {
+        // signaled from ISR
+        struct condition used_updated;
+
+        union {
+            struct virtq_avail avail;
+            char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
+        };
+
+        union {
+            volatile struct virtq_used used;
+            char _used_filler[VIRTQ_USED_SIZE(1)];
+        };
+
+        struct virtq_desc desc[2];
+        struct viopmem_req req;
+        volatile struct viopmem_resp resp;
+    } vq;
+};
+
+// Each open has its own position, so a process can open the device while the
+// file system has it mounted without moving the file system's position.
+
+struct viopmem_file {
+    struct io_intf io_intf;
+    struct viopmem_device * dev;
+    uint64_t pos;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int viopmem_open(struct io_intf ** ioptr, void * aux);
+static void viopmem_close(struct io_intf * io);
+static long viopmem_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static long viopmem_write(struct io_intf * io, const void * buf, unsigned long n);
+static int viopmem_ioctl(struct io_intf * io, int cmd, void * arg);
+static void viopmem_isr(int irqno, void * aux);
+
+static int viopmem_flush(struct viopmem_device * dev);
+static int viopmem_emul_copy(struct viopmem_device * dev, int store);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct io_ops viopmem_ops = {
+    .close = viopmem_close,
+    .read = viopmem_read,
+    .write = viopmem_write,
+    .ctl = viopmem_ioctl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * void viopmem_attach(volatile struct virtio_mmio_regs * regs, int irqno);
+ *
+ * Attaches a virtio-pmem device: maps its range into the kernel, sets up the
+ * flush queue and registers the device as "pmem". Declared and called
+ * directly from virtio.c.
+ *
+ * Inputs:
+ *          regs - MMIO registers of the device
+ *          irqno - interrupt line of the device
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Maps the range with memory_map_device and enables the interrupt.
+ *          Leaves the device failed if the range cannot be mapped.
+ */
+void viopmem_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
+    virtio_featset_t enabled_features, wanted_features, needed_features;
+    struct viopmem_device * dev;
+    uint64_t start, size;
+    void * base;
+    int result;
+
+    trace("%s(regs=%p,irqno=%d)", __func__, regs, irqno);
+
+    regs->status |= VIRTIO_STAT_DRIVER;
+    // fence o,io
+    __sync_synchronize();
+
+    virtio_featset_init(needed_features);
+    virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_PMEM_F_SHMEM_REGION);
+    result = virtio_negotiate_features(regs,
+        enabled_features, wanted_features, needed_features);
+
+    if (result != 0) {
+        kprintf("%p: virtio feature negotiation failed\n", regs);
+        return;
+    }
+
+    if (virtio_featset_test(enabled_features, VIRTIO_PMEM_F_SHMEM_REGION)) {
+        regs->shm_sel = 0;
+        // fence o,i
+        __sync_synchronize();
+        start = regs->shm_base;
+        size = regs->shm_len;
+    } else {
+        start = regs->config.pmem.start;
+        size = regs->config.pmem.size;
+    }
+
+    base = memory_map_device(start, size);
+    if (base == NULL) {
+        kprintf("%p: cannot map pmem range [%p,%p)\n",
+            regs, (void*)start, (void*)(start + size));
+        regs->status |= VIRTIO_STAT_FAILED;
+        return;
+    }
+
+    dev = kmalloc(sizeof(struct viopmem_device));
+    if (dev == NULL) {
+        // the mapping stays, as memory_map_device mappings do
+        kprintf("%p: out of memory\n", regs);
+        regs->status |= VIRTIO_STAT_FAILED;
+        return;
+    }
+    memset(dev, 0, sizeof(struct viopmem_device));
+
+    dev->regs = regs;
+    dev->irqno = irqno;
+    dev->base = base;
+    dev->size = size;
+
+    lock_init(&dev->flush_lock, "pmem_flush");
+    condition_init(&dev->vq.used_updated, "Used Updated");
+
+    dev->vq.desc[0].addr = (uint64_t)&dev->vq.req;
+    dev->vq.desc[0].len = sizeof(struct viopmem_req);
+    dev->vq.desc[0].flags = VIRTQ_DESC_F_NEXT;
+    dev->vq.desc[0].next = 1;
+
+    dev->vq.desc[1].addr = (uint64_t)&dev->vq.resp;
+    dev->vq.desc[1].len = sizeof(struct viopmem_resp);
+    dev->vq.desc[1].flags = VIRTQ_DESC_F_WRITE;
+
+    virtio_attach_virtq(regs, VIOPMEM_QUEUE_ID, 1,
+        (uint64_t)dev->vq.desc, (uint64_t)&dev->vq.used,
+        (uint64_t)&dev->vq.avail);
+    virtio_enable_virtq(regs, VIOPMEM_QUEUE_ID);
+
+    intr_register_isr(irqno, VIOPMEM_IRQ_PRIO, viopmem_isr, dev);
+    intr_enable_irq(irqno);
+    device_register("pmem", &viopmem_open, dev);
+
+    regs->status |= VIRTIO_STAT_DRIVER_OK;
+    // fence o,oi
+    __sync_synchronize();
+
+    kprintf("          pmem: [%p,%p) at %p\n",
+        (void*)start, (void*)(start + size), base);
+}
+
+/**
+ * int viopmem_emul_attach(void);
+ *
+ * Registers an emulated pmem device backed by the image on blk1, if it holds
+ * one. See viopmem.h.
+ *
+ * Inputs:
+ *          None.
+ * Outputs:
+ *          0 on success, -ENODEV without a second disk, -EBADFMT if blk1
+ *          holds no usable image, -ENOMEM, or an error from reading it
+ * Side Effects:
+ *          Leaves blk1 open on success. Maps the range with
+ *          memory_map_device and fills it from blk1.
+ */
+int viopmem_emul_attach(void) {
+    struct pmem_emul_header * hdr;
+    struct viopmem_device * dev;
+    struct io_intf * blkio;
+    uint64_t len, size;
+    void * page;
+    void * base;
+    int result;
+
+    result = device_open(&blkio, "blk", 1);
+    if (result < 0)
+        return result;
+
+    // blk1 may hold anything, so only the header's block is read to look
+
+    page = memory_alloc_page();
+    if (page == NULL) {
+        ioclose(blkio);
+        return -ENOMEM;
+    }
+
+    result = ioseek(blkio, 0);
+    if (result >= 0 && ioread_full(blkio, page, PAGE_SIZE) != PAGE_SIZE)
+        result = -EIO;
+    if (result >= 0)
+        result = ioctl(blkio, IOCTL_GETLEN, &len);
+
+    hdr = page;
+    size = hdr->size;
+    if (result >= 0 && (hdr->magic != PMEM_EMUL_MAGIC || size == 0 ||
+        size % PAGE_SIZE != 0 || PMEM_EMUL_MAXSIZE < size ||
+        len < PMEM_EMUL_HDRSZ + size))
+    {
+        result = -EBADFMT;
+    }
+
+    memory_free_page(page);
+
+    base = (result >= 0) ? memory_map_device(PMEM_EMUL_PMA, size) : NULL;
+    if (result >= 0 && base == NULL)
+        result = -ENOMEM;
+
+    if (result < 0) {
+        ioclose(blkio);
+        return result;
+    }
+
+    dev = kmalloc(sizeof(struct viopmem_device));
+    if (dev == NULL) {
+        // the mapping stays, as memory_map_device mappings do
+        ioclose(blkio);
+        return -ENOMEM;
+    }
+    memset(dev, 0, sizeof(struct viopmem_device));
+
+    dev->backing = blkio;
+    dev->base = base;
+    dev->size = size;
+    lock_init(&dev->flush_lock, "pmem_flush");
+
+    result = viopmem_emul_copy(dev, 0);
+    if (result < 0) {
+        // the mapping stays, as memory_map_device mappings do
+        ioclose(blkio);
+        kfree(dev);
+        return result;
+    }
+
+    device_register("pmem", &viopmem_open, dev);
+
+    kprintf("          pmem: emulated [%p,%p) at %p, backed by blk1\n",
+        (void*)PMEM_EMUL_PMA, (void*)(PMEM_EMUL_PMA + size), base);
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * int viopmem_open(struct io_intf ** ioptr, void * aux);
+ *
+ * Opens the device. It may be open any number of times; each open has its
+ * own position, starting at 0.
+ *
+ * Inputs:
+ *          ioptr - receives the I/O interface
+ *          aux - the device
+ * Outputs:
+ *          0, or -ENOMEM
+ * Side Effects:
+ *          Allocates the open's state, freed by viopmem_close.
+ */
+int viopmem_open(struct io_intf ** ioptr, void * aux) {
+    struct viopmem_file * file;
+
+    file = kmalloc(sizeof(struct viopmem_file));
+    if (file == NULL)
+        return -ENOMEM;
+
+    file->io_intf.ops = &viopmem_ops;
+    file->io_intf.refcnt = 1;
+    file->dev = aux;
+    file->pos = 0;
+
+    *ioptr = &file->io_intf;
+    return 0;
+}
+
+/**
+ * void viopmem_close(struct io_intf * io);
+ *
+ * Closes an open of the device. The device itself stays attached.
+ *
+ * Inputs:
+ *          io - the open
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Frees the open's state.
+ */
+void viopmem_close(struct io_intf * io) {
+    kfree((void*)io - offsetof(struct viopmem_file, io_intf));
+}
+
+/**
+ * long viopmem_read(struct io_intf * io, void * buf, unsigned long bufsz);
+ *
+ * Copies from the range at the current position.
+ *
+ * Inputs:
+ *          io - the device
+ *          buf - receives the data
+ *          bufsz - bytes to read
+ * Outputs:
+ *          Bytes read, 0 at the end of the device
+ * Side Effects:
+ *          Advances the position.
+ */
+long viopmem_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct viopmem_file * const file =
+        (void*)io - offsetof(struct viopmem_file, io_intf);
+    struct viopmem_device * const dev = file->dev;
+    unsigned long n;
+
+    if (dev->size <= file->pos)
+        return 0;
+
+    n = MIN(bufsz, dev->size - file->pos);
+    memcpy(buf, dev->base + file->pos, n);
+    file->pos += n;
+    return n;
+}
+
+/**
+ * long viopmem_write(struct io_intf * io, const void * buf, unsigned long n);
+ *
+ * Copies into the range at the current position. The data is durable only
+ * after the next IOCTL_FLUSH.
+ *
+ * Inputs:
+ *          io - the device
+ *          buf - data to write
+ *          n - bytes to write
+ * Outputs:
+ *          Bytes written, 0 at the end of the device
+ * Side Effects:
+ *          Advances the position.
+ */
+long viopmem_write(struct io_intf * io, const void * buf, unsigned long n) {
+    struct viopmem_file * const file =
+        (void*)io - offsetof(struct viopmem_file, io_intf);
+    struct viopmem_device * const dev = file->dev;
+
+    if (dev->size <= file->pos)
+        return 0;
+
+    n = MIN(n, dev->size - file->pos);
+    memcpy(dev->base + file->pos, buf, n);
+    file->pos += n;
+    return n;
+}
+
+/**
+ * int viopmem_ioctl(struct io_intf * io, int cmd, void * arg);
+ *
+ * Handles the block device ioctls, IOCTL_FLUSH and IOCTL_PMEM_DAX. The block
+ * size is 1, since the range can be accessed a byte at a time. sysioctl does
+ * not pass IOCTL_PMEM_DAX on, so only the kernel learns the range's address.
+ *
+ * Inputs:
+ *          io - the device
+ *          cmd - ioctl number
+ *          arg - argument of cmd
+ * Outputs:
+ *          0 or the result of cmd, -ENOTSUP for an unknown cmd
+ * Side Effects:
+ *          See viopmem_flush for IOCTL_FLUSH.
+ */
+int viopmem_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct viopmem_file * const file =
+        (void*)io - offsetof(struct viopmem_file, io_intf);
+    struct viopmem_device * const dev = file->dev;
+    struct pmem_dax * dax;
+
+    trace("%s(cmd=%d,arg=%p)", __func__, cmd, arg);
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t*)arg = dev->size;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t*)arg = file->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        file->pos = *(uint64_t*)arg;
+        return 0;
+    case IOCTL_GETBLKSZ:
+        *(uint32_t*)arg = 1;
+        return 0;
+    case IOCTL_FLUSH:
+        return viopmem_flush(dev);
+    case IOCTL_PMEM_DAX:
+        dax = arg;
+        dax->base = dev->base;
+        dax->size = dev->size;
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/**
+ * void viopmem_isr(int irqno, void * aux);
+ *
+ * Wakes the thread waiting for a flush when the device has used it.
+ *
+ * Inputs:
+ *          irqno - interrupt line of the device
+ *          aux - the device
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Acknowledges the interrupt.
+ */
+void viopmem_isr(int irqno, void * aux) {
+    struct viopmem_device * const dev = aux;
+    const uint32_t status = dev->regs->interrupt_status;
+
+    if (status & 1)
+        condition_broadcast(&dev->vq.used_updated);
+
+    dev->regs->interrupt_ack = status;
+}
+
+/**
+ * int viopmem_flush(struct viopmem_device * dev);
+ *
+ * Asks the device to write the range back to its backing file and waits
+ * until it has. An emulated device writes the range back to blk1 itself.
+ *
+ * Inputs:
+ *          dev - the device
+ * Outputs:
+ *          0, or -EIO if the device reports an error
+ * Side Effects:
+ *          Sleeps until the device interrupts.
+ */
+int viopmem_flush(struct viopmem_device * dev) {
+    int saved_intr_state;
+    int result;
+
+    lock_acquire(&dev->flush_lock);
+
+    if (dev->regs == NULL) {
+        result = viopmem_emul_copy(dev, 1);
+        lock_release(&dev->flush_lock);
+        debug("pmem flush: %d", result);
+        return result;
+    }
+
+    dev->vq.req.type = VIRTIO_PMEM_REQ_TYPE_FLUSH;
+    dev->vq.resp.ret = ~VIRTIO_PMEM_RESP_OK;
+
+    dev->vq.avail.ring[0] = 0;
+    // fence w,w: stores to the range and the request before the index
+    __sync_synchronize();
+    dev->vq.avail.idx += 1;
+    __sync_synchronize();
+
+    saved_intr_state = intr_disable();
+    virtio_notify_avail(dev->regs, VIOPMEM_QUEUE_ID);
+
+    while (dev->vq.used.idx != dev->vq.avail.idx)
+        condition_wait(&dev->vq.used_updated);
+
+    intr_restore(saved_intr_state);
+
+    result = (dev->vq.resp.ret == VIRTIO_PMEM_RESP_OK) ? 0 : -EIO;
+    lock_release(&dev->flush_lock);
+
+    debug("pmem flush: %d", result);
+    return result;
+}
+
+/**
+ * int viopmem_emul_copy(struct viopmem_device * dev, int store);
+ *
+ * Copies an emulated device's range from blk1 (store == 0) or to it, a page
+ * at a time through a page of RAM: the disk driver can only hand RAM and
+ * pinned user pages to the disk, not memory past RAM.
+ *
+ * Inputs:
+ *          dev - an emulated device
+ *          store - nonzero to write the range to blk1
+ * Outputs:
+ *          0, -ENOMEM, or -EIO if blk1 fails
+ * Side Effects:
+ *          Moves blk1's position.
+ */
+int viopmem_emul_copy(struct viopmem_device * dev, int store) {
+    void * const page = memory_alloc_page();
+    uint64_t off;
+    long len;
+    int result = 0;
+
+    if (page == NULL)
+        return -ENOMEM;
+
+    for (off = 0; off < dev->size && result == 0; off += PAGE_SIZE) {
+        result = ioseek(dev->backing, PMEM_EMUL_HDRSZ + off);
+        if (result < 0)
+            break;
+
+        if (store) {
+            memcpy(page, dev->base + off, PAGE_SIZE);
+            len = iowrite(dev->backing, page, PAGE_SIZE);
+        } else {
+            // a short read leaves the range as it was
+            len = ioread_full(dev->backing, page, PAGE_SIZE);
+            if (len == PAGE_SIZE)
+                memcpy(dev->base + off, page, PAGE_SIZE);
+        }
+
+        if (len != PAGE_SIZE)
+            result = -EIO;
+    }
+
+    memory_free_page(page);
+    return (result < 0) ? -EIO : 0;
+}
@@ -0,0 +1,85 @@
+// viopmem.h - VirtIO persistent memory device
+//
+// A virtio-pmem device is a range of host memory, normally backed by a host
+// file, that the machine reads and writes with plain loads and stores. The
+// driver maps the range into the kernel (memory_map_device) and registers it
+// as device "pmem". It reads and writes like a block device, but each request
+// is a memory copy: there is no request queue, no interrupt and no sector
+// alignment.
+//
+// Stores reach the host's memory, not the file behind it. The only request
+// the device takes is a flush, which writes the whole range back to the file.
+// IOCTL_FLUSH sends one and returns when the device has completed it, so data
+// that must survive a host crash has to be followed by an IOCTL_FLUSH.
+//
+// IOCTL_PMEM_DAX gives the kernel address and size of the range, so that a
+// file system can copy file blocks to and from it directly (direct access,
+// DAX). KFS does so when it is mounted on a pmem device.
+//
+// QEMU offers virtio-pmem only over PCI, which the kernel does not drive, so
+// a pmem device can also be emulated: if blk1 holds a pmem image (made by
+// util/mkpmem), viopmem_emul_attach copies it into memory past the kernel's
+// RAM and registers that memory as "pmem". Reads, writes and DAX work as on
+// a real device; IOCTL_FLUSH writes the range back to blk1, standing in for
+// the host file. make run-pmem starts a machine set up this way.
+//
+
+#ifndef _VIOPMEM_H_
+#define _VIOPMEM_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Most memory an emulated device may use past the kernel's RAM. The machine
+// must have this much more memory than RAM_SIZE (config.h); make run-pmem
+// gives it that.
+
+#ifndef PMEM_EMUL_MAXSIZE
+#define PMEM_EMUL_MAXSIZE   (24UL*1024*1024)
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// IOCTL number of a pmem device, for the kernel only: the address it returns
+// is not mapped in user space.
+
+#define IOCTL_PMEM_DAX      27 // arg is pointer to struct pmem_dax
+
+// A pmem image starts with a header block; the range's contents follow it.
+
+#define PMEM_EMUL_MAGIC     0x6d656d70 // "pmem"
+#define PMEM_EMUL_HDRSZ     4096
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Argument of IOCTL_PMEM_DAX
+
+struct pmem_dax {
+    void * base;                // kernel address of the range
+    uint64_t size;              // size of the range in bytes
+};
+
+// Header of a pmem image. Mirrored in util/mkpmem.c.
+
+struct pmem_emul_header {
+    uint32_t magic;             // PMEM_EMUL_MAGIC
+    uint32_t reserved;
+    uint64_t size;              // size of the range, a multiple of 4 KB
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Looks for a pmem image on blk1 and, if there is one, loads it and registers
+// the emulated "pmem" device, keeping blk1 open. Returns 0 if the device is
+// registered, -ENODEV if there is no second disk, -EBADFMT if it holds no
+// pmem image, or an error from reading it. Must be called with interrupts
+// enabled, after the virtio devices are attached.
+
+extern int viopmem_emul_attach(void);
+
+#endif // _VIOPMEM_H_
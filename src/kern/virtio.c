@@ -26,6 +26,10 @@ void virtio_attach(void * mmio_base, int irqno) {
         //           vioblk.c
         volatile struct virtio_mmio_regs * regs, int irqno);
 
+    extern void viopmem_attach (
+        //           viopmem.c
+        volatile struct virtio_mmio_regs * regs, int irqno);
+
     if (regs->magic_value != VIRTIO_MAGIC) {
         kprintf("%p: No virtio magic number found\n", mmio_base);
         return;
@@ -53,6 +57,10 @@ void virtio_attach(void * mmio_base, int irqno) {
         debug("%p: Found virtio block device", regs);
         vioblk_attach(regs, irqno);
         break;
+    case VIRTIO_ID_PMEM:
+        debug("%p: Found virtio pmem device", regs);
+        viopmem_attach(regs, irqno);
+        break;
     default:
         kprintf("%p: Unknown virtio device type %u ignored\n",
             mmio_base, (unsigned int) regs->device_id);
@@ -117,6 +125,13 @@ void virtio_attach_virtq (
     __sync_synchronize();
 }
 
+void virtio_reset(void * mmio_base) {
+    volatile struct virtio_mmio_regs * const regs = mmio_base;
+
+    if (regs->magic_value == VIRTIO_MAGIC && regs->device_id != VIRTIO_ID_NONE)
+        regs->status = 0;
+}
+
 void __attribute__ ((weak)) viocons_attach (
     volatile struct virtio_mmio_regs * regs, int irqno)
 {
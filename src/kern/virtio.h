@@ -107,6 +107,11 @@ struct virtio_mmio_regs {
             uint32_t max_secure_erase_seg;
             uint32_t secure_erase_sector_alignment;
         } blk;
+        //           Persistent memory device config
+        struct {
+            uint64_t start;
+            uint64_t size;
+        } pmem;
         uint8_t raw[0];
     } config;
 };
@@ -155,6 +160,11 @@ struct virtq_used {
 
 extern void virtio_attach(void * mmio_base, int irqno);
 
+//           Resets the device at mmio_base, if there is one, so that it stops using its
+//           queues. Used by kexec.
+
+extern void virtio_reset(void * mmio_base);
+
 static inline int virtio_check_feature (
     volatile struct virtio_mmio_regs * regs, uint_fast16_t k);
 
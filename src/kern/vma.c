@@ -0,0 +1,491 @@
+// vma.c - Per-process virtual memory regions
+//
+
+#include "vma.h"
+
+#include "config.h"
+#include "error.h"
+#include "memory.h"
+#include "console.h"
+#include "halt.h"
+
+#ifdef VMA_TRACE
+#define TRACE
+#endif
+
+#ifdef VMA_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct vma * vma_alloc(void);
+static void vma_free(struct vma * v);
+
+static inline int height(const struct vma * n);
+static inline void update_height(struct vma * n);
+static struct vma * rotate_left(struct vma * n);
+static struct vma * rotate_right(struct vma * n);
+static struct vma * rebalance(struct vma * n);
+static struct vma * insert_node(struct vma * n, struct vma * v);
+static struct vma * remove_node(struct vma * n, const struct vma * v);
+static struct vma * remove_min(struct vma * n, struct vma ** minp);
+static void free_subtree(struct vma * n);
+
+static int compatible(const struct vma * lo, const struct vma * hi);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Region descriptors are taken from a static pool. Descriptors that have never
+// been used are handed out in order; released ones go on a free list linked
+// through the left pointer.
+
+static struct vma vma_pool[VMA_POOL_SIZE];
+static unsigned int vma_pool_next;
+static unsigned int vma_pool_free;
+static struct vma * vma_free_list;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void vma_tree_init(struct vma_tree * tree) {
+    tree->root = NULL;
+    tree->hint = NULL;
+    tree->count = 0;
+}
+
+/**
+ * struct vma * vma_find(struct vma_tree * tree, uintptr_t addr);
+ *
+ * Finds the region containing an address.
+ *
+ * Inputs:
+ *          tree - region tree of the process
+ *          addr - user virtual address
+ * Outputs:
+ *          the region containing addr, or NULL.
+ * Side Effects:
+ *          Updates the last-hit cache of the tree.
+ */
+struct vma * vma_find(struct vma_tree * tree, uintptr_t addr) {
+    struct vma * n;
+
+    n = tree->hint;
+    if (n != NULL && n->start <= addr && addr < n->end)
+        return n;
+
+    n = tree->root;
+    while (n != NULL) {
+        if (addr < n->start)
+            n = n->left;
+        else if (n->end <= addr)
+            n = n->right;
+        else {
+            tree->hint = n;
+            return n;
+        }
+    }
+
+    return NULL;
+}
+
+struct vma * vma_find_ge(struct vma_tree * tree, uintptr_t addr) {
+    struct vma * best = NULL;
+    struct vma * n;
+
+    // Regions do not overlap, so their end addresses are ordered the same way
+    // as their start addresses.
+
+    n = tree->root;
+    while (n != NULL) {
+        if (addr < n->end) {
+            best = n;
+            n = n->left;
+        } else
+            n = n->right;
+    }
+
+    return best;
+}
+
+struct vma * vma_next(struct vma_tree * tree, const struct vma * v) {
+    return vma_find_ge(tree, v->end);
+}
+
+uintptr_t vma_find_free (
+    struct vma_tree * tree, uintptr_t lo, uintptr_t hi, size_t len)
+{
+    struct vma * v;
+    uintptr_t cur = lo;
+
+    for (v = vma_find_ge(tree, lo); v != NULL; v = vma_next(tree, v)) {
+        if (hi <= v->start)
+            break;
+        if (cur + len <= v->start)
+            return cur;
+        if (cur < v->end)
+            cur = v->end;
+    }
+
+    if (cur < hi && len <= hi - cur)
+        return cur;
+
+    return 0;
+}
+
+/**
+ * struct vma * vma_insert(struct vma_tree * tree, const struct vma * tmpl, int * errp);
+ *
+ * Adds a region to the tree.
+ *
+ * Inputs:
+ *          tree - region tree of the process
+ *          tmpl - region to copy (linkage fields are ignored)
+ *          errp - filled in with a negative error code on failure; may be NULL
+ * Outputs:
+ *          the new region, or NULL on failure.
+ * Side Effects:
+ *          Takes a reference to tmpl->io for a file-backed region.
+ */
+struct vma * vma_insert (
+    struct vma_tree * tree, const struct vma * tmpl, int * errp)
+{
+    struct vma * next;
+    struct vma * v;
+    int err = 0;
+
+    if (tmpl->end <= tmpl->start ||
+        tmpl->start % PAGE_SIZE != 0 || tmpl->end % PAGE_SIZE != 0)
+    {
+        err = -EINVAL;
+        goto fail;
+    }
+
+    next = vma_find_ge(tree, tmpl->start);
+    if (next != NULL && next->start < tmpl->end) {
+        err = -EBUSY;
+        goto fail;
+    }
+
+    v = vma_alloc();
+    if (v == NULL) {
+        err = -ENOMEM;
+        goto fail;
+    }
+
+    *v = *tmpl;
+    v->left = v->right = NULL;
+    v->height = 1;
+
+    if (v->backing == VMA_FILE && v->io != NULL)
+        ioref(v->io);
+
+    tree->root = insert_node(tree->root, v);
+    tree->count += 1;
+
+    trace("%s: [%p,%p) prot=%x backing=%d", __func__,
+        (void*)v->start, (void*)v->end, v->prot, v->backing);
+
+    return v;
+
+fail:
+    if (errp != NULL)
+        *errp = err;
+    return NULL;
+}
+
+struct vma * vma_split (
+    struct vma_tree * tree, struct vma * v, uintptr_t addr)
+{
+    const uint64_t lowsz = addr - v->start;
+    struct vma * hi;
+
+    assert (v->start < addr && addr < v->end && addr % PAGE_SIZE == 0);
+
+    hi = vma_alloc();
+    if (hi == NULL)
+        return NULL;
+
+    *hi = *v;
+    hi->left = hi->right = NULL;
+    hi->height = 1;
+    hi->start = addr;
+    hi->offset = v->offset + lowsz;
+    hi->filesz = (v->filesz > lowsz) ? v->filesz - lowsz : 0;
+
+    if (v->filesz > lowsz)
+        v->filesz = lowsz;
+    v->end = addr;
+
+    if (hi->backing == VMA_FILE && hi->io != NULL)
+        ioref(hi->io);
+
+    // Shrinking v does not change its position relative to any other node, so
+    // only the new upper half needs to be inserted.
+
+    tree->root = insert_node(tree->root, hi);
+    tree->count += 1;
+
+    return hi;
+}
+
+struct vma * vma_merge(struct vma_tree * tree, struct vma * v) {
+    struct vma * prev;
+    struct vma * next;
+    uintptr_t end;
+
+    if (v->start != 0) {
+        prev = vma_find(tree, v->start - 1);
+        if (prev != NULL && compatible(prev, v)) {
+            prev->filesz += v->filesz;
+            prev->end = v->end;
+            vma_remove(tree, v);
+            v = prev;
+        }
+    }
+
+    next = vma_find(tree, v->end);
+    if (next != NULL && compatible(v, next)) {
+        end = next->end;
+        v->filesz += next->filesz;
+        vma_remove(tree, next);
+        v->end = end;
+    }
+
+    tree->hint = v;
+    return v;
+}
+
+void vma_remove(struct vma_tree * tree, struct vma * v) {
+    tree->root = remove_node(tree->root, v);
+    tree->count -= 1;
+
+    if (tree->hint == v)
+        tree->hint = NULL;
+
+    if (v->backing == VMA_FILE && v->io != NULL)
+        ioclose(v->io);
+
+    vma_free(v);
+}
+
+/**
+ * int vma_remove_range(struct vma_tree * tree, uintptr_t start, uintptr_t end);
+ *
+ * Removes an address range from the tree.
+ *
+ * Inputs:
+ *          tree - region tree of the process
+ *          start, end - page-aligned range to remove
+ * Outputs:
+ *          0 on success, -ENOMEM if a straddling region could not be split.
+ * Side Effects:
+ *          Regions partially inside the range are trimmed.
+ */
+int vma_remove_range (
+    struct vma_tree * tree, uintptr_t start, uintptr_t end)
+{
+    struct vma * next;
+    struct vma * v;
+
+    // Splitting both ends of a single region needs two descriptors before the
+    // middle one is released. Check up front so a failure leaves the tree
+    // unchanged.
+
+    if (VMA_POOL_SIZE - vma_pool_next + vma_pool_free < 2)
+        return -ENOMEM;
+
+    v = vma_find_ge(tree, start);
+
+    while (v != NULL && v->start < end) {
+        if (v->start < start) {
+            v = vma_split(tree, v, start);
+            continue;
+        }
+
+        if (end < v->end)
+            vma_split(tree, v, end);
+
+        next = vma_next(tree, v);
+        vma_remove(tree, v);
+        v = next;
+    }
+
+    return 0;
+}
+
+int vma_clone(struct vma_tree * dst, struct vma_tree * src) {
+    struct vma * v;
+
+    vma_tree_init(dst);
+
+    for (v = vma_find_ge(src, 0); v != NULL; v = vma_next(src, v)) {
+        if (vma_insert(dst, v, NULL) == NULL) {
+            vma_clear(dst);
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void vma_clear(struct vma_tree * tree) {
+    free_subtree(tree->root);
+    vma_tree_init(tree);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static struct vma * vma_alloc(void) {
+    struct vma * v;
+
+    if (vma_free_list != NULL) {
+        v = vma_free_list;
+        vma_free_list = v->left;
+        vma_pool_free -= 1;
+        return v;
+    }
+
+    if (vma_pool_next < VMA_POOL_SIZE)
+        return &vma_pool[vma_pool_next++];
+
+    debug("%s: region pool exhausted", __func__);
+    return NULL;
+}
+
+static void vma_free(struct vma * v) {
+    v->left = vma_free_list;
+    vma_free_list = v;
+    vma_pool_free += 1;
+}
+
+static inline int height(const struct vma * n) {
+    return (n != NULL) ? n->height : 0;
+}
+
+static inline void update_height(struct vma * n) {
+    const int hl = height(n->left);
+    const int hr = height(n->right);
+    n->height = 1 + ((hl > hr) ? hl : hr);
+}
+
+static struct vma * rotate_left(struct vma * n) {
+    struct vma * const r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    update_height(n);
+    update_height(r);
+    return r;
+}
+
+static struct vma * rotate_right(struct vma * n) {
+    struct vma * const l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    update_height(n);
+    update_height(l);
+    return l;
+}
+
+static struct vma * rebalance(struct vma * n) {
+    int balance;
+
+    update_height(n);
+    balance = height(n->left) - height(n->right);
+
+    if (balance > 1) {
+        if (height(n->left->left) < height(n->left->right))
+            n->left = rotate_left(n->left);
+        return rotate_right(n);
+    }
+
+    if (balance < -1) {
+        if (height(n->right->right) < height(n->right->left))
+            n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+
+    return n;
+}
+
+static struct vma * insert_node(struct vma * n, struct vma * v) {
+    if (n == NULL)
+        return v;
+
+    if (v->start < n->start)
+        n->left = insert_node(n->left, v);
+    else
+        n->right = insert_node(n->right, v);
+
+    return rebalance(n);
+}
+
+static struct vma * remove_min(struct vma * n, struct vma ** minp) {
+    if (n->left == NULL) {
+        *minp = n;
+        return n->right;
+    }
+
+    n->left = remove_min(n->left, minp);
+    return rebalance(n);
+}
+
+static struct vma * remove_node(struct vma * n, const struct vma * v) {
+    struct vma * min;
+
+    if (n == NULL)
+        return NULL;
+
+    if (v->start < n->start)
+        n->left = remove_node(n->left, v);
+    else if (n->start < v->start)
+        n->right = remove_node(n->right, v);
+    else {
+        // Nodes are relinked rather than copied so that pointers to the
+        // remaining regions stay valid.
+
+        if (n->right == NULL)
+            return n->left;
+
+        n->right = remove_min(n->right, &min);
+        min->left = n->left;
+        min->right = n->right;
+        n = min;
+    }
+
+    return rebalance(n);
+}
+
+static void free_subtree(struct vma * n) {
+    if (n == NULL)
+        return;
+
+    free_subtree(n->left);
+    free_subtree(n->right);
+
+    if (n->backing == VMA_FILE && n->io != NULL)
+        ioclose(n->io);
+
+    vma_free(n);
+}
+
+static int compatible(const struct vma * lo, const struct vma * hi) {
+    if (lo->end != hi->start || lo->prot != hi->prot ||
+        lo->flags != hi->flags || lo->advice != hi->advice ||
+        lo->backing != hi->backing)
+        return 0;
+
+    if (lo->backing != VMA_FILE)
+        return 1;
+
+    // File data must continue without a zero-filled gap in between.
+
+    return (lo->io == hi->io &&
+        lo->filesz == lo->end - lo->start &&
+        hi->offset == lo->offset + (lo->end - lo->start));
+}
@@ -0,0 +1,162 @@
+// vma.h - Per-process virtual memory regions
+//
+// A region (struct vma) describes a page-aligned range of the user address
+// space: which accesses are allowed and what supplies the contents of a page
+// when it is first touched. The regions of a process are kept in a balanced
+// (AVL) search tree keyed by start address, so classifying a fault or locating
+// the regions affected by an unmap takes O(log n). The tree also remembers the
+// region found by the last lookup, which catches the common case of repeated
+// faults in the same region without a descent.
+//
+
+#ifndef _VMA_H_
+#define _VMA_H_
+
+#include "io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// VMA_POOL_SIZE is the number of region descriptors shared by all processes.
+
+#ifndef VMA_POOL_SIZE
+#define VMA_POOL_SIZE 256
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// Backing object of a region
+
+#define VMA_ANON    0 // zero-filled on first touch
+#define VMA_FILE    1 // filled from io at offset, zero past filesz
+#define VMA_SHARED  2 // pages are shared with other spaces instead of copied
+
+// Region flags
+
+#define VMA_STACK       (1 << 0) // initial user stack
+#define VMA_IMAGE       (1 << 1) // loaded from the program image
+#define VMA_HUGEPAGE    (1 << 2) // map megapages (anonymous) or fault in
+                                 // megapage-sized extents (file)
+
+// Access pattern advice (madvise). NORMAL, RANDOM and SEQUENTIAL are kept in
+// the region; WILLNEED and DONTNEED act on the range immediately; HUGEPAGE and
+// NOHUGEPAGE set and clear VMA_HUGEPAGE. Mirrored in user/syscall.h.
+
+#define MADV_NORMAL         0
+#define MADV_RANDOM         1 // no readahead
+#define MADV_SEQUENTIAL     2 // aggressive readahead, drop behind
+#define MADV_WILLNEED       3 // populate the range now
+#define MADV_DONTNEED       4 // free the range now, refill on next touch
+#define MADV_HUGEPAGE       14
+#define MADV_NOHUGEPAGE     15
+
+// Protection and flag bits of the mmap system call. These are mirrored in
+// user/syscall.h.
+
+#define PROT_READ   (1 << 0)
+#define PROT_WRITE  (1 << 1)
+#define PROT_EXEC   (1 << 2)
+
+#define MAP_PRIVATE (1 << 0)
+#define MAP_SHARED  (1 << 1)
+#define MAP_FIXED   (1 << 4)
+#define MAP_ANON    (1 << 5)
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct vma {
+    uintptr_t start;        // first address (page aligned)
+    uintptr_t end;          // one past the last address (page aligned)
+    uint8_t prot;           // OR of PTE_R, PTE_W, PTE_X
+    uint8_t flags;          // OR of VMA_STACK, VMA_IMAGE, VMA_HUGEPAGE
+    uint8_t backing;        // VMA_ANON, VMA_FILE or VMA_SHARED
+    uint8_t advice;         // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+    struct io_intf * io;    // backing file (VMA_FILE), holds a reference
+    uint64_t offset;        // file offset corresponding to start
+    uint64_t filesz;        // bytes of file data starting at start
+
+    // Tree linkage, private to vma.c
+
+    struct vma * left;
+    struct vma * right;
+    int height;
+};
+
+struct vma_tree {
+    struct vma * root;
+    struct vma * hint;      // region returned by the last lookup
+    unsigned int count;     // number of regions in the tree
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Initializes an empty region tree.
+
+extern void vma_tree_init(struct vma_tree * tree);
+
+// Returns the region containing addr, or NULL if addr is not in any region.
+
+extern struct vma * vma_find(struct vma_tree * tree, uintptr_t addr);
+
+// Returns the lowest region that ends above addr, i.e. the region containing
+// addr or the first one after it. Returns NULL if there is none.
+
+extern struct vma * vma_find_ge(struct vma_tree * tree, uintptr_t addr);
+
+// Returns the region following v in address order, or NULL.
+
+extern struct vma * vma_next(struct vma_tree * tree, const struct vma * v);
+
+// Returns the lowest address in [lo,hi) at which a free range of len bytes
+// begins, or 0 if there is no such range.
+
+extern uintptr_t vma_find_free (
+    struct vma_tree * tree, uintptr_t lo, uintptr_t hi, size_t len);
+
+// Inserts a copy of tmpl into the tree. The range must be page aligned and
+// must not overlap an existing region. A file-backed region takes a reference
+// to its io object. Returns a pointer to the new region, or NULL with *errp
+// set to -EINVAL (bad range), -EBUSY (overlap) or -ENOMEM (pool exhausted).
+
+extern struct vma * vma_insert (
+    struct vma_tree * tree, const struct vma * tmpl, int * errp);
+
+// Splits v at addr, which must be a page-aligned address strictly inside v.
+// On return v covers [v->start,addr) and the returned region covers the rest.
+// Returns NULL if no descriptor is available.
+
+extern struct vma * vma_split (
+    struct vma_tree * tree, struct vma * v, uintptr_t addr);
+
+// Merges v with its neighbours where they are adjacent and compatible (same
+// protection, flags, advice and backing, and contiguous file offsets). Returns the
+// region that now contains v's range.
+
+extern struct vma * vma_merge(struct vma_tree * tree, struct vma * v);
+
+// Removes v from the tree, releasing its io reference.
+
+extern void vma_remove(struct vma_tree * tree, struct vma * v);
+
+// Removes [start,end) from the tree, splitting regions that straddle either
+// boundary. Page tables are not touched. Returns 0 or -ENOMEM.
+
+extern int vma_remove_range (
+    struct vma_tree * tree, uintptr_t start, uintptr_t end);
+
+// Copies every region of src into the empty tree dst (for fork). Returns 0 or
+// -ENOMEM, in which case dst is left empty.
+
+extern int vma_clone(struct vma_tree * dst, struct vma_tree * src);
+
+// Removes all regions from the tree.
+
+extern void vma_clear(struct vma_tree * tree);
+
+#endif // _VMA_H_
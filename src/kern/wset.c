@@ -0,0 +1,185 @@
+// wset.c - Recorded working sets of executables
+//
+
+#include "wset.h"
+
+#include "process.h"
+#include "memory.h"
+#include "timer.h"
+#include "console.h"
+
+#ifdef WSET_TRACE
+#define TRACE
+#endif
+
+#ifdef WSET_DEBUG
+#define DEBUG
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct wset_entry {
+    int valid;
+    uint32_t ino;
+    uint64_t stamp;                 // last use, for replacement
+    unsigned int cnt;
+    uintptr_t pages[WSET_MAXPAGES]; // sorted, no duplicates
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct wset_entry * lookup(uint32_t ino);
+static struct wset_entry * replace(uint32_t ino);
+static void insert_page(struct wset_entry * ent, uintptr_t vma);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct wset_entry wset_table[WSET_NENT];
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * void wset_exec(struct process * proc, struct io_intf * exeio);
+ *
+ * Prefetches the recorded working set of an executable and starts recording.
+ *
+ * Inputs:
+ *          proc - process that just loaded the executable (current process)
+ *          exeio - io interface of the executable
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          Maps pages of the program image in the current memory space.
+ */
+void wset_exec(struct process * proc, struct io_intf * exeio) {
+    struct wset_entry * ent;
+    uint32_t ino;
+
+    wset_commit(proc);
+
+    if (ioctl(exeio, IOCTL_GETINO, &ino) < 0)
+        return;
+
+    ent = lookup(ino);
+    if (ent != NULL) {
+        ent->stamp = timer_ticks();
+        if (memory_prefetch(ent->pages, ent->cnt) < ent->cnt)
+            debug("%s: inode %u: working set only partly prefetched",
+                __func__, ino);
+    }
+
+    proc->ws.active = 1;
+    proc->ws.ino = ino;
+    proc->ws.cnt = 0;
+    proc->ws.tend = timer_ticks() + WSET_RECORD_MS * (TIMER_FREQ / 1000);
+}
+
+void wset_note_fault(struct process * proc, uintptr_t vma) {
+    if (!proc->ws.active)
+        return;
+
+    if (proc->ws.tend <= timer_ticks()) {
+        wset_commit(proc);
+        return;
+    }
+
+    if (proc->ws.cnt < WSET_MAXPAGES)
+        proc->ws.pages[proc->ws.cnt++] = vma;
+}
+
+/**
+ * void wset_commit(struct process * proc);
+ *
+ * Ends recording and merges the pages that faulted into the table entry of the
+ * executable. On later runs only pages missed by the prefetch fault, so the
+ * entry converges on the union of what the program touches early on.
+ *
+ * Inputs:
+ *          proc - process whose recording to end
+ * Outputs:
+ *          None.
+ * Side Effects:
+ *          May evict the least recently used table entry.
+ */
+void wset_commit(struct process * proc) {
+    struct wset_entry * ent;
+    unsigned int i;
+
+    if (!proc->ws.active)
+        return;
+
+    proc->ws.active = 0;
+
+    if (proc->ws.cnt == 0)
+        return;
+
+    ent = lookup(proc->ws.ino);
+    if (ent == NULL)
+        ent = replace(proc->ws.ino);
+
+    for (i = 0; i < proc->ws.cnt; i++)
+        insert_page(ent, proc->ws.pages[i]);
+
+    ent->stamp = timer_ticks();
+
+    trace("%s: inode %u: %u pages recorded, %u in working set",
+        __func__, proc->ws.ino, proc->ws.cnt, ent->cnt);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static struct wset_entry * lookup(uint32_t ino) {
+    int i;
+
+    for (i = 0; i < WSET_NENT; i++) {
+        if (wset_table[i].valid && wset_table[i].ino == ino)
+            return &wset_table[i];
+    }
+
+    return NULL;
+}
+
+static struct wset_entry * replace(uint32_t ino) {
+    struct wset_entry * victim = &wset_table[0];
+    int i;
+
+    for (i = 0; i < WSET_NENT; i++) {
+        if (!wset_table[i].valid) {
+            victim = &wset_table[i];
+            break;
+        }
+        if (wset_table[i].stamp < victim->stamp)
+            victim = &wset_table[i];
+    }
+
+    victim->valid = 1;
+    victim->ino = ino;
+    victim->cnt = 0;
+    return victim;
+}
+
+// Keeps the pages sorted by address so that the prefetch can coalesce them
+// into runs that are contiguous in the file.
+
+static void insert_page(struct wset_entry * ent, uintptr_t vma) {
+    unsigned int i, j;
+
+    if (ent->cnt == WSET_MAXPAGES)
+        return;
+
+    for (i = ent->cnt; 0 < i && vma < ent->pages[i-1]; i--)
+        continue;
+
+    if (0 < i && ent->pages[i-1] == vma)
+        return;
+
+    for (j = ent->cnt; i < j; j--)
+        ent->pages[j] = ent->pages[j-1];
+    ent->pages[i] = vma;
+    ent->cnt += 1;
+}
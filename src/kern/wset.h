@@ -0,0 +1,72 @@
+// wset.h - Recorded working sets of executables
+//
+// Every exec of the same program faults in much the same set of image pages.
+// The first MS milliseconds of faults in the image of a process are recorded
+// and kept in a small in-memory table keyed by the inode of the executable.
+// The next exec of that inode reads the recorded pages in as a few large,
+// file-ordered reads and maps them before the program starts, instead of
+// taking one fault and one small read per page.
+//
+
+#ifndef _WSET_H_
+#define _WSET_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "io.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// WSET_MAXPAGES is the largest working set recorded for one executable,
+// WSET_NENT the number of executables remembered, and WSET_RECORD_MS the
+// length of the recording window after exec.
+
+#ifndef WSET_MAXPAGES
+#define WSET_MAXPAGES 128
+#endif
+
+#ifndef WSET_NENT
+#define WSET_NENT 8
+#endif
+
+#ifndef WSET_RECORD_MS
+#define WSET_RECORD_MS 500
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct process; // process.h
+
+// Per-process recording state
+
+struct wset_record {
+    int active;                     // recording in progress
+    uint32_t ino;                   // inode of the executable
+    uint64_t tend;                  // end of the recording window (ticks)
+    unsigned int cnt;               // number of pages recorded
+    uintptr_t pages[WSET_MAXPAGES]; // faulting image pages, in fault order
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Called by process_exec once the image regions are set up in the current
+// process. Prefetches the recorded working set of the executable, if there is
+// one, and starts recording faults. Does nothing if exeio cannot report an
+// inode number.
+
+extern void wset_exec(struct process * proc, struct io_intf * exeio);
+
+// Called by the page fault handler after it maps a page of the program image.
+
+extern void wset_note_fault(struct process * proc, uintptr_t vma);
+
+// Ends recording and merges the recorded pages into the table. Called when the
+// window expires, and on exec and exit.
+
+extern void wset_commit(struct process * proc);
+
+#endif // _WSET_H_
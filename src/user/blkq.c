@@ -0,0 +1,226 @@
+// blkq.c - Direct access to a virtio block device queue
+//
+
+#include "blkq.h"
+#include "syscall.h"
+#include "string.h"
+#include "error.h"
+
+// INTERNAL CONSTANTS
+//
+
+#define PAGE_SIZE   4096
+
+#define DESC_F_NEXT     (1 << 0)
+#define DESC_F_WRITE    (1 << 1)
+
+#define AVAIL_F_NO_INTERRUPT    1
+
+// Layout of the header page: request headers, then status bytes
+
+#define STATUS_OFFSET   2048
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct used {
+    uint16_t flags;
+    uint16_t idx;
+    struct used_elem ring[];
+};
+
+struct req_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline volatile struct desc * q_desc(const struct blkq * q);
+static inline volatile struct avail * q_avail(const struct blkq * q);
+static inline volatile struct used * q_used(const struct blkq * q);
+static inline char * q_hdrpage(const struct blkq * q);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int blkq_open(struct blkq * q, int instno, uint32_t qsize, uint32_t nbufs) {
+    volatile struct desc * d;
+    struct blkq_claim claim;
+    uint64_t hdr_pa;
+    int fd, result;
+    uint16_t i;
+
+    if (nbufs < 2)
+        return -EINVAL;
+
+    fd = _devopen(-1, "blk", instno);
+    if (fd < 0)
+        return fd;
+
+    claim.qsize = qsize;
+    claim.nbufs = nbufs;
+    result = _ioctl(fd, IOCTL_BLKQ_CLAIM, &claim);
+    if (result < 0) {
+        _close(fd);
+        return result;
+    }
+
+    memset(q, 0, sizeof(*q));
+    q->fd = fd;
+    q->qsize = qsize;
+    q->nslots = qsize / 3;
+    q->nbufs = nbufs - 1;
+    q->base = claim.base;
+    q->info = (void *)(q->base + BLKQ_INFO_PAGE * PAGE_SIZE);
+
+    // Chain the three descriptors of each slot once; only addresses, lengths
+    // and the data direction change per request
+
+    hdr_pa = q->info->buf_pa[0];
+    d = q_desc(q);
+
+    for (i = 0; i < q->nslots; i++) {
+        d[3*i].addr = hdr_pa + i * sizeof(struct req_header);
+        d[3*i].len = sizeof(struct req_header);
+        d[3*i].flags = DESC_F_NEXT;
+        d[3*i].next = 3*i + 1;
+        d[3*i+1].flags = DESC_F_NEXT;
+        d[3*i+1].next = 3*i + 2;
+        d[3*i+2].addr = hdr_pa + STATUS_OFFSET + i;
+        d[3*i+2].len = 1;
+        d[3*i+2].flags = DESC_F_WRITE;
+        q->free[i] = i;
+    }
+
+    q->nfree = q->nslots;
+    return 0;
+}
+
+void blkq_close(struct blkq * q) {
+    _close(q->fd);
+    q->fd = -1;
+}
+
+void * blkq_buf(const struct blkq * q, int i) {
+    if (i < 0 || q->nbufs <= i)
+        return NULL;
+
+    return q->base + (BLKQ_BUF_PAGE + 1 + i) * PAGE_SIZE;
+}
+
+int blkq_submit(struct blkq * q, int type,
+    uint64_t sector, int bufno, uint32_t len)
+{
+    volatile struct desc * const d = q_desc(q);
+    volatile struct avail * const avail = q_avail(q);
+    struct req_header * hdr;
+    int slot;
+
+    if (bufno < 0 || q->nbufs <= bufno || len == 0 || PAGE_SIZE < len)
+        return -EINVAL;
+
+    if (len % q->info->blksz != 0)
+        return -EINVAL;
+
+    if (q->nfree == 0)
+        return -EBUSY;
+
+    slot = q->free[--q->nfree];
+
+    hdr = (struct req_header *)q_hdrpage(q) + slot;
+    hdr->type = type;
+    hdr->reserved = 0;
+    hdr->sector = sector;
+    q_hdrpage(q)[STATUS_OFFSET + slot] = 0xff;
+
+    d[3*slot+1].addr = q->info->buf_pa[1 + bufno];
+    d[3*slot+1].len = len;
+    d[3*slot+1].flags = DESC_F_NEXT | ((type == BLKQ_READ) ? DESC_F_WRITE : 0);
+
+    avail->ring[q->avail_idx % q->qsize] = 3*slot;
+    q->avail_idx += 1;
+
+    // The ring entry must be visible before the index that publishes it
+
+    __sync_synchronize();
+    avail->idx = q->avail_idx;
+
+    return slot;
+}
+
+int blkq_kick(struct blkq * q) {
+    __sync_synchronize();
+    return _ioctl(q->fd, IOCTL_BLKQ_NOTIFY, NULL);
+}
+
+int blkq_poll(struct blkq * q, int * statusp) {
+    volatile struct used * const used = q_used(q);
+    int slot;
+
+    if (used->idx == q->used_idx)
+        return -1;
+
+    __sync_synchronize();
+
+    slot = used->ring[q->used_idx % q->qsize].id / 3;
+    q->used_idx += 1;
+
+    if (statusp != NULL)
+        *statusp = (unsigned char)q_hdrpage(q)[STATUS_OFFSET + slot];
+
+    q->free[q->nfree++] = slot;
+    return slot;
+}
+
+int blkq_wait(struct blkq * q) {
+    uint16_t idx = q->used_idx;
+
+    if (q_used(q)->idx != idx)
+        return 0;
+
+    return _ioctl(q->fd, IOCTL_BLKQ_WAIT, &idx);
+}
+
+void blkq_set_polling(struct blkq * q, int on) {
+    q_avail(q)->flags = on ? AVAIL_F_NO_INTERRUPT : 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline volatile struct desc * q_desc(const struct blkq * q) {
+    return (void *)(q->base + BLKQ_DESC_PAGE * PAGE_SIZE);
+}
+
+static inline volatile struct avail * q_avail(const struct blkq * q) {
+    return (void *)(q->base + BLKQ_AVAIL_PAGE * PAGE_SIZE);
+}
+
+static inline volatile struct used * q_used(const struct blkq * q) {
+    return (void *)(q->base + BLKQ_USED_PAGE * PAGE_SIZE);
+}
+
+static inline char * q_hdrpage(const struct blkq * q) {
+    return q->base + BLKQ_BUF_PAGE * PAGE_SIZE;
+}
@@ -0,0 +1,107 @@
+// blkq.h - Direct access to a virtio block device queue
+//
+// A process that opens a block device can claim its request queue (see
+// kern/vioblk.h) and drive the device itself: requests are written into a
+// descriptor table and ring mapped into the process, the device is told about
+// them with one ioctl per batch, and completions are collected from the used
+// ring without a system call. Compared to _read and _write, which copy each
+// sector through the kernel and wait for it before starting the next, a batch
+// of requests is in flight at once and data lands directly in the buffers.
+//
+// Each request reads or writes up to one page to or from one of the buffers
+// returned by blkq_buf. The device must stay open while the queue is used;
+// closing the descriptor gives the queue back to the kernel.
+//
+
+#ifndef _BLKQ_H_
+#define _BLKQ_H_
+
+#include <stdint.h>
+
+// Mirrored from kern/vioblk.h
+
+#define IOCTL_BLKQ_CLAIM    24
+#define IOCTL_BLKQ_NOTIFY   25
+#define IOCTL_BLKQ_WAIT     26
+
+#define BLKQ_MAXBUFS        64
+#define BLKQ_MAXQSIZE       256
+
+#define BLKQ_DESC_PAGE      0
+#define BLKQ_AVAIL_PAGE     1
+#define BLKQ_USED_PAGE      2
+#define BLKQ_INFO_PAGE      3
+#define BLKQ_BUF_PAGE       4
+
+struct blkq_claim {
+    uint32_t qsize;
+    uint32_t nbufs;
+    void * base;
+};
+
+struct blkq_info {
+    uint32_t qsize;
+    uint32_t nbufs;
+    uint32_t blksz;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t buf_pa[BLKQ_MAXBUFS];
+};
+
+// Request types
+
+#define BLKQ_READ   0
+#define BLKQ_WRITE  1
+
+// The first buffer page holds request headers and status bytes, so a queue
+// claimed with nbufs buffer pages offers nbufs-1 data buffers. Each request
+// takes three descriptors.
+
+struct blkq {
+    int fd;
+    uint16_t qsize;
+    uint16_t nslots;            // requests that can be in flight
+    uint16_t nfree;
+    uint16_t avail_idx;         // next free entry of the available ring
+    uint16_t used_idx;          // next used entry to collect
+    uint16_t nbufs;             // data buffers
+    char * base;
+    const struct blkq_info * info;
+    uint16_t free[BLKQ_MAXQSIZE / 3];
+};
+
+// Opens block device instno and claims its queue. Only init may claim one.
+// Returns 0 or a negative error.
+
+extern int blkq_open(struct blkq * q, int instno, uint32_t qsize, uint32_t nbufs);
+extern void blkq_close(struct blkq * q);
+
+// Returns data buffer i, a page.
+
+extern void * blkq_buf(const struct blkq * q, int i);
+
+// Queues a request to transfer len bytes (a multiple of the sector size, at
+// most a page) between sector and buffer bufno. The device does not see it
+// until blkq_kick. Returns a request id or -EBUSY if the queue is full.
+
+extern int blkq_submit(struct blkq * q, int type,
+    uint64_t sector, int bufno, uint32_t len);
+
+extern int blkq_kick(struct blkq * q);
+
+// Collects one completed request. Returns its id, or -1 if none has completed.
+// *statusp receives the virtio status byte, 0 for success.
+
+extern int blkq_poll(struct blkq * q, int * statusp);
+
+// Sleeps until a request completes; returns at once if one already has.
+// Must not be used while interrupts are off (blkq_set_polling).
+
+extern int blkq_wait(struct blkq * q);
+
+// Asks the device not to interrupt on completions, for a process that only
+// polls.
+
+extern void blkq_set_polling(struct blkq * q, int on);
+
+#endif // _BLKQ_H_
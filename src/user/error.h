@@ -14,5 +14,9 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define ENOMEM     11
+#define ENOSPC     12
+#define EDEADLK    13
+#define EPERM      14
 
 #endif // _ERROR_H_
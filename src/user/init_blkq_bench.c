@@ -0,0 +1,117 @@
+#include "syscall.h"
+#include "string.h"
+#include "blkq.h"
+
+/*
+User program to compare kernel block I/O with a claimed queue. Needs a second
+disk (make run-blkq in kern); it only reads. Does so by doing the following:
+    1. Reads NBLKS 4 KB blocks from blk1 with _read, one block per call
+    2. Claims the queue of blk1 and reads the same blocks in batches of up to
+       BATCH requests, kicking once per batch and polling for completions
+    3. Checks that both passes read the same data
+    Prints timer ticks per block for each pass.
+*/
+
+#define NBLKS 256
+#define BATCH 16
+#define BLKSZ 4096
+
+static inline unsigned long ticks(void) {
+    unsigned long t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+static void report(const char * what, unsigned long t, unsigned long n) {
+    char buf[80];
+
+    snprintf(buf, sizeof(buf), "%s: %lu ticks per block", what, t / n);
+    _msgout(buf);
+}
+
+static unsigned long sum(const unsigned char * p) {
+    unsigned long s = 0;
+    int i;
+
+    for (i = 0; i < BLKSZ; i++)
+        s = s * 31 + p[i];
+
+    return s;
+}
+
+void main(void){
+    static unsigned char blk[BLKSZ];
+    static unsigned long sums[NBLKS];
+    struct blkq q;
+    unsigned long t0;
+    int submitted, done;
+    int ok = 1;
+    int status;
+    int slot;
+    int bufof[BLKQ_MAXQSIZE / 3];
+    int blkof[BATCH];
+    int i;
+
+    if (_devopen(0, "blk", 1) < 0) {
+        _msgout("_devopen failed; is there a second disk?");
+        return;
+    }
+
+    t0 = ticks();
+
+    for (i = 0; i < NBLKS; i++) {
+        if (_read(0, blk, BLKSZ) != BLKSZ) {
+            _msgout("_read failed");
+            return;
+        }
+        sums[i] = sum(blk);
+    }
+
+    report("_read", ticks() - t0, NBLKS);
+    _close(0);
+
+    if (blkq_open(&q, 1, 64, BATCH + 1) < 0) {
+        _msgout("blkq_open failed");
+        return;
+    }
+
+    blkq_set_polling(&q, 1);
+    t0 = ticks();
+
+    for (i = 0; i < NBLKS; i += BATCH) {
+        for (submitted = 0; submitted < BATCH; submitted++) {
+            slot = blkq_submit(&q, BLKQ_READ,
+                (uint64_t)(i + submitted) * BLKSZ / q.info->blksz,
+                submitted, BLKSZ);
+            if (slot < 0) {
+                _msgout("blkq_submit failed");
+                return;
+            }
+            bufof[slot] = submitted;
+        }
+
+        blkq_kick(&q);
+
+        for (done = 0; done < submitted; done++) {
+            while ((slot = blkq_poll(&q, &status)) < 0)
+                continue;
+            if (status != 0)
+                ok = 0;
+            blkof[bufof[slot]] = 1;
+        }
+
+        for (done = 0; done < submitted; done++) {
+            if (!blkof[done] || sum(blkq_buf(&q, done)) != sums[i + done])
+                ok = 0;
+            blkof[done] = 0;
+        }
+    }
+
+    report("blkq, polled", ticks() - t0, NBLKS);
+    blkq_close(&q);
+
+    if (ok)
+        _msgout("Both passes read the same data");
+    else
+        _msgout("Passes differ");
+}
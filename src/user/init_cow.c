@@ -0,0 +1,77 @@
+#include "syscall.h"
+#include "string.h"
+
+#define IOCTL_SETPOS 4
+
+/*
+User program to test the copy-on-write overlay device. Boot it with
+`make run-cow` in kern, which adds a delta disk. Does so by doing the
+following:
+    1. Opens the overlay and prints how many chunks are copied to the delta
+    2. Reads the start of test.txt and writes the same bytes back, which
+       copies the chunk holding them to the delta
+    3. Reads the bytes again and checks them, then prints the count again,
+       which should have gone up by one unless the chunk was already copied
+    4. Commits the delta to the base image and prints the count, now 0
+*/
+
+static void print_stat(int fd, const char * when) {
+    struct cow_stat st;
+    char msg[100];
+
+    if (_ioctl(fd, IOCTL_COW_STAT, &st) < 0) {
+        _msgout("IOCTL_COW_STAT failed");
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "%s: %u of %u chunks copied, room for %u",
+        when, st.ncopied, st.nchunks, st.nfree);
+    _msgout(msg);
+}
+
+void main(void){
+    char buf[512], check[512];
+    uint64_t merged, pos;
+    char msg[80];
+    long n;
+
+    if (_devopen(1, "cow", 0) < 0) {
+        _msgout("no overlay; boot with a delta disk (make run-cow)");
+        return;
+    }
+
+    print_stat(1, "before");
+
+    if (_fsopen(0, "test.txt") < 0 ||
+        (n = _read(0, buf, sizeof(buf))) <= 0)
+    {
+        _msgout("reading test.txt failed");
+        return;
+    }
+
+    pos = 0;
+    _ioctl(0, IOCTL_SETPOS, &pos);
+    if (_write(0, buf, n) != n) {
+        _msgout("writing test.txt failed");
+        return;
+    }
+
+    pos = 0;
+    _ioctl(0, IOCTL_SETPOS, &pos);
+    if (_read(0, check, n) != n || memcmp(buf, check, n) != 0) {
+        _msgout("test.txt changed");
+        return;
+    }
+
+    _close(0);
+    print_stat(1, "after write");
+
+    if (_ioctl(1, IOCTL_COW_COMMIT, &merged) < 0) {
+        _msgout("IOCTL_COW_COMMIT failed");
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "committed %lu chunks", (unsigned long)merged);
+    _msgout(msg);
+    print_stat(1, "after commit");
+}
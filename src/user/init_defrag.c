@@ -0,0 +1,55 @@
+#include "syscall.h"
+#include "string.h"
+
+/*
+User program to defragment the file system. Does so by doing the following:
+    1. Calls _defrag, which moves every file into one run of disk blocks
+    2. Prints how many runs the files were in before and after
+    3. Checks that test.txt reads back the same as before
+*/
+
+static unsigned long checksum(void) {
+    char buf[256];
+    unsigned long s = 0;
+    long n, i;
+
+    if (_fsopen(0, "test.txt") < 0)
+        return 0;
+
+    while ((n = _read(0, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++)
+            s = s * 31 + (unsigned char)buf[i];
+    }
+
+    _close(0);
+    return s;
+}
+
+void main(void){
+    struct kfs_defrag_stats st;
+    unsigned long before;
+    char buf[100];
+    int result;
+
+    before = checksum();
+
+    result = _defrag(&st);
+    if (result < 0) {
+        snprintf(buf, sizeof(buf), "_defrag failed: %d", result);
+        _msgout(buf);
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%lu files, %lu blocks, %lu blocks moved",
+        (unsigned long)st.files, (unsigned long)st.blocks,
+        (unsigned long)st.moved);
+    _msgout(buf);
+    snprintf(buf, sizeof(buf), "runs: %lu before, %lu after",
+        (unsigned long)st.runs_before, (unsigned long)st.runs_after);
+    _msgout(buf);
+
+    if (checksum() == before)
+        _msgout("test.txt unchanged");
+    else
+        _msgout("test.txt changed");
+}
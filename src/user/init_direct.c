@@ -0,0 +1,76 @@
+#include "syscall.h"
+#include "string.h"
+
+#define IOCTL_SETPOS 4
+#define IOCTL_SETDIRECT 8
+
+#define FILE_LEN 13000 // three 4 KB blocks and a partial one
+#define SKEW 100
+
+/*
+User program to test direct I/O (IOCTL_SETDIRECT). Whole blocks go between
+the buffer and the disk directly; the partial block at either end goes
+through the file system's block buffer. Does so by doing the following:
+    1. Opens direct.dat twice and turns on direct mode on the first fd
+    2. Writes a pattern over the whole file through the first fd: three
+       blocks take the direct path, the tail takes the buffered one
+    3. Reads the file back through the second fd, not in direct mode, and
+       checks it
+    4. Reads the file through the first fd from an offset inside the first
+       block, so that the request starts and ends with a partial block, and
+       checks it
+*/
+
+static char pattern[FILE_LEN];
+static char check[FILE_LEN];
+
+void main(void){
+    uint64_t pos;
+    char msg[80];
+    int on = 1;
+    long n;
+    int i;
+
+    if (_fsopen(0, "direct.dat") < 0 || _fsopen(1, "direct.dat") < 0) {
+        _msgout("_fsopen failed");
+        return;
+    }
+
+    if (_ioctl(0, IOCTL_SETDIRECT, &on) != 0) {
+        _msgout("IOCTL_SETDIRECT failed");
+        return;
+    }
+
+    for (i = 0; i < FILE_LEN; i++)
+        pattern[i] = 'a' + (i * 7) % 26;
+
+    n = _write(0, pattern, FILE_LEN);
+    snprintf(msg, sizeof(msg), "direct write: %ld", n);
+    _msgout(msg);
+    if (n != FILE_LEN)
+        return;
+
+    if (_read(1, check, FILE_LEN) != FILE_LEN ||
+        memcmp(check, pattern, FILE_LEN) != 0)
+    {
+        _msgout("buffered read after direct write differs");
+        return;
+    }
+
+    pos = SKEW;
+    _ioctl(0, IOCTL_SETPOS, &pos);
+    memset(check, 0, sizeof(check));
+    n = _read(0, check, FILE_LEN - SKEW);
+    snprintf(msg, sizeof(msg), "direct read: %ld", n);
+    _msgout(msg);
+    if (n != FILE_LEN - SKEW ||
+        memcmp(check, pattern + SKEW, FILE_LEN - SKEW) != 0)
+    {
+        _msgout("direct read differs");
+        return;
+    }
+
+    _msgout("contents ok");
+    _close(0);
+    _close(1);
+}
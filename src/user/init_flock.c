@@ -0,0 +1,98 @@
+#include "syscall.h"
+#include "string.h"
+#include "error.h"
+
+#define IOCTL_SETPOS 4
+
+/*
+User program to test byte-range locks. Does so by doing the following:
+    1. Opens test_lock.txt and a message queue, and locks bytes 0-9
+       exclusively
+    2. Forks a child that locks bytes 10-19, which does not wait since the
+       ranges are disjoint, and checks that bytes 0-9 are busy with FLOCK_NB
+    3. The child tells the parent through the queue that it is about to wait
+       for bytes 0-9 and does so. Sending does not yield, so the parent gets
+       the message only once the child is blocked; it then asks for bytes
+       10-19, which would deadlock and must fail with -EDEADLK
+    4. The parent writes its range and unlocks it; the child gets it, writes
+       both ranges and exits
+    5. The parent prints the file
+*/
+
+static void write_at(int fd, uint64_t pos, const char * s) {
+    _ioctl(fd, IOCTL_SETPOS, &pos);
+    _write(fd, s, strlen(s));
+}
+
+static void report(const char * what, int result, int expected) {
+    char msg[80];
+
+    snprintf(msg, sizeof(msg), "%s: %d (%s)", what, result,
+        (result == expected) ? "ok" : "unexpected");
+    _msgout(msg);
+}
+
+void main(void){
+    char buf[64];
+    uint64_t pos;
+    size_t len;
+    char * msg;
+    long n;
+    int pid;
+    int mq;
+
+    if (_fsopen(0, "test_lock.txt") < 0) {
+        _msgout("_fsopen failed");
+        return;
+    }
+
+    mq = _msgq(-1);
+    if (mq < 0) {
+        _msgout("_msgq failed");
+        return;
+    }
+
+    report("parent locks 0-9", _flock_range(0, 0, 10, FLOCK_EX), 0);
+
+    pid = _fork();
+    if (pid < 0) {
+        _msgout("_fork failed");
+        return;
+    }
+
+    if (pid == 0) {
+        report("child locks 10-19", _flock_range(0, 10, 10, FLOCK_EX | FLOCK_NB), 0);
+        report("child tries 0-9", _flock_range(0, 0, 10, FLOCK_EX | FLOCK_NB), -EBUSY);
+        if (_msgsend(mq, "waiting", sizeof("waiting"), 0) != 0)
+            _msgout("_msgsend failed");
+        report("child waits for 0-9", _flock_range(0, 0, 10, FLOCK_EX), 0);
+        write_at(0, 0, "child0123");
+        write_at(0, 10, "child4567");
+        _exit();
+    }
+
+    // Returns once the child is blocked waiting for bytes 0-9
+
+    msg = _msgrecv(mq, &len, 0);
+    if (MAP_FAILED(msg)) {
+        _msgout("_msgrecv failed");
+        return;
+    }
+    _munmap(msg, len);
+
+    report("parent asks for 10-19", _flock_range(0, 10, 10, FLOCK_EX), -EDEADLK);
+
+    write_at(0, 0, "parent-01");
+    report("parent unlocks 0-9", _flock_range(0, 0, 10, FLOCK_UN), 0);
+
+    _wait(pid);
+
+    pos = 0;
+    _ioctl(0, IOCTL_SETPOS, &pos);
+    n = _read(0, buf, sizeof(buf) - 1);
+    buf[(n > 0) ? n : 0] = '\0';
+    _msgout("File contents: ");
+    _msgout(buf);
+    _close(mq);
+    _close(0);
+}
@@ -0,0 +1,125 @@
+#include "syscall.h"
+#include "string.h"
+
+/*
+User program to test I/O priorities and rate limits. Does so by doing the
+following:
+    1. Times reading test.txt with the disk to itself
+    2. Forks a child that moves itself to the idle class and reads trek over
+       and over, then times test.txt again while the child keeps the disk busy
+    3. Caps the child at 8 KB per second with _ioprio and checks that the
+       child's reads slow down to about that rate
+    Prints timer ticks per read of test.txt for steps 1 and 2, which should be
+    close to each other, and the child's bytes per second for step 3.
+*/
+
+#define NREADS 20
+#define CHILD_SECS 2
+
+static inline unsigned long ticks(void) {
+    unsigned long t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+static unsigned long time_reads(void) {
+    char buf[256];
+    unsigned long t0;
+    int i;
+
+    t0 = ticks();
+
+    for (i = 0; i < NREADS; i++) {
+        if (_fsopen(0, "test.txt") < 0)
+            return 0;
+        while (_read(0, buf, sizeof(buf)) > 0)
+            continue;
+        _close(0);
+    }
+
+    return (ticks() - t0) / NREADS;
+}
+
+static void child(void) {
+    struct ioprio_attr attr = { IOPRIO_CLASS_IDLE, 0, 0, 0 };
+    char buf[4096];
+    unsigned long t0, nbytes;
+    long n;
+    char msg[80];
+
+    _ioprio(-1, &attr, NULL);
+
+    t0 = ticks();
+    nbytes = 0;
+
+    // Runs until the parent has applied the cap and the cap has had
+    // CHILD_SECS seconds to take effect, then reports the rate of the last
+    // CHILD_SECS seconds.
+
+    for (;;) {
+        if (_fsopen(1, "trek") < 0)
+            _exit();
+        while ((n = _read(1, buf, sizeof(buf))) > 0)
+            nbytes += n;
+        _close(1);
+
+        if (_ioprio(-1, NULL, &attr) == 0 && attr.bps != 0)
+            break;
+    }
+
+    t0 = ticks();
+    nbytes = 0;
+
+    while (ticks() - t0 < CHILD_SECS * 10000000UL) {
+        if (_fsopen(1, "trek") < 0)
+            _exit();
+        while ((n = _read(1, buf, sizeof(buf))) > 0 &&
+            ticks() - t0 < CHILD_SECS * 10000000UL)
+            nbytes += n;
+        _close(1);
+    }
+
+    snprintf(msg, sizeof(msg), "capped child: %lu bytes per second",
+        nbytes / CHILD_SECS);
+    _msgout(msg);
+    _exit();
+}
+
+void main(void){
+    struct ioprio_attr attr;
+    unsigned long alone, busy;
+    char msg[80];
+    int pid;
+
+    alone = time_reads();
+
+    pid = _fork();
+    if (pid < 0) {
+        _msgout("_fork failed");
+        return;
+    }
+
+    if (pid == 0)
+        child();
+
+    // Let the child start streaming before measuring
+
+    _usleep(100000);
+    busy = time_reads();
+
+    snprintf(msg, sizeof(msg), "test.txt: %lu ticks alone, %lu with idle reader",
+        alone, busy);
+    _msgout(msg);
+
+    attr.class = IOPRIO_CLASS_BE;
+    attr.level = 7;
+    attr.iops = 0;
+    attr.bps = 8192;
+
+    if (_ioprio(pid, &attr, NULL) < 0) {
+        _msgout("_ioprio failed");
+        return;
+    }
+
+    _wait(pid);
+}
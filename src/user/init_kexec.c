@@ -0,0 +1,53 @@
+#include "syscall.h"
+#include "string.h"
+
+/*
+User program to test kexec. Does so by doing the following:
+    1. Asks the kernel for the region handed over by the kernel that booted it
+    2. If there is none, this is a cold boot: opens kernel.elf and boots it
+       with _kexec, handing over a message with the current time
+    3. Otherwise, prints the message and the timer ticks between the _kexec
+       call and now, which covers the whole warm reboot up to this program
+       starting again
+    Boot with init18 on the command line; the kernel starts it again after the
+    kexec, so the second run prints the result.
+*/
+
+struct handoff {
+    char msg[64];
+    unsigned long t0;
+};
+
+static inline unsigned long ticks(void) {
+    unsigned long t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+void main(void){
+    struct handoff h;
+    char msg[120];
+    long n;
+
+    n = _kexec(-1, &h, sizeof(h));
+
+    if (n == sizeof(h)) {
+        snprintf(msg, sizeof(msg), "warm boot: \"%s\" after %lu ticks",
+            h.msg, ticks() - h.t0);
+        _msgout(msg);
+        return;
+    }
+
+    if (_fsopen(0, "kernel.elf") < 0) {
+        _msgout("_fsopen failed");
+        return;
+    }
+
+    strncpy(h.msg, "hello from the previous kernel", sizeof(h.msg));
+    h.t0 = ticks();
+
+    n = _kexec(0, &h, sizeof(h));
+
+    snprintf(msg, sizeof(msg), "_kexec failed: %ld", n);
+    _msgout(msg);
+}
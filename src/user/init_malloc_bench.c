@@ -0,0 +1,118 @@
+#include "syscall.h"
+#include "string.h"
+#include "malloc.h"
+
+/*
+User program to benchmark the allocator. Does so by doing the following:
+    1. Keeps 256 small blocks of mixed sizes live, replacing the oldest one on
+       every iteration, and checks each block's fill byte before freeing it
+    2. Grows one buffer with realloc and checks that its contents survive
+    3. Allocates and frees 64 KB blocks, which map and unmap each time
+    4. Times an mmap/munmap pair of one page for comparison
+    Prints timer ticks per operation for each step.
+*/
+
+#define NLIVE 256
+#define NITER 20000
+#define NLARGE 200
+
+static inline unsigned long ticks(void) {
+    unsigned long t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+static void report(const char * what, unsigned long t, unsigned long n) {
+    char buf[80];
+
+    snprintf(buf, sizeof(buf), "%s: %lu ticks per op", what, t / n);
+    _msgout(buf);
+}
+
+void main(void){
+    static unsigned char * live[NLIVE];
+    static size_t livesz[NLIVE];
+    unsigned long t0;
+    unsigned char * p;
+    size_t size;
+    unsigned int seed = 1;
+    int ok = 1;
+    int i, j;
+
+    t0 = ticks();
+
+    for (i = 0; i < NITER; i++) {
+        j = i % NLIVE;
+
+        if (live[j] != NULL) {
+            if (live[j][0] != (unsigned char)j ||
+                live[j][livesz[j]-1] != (unsigned char)j)
+                ok = 0;
+            free(live[j]);
+        }
+
+        seed = seed * 1103515245 + 12345;
+        size = 1 + (seed >> 16) % 512;
+
+        live[j] = malloc(size);
+        if (live[j] == NULL) {
+            _msgout("malloc failed");
+            _exit();
+        }
+
+        livesz[j] = size;
+        live[j][0] = j;
+        live[j][size-1] = j;
+    }
+
+    report("malloc+free, 1..512 bytes", ticks() - t0, NITER);
+
+    for (j = 0; j < NLIVE; j++)
+        free(live[j]);
+
+    p = NULL;
+    for (size = 16; size <= 256 * 1024; size *= 2) {
+        p = realloc(p, size);
+        if (p == NULL) {
+            _msgout("realloc failed");
+            _exit();
+        }
+        p[size/2] = size / 1024;
+        if (size > 16 && p[size/4] != (unsigned char)(size / 2 / 1024))
+            ok = 0;
+    }
+    free(p);
+
+    t0 = ticks();
+
+    for (i = 0; i < NLARGE; i++) {
+        p = malloc(64 * 1024);
+        if (p == NULL) {
+            _msgout("malloc failed");
+            _exit();
+        }
+        p[0] = 1;
+        free(p);
+    }
+
+    report("malloc+free, 64 KB", ticks() - t0, NLARGE);
+
+    t0 = ticks();
+
+    for (i = 0; i < NLARGE; i++) {
+        p = _mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED(p)) {
+            _msgout("mmap failed");
+            _exit();
+        }
+        p[0] = 1;
+        _munmap(p, 4096);
+    }
+
+    report("mmap+munmap, one page", ticks() - t0, NLARGE);
+
+    if (ok)
+        _msgout("Allocator contents check passed");
+    else
+        _msgout("Allocator returned corrupted blocks");
+}
@@ -0,0 +1,78 @@
+#include "syscall.h"
+#include "string.h"
+
+/*
+User program to test page-transfer message passing. Does so by doing the following:
+    1. Creates a message queue and forks
+    2. Child maps eight pages, fills each with a letter chosen from the page
+       index and sends them as one message, then sends an unaligned string
+       that straddles a page boundary
+    3. Child checks that the pages it sent now read as zero
+    4. Parent receives both messages, checks lengths and contents, and
+       checks that the unaligned message kept its offset within the page
+*/
+void main(void){
+    static const char text[] = "unaligned message across a page boundary";
+    char * base;
+    char * msg;
+    size_t len;
+    int child;
+    int ok = 1;
+    int fd;
+    int i;
+
+    fd = _msgq(-1);
+    if (fd < 0) {
+        _msgout("msgq failed");
+        _exit();
+    }
+
+    child = _fork();
+
+    if (child == 0) {
+        base = _mmap(NULL, 8 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED(base))
+            _exit();
+
+        for (i = 0; i < 8; i++)
+            memset(base + i * 4096, 'A' + i, 4096);
+
+        if (_msgsend(fd, base, 8 * 4096, 0) != 0)
+            _msgout("msgsend failed");
+
+        for (i = 0; i < 8; i++) {
+            if (base[i * 4096] != 0)
+                _msgout("Sent page is still mapped in the sender");
+        }
+
+        msg = base + 4096 - 10;
+        memcpy(msg, text, sizeof(text));
+        if (_msgsend(fd, msg, sizeof(text), 0) != 0)
+            _msgout("msgsend failed");
+
+        _exit();
+    }
+
+    msg = _msgrecv(fd, &len, 0);
+    if (MAP_FAILED(msg) || len != 8 * 4096) {
+        ok = 0;
+    } else {
+        for (i = 0; i < 8; i++) {
+            if (msg[i * 4096] != 'A' + i || msg[i * 4096 + 4095] != 'A' + i)
+                ok = 0;
+        }
+        _munmap(msg, len);
+    }
+
+    msg = _msgrecv(fd, &len, 0);
+    if (MAP_FAILED(msg) || len != sizeof(text) ||
+        (uintptr_t)msg % 4096 != 4096 - 10 || strcmp(msg, text) != 0)
+        ok = 0;
+
+    _wait(child);
+
+    if (ok)
+        _msgout("Both messages arrived intact");
+    else
+        _msgout("Wrong message contents");
+}
@@ -0,0 +1,61 @@
+#include "syscall.h"
+#include "string.h"
+
+#define IOCTL_SETPOS 4
+#define IOCTL_FLUSH 5
+
+/*
+User program to test KFS on a virtio-pmem device, where it runs in DAX mode.
+make run-pmem provides an emulated one (kern/viopmem.h). Does so by doing the
+following:
+    1. Opens the pmem device to check that there is one; KFS also works on a
+       block device, where the steps below still pass but do not use DAX
+    2. Reads the start of test.txt and writes the same bytes back, which in
+       DAX mode copies them straight into device memory
+    3. Flushes the file system with IOCTL_FLUSH so the write is durable
+    4. Reads the bytes again and checks them
+*/
+
+void main(void){
+    char buf[512], check[512];
+    uint64_t pos;
+    char msg[80];
+    long n;
+    int result;
+
+    if (_devopen(1, "pmem", 0) < 0)
+        _msgout("no pmem device; KFS is on a block device");
+    else {
+        _msgout("KFS is on a pmem device");
+        _close(1);
+    }
+
+    if (_fsopen(0, "test.txt") < 0 ||
+        (n = _read(0, buf, sizeof(buf))) <= 0)
+    {
+        _msgout("reading test.txt failed");
+        return;
+    }
+
+    pos = 0;
+    _ioctl(0, IOCTL_SETPOS, &pos);
+    if (_write(0, buf, n) != n) {
+        _msgout("writing test.txt failed");
+        return;
+    }
+
+    result = _ioctl(0, IOCTL_FLUSH, NULL);
+    snprintf(msg, sizeof(msg), "flush: %d (%s)", result,
+        (result == 0) ? "ok" : "unexpected");
+    _msgout(msg);
+
+    pos = 0;
+    _ioctl(0, IOCTL_SETPOS, &pos);
+    if (_read(0, check, n) != n || memcmp(buf, check, n) != 0) {
+        _msgout("test.txt changed");
+        return;
+    }
+
+    _msgout("test.txt read back ok");
+    _close(0);
+}
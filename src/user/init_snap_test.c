@@ -0,0 +1,49 @@
+#include "syscall.h"
+#include "string.h"
+
+#define TABLE_LEN 4096
+
+/*
+User program to test process snapshots. Does so by doing the following:
+    1. Tries to restore snap.img; on a warm start this resumes at step 4
+    2. Builds a table (standing in for expensive initialization)
+    3. Saves a snapshot in snap.img and restores it right away
+    4. The restored process returns 1 from _snapshot and checks the table,
+       whose pages are faulted in from the snapshot file
+*/
+
+static unsigned int table[TABLE_LEN];
+
+void main(void){
+    unsigned int i;
+    int result;
+
+    _restore("snap.img");
+    _msgout("No usable snapshot, initializing");
+
+    for (i = 0; i < TABLE_LEN; i++)
+        table[i] = i * i + 7;
+
+    result = _snapshot("snap.img");
+
+    if (result < 0) {
+        _msgout("Snapshot failed");
+        _exit();
+    }
+
+    if (result == 0) {
+        _msgout("Snapshot taken, restoring it");
+        _restore("snap.img");
+        _msgout("Restore failed");
+        _exit();
+    }
+
+    for (i = 0; i < TABLE_LEN; i++) {
+        if (table[i] != i * i + 7) {
+            _msgout("Restored table is wrong");
+            _exit();
+        }
+    }
+
+    _msgout("Restored from snapshot, table is intact");
+}
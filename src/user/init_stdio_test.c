@@ -0,0 +1,44 @@
+#include "syscall.h"
+#include "string.h"
+#include "stdio.h"
+
+/*
+User program to test buffered stdio. Does so by doing the following:
+    1. Opens ser1 and wraps it in a fully buffered stream
+    2. Prints fifty numbered lines with fprintf, which should reach the
+       device in a few large writes rather than one write per line
+    3. Reads test.txt line by line with fgets and echoes it
+    4. Leaves the last lines unflushed; _exit flushes them when main returns
+*/
+void main(void){
+    char line[80];
+    FILE * out;
+    FILE * in;
+    int i;
+
+    if (_devopen(0, "ser", 1) < 0) {
+        _msgout("_devopen failed");
+        return;
+    }
+
+    out = fdopen(0, "w");
+    if (out == NULL) {
+        _msgout("fdopen failed");
+        return;
+    }
+
+    for (i = 0; i < 50; i++)
+        fprintf(out, "line %d of %d\r\n", i + 1, 50);
+
+    in = fopen("test.txt", "r");
+    if (in == NULL) {
+        fputs("fopen of test.txt failed\r\n", out);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+        fprintf(out, "test.txt: %s", line);
+
+    fclose(in);
+    fputs("\r\nThis line is flushed by _exit\r\n", out);
+}
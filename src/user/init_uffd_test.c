@@ -0,0 +1,70 @@
+#include "syscall.h"
+#include "string.h"
+
+/*
+User program to test user-space page fault handling. Does so by doing the following:
+    1. Creates a userfaultfd and maps a four-page anonymous region
+    2. Registers the region with the userfaultfd and forks
+    3. Child acts as the handler: reads a fault event and installs a page
+       filled with a letter chosen from the page index, four times, after
+       checking that a kernel source address is refused
+    4. Parent reads the first byte of every page, which suspends it until the
+       child has supplied that page, and checks the letters
+*/
+void main(void){
+    struct uffd_range range;
+    struct uffd_copy copy;
+    struct uffd_msg msg;
+    static char page[4096];
+    char * base;
+    int child;
+    int ok = 1;
+    int fd;
+    int i;
+
+    fd = _uffd(-1);
+    base = _mmap(NULL, 4 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (fd < 0 || MAP_FAILED(base)) {
+        _msgout("uffd or mmap failed");
+        _exit();
+    }
+
+    range.start = (uintptr_t)base;
+    range.len = 4 * 4096;
+    if (_ioctl(fd, IOCTL_UFFD_REGISTER, &range) != 0) {
+        _msgout("uffd register failed");
+        _exit();
+    }
+
+    child = _fork();
+
+    if (child == 0) {
+        for (i = 0; i < 4; i++) {
+            if (_read(fd, &msg, sizeof(msg)) != sizeof(msg))
+                break;
+            memset(page, 'A' + (msg.addr - (uintptr_t)base) / 4096, sizeof(page));
+            copy.dst = msg.addr;
+            copy.len = sizeof(page);
+            // a source outside the handler's space must be refused
+            copy.src = (void *)0x80000000;
+            if (_ioctl(fd, IOCTL_UFFD_COPY, &copy) >= 0)
+                _msgout("Kernel source address was accepted");
+            copy.src = page;
+            if (_ioctl(fd, IOCTL_UFFD_COPY, &copy) != sizeof(page))
+                _msgout("Copy did not install the whole page");
+        }
+        _exit();
+    }
+
+    for (i = 3; i >= 0; i--) {
+        if (base[i * 4096] != 'A' + i)
+            ok = 0;
+    }
+
+    _wait(child);
+
+    if (ok)
+        _msgout("All four pages were supplied by the handler");
+    else
+        _msgout("Wrong page contents");
+}
@@ -0,0 +1,364 @@
+// malloc.c - User-space memory allocator
+//
+
+#include "malloc.h"
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// INTERNAL CONSTANTS
+//
+
+#define PAGE_SIZE       4096UL
+#define CHUNK_SIZE      (64 * 1024UL)       // holds objects of one class
+#define ARENA_SIZE      (1024 * 1024UL)     // reserved at a time for chunks
+#define MAXARENAS       64
+
+#define CHUNK_HDR       64  // first object offset, keeps 16-byte alignment
+#define LARGE_HDR       16
+
+#define CHUNK_MAGIC     0x6b6e6863 // "chnk"
+#define LARGE_MAGIC     0x6567726c // "lrge"
+
+#define NCLASSES        (sizeof(class_size) / sizeof(class_size[0]))
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Header at the start of every chunk. Objects that were never handed out lie
+// above bump; freed ones are on the free list, linked through their first
+// word. A chunk with room is on the partial list of its class.
+
+struct chunk {
+    uint32_t magic;
+    uint16_t cls;
+    uint16_t nused;             // objects handed out
+    uint32_t bump;              // offset of the first object never used
+    uint32_t limit;             // end of the last whole object
+    void * free;
+    struct chunk * next;
+    struct chunk * prev;
+};
+
+struct large {
+    uint32_t magic;
+    size_t size;                // bytes mapped, header included
+};
+
+struct arena {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t brk;              // first chunk not cut yet
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Class sizes grow by about a quarter of a power of two above 128 bytes, so
+// no more than a fifth of a small object is padding.
+
+static const uint16_t class_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+
+static uint8_t class_of[MALLOC_SMALL_MAX / 16 + 1]; // by (size+15)/16
+static int classes_ready;
+
+static struct chunk * partial[NCLASSES];
+static struct chunk * spare;    // empty chunks, linked through next
+
+static struct arena arenas[MAXARENAS];
+static int narenas;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void init_classes(void);
+static struct chunk * new_chunk(unsigned int cls);
+static int new_arena(void);
+static struct chunk * small_chunk(const void * p);
+static void unlink_chunk(struct chunk * c);
+
+static void * large_alloc(size_t size);
+static void large_free(void * p);
+
+static size_t usable_size(void * p);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void * malloc(size_t size) {
+    struct chunk * c;
+    unsigned int cls;
+    void * p;
+
+    if (size > MALLOC_SMALL_MAX)
+        return large_alloc(size);
+
+    if (!classes_ready)
+        init_classes();
+
+    cls = class_of[(size + 15) / 16];
+    c = partial[cls];
+
+    if (c == NULL) {
+        c = new_chunk(cls);
+        if (c == NULL)
+            return NULL;
+    }
+
+    if (c->free != NULL) {
+        p = c->free;
+        c->free = *(void **)p;
+    } else {
+        p = (char *)c + c->bump;
+        c->bump += class_size[cls];
+    }
+
+    c->nused += 1;
+
+    if (c->free == NULL && c->bump == c->limit)
+        unlink_chunk(c);
+
+    return p;
+}
+
+void free(void * p) {
+    struct chunk * c;
+    unsigned int cls;
+
+    if (p == NULL)
+        return;
+
+    c = small_chunk(p);
+    if (c == NULL) {
+        large_free(p);
+        return;
+    }
+
+    if (c->magic != CHUNK_MAGIC || c->nused == 0) {
+        _msgout("free: bad pointer");
+        _exit();
+    }
+
+    cls = c->cls;
+
+    // A full chunk is off the partial list; it has room again
+
+    if (c->free == NULL && c->bump == c->limit) {
+        c->prev = NULL;
+        c->next = partial[cls];
+        if (c->next != NULL)
+            c->next->prev = c;
+        partial[cls] = c;
+    }
+
+    *(void **)p = c->free;
+    c->free = p;
+    c->nused -= 1;
+
+    // Keep the last chunk of a class for the next allocation; return the
+    // pages of any other empty chunk (all but the header page).
+
+    if (c->nused == 0 && (partial[cls] != c || c->next != NULL)) {
+        unlink_chunk(c);
+        _madvise((char *)c + PAGE_SIZE, CHUNK_SIZE - PAGE_SIZE, MADV_DONTNEED);
+        c->magic = 0;
+        c->next = spare;
+        spare = c;
+    }
+}
+
+void * calloc(size_t nmemb, size_t size) {
+    void * p;
+
+    if (size != 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    size *= nmemb;
+    p = malloc(size);
+
+    // Large allocations come straight from the kernel, zeroed
+
+    if (p != NULL && size <= MALLOC_SMALL_MAX)
+        memset(p, 0, size);
+
+    return p;
+}
+
+void * realloc(void * p, size_t size) {
+    size_t oldsize;
+    void * q;
+
+    if (p == NULL)
+        return malloc(size);
+
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+
+    oldsize = usable_size(p);
+    if (size <= oldsize)
+        return p;
+
+    q = malloc(size);
+    if (q == NULL)
+        return NULL;
+
+    memcpy(q, p, oldsize);
+    free(p);
+    return q;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void init_classes(void) {
+    unsigned int cls = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(class_of); i++) {
+        while (class_size[cls] < i * 16)
+            cls += 1;
+        class_of[i] = cls;
+    }
+
+    classes_ready = 1;
+}
+
+// Returns an empty chunk set up for class cls and put on its partial list.
+// Reuses a spare chunk if there is one, else cuts one from the last arena.
+
+struct chunk * new_chunk(unsigned int cls) {
+    struct arena * a;
+    struct chunk * c;
+
+    if (spare != NULL) {
+        c = spare;
+        spare = c->next;
+    } else {
+        if (narenas == 0 || arenas[narenas-1].brk == arenas[narenas-1].end) {
+            if (new_arena() < 0)
+                return NULL;
+        }
+
+        a = &arenas[narenas-1];
+        c = (struct chunk *)a->brk;
+        a->brk += CHUNK_SIZE;
+    }
+
+    c->magic = CHUNK_MAGIC;
+    c->cls = cls;
+    c->nused = 0;
+    c->bump = CHUNK_HDR;
+    c->limit = CHUNK_HDR +
+        (CHUNK_SIZE - CHUNK_HDR) / class_size[cls] * class_size[cls];
+    c->free = NULL;
+
+    c->prev = NULL;
+    c->next = partial[cls];
+    if (c->next != NULL)
+        c->next->prev = c;
+    partial[cls] = c;
+
+    return c;
+}
+
+// Reserves a chunk-aligned arena. The kernel picks page-aligned addresses
+// only, so a chunk more than needed is mapped and the ends are trimmed.
+
+int new_arena(void) {
+    uintptr_t base, start;
+    char * p;
+
+    if (narenas == MAXARENAS)
+        return -1;
+
+    p = _mmap(NULL, ARENA_SIZE + CHUNK_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (MAP_FAILED(p))
+        return -1;
+
+    base = (uintptr_t)p;
+    start = (base + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1);
+
+    if (start != base)
+        _munmap((void *)base, start - base);
+    _munmap((void *)(start + ARENA_SIZE), base + CHUNK_SIZE - start);
+
+    arenas[narenas].start = start;
+    arenas[narenas].end = start + ARENA_SIZE;
+    arenas[narenas].brk = start;
+    narenas += 1;
+
+    return 0;
+}
+
+// Returns the chunk holding p, or NULL if p is not in an arena
+
+struct chunk * small_chunk(const void * p) {
+    const uintptr_t addr = (uintptr_t)p;
+    int i;
+
+    for (i = narenas - 1; i >= 0; i--) {
+        if (arenas[i].start <= addr && addr < arenas[i].brk)
+            return (struct chunk *)(addr & ~(CHUNK_SIZE - 1));
+    }
+
+    return NULL;
+}
+
+void unlink_chunk(struct chunk * c) {
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        partial[c->cls] = c->next;
+
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+
+    c->next = NULL;
+    c->prev = NULL;
+}
+
+void * large_alloc(size_t size) {
+    struct large * l;
+    size_t len;
+
+    if (size > SIZE_MAX - LARGE_HDR - PAGE_SIZE)
+        return NULL;
+
+    len = (size + LARGE_HDR + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    l = _mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (MAP_FAILED(l))
+        return NULL;
+
+    l->magic = LARGE_MAGIC;
+    l->size = len;
+    return (char *)l + LARGE_HDR;
+}
+
+void large_free(void * p) {
+    struct large * const l = (struct large *)((char *)p - LARGE_HDR);
+
+    if ((uintptr_t)l % PAGE_SIZE != 0 || l->magic != LARGE_MAGIC) {
+        _msgout("free: bad pointer");
+        _exit();
+    }
+
+    l->magic = 0;
+    _munmap(l, l->size);
+}
+
+size_t usable_size(void * p) {
+    struct chunk * const c = small_chunk(p);
+
+    if (c != NULL)
+        return class_size[c->cls];
+    else
+        return ((struct large *)((char *)p - LARGE_HDR))->size - LARGE_HDR;
+}
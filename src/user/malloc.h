@@ -0,0 +1,31 @@
+// malloc.h - User-space memory allocator
+//
+// Small requests (up to MALLOC_SMALL_MAX bytes) are rounded up to one of a few
+// size classes and carved out of 64 KB chunks, each chunk holding objects of
+// one class. Chunks are cut from arenas, large anonymous mappings reserved a
+// megabyte at a time, so an allocation normally costs a few loads and stores
+// and no system call; pages of a chunk are faulted in only as objects are
+// first handed out. A chunk whose objects have all been freed gives its pages
+// back with MADV_DONTNEED and is reused by any class.
+//
+// Larger requests get a mapping of their own, which free unmaps at once.
+//
+// User processes are single-threaded, so there are no per-thread caches and
+// no locking.
+//
+
+#ifndef _MALLOC_H_
+#define _MALLOC_H_
+
+#include <stddef.h>
+
+// Requests above this size get their own mapping
+
+#define MALLOC_SMALL_MAX 2048
+
+extern void * malloc(size_t size);
+extern void free(void * p);
+extern void * calloc(size_t nmemb, size_t size);
+extern void * realloc(void * p, size_t size);
+
+#endif // _MALLOC_H_
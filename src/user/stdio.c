@@ -0,0 +1,408 @@
+// stdio.c - Buffered I/O over file descriptors
+//
+
+#include "stdio.h"
+#include "syscall.h"
+#include "string.h"
+#include "malloc.h"
+
+#include <stdint.h>
+
+// INTERNAL CONSTANTS
+//
+
+#define F_READ      (1 << 0)
+#define F_WRITE     (1 << 1)
+#define F_EOF       (1 << 2)
+#define F_ERR       (1 << 3)
+#define F_MYBUF     (1 << 4) // buf was allocated by us
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A free slot has flags == 0. For a writing stream buf[0..pos) is pending
+// output; for a reading stream buf[pos..len) is input not consumed yet.
+
+struct stdio_file {
+    int fd;
+    int flags;
+    int mode;
+    char * buf;
+    size_t bufsz;
+    size_t pos;
+    size_t len;
+    char ch;                // buffer of an unbuffered reading stream
+};
+
+// Formatted output is staged in a small buffer on the stack and passed to
+// fwrite in pieces, instead of one fwrite per character.
+
+struct vfprintf_state {
+    FILE * f;
+    size_t n;
+    char buf[64];
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct stdio_file files[FOPEN_MAX];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int write_all(FILE * f, const char * p, size_t n);
+static int fill(FILE * f);
+static int setup(FILE * f);
+static void vfprintf_putc(char c, void * aux);
+
+// Called by _exit (syscall.S) before the process ends
+
+void _stdio_exit(void);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+FILE * fdopen(int fd, const char * mode) {
+    FILE * f;
+    int flags;
+
+    if (fd < 0 || mode == NULL)
+        return NULL;
+
+    if (strcmp(mode, "r") == 0)
+        flags = F_READ;
+    else if (strcmp(mode, "w") == 0)
+        flags = F_WRITE;
+    else
+        return NULL;
+
+    for (f = files; f < files + FOPEN_MAX; f++) {
+        if (f->flags == 0)
+            break;
+    }
+
+    if (f == files + FOPEN_MAX)
+        return NULL;
+
+    memset(f, 0, sizeof(*f));
+    f->fd = fd;
+    f->flags = flags;
+    f->mode = _IOFBF;
+    return f;
+}
+
+FILE * fopen(const char * name, const char * mode) {
+    FILE * f;
+    int fd;
+
+    fd = _fsopen(-1, name);
+    if (fd < 0)
+        return NULL;
+
+    f = fdopen(fd, mode);
+    if (f == NULL)
+        _close(fd);
+
+    return f;
+}
+
+int fclose(FILE * f) {
+    int result;
+
+    result = fflush(f);
+
+    if (f->flags & F_MYBUF)
+        free(f->buf);
+
+    if (_close(f->fd) < 0)
+        result = EOF;
+
+    f->flags = 0;
+    return result;
+}
+
+int setvbuf(FILE * f, char * buf, int mode, size_t size) {
+    if (f->buf != NULL || mode < _IOFBF || _IONBF < mode)
+        return EOF;
+
+    f->mode = mode;
+
+    if (mode == _IONBF)
+        return 0;
+
+    if (size == 0)
+        size = BUFSIZ;
+
+    if (buf == NULL) {
+        buf = malloc(size);
+        if (buf == NULL)
+            return EOF;
+        f->flags |= F_MYBUF;
+    }
+
+    f->buf = buf;
+    f->bufsz = size;
+    return 0;
+}
+
+int fflush(FILE * f) {
+    int result = 0;
+    size_t n;
+
+    if (f == NULL) {
+        for (f = files; f < files + FOPEN_MAX; f++) {
+            if ((f->flags & F_WRITE) && fflush(f) < 0)
+                result = EOF;
+        }
+        return result;
+    }
+
+    if (!(f->flags & F_WRITE) || f->pos == 0)
+        return 0;
+
+    n = f->pos;
+    f->pos = 0;
+    return write_all(f, f->buf, n);
+}
+
+int fputc(int c, FILE * f) {
+    char ch = c;
+
+    if (fwrite(&ch, 1, 1, f) != 1)
+        return EOF;
+
+    return (unsigned char)ch;
+}
+
+int fputs(const char * s, FILE * f) {
+    size_t n = strlen(s);
+
+    if (fwrite(s, 1, n, f) != n)
+        return EOF;
+
+    return 0;
+}
+
+size_t fwrite(const void * p, size_t size, size_t nmemb, FILE * f) {
+    const char * s = p;
+    size_t total, n;
+    int flush;
+
+    if (!(f->flags & F_WRITE) || setup(f) < 0)
+        return 0;
+
+    if (size != 0 && nmemb > SIZE_MAX / size)
+        return 0;
+
+    total = size * nmemb;
+    if (total == 0)
+        return 0;
+
+    if (f->mode == _IONBF)
+        return (write_all(f, s, total) < 0) ? 0 : nmemb;
+
+    // Output that would not fit goes out directly behind the buffer contents
+    // rather than being copied through the buffer piecewise
+
+    if (f->bufsz - f->pos < total) {
+        if (fflush(f) < 0)
+            return 0;
+        if (f->bufsz <= total)
+            return (write_all(f, s, total) < 0) ? 0 : nmemb;
+    }
+
+    memcpy(f->buf + f->pos, s, total);
+    f->pos += total;
+
+    flush = (f->pos == f->bufsz);
+    if (f->mode == _IOLBF) {
+        for (n = 0; n < total && !flush; n++)
+            flush = (s[n] == '\n');
+    }
+
+    if (flush && fflush(f) < 0)
+        return 0;
+
+    return nmemb;
+}
+
+int fprintf(FILE * f, const char * fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vfprintf(f, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int vfprintf(FILE * f, const char * fmt, va_list ap) {
+    struct vfprintf_state st;
+    size_t n;
+
+    st.f = f;
+    st.n = 0;
+
+    n = vgprintf(vfprintf_putc, &st, fmt, ap);
+    if (st.n != 0)
+        fwrite(st.buf, 1, st.n, f);
+
+    return (f->flags & F_ERR) ? EOF : (int)n;
+}
+
+int fgetc(FILE * f) {
+    if (f->pos == f->len && fill(f) <= 0)
+        return EOF;
+
+    return (unsigned char)f->buf[f->pos++];
+}
+
+char * fgets(char * s, int n, FILE * f) {
+    int i = 0;
+    int c;
+
+    if (n <= 0)
+        return NULL;
+
+    while (i < n - 1) {
+        c = fgetc(f);
+        if (c == EOF)
+            break;
+        s[i++] = c;
+        if (c == '\n')
+            break;
+    }
+
+    if (i == 0)
+        return NULL;
+
+    s[i] = '\0';
+    return s;
+}
+
+size_t fread(void * p, size_t size, size_t nmemb, FILE * f) {
+    char * d = p;
+    size_t total, done, n;
+    long cnt;
+
+    if (!(f->flags & F_READ) || setup(f) < 0)
+        return 0;
+
+    if (size == 0 || nmemb > SIZE_MAX / size)
+        return 0;
+
+    total = size * nmemb;
+    done = 0;
+
+    while (done < total) {
+        if (f->pos < f->len) {
+            n = f->len - f->pos;
+            if (total - done < n)
+                n = total - done;
+            memcpy(d + done, f->buf + f->pos, n);
+            f->pos += n;
+            done += n;
+        } else if (f->bufsz <= total - done || f->mode == _IONBF) {
+            // Large reads bypass the buffer
+
+            cnt = _read(f->fd, d + done, total - done);
+            if (cnt <= 0) {
+                f->flags |= (cnt == 0) ? F_EOF : F_ERR;
+                break;
+            }
+            done += cnt;
+        } else if (fill(f) <= 0) {
+            break;
+        }
+    }
+
+    return done / size;
+}
+
+int feof(FILE * f) {
+    return (f->flags & F_EOF) != 0;
+}
+
+int ferror(FILE * f) {
+    return (f->flags & F_ERR) != 0;
+}
+
+int fileno(FILE * f) {
+    return f->fd;
+}
+
+void _stdio_exit(void) {
+    fflush(NULL);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Allocates the default buffer of a stream on first use. A stream whose
+// buffer cannot be allocated falls back to unbuffered.
+
+int setup(FILE * f) {
+    if (f->buf != NULL || f->mode == _IONBF)
+        return 0;
+
+    if (setvbuf(f, NULL, f->mode, BUFSIZ) < 0)
+        f->mode = _IONBF;
+
+    return 0;
+}
+
+int write_all(FILE * f, const char * p, size_t n) {
+    long cnt;
+
+    while (n > 0) {
+        cnt = _write(f->fd, p, n);
+        if (cnt <= 0) {
+            f->flags |= F_ERR;
+            return EOF;
+        }
+        p += cnt;
+        n -= cnt;
+    }
+
+    return 0;
+}
+
+// Refills the buffer of a reading stream. Returns the number of bytes read,
+// 0 at end of file or -1 on error.
+
+int fill(FILE * f) {
+    long cnt;
+
+    if (!(f->flags & F_READ) || setup(f) < 0)
+        return -1;
+
+    if (f->mode == _IONBF) {
+        // Single-character reads go through a one-byte buffer
+
+        f->buf = &f->ch;
+        f->bufsz = 1;
+    }
+
+    cnt = _read(f->fd, f->buf, f->bufsz);
+    if (cnt <= 0) {
+        f->flags |= (cnt == 0) ? F_EOF : F_ERR;
+        f->pos = f->len = 0;
+        return (cnt == 0) ? 0 : -1;
+    }
+
+    f->pos = 0;
+    f->len = cnt;
+    return cnt;
+}
+
+void vfprintf_putc(char c, void * aux) {
+    struct vfprintf_state * const st = aux;
+
+    st->buf[st->n++] = c;
+
+    if (st->n == sizeof(st->buf)) {
+        fwrite(st->buf, 1, st->n, st->f);
+        st->n = 0;
+    }
+}
@@ -0,0 +1,64 @@
+// stdio.h - Buffered I/O over file descriptors
+//
+// A FILE collects output in a buffer and hands it to the kernel in one _write
+// when the buffer fills, on fflush or fclose, and when the program exits
+// (through _exit or by returning from main), so a chatty program makes a few
+// large writes instead of a system call per line. Input is read a buffer at a
+// time in the same way. Formatting is done by vgprintf (string.h).
+//
+// Streams are created with fdopen over an open descriptor or with fopen, which
+// opens a KFS file. A stream is either for reading ("r") or for writing ("w").
+// New streams are fully buffered with BUFSIZ bytes; setvbuf selects line
+// buffering (useful for a serial console) or no buffering.
+//
+// Buffered output is not flushed by _fork or _exec: call fflush(NULL) first,
+// or the child prints it twice, or the new program never does.
+//
+
+#ifndef _STDIO_H_
+#define _STDIO_H_
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#define BUFSIZ      512
+#define FOPEN_MAX   8
+#define EOF         (-1)
+
+// Buffering modes of setvbuf
+
+#define _IOFBF      0 // write when the buffer is full
+#define _IOLBF      1 // also write at every newline
+#define _IONBF      2 // write every call through
+
+typedef struct stdio_file FILE;
+
+extern FILE * fdopen(int fd, const char * mode);
+extern FILE * fopen(const char * name, const char * mode);
+extern int fclose(FILE * f);
+
+// Sets the buffering mode and buffer of a stream before its first use. If
+// buf is NULL, a buffer of size bytes is allocated with malloc.
+
+extern int setvbuf(FILE * f, char * buf, int mode, size_t size);
+
+// Writes out the buffered output of f, or of every stream if f is NULL.
+// Returns 0 or EOF on a write error.
+
+extern int fflush(FILE * f);
+
+extern int fputc(int c, FILE * f);
+extern int fputs(const char * s, FILE * f);
+extern size_t fwrite(const void * p, size_t size, size_t nmemb, FILE * f);
+extern int fprintf(FILE * f, const char * fmt, ...);
+extern int vfprintf(FILE * f, const char * fmt, va_list ap);
+
+extern int fgetc(FILE * f);
+extern char * fgets(char * s, int n, FILE * f);
+extern size_t fread(void * p, size_t size, size_t nmemb, FILE * f);
+
+extern int feof(FILE * f);
+extern int ferror(FILE * f);
+extern int fileno(FILE * f);
+
+#endif // _STDIO_H_
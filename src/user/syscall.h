@@ -5,6 +5,155 @@
 #define _SYSCALL_H_
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Protection and flag bits for _mmap (see kern/vma.h)
+
+#define PROT_READ   (1 << 0)
+#define PROT_WRITE  (1 << 1)
+#define PROT_EXEC   (1 << 2)
+
+#define MAP_PRIVATE (1 << 0)
+#define MAP_SHARED  (1 << 1)
+#define MAP_FIXED   (1 << 4)
+#define MAP_ANON    (1 << 5)
+
+// _mmap returns the address of the mapping, or a negative error code cast to a
+// pointer.
+
+#define MAP_FAILED(p) ((long)(p) < 0)
+
+// Advice values for _madvise (see kern/vma.h)
+
+#define MADV_NORMAL         0
+#define MADV_RANDOM         1
+#define MADV_SEQUENTIAL     2
+#define MADV_WILLNEED       3
+#define MADV_DONTNEED       4
+#define MADV_HUGEPAGE       14
+#define MADV_NOHUGEPAGE     15
+
+// Commands and argument of _pgidle (see kern/memory.h). MARK clears the
+// accessed bits of the pages mapped in [start,end) of a process; QUERY counts
+// the pages accessed since. Both report on the interval ending with the call.
+// An end of 0 selects the whole address space (no bitmap allowed then).
+// Only the caller itself and its children may be tracked (-EPERM otherwise).
+
+#define PGIDLE_MARK     0
+#define PGIDLE_QUERY    1
+
+struct pgidle_info {
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t * bitmap;      // optional, one bit per page, set if accessed
+    uint64_t mapped;
+    uint64_t accessed;
+    uint64_t idle;
+    uint64_t age;           // milliseconds since the last MARK
+};
+
+// Counters reported by _compact (see kern/memory.h)
+
+struct compact_stats {
+    uint64_t runs;
+    uint64_t successes;
+    uint64_t failures;
+    uint64_t migrated;
+    uint64_t mega_allocs;
+    uint64_t mega_fails;
+    uint64_t mega_free;
+    uint64_t mega_total;
+};
+
+// Counters reported by _defrag (see kern/fs.h). A run is a stretch of a file
+// stored in consecutive disk blocks; a defragmented file has one.
+
+struct kfs_defrag_stats {
+    uint64_t files;
+    uint64_t blocks;
+    uint64_t runs_before;
+    uint64_t runs_after;
+    uint64_t moved;
+};
+
+// I/O classes and settings of _ioprio (see kern/ioprio.h). Levels run from 0
+// (highest) to 7 within the real-time and best-effort classes; a limit of 0
+// means none.
+
+#define IOPRIO_CLASS_RT     1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+
+struct ioprio_attr {
+    uint32_t class;
+    uint32_t level;
+    uint32_t iops;              // requests per second
+    uint32_t bps;               // bytes per second
+};
+
+// Copy-on-write overlay device "cow" (see kern/cowblk.h), which the kernel
+// mounts when booted with a delta disk. Open it with _devopen; each open has
+// its own position. Only init may use IOCTL_COW_COMMIT.
+
+#define IOCTL_COW_STAT      28
+#define IOCTL_COW_COMMIT    29  // arg is pointer to uint64_t chunks merged, or NULL
+
+struct cow_stat {
+    uint32_t chunksz;
+    uint32_t nchunks;           // chunks in the base device
+    uint32_t ncopied;           // chunks copied to the delta
+    uint32_t nfree;             // chunks the delta has room for
+};
+
+// Byte-range locks of _flock_range (see kern/flock.h). Locks belong to the
+// process and are dropped when it exits; a len of 0 reaches to any offset.
+
+#define FLOCK_UN    0
+#define FLOCK_SH    1
+#define FLOCK_EX    2
+#define FLOCK_NB    4   // or'ed in: fail with -EBUSY instead of waiting
+
+// userfaultfd (see kern/uffd.h). _uffd creates the object; the calling process
+// registers ranges with _ioctl(fd, IOCTL_UFFD_REGISTER, ...), and a handler
+// (e.g. a forked child) reads struct uffd_msg events from the fd and installs
+// pages with IOCTL_UFFD_COPY or IOCTL_UFFD_ZERO.
+
+#define IOCTL_UFFD_REGISTER     16
+#define IOCTL_UFFD_UNREGISTER   17
+#define IOCTL_UFFD_COPY         18
+#define IOCTL_UFFD_ZERO         19
+
+#define UFFD_MSG_WRITE  (1 << 0)
+
+struct uffd_range {
+    uintptr_t start;
+    size_t len;
+};
+
+struct uffd_copy {
+    uintptr_t dst;
+    const void * src;
+    size_t len;
+};
+
+struct uffd_msg {
+    uint64_t addr;
+    uint32_t pid;
+    uint32_t flags;
+};
+
+// Message queues (see kern/msgq.h). _msgq creates a queue that is shared with
+// children forked afterwards. _msgsend moves the whole pages of a buffer to the
+// queue (the sender's copy reads as zero afterwards); _msgrecv maps the oldest
+// message at an address chosen by the kernel and returns it (test the result
+// with MAP_FAILED). Release a received message with _munmap.
+
+#define MSG_DONTWAIT    (1 << 0)
+
+// Process snapshots (see kern/snap.h). _snapshot saves the caller in an
+// existing KFS file and returns 0; _restore replaces the caller with a saved
+// process, which then returns 1 from its _snapshot call. _restore returns
+// only on failure.
 
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
@@ -19,5 +168,20 @@ extern int _fork(void);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
 extern void _pioref();
+extern void * _mmap(void * addr, size_t len, int prot, int flags, int fd, long offset);
+extern int _munmap(void * addr, size_t len);
+extern int _madvise(void * addr, size_t len, int advice);
+extern int _pgidle(int pid, int cmd, struct pgidle_info * info);
+extern long _compact(size_t want, struct compact_stats * stats);
+extern int _uffd(int fd);
+extern int _snapshot(const char * path);
+extern int _restore(const char * path);
+extern int _msgq(int fd);
+extern int _msgsend(int fd, const void * buf, size_t len, int flags);
+extern void * _msgrecv(int fd, size_t * lenp, int flags);
+extern int _defrag(struct kfs_defrag_stats * stats);
+extern int _ioprio(int pid, const struct ioprio_attr * attr, struct ioprio_attr * old);
+extern long _kexec(int fd, const void * data, size_t len);
+extern int _flock_range(int fd, uint64_t off, uint64_t len, int mode);
 
 #endif // _SYSCALL_H_
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Copy-on-write delta for the kernel's overlay device, see kern/cowblk.h
+#define COW_CHUNKSZ   4096
+#define COW_MAGIC     0x64776f63
+
+// Delta layout:
+// [ header | remap table | copied chunks ]
+//
+// The file is made big enough to copy every chunk of the base (or the number
+// of chunks given), but only the header and table are written, so it takes
+// no more host disk space than what the machine writes to it.
+
+typedef struct cow_header_t{
+    uint32_t magic;
+    uint32_t chunksz;
+    uint64_t base_size;
+    uint32_t tabchunks;
+    uint32_t reserved;
+}__attribute((packed)) cow_header_t;
+
+void die(const char *);
+
+int
+main(int argc, char *argv[])
+{
+  if(argc < 3 || argc > 4){
+    fprintf(stderr, "Usage: ./mkcow [delta_image] [base_image] [chunks]\n");
+    exit(1);
+  }
+
+  struct stat st;
+  if(stat(argv[2], &st) < 0)
+    die(argv[2]);
+
+  uint64_t nchunks = (st.st_size + COW_CHUNKSZ - 1) / COW_CHUNKSZ;
+  uint64_t tabchunks = (nchunks * 4 + COW_CHUNKSZ - 1) / COW_CHUNKSZ;
+  uint64_t room = (argc == 4) ? strtoull(argv[3], NULL, 0) : nchunks;
+
+  if(tabchunks == 0 || room == 0){
+    fprintf(stderr, "Base image and delta must not be empty\n");
+    exit(1);
+  }
+
+  int fd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fd < 0)
+    die(argv[1]);
+
+  static char chunk[COW_CHUNKSZ];
+  cow_header_t *hdr = (cow_header_t*)chunk;
+  hdr->magic = COW_MAGIC;
+  hdr->chunksz = COW_CHUNKSZ;
+  hdr->base_size = st.st_size;
+  hdr->tabchunks = tabchunks;
+
+  if(write(fd, chunk, COW_CHUNKSZ) != COW_CHUNKSZ)
+    die(argv[1]);
+
+  // An empty table: no chunk copied yet
+  memset(chunk, 0, COW_CHUNKSZ);
+  for(uint64_t i = 0; i < tabchunks; i++){
+    if(write(fd, chunk, COW_CHUNKSZ) != COW_CHUNKSZ)
+      die(argv[1]);
+  }
+
+  if(ftruncate(fd, (1 + tabchunks + room) * COW_CHUNKSZ) < 0)
+    die(argv[1]);
+
+  printf("Delta for %s: %llu chunks, room for %llu\n", argv[2],
+    (unsigned long long)nchunks, (unsigned long long)room);
+
+  close(fd);
+  return 0;
+}
+
+void
+die(const char *s)
+{
+  perror(s);
+  exit(1);
+}
@@ -9,12 +9,18 @@
 #define FS_BLKSZ      4096
 #define FS_NAMELEN    32
 
+// Log region (-l), see KFS_LOG_SEGBLKS in kern/kfs.c for the smallest size
+#define KFS_LOG_MAGIC   0x474f4c4b
+#define LOG_CP_MAGIC    0x5043464b
+#define LOG_MINBLKS     18
+#define LOG_MAXBLKS     1024
+
 #ifndef static_assert
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
 // Disk layout:
-// [ boot block | inodes | data blocks ]
+// [ boot block | inodes | data blocks | log ]
 
 typedef struct dentry_t{
     char file_name[FS_NAMELEN];
@@ -26,7 +32,9 @@ typedef struct boot_block_t{
     uint32_t num_dentry;
     uint32_t num_inodes;
     uint32_t num_data;
-    uint8_t reserved[52];
+    uint32_t log_magic;
+    uint32_t log_blocks;
+    uint8_t reserved[44];
     dentry_t dir_entries[63];
 }__attribute((packed)) boot_block_t;
 
@@ -69,8 +77,20 @@ main(int argc, char *argv[])
 {
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  // -l N reserves a log of N blocks for log-structured writes
+  int log_blocks = 0;
+  if(argc > 2 && strcmp(argv[1], "-l") == 0){
+    log_blocks = atoi(argv[2]);
+    if(log_blocks < LOG_MINBLKS || log_blocks > LOG_MAXBLKS){
+      fprintf(stderr, "Log size must be %d to %d blocks\n", LOG_MINBLKS, LOG_MAXBLKS);
+      exit(1);
+    }
+    argv += 2;
+    argc -= 2;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: ./mkfs [filesystem_image] [file1] [file2] ...\n");
+    fprintf(stderr, "Usage: ./mkfs [-l log_blocks] [filesystem_image] [file1] [file2] ...\n");
     exit(1);
   }
 
@@ -91,6 +111,8 @@ main(int argc, char *argv[])
       shortname = argv[i] + 12;
     else if(strncmp(argv[i], "user/bin/", 9) == 0)
       shortname = argv[i] + 9;
+    else if(strncmp(argv[i], "../kern/", 8) == 0)
+      shortname = argv[i] + 8;
     else
       shortname = argv[i];
 
@@ -135,10 +157,15 @@ main(int argc, char *argv[])
   boot_block.num_dentry = number_inodes;
   boot_block.num_inodes = number_inodes;
   boot_block.num_data = data_block_idx;
+  if(log_blocks > 0){
+    boot_block.log_magic = KFS_LOG_MAGIC;
+    boot_block.log_blocks = log_blocks;
+  }
 
   printf("Total number of dentries: %d\n", boot_block.num_dentry);
   printf("Total number of inodes: %d\n", boot_block.num_inodes);
   printf("Total number of data blocks: %d\n", boot_block.num_data);
+  printf("Number of log blocks: %d\n", log_blocks);
 
   write(fsfd, &boot_block, sizeof(boot_block_t)); 
 
@@ -157,6 +184,16 @@ main(int argc, char *argv[])
       write(fsfd, buf, FS_BLKSZ);
   }
 
+  if(log_blocks > 0){ //Add the log: a checkpoint, then empty blocks
+    uint32_t blk[FS_BLKSZ / 4] = {0};
+    blk[0] = LOG_CP_MAGIC;
+    blk[1] = 1;
+    write(fsfd, blk, FS_BLKSZ);
+    blk[0] = blk[1] = 0;
+    for(i = 1; i < log_blocks; i++)
+      write(fsfd, blk, FS_BLKSZ);
+  }
+
   printf("Wrote filesystem image to %s\n", argv[1]);
 
   close(fsfd);
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Image for the kernel's emulated pmem device, see kern/viopmem.h
+#define PMEM_HDRSZ    4096
+#define PMEM_PAGESZ   4096
+#define PMEM_MAGIC    0x6d656d70
+
+// Image layout:
+// [ header block | contents of the range ]
+//
+// The range holds a copy of the source image, padded to a whole page. The
+// machine gets it as blk1; the kernel copies it into memory at boot and
+// IOCTL_FLUSH writes it back here.
+
+typedef struct pmem_header_t{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t size;
+}__attribute((packed)) pmem_header_t;
+
+void die(const char *);
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 3){
+    fprintf(stderr, "Usage: ./mkpmem [pmem_image] [source_image]\n");
+    exit(1);
+  }
+
+  int in = open(argv[2], O_RDONLY);
+  if(in < 0)
+    die(argv[2]);
+
+  struct stat st;
+  if(fstat(in, &st) < 0)
+    die(argv[2]);
+
+  uint64_t size = (st.st_size + PMEM_PAGESZ - 1) / PMEM_PAGESZ * PMEM_PAGESZ;
+  if(size == 0){
+    fprintf(stderr, "Source image must not be empty\n");
+    exit(1);
+  }
+
+  int fd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fd < 0)
+    die(argv[1]);
+
+  static char block[PMEM_HDRSZ];
+  pmem_header_t *hdr = (pmem_header_t*)block;
+  hdr->magic = PMEM_MAGIC;
+  hdr->size = size;
+
+  if(write(fd, block, PMEM_HDRSZ) != PMEM_HDRSZ)
+    die(argv[1]);
+
+  ssize_t n;
+  while((n = read(in, block, sizeof(block))) > 0){
+    if(write(fd, block, n) != n)
+      die(argv[1]);
+  }
+  if(n < 0)
+    die(argv[2]);
+
+  // The padding of the last page reads as zeros
+  if(ftruncate(fd, PMEM_HDRSZ + size) < 0)
+    die(argv[1]);
+
+  printf("pmem image of %s: %llu bytes\n", argv[2], (unsigned long long)size);
+
+  close(in);
+  close(fd);
+  return 0;
+}
+
+void
+die(const char *s)
+{
+  perror(s);
+  exit(1);
+}